@@ -4,22 +4,88 @@
 
 # Add inputs and outputs from these tool invocations to the build variables 
 C_SRCS += \
+../src/chunkplan.c \
+../src/coord.c \
+../src/crawl.c \
+../src/daemon.c \
+../src/delta.c \
+../src/hostprof.c \
+../src/hpack.c \
+../src/http2.c \
 ../src/httpclient.c \
 ../src/linkparser.c \
+../src/linkscan.c \
 ../src/main.c \
-../src/threadmanager.c 
+../src/membudget.c \
+../src/metalink.c \
+../src/progress.c \
+../src/rdwget.c \
+../src/redirect.c \
+../src/retry.c \
+../src/schedule.c \
+../src/smallfile.c \
+../src/pack.c \
+../src/threadmanager.c \
+../src/tls.c \
+../src/trace.c \
+../src/log.c \
+../src/unpack.c 
 
 OBJS += \
+./src/chunkplan.o \
+./src/coord.o \
+./src/crawl.o \
+./src/daemon.o \
+./src/delta.o \
+./src/hostprof.o \
+./src/hpack.o \
+./src/http2.o \
 ./src/httpclient.o \
 ./src/linkparser.o \
+./src/linkscan.o \
 ./src/main.o \
-./src/threadmanager.o 
+./src/membudget.o \
+./src/metalink.o \
+./src/progress.o \
+./src/rdwget.o \
+./src/redirect.o \
+./src/retry.o \
+./src/schedule.o \
+./src/smallfile.o \
+./src/pack.o \
+./src/threadmanager.o \
+./src/tls.o \
+./src/trace.o \
+./src/log.o \
+./src/unpack.o 
 
 C_DEPS += \
+./src/chunkplan.d \
+./src/coord.d \
+./src/crawl.d \
+./src/daemon.d \
+./src/delta.d \
+./src/hostprof.d \
+./src/hpack.d \
+./src/http2.d \
 ./src/httpclient.d \
 ./src/linkparser.d \
+./src/linkscan.d \
 ./src/main.d \
-./src/threadmanager.d 
+./src/membudget.d \
+./src/metalink.d \
+./src/progress.d \
+./src/rdwget.d \
+./src/redirect.d \
+./src/retry.d \
+./src/schedule.d \
+./src/smallfile.d \
+./src/pack.d \
+./src/threadmanager.d \
+./src/tls.d \
+./src/trace.d \
+./src/log.d \
+./src/unpack.d 
 
 
 # Each subdirectory must supply rules for building sources it contributes
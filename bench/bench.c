@@ -0,0 +1,325 @@
+/*!
+ * \file
+ * \brief Microbenchmarks of link and http header parsers.
+ *
+ *  Every case runs one parser on one input repeatedly for the given time
+ *  and reports time and heap allocations per operation (malloc is counted
+ *  by wrappers of glibc allocator) and parsed bytes per second. Inputs are
+ *  realistic links and response headers and adversarial ones: headers
+ *  split across many reads, huge headers and headers without CRLF.
+ *
+ *  usage: rdwget-bench [-t seconds] [case...]
+ *  (cases are selected by substring of their names)
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "linkparser.h"
+#include "httpclient.h"
+#include "harness.h"
+
+#define	BENCH_TIME 0.5		// default time of one case in seconds
+#define	BENCH_CHECK_OPS 16	// operations between clock reads
+#define	BENCH_BODY_LEN 1024	// body sent after header by server
+
+typedef enum
+{
+	BENCH_LINK, BENCH_HEADER_PARSE, BENCH_HEADER_READ
+} bench_kind;
+
+typedef struct
+{
+	char name[32];
+	bench_kind kind;
+	char *data;
+	size_t len;
+	size_t piece;	// size of reads of http_header_read
+} bench_case;
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t num, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+static long long int bench_allocs;
+
+void *
+malloc(size_t size)
+{
+	__atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+	return (__libc_malloc(size));
+}
+
+void *
+calloc(size_t num, size_t size)
+{
+	__atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+	return (__libc_calloc(num, size));
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	__atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+	return (__libc_realloc(ptr, size));
+}
+
+static bench_case *cases;
+static int casenum;
+static char *scratch;	// copy of header parsed in place
+static size_t scratchlen;
+static int nullfd;
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/**
+ * Appends text repeated count times to string str of length *len.
+ * \return the string (reallocated).
+ */
+static char *
+bench_append(char *str, size_t *len, const char *text, int count)
+{
+	size_t tlen = strlen(text);
+
+	str = realloc(str, *len + tlen * count + 1);
+	while (count-- > 0) {
+		memcpy(str + *len, text, tlen);
+		*len += tlen;
+	}
+	str[*len] = '\0';
+
+	return (str);
+}
+
+static void
+bench_add(const char *name, bench_kind kind, char *data, size_t len,
+		size_t piece)
+{
+	bench_case *bc;
+
+	cases = realloc(cases, (casenum + 1) * sizeof (bench_case));
+	bc = &cases[casenum++];
+	snprintf(bc->name, sizeof (bc->name), "%s", name);
+	bc->kind = kind;
+	bc->data = data;
+	bc->len = len;
+	bc->piece = piece;
+}
+
+/**
+ * Adds case of link_parse on link made of prefix and text repeated count
+ * times.
+ */
+static void
+bench_add_link(const char *name, const char *prefix, const char *text,
+		int count)
+{
+	size_t len = 0;
+	char *link = bench_append(NULL, &len, prefix, 1);
+
+	link = bench_append(link, &len, text, count);
+	bench_add(name, BENCH_LINK, link, len, 0);
+}
+
+/**
+ * Adds cases of link_header_parse and http_header_read (read in given
+ * pieces) on header made of head, line repeated count times and end.
+ */
+static void
+bench_add_header(const char *name, const char *head, const char *line,
+		int count, const char *end, const size_t *pieces)
+{
+	char cname[32], *hdr;
+	size_t len = 0, hlen;
+
+	hdr = bench_append(NULL, &len, head, 1);
+	hdr = bench_append(hdr, &len, line, count);
+	hdr = bench_append(hdr, &len, end, 1);
+	// http_header_read strips CRLF of the last line
+	hlen = ((len >= 2) && (strcmp(hdr + len - 2, CRLF) == 0)) ? len - 2 :
+			len;
+	snprintf(cname, sizeof (cname), "parse_%s", name);
+	bench_add(cname, BENCH_HEADER_PARSE, strndup(hdr, hlen), hlen, 0);
+
+	hdr = bench_append(hdr, &len, CRLF, 1);
+	hdr = bench_append(hdr, &len, "x", BENCH_BODY_LEN);
+	for (; *pieces != (size_t) -1; ++pieces) {
+		if (*pieces == HARNESS_WHOLE)
+			snprintf(cname, sizeof (cname), "read_%s", name);
+		else
+			snprintf(cname, sizeof (cname), "read_%s/%zu", name,
+					*pieces);
+		bench_add(cname, BENCH_HEADER_READ, hdr, len, *pieces);
+	}
+
+	if (hlen + 1 > scratchlen) {
+		scratchlen = hlen + 1;
+		scratch = realloc(scratch, scratchlen);
+	}
+}
+
+static void
+bench_corpus(void)
+{
+	static const size_t whole[] = { HARNESS_WHOLE, -1 };
+	static const size_t split[] = { HARNESS_WHOLE, 16, 1, -1 };
+	static const size_t huge[] = { HARNESS_WHOLE, 1000, -1 };
+	static const char status[] =
+			"HTTP/1.1 200 OK" CRLF
+			"Server: nginx/1.24.0" CRLF
+			"Date: Mon, 19 Oct 2026 08:00:00 GMT" CRLF
+			"Content-Type: application/octet-stream" CRLF
+			"Content-Length: 5000000" CRLF
+			"Last-Modified: Sun, 18 Oct 2026 21:14:03 GMT" CRLF
+			"Connection: keep-alive" CRLF
+			"ETag: \"6530a1bb-4c4b40\"" CRLF
+			"Accept-Ranges: bytes" CRLF;
+	static const char partial[] =
+			"HTTP/1.1 206 Partial Content" CRLF
+			"Content-Type: application/x-xz" CRLF
+			"Content-Length: 1048576" CRLF
+			"Content-Range: bytes 1048576-2097151/134217728" CRLF;
+	static const char cdn[] =
+			"x-amz-meta-sha256: 9f86d081884c7d659a2feaa0c55ad015a3bf4f"
+			"1b2b0b822cd15d6c15b0f00a08" CRLF
+			"Set-Cookie: session=3q2+7w3q2+7w3q2+7w; Path=/; Secure; "
+			"HttpOnly; SameSite=Lax" CRLF
+			"Via: 1.1 varnish, 1.1 cache-fra-eddf8230049-FRA" CRLF;
+
+	bench_add_link("link_short", "http://example.com/", "", 0);
+	bench_add_link("link_typical", "https://downloads.example.org/pub/"
+			"linux/kernel/v6.x/linux-6.1.tar.xz", "", 0);
+	bench_add_link("link_port", "http://127.0.0.1:8080/a/b/c/file.bin",
+			"", 0);
+	bench_add_link("link_noscheme", "mirror.example.net/debian-12.iso",
+			"", 0);
+	bench_add_link("link_query", "http://example.com/get?id=12345&"
+			"token=0123456789abcdef", "", 0);
+	bench_add_link("link_longpath", "http://example.com", "/segment",
+			256);
+	bench_add_link("link_invalid", "http:///", "/", 512);
+
+	bench_add_header("nginx", status, "", 0, "", split);
+	bench_add_header("partial", partial, "", 0, "", whole);
+	bench_add_header("cdn", status, cdn, 10, "", split);
+	bench_add_header("huge", status, "X-Pad: 0123456789abcdef0123456789"
+			"abcdef" CRLF, 1500, "", huge);
+	bench_add_header("cookie", status, "Set-Cookie: a=0123456789abcdef",
+			1024, CRLF, whole);
+	// missing CRLF: the end of header is never found
+	bench_add_header("lf_only", "HTTP/1.1 200 OK\nContent-Length: 10\n",
+			"Content-Type: text/plain\n", 20, "\n", whole);
+	bench_add_header("no_status", "HTTP/1.1" CRLF, "X: y" CRLF, 4, "",
+			whole);
+}
+
+/**
+ * Runs one operation of case.
+ * \return result of parser.
+ */
+static int
+bench_op(const bench_case *bc)
+{
+	lnk link;
+	lnk_http_header linkh;
+	headerbufs hbufs;
+	http_conn conn;
+	int ret;
+
+	switch (bc->kind) {
+	case BENCH_LINK:
+		if ((ret = link_parse(bc->data, &link)) == 0)
+			link_free(&link);
+		return (ret);
+	case BENCH_HEADER_PARSE:
+		// parser tokenizes header in place
+		memcpy(scratch, bc->data, bc->len + 1);
+		ret = link_header_parse(scratch, &linkh);
+		link_header_free(&linkh);
+		return (ret);
+	default:
+		if (harness_conn(&conn, bc->data, bc->len, bc->piece) == -1)
+			exit(1);
+		if ((ret = http_header_read(&conn, &hbufs)) == 0) {
+			free(hbufs.hdata);
+			free(hbufs.remain);
+		}
+		harness_close(&conn);
+		return (ret);
+	}
+}
+
+/**
+ * Runs case for time seconds and prints its results.
+ */
+static void
+bench_run(const bench_case *bc, double time)
+{
+	long long int ops = 0, allocs;
+	double start, elapsed = 0;
+	int ret, errfd;
+
+	// parsers report invalid input, it would be printed in every loop
+	errfd = dup(STDERR_FILENO);
+	dup2(nullfd, STDERR_FILENO);
+
+	ret = bench_op(bc);
+	allocs = __atomic_load_n(&bench_allocs, __ATOMIC_RELAXED);
+	start = bench_now();
+	do {
+		bench_op(bc);
+	} while ((++ops % BENCH_CHECK_OPS != 0) ||
+			((elapsed = bench_now() - start) < time));
+	allocs = __atomic_load_n(&bench_allocs, __ATOMIC_RELAXED) - allocs;
+
+	dup2(errfd, STDERR_FILENO);
+	close(errfd);
+
+	printf("%-24s %7zu B %10lld ops %12.1f ns/op %8.1f allocs/op "
+			"%9.1f MB/s %s\n", bc->name, bc->len, ops,
+			elapsed * 1e9 / ops, (double) allocs / ops,
+			bc->len * ops / elapsed / 1e6, (ret < 0) ? "fail" : "ok");
+	fflush(stdout);
+}
+
+int
+main(int argc, char **argv)
+{
+	double time = BENCH_TIME;
+	int opt, idx, arg;
+
+	while ((opt = getopt(argc, argv, "t:")) != -1) {
+		if ((opt != 't') || ((time = atof(optarg)) <= 0)) {
+			fprintf(stderr, "usage: %s [-t seconds] [case...]\n",
+					argv[0]);
+			return (1);
+		}
+	}
+
+	if ((nullfd = open("/dev/null", O_WRONLY)) == -1) {
+		perror("/dev/null");
+		return (1);
+	}
+	bench_corpus();
+	for (idx = 0; idx != casenum; ++idx) {
+		for (arg = optind; (arg != argc) &&
+				(strstr(cases[idx].name, argv[arg]) == NULL);
+				++arg)
+			;
+		if ((optind == argc) || (arg != argc))
+			bench_run(&cases[idx], time);
+	}
+
+	return (0);
+}
@@ -0,0 +1,243 @@
+/*!
+ * \file
+ * \brief Standalone driver of fuzz harnesses for builds without libFuzzer.
+ *
+ *  Runs harness on every input file (and every file of input directory) and
+ *  then on random mutations of them. It understands the libFuzzer flags
+ *  which make sense without coverage feedback (-runs, -seed, -max_len,
+ *  -close_fd_mask), so corpora and command lines work with both. Input
+ *  which crashes harness built with sanitizers is saved into crash-<run>.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define	DRIVER_MAX_LEN 4096	// default limit of mutated input
+#define	DRIVER_MUTATIONS 8	// most mutations applied to one input
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+void __sanitizer_set_report_fd(void *fd) __attribute__((weak));
+void __sanitizer_set_death_callback(void (*callback)(void))
+		__attribute__((weak));
+
+typedef struct
+{
+	uint8_t *data;
+	size_t size;
+} input;
+
+static input *inputs;
+static int inputnum;
+static const uint8_t *current;	// input being run
+static size_t currentsize;
+static long long int currentrun;
+
+// tokens of parsed grammars inserted by mutations
+static const char *tokens[] = {
+	"\r\n", "\r\n\r\n", "\n", " ", ":", "/", "//", "http://", "https://",
+	"HTTP/1.1 ", "200", "206", "Content-Length: ", "Content-Type: ",
+	"Retry-After: ", "Content-Range: bytes ", "Connection: close",
+	"18446744073709551616", "-1", "%00", "\0",
+	"zsync: ", "Blocksize: ", "Length: ", "Hash-Lengths: ", "SHA-1: ",
+	"<file name=\"", "<url>", "</url>", "<size>", "<hash type=\"",
+	"<pieces length=\"", "</pieces>", "<!--", "-->", "&amp;"
+};
+
+/**
+ * Saves input which crashed harness.
+ */
+static void
+driver_crash(void)
+{
+	char name[32];
+	int fd;
+
+	// leaks are reported at exit, not by any input
+	if (current == NULL)
+		return;
+	snprintf(name, sizeof (name), "crash-%lld", currentrun);
+	if ((fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+		return;
+	if (write(fd, current, currentsize) == (ssize_t) currentsize)
+		fprintf(stderr, "input saved into %s\n", name);
+	close(fd);
+}
+
+static void
+driver_run(const uint8_t *data, size_t size)
+{
+	current = data;
+	currentsize = size;
+	LLVMFuzzerTestOneInput(data, size);
+	current = NULL;
+	++currentrun;
+}
+
+/**
+ * Loads file path into inputs (files of directory if path is directory).
+ */
+static void
+driver_load(const char *path)
+{
+	struct stat st;
+	struct dirent *ent;
+	DIR *dir;
+	char sub[4096];
+	input *in;
+	int fd;
+
+	if (stat(path, &st) == -1) {
+		perror(path);
+		exit(1);
+	}
+	if (S_ISDIR(st.st_mode)) {
+		if ((dir = opendir(path)) == NULL) {
+			perror(path);
+			exit(1);
+		}
+		while ((ent = readdir(dir)) != NULL) {
+			if (ent->d_name[0] == '.')
+				continue;
+			snprintf(sub, sizeof (sub), "%s/%s", path, ent->d_name);
+			driver_load(sub);
+		}
+		closedir(dir);
+		return;
+	}
+
+	inputs = realloc(inputs, (inputnum + 1) * sizeof (input));
+	in = &inputs[inputnum++];
+	in->size = st.st_size;
+	in->data = malloc(in->size + 1);
+	if (((fd = open(path, O_RDONLY)) == -1) ||
+			(read(fd, in->data, in->size) != (ssize_t) in->size)) {
+		perror(path);
+		exit(1);
+	}
+	close(fd);
+}
+
+/**
+ * Applies random mutation to data of size bytes (buffer has maxlen bytes).
+ * \return new size of data.
+ */
+static size_t
+driver_mutate(uint8_t *data, size_t size, size_t maxlen)
+{
+	const input *other;
+	const char *token;
+	size_t pos = (size > 0) ? random() % size : 0;
+	size_t len, span = 0, idx;
+
+	switch (random() % 6) {
+	case 0:	// flip bit
+		if (size > 0)
+			data[pos] ^= 1 << (random() % 8);
+		return (size);
+	case 1:	// random byte
+		if (size > 0)
+			data[pos] = random();
+		return (size);
+	case 2:	// erase range
+		len = (size > pos) ? random() % (size - pos + 1) : 0;
+		memmove(data + pos, data + pos + len, size - pos - len);
+		return (size - len);
+	case 3:	// insert token
+		token = tokens[random() % (sizeof (tokens) / sizeof (*tokens))];
+		len = (*token == '\0') ? 1 : strlen(token);
+		break;
+	case 4:	// insert part of another input
+		other = &inputs[random() % inputnum];
+		if (other->size == 0)
+			return (size);
+		len = 1 + random() % other->size;
+		token = (const char *) other->data + random() %
+				(other->size - len + 1);
+		break;
+	default:	// repeat range (long lines, many headers)
+		if (size == 0)
+			return (size);
+		span = 1 + random() % (size - pos);
+		len = span * (1 + random() % 64);
+		token = NULL;
+		break;
+	}
+
+	if (size + len > maxlen)
+		return (size);
+	memmove(data + pos + len, data + pos, size - pos);
+	if (token != NULL) {
+		memcpy(data + pos, token, len);
+	} else {
+		// repeated range was moved behind the gap
+		for (idx = 0; idx != len; ++idx)
+			data[pos + idx] = data[pos + len + idx % span];
+	}
+	return (size + len);
+}
+
+int
+main(int argc, char **argv)
+{
+	long long int runs = 0, run;
+	unsigned int seed = getpid();
+	size_t maxlen = DRIVER_MAX_LEN, size;
+	uint8_t *data;
+	int idx, mutations, errfd;
+
+	for (idx = 1; idx != argc; ++idx) {
+		if (sscanf(argv[idx], "-runs=%lld", &runs) == 1)
+			continue;
+		if (sscanf(argv[idx], "-seed=%u", &seed) == 1)
+			continue;
+		if (sscanf(argv[idx], "-max_len=%zu", &maxlen) == 1)
+			continue;
+		if (strcmp(argv[idx], "-close_fd_mask=2") == 0) {
+			// sanitizer reports still go to stderr
+			errfd = dup(STDERR_FILENO);
+			if (__sanitizer_set_report_fd != NULL)
+				__sanitizer_set_report_fd((void *) (intptr_t)
+						errfd);
+			close(STDERR_FILENO);
+			open("/dev/null", O_WRONLY);
+			continue;
+		}
+		if (argv[idx][0] == '-') {
+			fprintf(stderr, "unknown flag %s\n", argv[idx]);
+			return (1);
+		}
+		driver_load(argv[idx]);
+	}
+	if (__sanitizer_set_death_callback != NULL)
+		__sanitizer_set_death_callback(driver_crash);
+
+	for (idx = 0; idx != inputnum; ++idx)
+		driver_run(inputs[idx].data, inputs[idx].size);
+	printf("%d inputs passed\n", inputnum);
+
+	if ((runs == 0) || (inputnum == 0))
+		return (0);
+
+	srandom(seed);
+	data = malloc(maxlen);
+	for (run = 0; run != runs; ++run) {
+		idx = random() % inputnum;
+		size = (inputs[idx].size < maxlen) ? inputs[idx].size : maxlen;
+		memcpy(data, inputs[idx].data, size);
+		for (mutations = 1 + random() % DRIVER_MUTATIONS;
+				mutations > 0; --mutations)
+			size = driver_mutate(data, size, maxlen);
+		driver_run(data, size);
+	}
+	printf("%lld mutations passed (seed %u)\n", runs, seed);
+
+	free(data);
+	return (0);
+}
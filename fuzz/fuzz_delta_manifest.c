@@ -0,0 +1,21 @@
+/*!
+ * \file
+ * \brief Fuzz harness of delta_manifest_parse (libFuzzer entry point).
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "delta.h"
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	delta_manifest *mf;
+
+	// manifest is binary, it is parsed without terminating NUL
+	if ((mf = delta_manifest_parse((const char *) data, size)) != NULL)
+		delta_manifest_free(mf);
+
+	return (0);
+}
@@ -0,0 +1,28 @@
+/*!
+ * \file
+ * \brief Fuzz harness of link_header_parse (libFuzzer entry point).
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "httpclient.h"
+#include "harness.h"
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	char *buff = malloc(size + 1);
+	lnk_http_header linkh;
+
+	// header is parsed as read by http_header_read (without CRLF CRLF)
+	memcpy(buff, data, size);
+	buff[size] = '\0';
+
+	link_header_parse(buff, &linkh);
+	link_header_free(&linkh);
+
+	free(buff);
+	return (0);
+}
@@ -0,0 +1,33 @@
+/*!
+ * \file
+ * \brief Fuzz harness of http_header_read (libFuzzer entry point).
+ *
+ *  The first byte of input is size of pieces in which the rest of input is
+ *  sent into connection (0 sends it at once).
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "httpclient.h"
+#include "harness.h"
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	http_conn conn;
+	headerbufs hbufs;
+
+	if (size == 0)
+		return (0);
+	if (harness_conn(&conn, (const char *) data + 1, size - 1, data[0]) == -1)
+		abort();
+
+	if (http_header_read(&conn, &hbufs) == 0) {
+		free(hbufs.hdata);
+		free(hbufs.remain);
+	}
+
+	harness_close(&conn);
+	return (0);
+}
@@ -0,0 +1,28 @@
+/*!
+ * \file
+ * \brief Fuzz harness of link_parse (libFuzzer entry point).
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "linkparser.h"
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	char *linkstr = malloc(size + 1);
+	lnk link;
+
+	// links come from command line, they are strings
+	memcpy(linkstr, data, size);
+	linkstr[size] = '\0';
+
+	memset(&link, 0, sizeof (link));
+	if (link_parse(linkstr, &link) == 0)
+		link_free(&link);
+
+	free(linkstr);
+	return (0);
+}
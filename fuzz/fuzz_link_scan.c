@@ -0,0 +1,57 @@
+/*!
+ * \file
+ * \brief Fuzz harness of linkscan and link_resolve (libFuzzer entry point).
+ *
+ *  The first line of input is link of page, the rest is page fed into
+ *  scanner in pieces of size given by the first byte of page. Every found
+ *  link is resolved against link of page.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "linkparser.h"
+#include "linkscan.h"
+
+static void
+found(void *data, const char *ref)
+{
+	char *url;
+
+	if ((url = link_resolve(data, ref)) != NULL)
+		free(url);
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	const uint8_t *eol = memchr(data, '\n', size);
+	size_t baselen = (eol != NULL) ? (size_t) (eol - data) : size;
+	char *base = malloc(baselen + 1);
+	linkscan *scan;
+	size_t piece;
+
+	memcpy(base, data, baselen);
+	base[baselen] = '\0';
+	data += baselen;
+	size -= baselen;
+	if (size > 0) {
+		++data;
+		--size;
+	}
+
+	piece = (size > 0) ? (size_t) data[0] + 1 : 1;
+	scan = linkscan_init(found, base);
+	while (size > 0) {
+		if (piece > size)
+			piece = size;
+		linkscan_feed(scan, (const char *) data, piece);
+		data += piece;
+		size -= piece;
+	}
+	linkscan_free(scan);
+
+	free(base);
+	return (0);
+}
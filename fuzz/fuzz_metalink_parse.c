@@ -0,0 +1,21 @@
+/*!
+ * \file
+ * \brief Fuzz harness of metalink_parse (libFuzzer entry point).
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "metalink.h"
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	metalink *ml;
+
+	// metalink is parsed by length, without terminating NUL
+	if ((ml = metalink_parse((const char *) data, size)) != NULL)
+		metalink_free(ml);
+
+	return (0);
+}
@@ -0,0 +1,116 @@
+/*!
+ * \file
+ * \brief Support of parser benchmarks and fuzz harnesses.
+ *
+ *  Fake http connections: data of connection are sent into socket pair piece by piece by feeder
+ *  thread (started once and reused by all connections), so reader gets
+ *  them split across reads like from a slow server. Feeder closes its end
+ *  after the last piece, so reader reaches end of connection.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "httpclient.h"
+#include "harness.h"
+
+static pthread_mutex_t feed_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t feed_cond = PTHREAD_COND_INITIALIZER;
+static int feed_started;
+static int feed_fd = -1;	// end of connection being fed, -1 if idle
+static const char *feed_data;
+static size_t feed_len, feed_piece;
+
+static void *
+feed_thread(void *arg)
+{
+	size_t off, len;
+	ssize_t sz;
+	int fd;
+
+	pthread_mutex_lock(&feed_lock);
+	for (;;) {
+		while (feed_fd == -1)
+			pthread_cond_wait(&feed_cond, &feed_lock);
+		fd = feed_fd;
+		pthread_mutex_unlock(&feed_lock);
+
+		for (off = 0; off < feed_len; off += sz) {
+			len = feed_len - off;
+			if ((feed_piece != HARNESS_WHOLE) && (len > feed_piece))
+				len = feed_piece;
+			// fails when reader closed connection before its end
+			if ((sz = send(fd, feed_data + off, len,
+					MSG_NOSIGNAL)) <= 0)
+				break;
+		}
+		close(fd);
+
+		pthread_mutex_lock(&feed_lock);
+		feed_fd = -1;
+		pthread_cond_broadcast(&feed_cond);
+	}
+
+	return (NULL);
+}
+
+/**
+ * Opens connection conn which receives len bytes of data sent in pieces
+ * of at most piece bytes (HARNESS_WHOLE sends them at once). Data must stay
+ * valid until harness_close.
+ * \return 0 on success, -1 on fail.
+ */
+int
+harness_conn(http_conn *conn, const char *data, size_t len, size_t piece)
+{
+	pthread_t thr;
+	int fds[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1) {
+		perror("socketpair");
+		return (-1);
+	}
+
+	pthread_mutex_lock(&feed_lock);
+	if (!feed_started) {
+		if (pthread_create(&thr, NULL, feed_thread, NULL) != 0) {
+			pthread_mutex_unlock(&feed_lock);
+			fprintf(stdlog, log_ERROR "feeder couldn't be started\n");
+			close(fds[0]);
+			close(fds[1]);
+			return (-1);
+		}
+		pthread_detach(thr);
+		feed_started = 1;
+	}
+	while (feed_fd != -1)
+		pthread_cond_wait(&feed_cond, &feed_lock);
+	feed_data = data;
+	feed_len = len;
+	feed_piece = piece;
+	feed_fd = fds[1];
+	pthread_cond_broadcast(&feed_cond);
+	pthread_mutex_unlock(&feed_lock);
+
+	conn->fd = fds[0];
+	conn->tls = NULL;
+	return (0);
+}
+
+/**
+ * Closes connection opened by harness_conn and waits until feeder stops
+ * using its data.
+ */
+void
+harness_close(http_conn *conn)
+{
+	close(conn->fd);
+
+	pthread_mutex_lock(&feed_lock);
+	while (feed_fd != -1)
+		pthread_cond_wait(&feed_cond, &feed_lock);
+	pthread_mutex_unlock(&feed_lock);
+}
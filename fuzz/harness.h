@@ -0,0 +1,13 @@
+#ifndef HARNESS_H
+#define	HARNESS_H
+
+#include <stddef.h>
+#include "defaults.h"
+
+#define	HARNESS_WHOLE 0	// piece of harness_conn writing data at once
+
+int harness_conn(http_conn *conn, const char *data, size_t len,
+		size_t piece);
+void harness_close(http_conn *conn);
+
+#endif /* HARNESS_H */
@@ -0,0 +1,139 @@
+/*!
+ * \file
+ * \brief Planning of chunk ranges of file.
+ *
+ *  File is cut into blocks of align bytes (page or filesystem block) and
+ *  blocks are dealt to chunks evenly, so ranges start on block boundaries
+ *  and differ by one block at most. Number of chunks is lowered when ranges
+ *  would be shorter than min and raised when they would be longer than max.
+ *  Positions are 64-bit, any file size up to LLONG_MAX is planned.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "chunkplan.h"
+
+/**
+ * Plans ranges of file of size bytes for chunks (wanted number of chunks),
+ * ranges are aligned to align and between min and max bytes long (but the
+ * last one, and every one if file is shorter than min).
+ * \return new plan.
+ */
+chunk_plan *
+chunkplan_new(long long int size, int chunks, long long int align,
+		long long int min, long long int max)
+{
+	chunk_plan *plan = calloc(1, sizeof (chunk_plan));
+	long long int blocks, minblocks, maxblocks, num, pos = 0, len;
+	int idx;
+
+	if (align < 1)
+		align = 1;
+	minblocks = (min + align - 1) / align;
+	if (minblocks < 1)
+		minblocks = 1;
+	maxblocks = max / align;
+	if (maxblocks < minblocks)
+		maxblocks = minblocks;
+
+	// the last block may be partial
+	blocks = size / align + ((size % align != 0) ? 1 : 0);
+	num = (chunks < 1) ? 1 : chunks;
+	if (blocks / num < minblocks)
+		num = blocks / minblocks;
+	if ((blocks > 0) && (num < 1))
+		num = 1;
+	if ((num > 0) && ((blocks + num - 1) / num > maxblocks))
+		num = (blocks + maxblocks - 1) / maxblocks;
+	if (num > INT_MAX)
+		num = INT_MAX;
+
+	plan->size = size;
+	plan->align = align;
+	plan->num = (int) num;
+	plan->ranges = malloc(sizeof (plan_range) * (num + 1));
+	for (idx = 0; idx != plan->num; ++idx) {
+		len = (blocks / num + ((idx < blocks % num) ? 1 : 0)) * align;
+		plan->ranges[idx].start = pos;
+		pos = (len > size - pos) ? size : pos + len;
+		plan->ranges[idx].end = pos - 1;
+	}
+
+	return (plan);
+}
+
+/**
+ * Creates plan of file of size bytes without ranges, they are added by
+ * chunkplan_add (e.g. only ranges missing in local copy).
+ * \return new plan.
+ */
+chunk_plan *
+chunkplan_empty(long long int size, long long int align)
+{
+	chunk_plan *plan = calloc(1, sizeof (chunk_plan));
+
+	plan->size = size;
+	plan->align = (align < 1) ? 1 : align;
+	plan->ranges = malloc(sizeof (plan_range));
+	return (plan);
+}
+
+/**
+ * Appends range start - end (both included) behind the last range of plan.
+ * \return 0 on success, -1 if range doesn't follow the last one or exceeds
+ * file.
+ */
+int
+chunkplan_add(chunk_plan *plan, long long int start, long long int end)
+{
+	plan_range *ranges;
+
+	if ((start > end) || (end >= plan->size) || ((plan->num > 0) &&
+			(start <= plan->ranges[plan->num - 1].end)) ||
+			(plan->num == INT_MAX))
+		return (-1);
+	if ((ranges = realloc(plan->ranges, sizeof (plan_range) *
+			(plan->num + 1))) == NULL)
+		return (-1);
+	plan->ranges = ranges;
+	ranges[plan->num].start = start;
+	ranges[plan->num++].end = end;
+
+	return (0);
+}
+
+/**
+ * Splits range idx of plan at position at (multiple of align inside range),
+ * the second part becomes range idx + 1.
+ * \return 0 on success, -1 if range can't be split there.
+ */
+int
+chunkplan_split(chunk_plan *plan, int idx, long long int at)
+{
+	plan_range *ranges;
+
+	if ((idx < 0) || (idx >= plan->num) || (at % plan->align != 0) ||
+			(at <= plan->ranges[idx].start) ||
+			(at > plan->ranges[idx].end) || (plan->num == INT_MAX))
+		return (-1);
+	if ((ranges = realloc(plan->ranges, sizeof (plan_range) *
+			(plan->num + 1))) == NULL)
+		return (-1);
+	plan->ranges = ranges;
+	memmove(&ranges[idx + 1], &ranges[idx],
+			sizeof (plan_range) * (plan->num - idx));
+	ranges[idx].end = at - 1;
+	ranges[idx + 1].start = at;
+	++plan->num;
+
+	return (0);
+}
+
+void
+chunkplan_free(chunk_plan *plan)
+{
+	free(plan->ranges);
+	free(plan);
+}
@@ -0,0 +1,40 @@
+#ifndef CHUNKPLAN_H
+#define	CHUNKPLAN_H
+
+#include <limits.h>
+
+#include "defaults.h"
+
+#define	CHUNKPLAN_MIN_SIZE (64 * 1024)	// smaller files get fewer chunks
+#define	CHUNKPLAN_MAX_SIZE ((long long int) SSIZE_MAX)	// range fits memlen
+
+/**
+ * Range of file downloaded by one chunk (both positions included).
+ */
+typedef struct
+{
+	long long int start, end;
+} plan_range;
+
+/**
+ * Ranges of file in order, every one starts and ends on multiple of align
+ * (but at end of file). Planned ranges cover whole file, added ones only
+ * parts to download. Schedulers may split ranges or hand them out in any
+ * order.
+ */
+typedef struct
+{
+	long long int size;	// size of file
+	long long int align;	// ranges start at multiples of align
+	int num;		// number of ranges (0 for empty file)
+	plan_range *ranges;
+} chunk_plan;
+
+chunk_plan *chunkplan_new(long long int size, int chunks,
+		long long int align, long long int min, long long int max);
+chunk_plan *chunkplan_empty(long long int size, long long int align);
+int chunkplan_add(chunk_plan *plan, long long int start, long long int end);
+int chunkplan_split(chunk_plan *plan, int idx, long long int at);
+void chunkplan_free(chunk_plan *plan);
+
+#endif /* CHUNKPLAN_H */
@@ -0,0 +1,1027 @@
+/*!
+ * \file
+ * \brief Distributed download: coordinator leasing ranges to workers.
+ *
+ *  Coordinator (-G) gets header of every link, creates its file and splits
+ *  it into pieces of COORD_PIECE bytes. Workers (-J, rdwget processes on
+ *  the same or other machines) connect over unix or TCP socket and lease
+ *  one piece at a time, which they download by their own chunks. Lines
+ *  have tab separated fields:
+ *
+ *  - LEASE  -> RANGE lease size start end name url (once a piece is free)
+ *  - RENEW lease received  (every second while range is downloaded)
+ *  - DATA lease offset len, followed by len bytes of range
+ *  - DONE lease, FAILED lease
+ *
+ *  Worker writes its range into file name of its result directory (shared
+ *  storage, e.g. NFS) or sends it back by DATA (-E). Lease which isn't
+ *  renewed for COORD_LEASE_SEC or whose worker disconnected goes to the next
+ *  worker asking, renewal of such lease is answered by LOST and the old
+ *  worker gives it up. Range failed COORD_ATTEMPTS times fails its file.
+ *  Coordinator sends BYE to every worker when all files are finished.
+ */
+
+#define	_GNU_SOURCE	// memfd_create
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+
+#include "coord.h"
+#include "threadmanager.h"
+#include "httpclient.h"
+#include "linkparser.h"
+#include "tls.h"
+#include "membudget.h"
+#include "hostprof.h"
+#include "log.h"
+
+#define	COORD_POLL_MS 1000	// period of lease expiry check
+#define	COORD_SEND_TIMEOUT 5	// seconds a stuck peer may block sender
+
+typedef enum
+{
+	PIECE_FREE, PIECE_LEASED, PIECE_DONE
+} piece_state;
+
+struct cworker;
+
+typedef struct
+{
+	long long int start, end;
+	piece_state state;
+	long lease;		// lease of worker downloading it, 0 if none
+	struct cworker *worker;
+	double expires;		// lease is reassigned after
+	long long int received;	// bytes reported by the last renewal
+	int failures;
+} cpiece;
+
+typedef struct
+{
+	lnk link;
+	char *url;		// final location of link
+	const char *name;	// file name (within link.filename)
+	long long int size;
+	file_fd fd;
+	int num, done;		// pieces, finished pieces
+	cpiece *pieces;
+	int finished;		// 1 = downloaded, -1 = failed
+} cfile;
+
+typedef struct cworker
+{
+	int fd;
+	char *buf;		// COORD_BUF_SIZE bytes
+	size_t len;
+	int wants;		// asked for lease which wasn't assigned yet
+	cfile *datafile;	// file of DATA being received, NULL = drop it
+	long long int dataoff, datalen;
+} cworker;
+
+/**
+ * State of coordinator, all of it is touched by its poll loop only.
+ */
+typedef struct
+{
+	const prgstx *stx;
+	cfile *files;
+	int numfiles, pending;	// files, files not finished yet
+	cworker *workers[COORD_MAX_WORKERS];
+	int joined;		// workers connected so far
+	long nextlease;
+	long long int bytes;	// size of downloaded files
+	double began;		// the first worker joined
+} cstate;
+
+static cstate crd;
+
+/**
+ * Connection of worker to coordinator.
+ */
+typedef struct
+{
+	int fd;
+	char buf[COORD_LINE_MAX];
+	size_t len;
+	long lease;		// lease being downloaded
+	char *url;		// link of the last range, NULL if none
+	lnk link;		// (its header is reused by the next range)
+	lnk_http_header *linkh;
+	int lost;		// coordinator took the lease back
+	int bye;		// coordinator finished
+} cjoin;
+
+/**
+ * \return monotonic time in seconds.
+ */
+static double
+coord_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/**
+ * Sends formatted line to peer.
+ * \return 0 on success, -1 on fail.
+ */
+static int
+coord_send(int fd, const char *format, ...)
+{
+	char line[COORD_LINE_MAX];
+	va_list args;
+	int len;
+
+	va_start(args, format);
+	len = vsnprintf(line, sizeof (line) - 1, format, args);
+	va_end(args);
+	if ((len < 0) || (len >= (int) sizeof (line) - 1))
+		return (-1);
+	line[len++] = '\n';
+
+	return ((send(fd, line, len, MSG_NOSIGNAL) == len) ? 0 : -1);
+}
+
+/**
+ * Splits line into tab separated fields.
+ * \return number of fields (at most max).
+ */
+static int
+coord_fields(char *line, char **fields, int max)
+{
+	int num = 0;
+	char *holder;
+
+	for (fields[num] = strtok_r(line, "\t", &holder);
+			(fields[num] != NULL) && (num < max - 1);
+			fields[num] = strtok_r(NULL, "\t", &holder))
+		++num;
+	if (fields[num] != NULL)
+		++num;
+
+	return (num);
+}
+
+/**
+ * Opens socket of addr: unix socket if addr contains '/', host:port
+ * otherwise (empty host listens on all addresses). Listening socket is
+ * bound (unix one refuses path of running coordinator), the other one
+ * connected.
+ * \return socket, -1 on fail (errno is set).
+ */
+static int
+coord_socket(const char *addr, int listening)
+{
+	struct addrinfo hints, *res, *ai;
+	struct sockaddr_un sun;
+	char *host, *port, *name;
+	mode_t mask;
+	int sockfd = -1, one = 1, ret, err;
+
+	if (strchr(addr, '/') != NULL) {
+		if (strlen(addr) >= sizeof (sun.sun_path)) {
+			errno = ENAMETOOLONG;
+			return (-1);
+		}
+		memset(&sun, 0, sizeof (sun));
+		sun.sun_family = AF_UNIX;
+		strcpy(sun.sun_path, addr);
+		if ((sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC,
+				0)) == -1)
+			return (-1);
+		ret = connect(sockfd, (struct sockaddr *) &sun, sizeof (sun));
+		if (listening) {
+			if (ret == 0) {
+				close(sockfd);
+				errno = EADDRINUSE;
+				return (-1);
+			}
+			unlink(addr);
+			// only owner may lease ranges
+			mask = umask(S_IRWXG | S_IRWXO);
+			if ((ret = bind(sockfd, (struct sockaddr *) &sun,
+					sizeof (sun))) == 0)
+				ret = listen(sockfd, SOMAXCONN);
+			umask(mask);
+		}
+		if (ret == -1) {
+			err = errno;
+			close(sockfd);
+			errno = err;
+			return (-1);
+		}
+		return (sockfd);
+	}
+
+	host = strdup(addr);
+	if ((port = strrchr(host, ':')) == NULL) {
+		free(host);
+		errno = EINVAL;
+		return (-1);
+	}
+	*(port++) = '\0';
+	// [ipv6 address]:port
+	name = host;
+	if ((name[0] == '[') && (port - host > 2) && (port[-2] == ']')) {
+		port[-2] = '\0';
+		++name;
+	}
+
+	memset(&hints, 0, sizeof (hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = (listening) ? AI_PASSIVE : 0;
+	if (getaddrinfo((*name != '\0') ? name : NULL, port, &hints,
+			&res) != 0) {
+		free(host);
+		errno = EINVAL;
+		return (-1);
+	}
+	free(host);
+
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		if ((sockfd = socket(ai->ai_family, ai->ai_socktype |
+				SOCK_CLOEXEC, ai->ai_protocol)) == -1)
+			continue;
+		// lines of protocol aren't delayed (accepted sockets inherit)
+		setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one,
+				sizeof (one));
+		if (listening) {
+			setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &one,
+					sizeof (one));
+			if ((bind(sockfd, ai->ai_addr, ai->ai_addrlen) == 0) &&
+					(listen(sockfd, SOMAXCONN) == 0))
+				break;
+		} else if (connect(sockfd, ai->ai_addr, ai->ai_addrlen) == 0) {
+			break;
+		}
+		err = errno;
+		close(sockfd);
+		errno = err;
+		sockfd = -1;
+	}
+	freeaddrinfo(res);
+
+	return (sockfd);
+}
+
+/**
+ * Sets download settings of link (chunks, socket profile, retries...).
+ */
+static void
+coord_link_settings(lnk *link, const prgstx *stx)
+{
+	link->chunknum = stx->chunks;
+	link->sprf = &stx->sprf;
+	link->hedge = stx->hedge;
+	link->retries = stx->retries;
+	link->retrywait = stx->retrywait;
+	link->http2 = stx->http2;
+	link->maxredirs = stx->maxredirs;
+	link->durability = stx->durability;
+	link->writeback = stx->writeback;
+	link->destfd = -1;
+}
+
+/**
+ * Syncs and closes finished file (removed if ret is -1) and reports it.
+ */
+static void
+coord_file_finish(cfile *file, int ret)
+{
+	ret = thr_mgr_closefile(&file->link, file->fd, ret);
+	file->fd = -1;
+	file->finished = (ret == 0) ? 1 : -1;
+	--crd.pending;
+
+	if (ret == 0) {
+		crd.bytes += file->size;
+		printf("%s successfully downloaded! (%s)\n",
+				file->link.filename, file->url);
+		fflush(stdout);
+	} else {
+		log_error(&file->link, 0, "%s couldn't be downloaded",
+				file->url);
+	}
+}
+
+/**
+ * Gets header of url, creates its file and splits it into pieces.
+ * \return 0 on success, -1 on fail.
+ */
+static int
+coord_file_open(cfile *file, const char *url)
+{
+	const prgstx *stx = crd.stx;
+	lnk_http_header *linkh;
+	chunk_plan *plan;
+	char *linkstr = strdup(url);
+	int idx, ret;
+
+	file->fd = -1;
+	file->finished = -1;
+	ret = link_parse(linkstr, &file->link);
+	free(linkstr);
+	if (ret == -1)
+		return (-1);
+	coord_link_settings(&file->link, stx);
+	file->link.path = stx->output;
+
+	if (thr_mgr_linkheader(&file->link, &linkh) == -1)
+		return (-1);
+	file->size = linkh->clen;
+	link_header_free(linkh);
+	free(linkh);
+	if ((file->fd = thr_mgr_createfile(stx->resultdir, &file->link,
+			file->size)) == -1)
+		return (-1);
+
+	plan = chunkplan_new(file->size, (int) ((file->size + COORD_PIECE -
+			1) / COORD_PIECE), chunk_align(file->fd),
+			CHUNKPLAN_MIN_SIZE, CHUNKPLAN_MAX_SIZE);
+	file->num = plan->num;
+	file->pieces = calloc(plan->num + 1, sizeof (cpiece));
+	for (idx = 0; idx != plan->num; ++idx) {
+		file->pieces[idx].start = plan->ranges[idx].start;
+		file->pieces[idx].end = plan->ranges[idx].end;
+	}
+	chunkplan_free(plan);
+
+	file->url = link_url(&file->link);
+	file->name = strrchr(file->link.filename, '/');
+	file->name = (file->name != NULL) ? file->name + 1 :
+			file->link.filename;
+	file->finished = 0;
+	printf("%s: %lld bytes in %d ranges\n", file->url, file->size,
+			file->num);
+
+	// empty file has nothing to lease
+	if (file->num == 0)
+		coord_file_finish(file, 0);
+	return (0);
+}
+
+/**
+ * \return leased piece of lease (its file into filep), NULL if lease was
+ * taken back or its file is finished.
+ */
+static cpiece *
+coord_lease_find(long lease, cfile **filep)
+{
+	cfile *file;
+	int fidx, pidx;
+
+	for (fidx = 0; fidx != crd.numfiles; ++fidx) {
+		file = &crd.files[fidx];
+		if (file->finished != 0)
+			continue;
+		for (pidx = 0; pidx != file->num; ++pidx) {
+			if ((file->pieces[pidx].state == PIECE_LEASED) &&
+					(file->pieces[pidx].lease == lease)) {
+				*filep = file;
+				return (&file->pieces[pidx]);
+			}
+		}
+	}
+	return (NULL);
+}
+
+/**
+ * Returns leased piece to pool.
+ */
+static void
+coord_piece_free(cpiece *piece)
+{
+	piece->state = PIECE_FREE;
+	piece->lease = 0;
+	piece->worker = NULL;
+}
+
+/**
+ * Executes one command line of worker.
+ */
+static void
+coord_command(cworker *worker, char *line)
+{
+	char *fields[4];
+	int num = coord_fields(line, fields, 4);
+	long long int off, len;
+	cpiece *piece;
+	cfile *file = NULL;
+
+	if (num == 0)
+		return;
+	if (strcmp(fields[0], "LEASE") == 0) {
+		worker->wants = 1;
+		return;
+	}
+	if (num < 2)
+		return;
+	piece = coord_lease_find(atol(fields[1]), &file);
+
+	if ((strcmp(fields[0], "DATA") == 0) && (num == 4)) {
+		off = atoll(fields[2]);
+		len = atoll(fields[3]);
+		// data of lost lease are read and dropped
+		worker->datafile = ((piece != NULL) && (off >= piece->start) &&
+				(len > 0) && (off + len - 1 <= piece->end)) ?
+				file : NULL;
+		worker->dataoff = off;
+		worker->datalen = (len > 0) ? len : 0;
+		return;
+	}
+
+	if (piece == NULL) {
+		// lease was reassigned or its file failed
+		if (strcmp(fields[0], "RENEW") == 0)
+			coord_send(worker->fd, "LOST\t%s", fields[1]);
+		return;
+	}
+	if ((strcmp(fields[0], "RENEW") == 0) && (num == 3)) {
+		piece->expires = coord_now() + COORD_LEASE_SEC;
+		piece->received = atoll(fields[2]);
+	} else if (strcmp(fields[0], "DONE") == 0) {
+		coord_piece_free(piece);
+		piece->state = PIECE_DONE;
+		if (++file->done == file->num)
+			coord_file_finish(file, 0);
+	} else if (strcmp(fields[0], "FAILED") == 0) {
+		coord_piece_free(piece);
+		if (++piece->failures == COORD_ATTEMPTS) {
+			log_range(LOG_ERROR, &file->link, piece->start,
+					piece->end, 0, "range %lld-%lld of %s "
+					"failed %d times", piece->start,
+					piece->end, file->url, COORD_ATTEMPTS);
+			coord_file_finish(file, -1);
+		}
+	}
+}
+
+/**
+ * Reads commands and data of worker.
+ * \return 0 while worker stays connected, -1 when it disconnected.
+ */
+static int
+coord_worker_read(cworker *worker)
+{
+	ssize_t readed;
+	size_t pos = 0, len;
+	cfile *file;
+	char *end;
+
+	readed = read(worker->fd, worker->buf + worker->len,
+			COORD_BUF_SIZE - worker->len);
+	if (readed <= 0)
+		return (-1);
+	worker->len += readed;
+
+	while (pos != worker->len) {
+		if (worker->datalen > 0) {
+			len = worker->len - pos;
+			if ((long long int) len > worker->datalen)
+				len = (size_t) worker->datalen;
+			file = worker->datafile;
+			if ((file != NULL) && (file->finished == 0) &&
+					(pwrite(file->fd, worker->buf + pos,
+					len, (off_t) worker->dataoff) !=
+					(ssize_t) len)) {
+				log_error(&file->link, errno, "range of %s "
+						"couldn't be written",
+						file->url);
+				coord_file_finish(file, -1);
+			}
+			worker->dataoff += len;
+			worker->datalen -= len;
+			pos += len;
+			continue;
+		}
+		if ((end = memchr(worker->buf + pos, '\n', worker->len -
+				pos)) == NULL)
+			break;
+		*end = '\0';
+		coord_command(worker, worker->buf + pos);
+		pos = end + 1 - worker->buf;
+	}
+
+	worker->len -= pos;
+	memmove(worker->buf, worker->buf + pos, worker->len);
+	if (worker->len == COORD_BUF_SIZE) {
+		log_error(NULL, 0, "command of worker is too long");
+		return (-1);
+	}
+
+	return (0);
+}
+
+/**
+ * Disconnects worker, its leases go to other workers.
+ */
+static void
+coord_worker_close(int idx)
+{
+	cworker *worker = crd.workers[idx];
+	cfile *file;
+	int fidx, pidx, num = 0;
+
+	for (fidx = 0; fidx != crd.numfiles; ++fidx) {
+		file = &crd.files[fidx];
+		for (pidx = 0; pidx != file->num; ++pidx) {
+			if ((file->pieces[pidx].state == PIECE_LEASED) &&
+					(file->pieces[pidx].worker == worker)) {
+				coord_piece_free(&file->pieces[pidx]);
+				++num;
+			}
+		}
+	}
+	if ((num > 0) && (crd.pending > 0))
+		log_info(NULL, "worker left, %d ranges are reassigned", num);
+
+	crd.workers[idx] = NULL;
+	close(worker->fd);
+	free(worker->buf);
+	free(worker);
+}
+
+static void
+coord_accept(int sockfd)
+{
+	struct timeval tv = { COORD_SEND_TIMEOUT, 0 };
+	cworker *worker;
+	int fd, idx;
+
+	if ((fd = accept(sockfd, NULL, NULL)) == -1)
+		return;
+	for (idx = 0; idx != COORD_MAX_WORKERS; ++idx) {
+		if (crd.workers[idx] == NULL)
+			break;
+	}
+	if (idx == COORD_MAX_WORKERS) {
+		log_error(NULL, 0, "too many workers of coordinator");
+		close(fd);
+		return;
+	}
+
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+	worker = calloc(1, sizeof (cworker));
+	worker->fd = fd;
+	worker->buf = malloc(COORD_BUF_SIZE);
+	crd.workers[idx] = worker;
+	if (crd.joined++ == 0)
+		crd.began = coord_now();
+}
+
+/**
+ * Takes back leases which weren't renewed in time.
+ */
+static void
+coord_expire(double now)
+{
+	cfile *file;
+	cpiece *piece;
+	int fidx, pidx;
+
+	for (fidx = 0; fidx != crd.numfiles; ++fidx) {
+		file = &crd.files[fidx];
+		if (file->finished != 0)
+			continue;
+		for (pidx = 0; pidx != file->num; ++pidx) {
+			piece = &file->pieces[pidx];
+			if ((piece->state != PIECE_LEASED) ||
+					(piece->expires > now))
+				continue;
+			log_range(LOG_INFO, &file->link, piece->start,
+					piece->end, 0, "lease %ld of %s "
+					"expired at %lld of %lld bytes, range "
+					"is reassigned",
+					piece->lease, file->url,
+					piece->received, piece->end + 1 -
+					piece->start);
+			coord_piece_free(piece);
+		}
+	}
+}
+
+/**
+ * Leases free pieces (files in order) to workers which asked for them.
+ */
+static void
+coord_dispatch(double now)
+{
+	cworker *worker;
+	cfile *file = NULL;
+	cpiece *piece;
+	int idx, fidx = 0, pidx = 0;
+
+	for (idx = 0; idx != COORD_MAX_WORKERS; ++idx) {
+		if (((worker = crd.workers[idx]) == NULL) || (!worker->wants))
+			continue;
+		for (; fidx != crd.numfiles; ++fidx, pidx = 0) {
+			file = &crd.files[fidx];
+			if (file->finished != 0)
+				continue;
+			while ((pidx != file->num) &&
+					(file->pieces[pidx].state !=
+					PIECE_FREE))
+				++pidx;
+			if (pidx != file->num)
+				break;
+		}
+		if (fidx == crd.numfiles)
+			return;
+
+		piece = &file->pieces[pidx];
+		piece->state = PIECE_LEASED;
+		piece->lease = ++crd.nextlease;
+		piece->worker = worker;
+		piece->expires = now + COORD_LEASE_SEC;
+		piece->received = 0;
+		worker->wants = 0;
+		coord_send(worker->fd, "RANGE\t%ld\t%lld\t%lld\t%lld\t%s\t%s",
+				piece->lease, file->size, piece->start,
+				piece->end, file->name, file->url);
+	}
+}
+
+/**
+ * Runs coordinator listening on stx->coordinator until all links of stx
+ * are downloaded by workers which join it.
+ * \return 0 if all links were downloaded, -1 otherwise.
+ */
+int
+coord_run(const prgstx *stx)
+{
+	struct pollfd pfds[COORD_MAX_WORKERS + 1];
+	int widx[COORD_MAX_WORKERS + 1];
+	double elapsed;
+	int sockfd, nfds, idx, ret = 0;
+
+	if ((sockfd = coord_socket(stx->coordinator, 1)) == -1) {
+		log_error(NULL, errno, "Couldn't listen on %s",
+				stx->coordinator);
+		return (-1);
+	}
+	if (tls_init(stx->tlsverify, stx->cafile) == -1)
+		log_error(NULL, 0, "https links can't be downloaded");
+	if (stx->membudget > 0)
+		membudget_init(stx->membudget);
+
+	crd.stx = stx;
+	crd.numfiles = crd.pending = stx->numlinks;
+	crd.files = calloc(stx->numlinks + 1, sizeof (cfile));
+	for (idx = 0; idx != crd.numfiles; ++idx) {
+		if (coord_file_open(&crd.files[idx], stx->links[idx]) == -1) {
+			log_error(NULL, 0, "%s can't be leased",
+					stx->links[idx]);
+			--crd.pending;
+		}
+	}
+
+	printf("coordinator listens on %s\n", stx->coordinator);
+	fflush(stdout);
+
+	while (crd.pending > 0) {
+		pfds[0].fd = sockfd;
+		for (nfds = 1, idx = 0; idx != COORD_MAX_WORKERS; ++idx) {
+			if (crd.workers[idx] != NULL) {
+				widx[nfds] = idx;
+				pfds[nfds++].fd = crd.workers[idx]->fd;
+			}
+		}
+		for (idx = 0; idx != nfds; ++idx)
+			pfds[idx].events = POLLIN;
+
+		if (poll(pfds, nfds, COORD_POLL_MS) == -1) {
+			if (errno == EINTR)
+				continue;
+			log_error(NULL, errno, "poll");
+			break;
+		}
+		for (idx = 1; idx != nfds; ++idx) {
+			if ((pfds[idx].revents & (POLLIN | POLLHUP |
+					POLLERR)) && (coord_worker_read(
+					crd.workers[widx[idx]]) == -1))
+				coord_worker_close(widx[idx]);
+		}
+		if (pfds[0].revents & POLLIN)
+			coord_accept(sockfd);
+
+		coord_expire(coord_now());
+		coord_dispatch(coord_now());
+	}
+	elapsed = coord_now() - crd.began;
+
+	for (idx = 0; idx != COORD_MAX_WORKERS; ++idx) {
+		if (crd.workers[idx] != NULL) {
+			coord_send(crd.workers[idx]->fd, "BYE");
+			coord_worker_close(idx);
+		}
+	}
+	close(sockfd);
+	if (strchr(stx->coordinator, '/') != NULL)
+		unlink(stx->coordinator);
+
+	for (idx = 0; idx != crd.numfiles; ++idx) {
+		if (crd.files[idx].finished != 1)
+			ret = -1;
+		// interrupted poll leaves files open
+		if (crd.files[idx].finished == 0)
+			thr_mgr_closefile(&crd.files[idx].link,
+					crd.files[idx].fd, -1);
+		link_free(&crd.files[idx].link);
+		free(crd.files[idx].url);
+		free(crd.files[idx].pieces);
+	}
+	free(crd.files);
+
+	if ((crd.bytes > 0) && (elapsed > 0))
+		printf("%lld bytes in %.2f s (%.1f MB/s) by %d workers\n",
+				crd.bytes, elapsed, crd.bytes / elapsed / 1e6,
+				crd.joined);
+
+	return (ret);
+}
+
+/**
+ * Reads next line of coordinator into line (without newline), waits at
+ * most timeout milliseconds for it (-1 = until it comes).
+ * \return 1 if line was read, 0 on timeout, -1 if connection was closed.
+ */
+static int
+join_line(cjoin *jn, char *line, int timeout)
+{
+	struct pollfd pfd = { jn->fd, POLLIN, 0 };
+	ssize_t readed;
+	char *end;
+	size_t len;
+
+	for (;;) {
+		if ((end = memchr(jn->buf, '\n', jn->len)) != NULL) {
+			len = end - jn->buf;
+			memcpy(line, jn->buf, len);
+			line[len] = '\0';
+			jn->len -= len + 1;
+			memmove(jn->buf, end + 1, jn->len);
+			return (1);
+		}
+		if (jn->len == sizeof (jn->buf))
+			return (-1);
+		if (poll(&pfd, 1, timeout) == 0)
+			return (0);
+		if ((readed = read(jn->fd, jn->buf + jn->len,
+				sizeof (jn->buf) - jn->len)) <= 0)
+			return (-1);
+		jn->len += readed;
+	}
+}
+
+/**
+ * Renews lease of range being downloaded (progress of its plan) and gives
+ * it up if coordinator took it back.
+ */
+static void
+join_progress(void *data, long long int received, long long int total,
+		const char *chunkmap)
+{
+	cjoin *jn = data;
+	char line[COORD_LINE_MAX];
+
+	coord_send(jn->fd, "RENEW\t%ld\t%lld", jn->lease, received);
+	while (join_line(jn, line, 0) == 1) {
+		if ((strncmp(line, "LOST\t", 5) == 0) &&
+				(atol(line + 5) == jn->lease)) {
+			jn->lost = 1;
+		} else if (strcmp(line, "BYE") == 0) {
+			jn->lost = 1;
+			jn->bye = 1;
+		}
+	}
+	if (jn->lost)
+		__atomic_store_n(&jn->link.cancel, 1, __ATOMIC_RELAXED);
+}
+
+static void
+join_link_free(cjoin *jn)
+{
+	if (jn->url == NULL)
+		return;
+	link_free(&jn->link);
+	link_header_free(jn->linkh);
+	free(jn->linkh);
+	free(jn->url);
+	jn->url = NULL;
+}
+
+/**
+ * Points worker to url and gets its header (reused by its next ranges).
+ * \return 0 on success, -1 on fail.
+ */
+static int
+join_link(cjoin *jn, const prgstx *stx, const char *url)
+{
+	char *linkstr = strdup(url);
+	int ret;
+
+	join_link_free(jn);
+	memset(&jn->link, 0, sizeof (lnk));
+	ret = link_parse(linkstr, &jn->link);
+	free(linkstr);
+	if (ret == -1)
+		return (-1);
+	coord_link_settings(&jn->link, stx);
+	// range sent back is staged in memory
+	if (stx->sendback)
+		jn->link.writeback = 0;
+	jn->link.progress = join_progress;
+	jn->link.progressdata = jn;
+
+	if (thr_mgr_linkheader(&jn->link, &jn->linkh) == -1) {
+		link_free(&jn->link);
+		return (-1);
+	}
+	jn->url = strdup(url);
+
+	return (0);
+}
+
+/**
+ * Downloads leased range start - end of url (file of size bytes) into file
+ * name of result directory, or into memory and sends it to coordinator.
+ * \return 0 on success, -1 on fail.
+ */
+static int
+join_range(cjoin *jn, const prgstx *stx, long long int size,
+		long long int start, long long int end, const char *name,
+		const char *url)
+{
+	chunk_plan *part, *plan;
+	char *dir, *path;
+	file_fd fd;
+	off_t off;
+	int idx, ret;
+
+	if (((jn->url == NULL) || (strcmp(jn->url, url) != 0)) &&
+			(join_link(jn, stx, url) == -1))
+		return (-1);
+	if (jn->linkh->clen != size) {
+		log_error(&jn->link, 0, "%s has %lld bytes, coordinator "
+				"expects %lld", url,
+				(long long int) jn->linkh->clen, size);
+		return (-1);
+	}
+
+	if (stx->sendback) {
+		if (((fd = memfd_create("rdwget-range", MFD_CLOEXEC)) == -1) ||
+				(ftruncate(fd, (off_t) size) == -1)) {
+			log_error(&jn->link, errno, "memfd_create");
+			if (fd != -1)
+				close(fd);
+			return (-1);
+		}
+	} else {
+		// name comes from coordinator, it can't leave result directory
+		if ((strchr(name, '/') != NULL) || (strcmp(name, "..") == 0)) {
+			log_error(&jn->link, 0, "coordinator sent invalid "
+					"file name %s", name);
+			return (-1);
+		}
+		dir = _strcat(stx->resultdir, "/");
+		path = _strcat(dir, name);
+		free(dir);
+		if ((fd = open(path, O_RDWR | O_CLOEXEC)) == -1) {
+			log_error(&jn->link, errno, "Couldn't open shared "
+					"file %s", path);
+			free(path);
+			return (-1);
+		}
+		free(path);
+	}
+	free(jn->link.filename);
+	jn->link.filename = strdup(name);
+
+	// range is downloaded by chunks of this worker
+	jn->link.chunknum = (stx->chunks == CHUNKS_AUTO) ?
+			hostprof_chunks(&jn->link, end + 1 - start) :
+			stx->chunks;
+	part = chunkplan_new(end + 1 - start, jn->link.chunknum,
+			chunk_align(fd), CHUNKPLAN_MIN_SIZE,
+			CHUNKPLAN_MAX_SIZE);
+	plan = chunkplan_empty(size, part->align);
+	for (idx = 0; idx != part->num; ++idx)
+		chunkplan_add(plan, start + part->ranges[idx].start,
+				start + part->ranges[idx].end);
+	chunkplan_free(part);
+
+	__atomic_store_n(&jn->link.cancel, 0, __ATOMIC_RELAXED);
+	ret = thr_mgr_downloadplan(&jn->link, jn->linkh, fd, plan);
+	chunkplan_free(plan);
+
+	if ((ret == 0) && (stx->sendback)) {
+		ret = coord_send(jn->fd, "DATA\t%ld\t%lld\t%lld", jn->lease,
+				start, end + 1 - start);
+		for (off = (off_t) start; (ret == 0) && (off <= end); ) {
+			if (sendfile(jn->fd, fd, &off, end + 1 - off) <= 0) {
+				log_range(LOG_ERROR, &jn->link, start, end,
+						errno, "sendfile");
+				ret = -1;
+			}
+		}
+	} else if ((ret == 0) && (stx->durability != DUR_NONE) &&
+			(fdatasync(fd) == -1)) {
+		log_range(LOG_ERROR, &jn->link, start, end, errno, "range "
+				"of %s couldn't be synced", name);
+		ret = -1;
+	}
+	close(fd);
+
+	return (ret);
+}
+
+/**
+ * Joins coordinator stx->join (waits COORD_CONNECT_WAIT seconds for it to
+ * start) and downloads ranges it leases until it finishes.
+ * \return 0 on success, -1 if connection to coordinator failed.
+ */
+int
+coord_join(const prgstx *stx)
+{
+	cjoin jn;
+	char line[COORD_LINE_MAX], *fields[7];
+	long long int start, end, bytes = 0;
+	int waited, ranges = 0, ret;
+
+	memset(&jn, 0, sizeof (jn));
+	for (waited = 0; (jn.fd = coord_socket(stx->join, 0)) == -1;
+			++waited) {
+		if (waited == COORD_CONNECT_WAIT) {
+			log_error(NULL, errno, "Couldn't connect to "
+					"coordinator %s", stx->join);
+			return (-1);
+		}
+		sleep(1);
+	}
+	if (tls_init(stx->tlsverify, stx->cafile) == -1)
+		log_error(NULL, 0, "https links can't be downloaded");
+	if (stx->membudget > 0)
+		membudget_init(stx->membudget);
+	printf("joined coordinator %s\n", stx->join);
+	fflush(stdout);
+
+	while ((!jn.bye) && (coord_send(jn.fd, "LEASE") == 0)) {
+		// LOST of ranges given up already is skipped
+		while (((ret = join_line(&jn, line, -1)) == 1) &&
+				(strncmp(line, "RANGE\t", 6) != 0) &&
+				(strcmp(line, "BYE") != 0))
+			;
+		if (ret != 1)
+			break;
+		if (strcmp(line, "BYE") == 0) {
+			jn.bye = 1;
+			break;
+		}
+		if (coord_fields(line, fields, 7) != 7)
+			continue;
+
+		jn.lease = atol(fields[1]);
+		jn.lost = 0;
+		start = atoll(fields[3]);
+		end = atoll(fields[4]);
+		if (join_range(&jn, stx, atoll(fields[2]), start, end,
+				fields[5], fields[6]) == 0) {
+			coord_send(jn.fd, "DONE\t%ld", jn.lease);
+			bytes += end + 1 - start;
+			++ranges;
+		} else if (!jn.lost) {
+			log_range(LOG_ERROR, &jn.link, start, end, 0,
+					"range %lld-%lld of %s failed", start,
+					end, fields[6]);
+			coord_send(jn.fd, "FAILED\t%ld", jn.lease);
+		}
+	}
+	if (!jn.bye)
+		log_error(NULL, 0, "coordinator %s closed connection",
+				stx->join);
+	printf("%d ranges (%lld bytes) downloaded for %s\n", ranges, bytes,
+			stx->join);
+
+	join_link_free(&jn);
+	close(jn.fd);
+
+	return ((jn.bye) ? 0 : -1);
+}
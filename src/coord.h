@@ -0,0 +1,17 @@
+#ifndef COORD_H
+#define	COORD_H
+
+#include "defaults.h"
+
+#define	COORD_PIECE (8 * 1024 * 1024)	// range leased to worker at once
+#define	COORD_LEASE_SEC 10	// lease which isn't renewed is reassigned
+#define	COORD_ATTEMPTS 3	// failed leases of range before file fails
+#define	COORD_MAX_WORKERS 256
+#define	COORD_LINE_MAX 8192
+#define	COORD_BUF_SIZE (256 * 1024)	// commands and data of worker
+#define	COORD_CONNECT_WAIT 30	// seconds worker waits for coordinator
+
+int coord_run(const prgstx *stx);
+int coord_join(const prgstx *stx);
+
+#endif /* COORD_H */
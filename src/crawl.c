@@ -0,0 +1,562 @@
+/*!
+ * \file
+ * \brief Recursive mirroring of http sites.
+ *
+ *  Seed links and links found in downloaded HTML pages (linkscan) are
+ *  downloaded within scope of include prefix and depth. Page is scanned by
+ *  worker which downloaded it (in done callback of its job), so crawling
+ *  and downloading overlap in one pass. Found links are deduplicated by
+ *  concurrent set of their fingerprints (sharded by locks, scanning workers
+ *  rarely meet) before they reach the frontier, a FIFO queue of every host
+ *  from which at most hostlimit links are downloaded at once.
+ *
+ *  Link is mirrored into resultdir/host[:port]/path (index.html for path
+ *  ending with slash), which is also the key of the set.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "crawl.h"
+#include "rdwget.h"
+#include "linkparser.h"
+#include "linkscan.h"
+#include "log.h"
+
+typedef struct
+{
+	pthread_mutex_t lock;
+	uint64_t *slots;	// open addressing, 0 = empty slot
+	size_t size;
+	size_t used;
+} crawl_shard;
+
+struct crawl_host;
+
+typedef struct crawl_link
+{
+	struct crawl_link *next;
+	struct crawl_host *host;
+	int depth;		// links followed from seed
+	char url[];
+} crawl_link;
+
+typedef struct crawl_host
+{
+	struct crawl_host *next;
+	char *name;		// scheme://host[:port]
+	int active;		// links being downloaded
+	crawl_link *queue, **qtail;
+} crawl_host;
+
+typedef struct
+{
+	const prgstx *stx;
+	rdw_ctx *ctx;
+	crawl_shard shards[CRAWL_SHARDS];
+	char **scope;		// prefixes of crawled links
+	int scopenum;
+
+	// frontier
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	// crawl finished
+	crawl_host *hosts;
+	int queued;		// links in queues of hosts
+	int active;		// links being downloaded
+
+	long long int files, failed;
+} crawl;
+
+/**
+ * Job of link (data of its done callback).
+ */
+typedef struct
+{
+	crawl *crw;
+	crawl_host *host;
+	int depth;
+} crawl_job;
+
+/**
+ * Page being scanned (data of linkscan callback).
+ */
+typedef struct
+{
+	crawl *crw;
+	const char *base;
+	int depth;		// of links found in page
+} crawl_page;
+
+/**
+ * \return 64 bit fingerprint of key (never 0).
+ */
+static uint64_t
+crawl_fingerprint(const char *key)
+{
+	uint64_t hash = 0xCBF29CE484222325ULL;
+
+	// FNV-1a with final mix of bits (shard and slot use different ones)
+	for (; *key != '\0'; ++key) {
+		hash ^= (unsigned char) *key;
+		hash *= 0x100000001B3ULL;
+	}
+	hash ^= hash >> 33;
+	hash *= 0xFF51AFD7ED558CCDULL;
+	hash ^= hash >> 33;
+
+	return ((hash != 0) ? hash : 1);
+}
+
+/**
+ * Inserts fingerprint of key into link set.
+ * \return 1 if key is new, 0 if it was in set already.
+ */
+static int
+crawl_set_add(crawl *crw, const char *key)
+{
+	uint64_t fp = crawl_fingerprint(key), *old;
+	crawl_shard *shard = &crw->shards[(fp >> 32) % CRAWL_SHARDS];
+	size_t idx, oldidx, oldsize;
+
+	pthread_mutex_lock(&shard->lock);
+	for (idx = fp & (shard->size - 1); shard->slots[idx] != 0;
+			idx = (idx + 1) & (shard->size - 1)) {
+		if (shard->slots[idx] == fp) {
+			pthread_mutex_unlock(&shard->lock);
+			return (0);
+		}
+	}
+	shard->slots[idx] = fp;
+
+	// shard grows at 3/4 load
+	if (++shard->used * 4 > shard->size * 3) {
+		old = shard->slots;
+		oldsize = shard->size;
+		shard->size *= 2;
+		shard->slots = calloc(shard->size, sizeof (uint64_t));
+		for (oldidx = 0; oldidx != oldsize; ++oldidx) {
+			if (old[oldidx] == 0)
+				continue;
+			for (idx = old[oldidx] & (shard->size - 1);
+					shard->slots[idx] != 0;
+					idx = (idx + 1) & (shard->size - 1))
+				;
+			shard->slots[idx] = old[oldidx];
+		}
+		free(old);
+	}
+	pthread_mutex_unlock(&shard->lock);
+
+	return (1);
+}
+
+/**
+ * \return new path of normalized link relative to result directory
+ * (host[:port]/path, CRAWL_INDEX added to path ending with slash).
+ */
+static char *
+crawl_key(const char *url)
+{
+	const char *auth = strstr(url, "://") + 3;
+	const char *query = auth + strcspn(auth, "?");
+	char *key = malloc(strlen(auth) + sizeof (CRAWL_INDEX));
+	char *end = key + (query - auth);
+
+	memcpy(key, auth, query - auth);
+	if (end[-1] == '/')
+		end = stpcpy(end, CRAWL_INDEX);
+	strcpy(end, query);
+
+	return (key);
+}
+
+/**
+ * \return new normalized link given by user (http:// is default scheme),
+ * NULL if it isn't http(s) link.
+ */
+static char *
+crawl_normalize(const char *link)
+{
+	char *url, *full;
+
+	if (strstr(link, "://") != NULL)
+		return (link_resolve(NULL, link));
+
+	full = _strcat(PROTOCOL_HTTP, link);
+	url = link_resolve(NULL, full);
+	free(full);
+	return (url);
+}
+
+/**
+ * Adds link at depth into queue of its host unless it was added before
+ * or it is out of scope (seeds are always in scope).
+ */
+static void
+crawl_add(crawl *crw, const char *url, int depth, int seed)
+{
+	crawl_link *item;
+	crawl_host *host;
+	size_t hostln;
+	char *key;
+	int idx, isnew;
+
+	for (idx = 0; (!seed) && (idx != crw->scopenum); ++idx) {
+		if (strncmp(url, crw->scope[idx], strlen(crw->scope[idx])) == 0)
+			break;
+	}
+	if ((!seed) && (idx == crw->scopenum))
+		return;
+
+	key = crawl_key(url);
+	isnew = crawl_set_add(crw, key);
+	free(key);
+	if (!isnew)
+		return;
+
+	item = malloc(sizeof (crawl_link) + strlen(url) + 1);
+	item->next = NULL;
+	item->depth = depth;
+	strcpy(item->url, url);
+	hostln = strstr(url, "://") + 3 - url;
+	hostln += strcspn(url + hostln, "/");
+
+	pthread_mutex_lock(&crw->lock);
+	for (host = crw->hosts; host != NULL; host = host->next) {
+		if ((strncmp(host->name, url, hostln) == 0) &&
+				(host->name[hostln] == '\0'))
+			break;
+	}
+	if (host == NULL) {
+		host = calloc(1, sizeof (crawl_host));
+		host->name = strndup(url, hostln);
+		host->qtail = &host->queue;
+		host->next = crw->hosts;
+		crw->hosts = host;
+	}
+	item->host = host;
+	*host->qtail = item;
+	host->qtail = &item->next;
+	++crw->queued;
+	pthread_mutex_unlock(&crw->lock);
+}
+
+/**
+ * Link found in page, it is resolved against page and added at depth of
+ * links of the page.
+ */
+static void
+crawl_found(void *data, const char *ref)
+{
+	crawl_page *page = data;
+	char *url;
+
+	// sorting links of directory listings (?C=N;O=D) repeat the page
+	if (*ref == '?')
+		return;
+
+	if ((url = link_resolve(page->base, ref)) != NULL) {
+		crawl_add(page->crw, url, page->depth, 0);
+		free(url);
+	}
+}
+
+/**
+ * Scans downloaded file path for links if it is HTML page (starts with
+ * tag), base is its link and depth the depth of its links.
+ */
+static void
+crawl_scan(crawl *crw, const char *path, const char *base, int depth)
+{
+	crawl_page page = { crw, base, depth };
+	linkscan *scan;
+	const char *chr;
+	ssize_t len;
+	char *buf;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		return;
+	buf = malloc(CRAWL_READ_SIZE);
+
+	if ((len = read(fd, buf, CRAWL_READ_SIZE)) > 0) {
+		chr = buf;
+		if ((len >= 3) && (memcmp(chr, "\xEF\xBB\xBF", 3) == 0))
+			chr += 3;
+		while ((chr != buf + len) && ((*chr == ' ') || (*chr == '\t') ||
+				(*chr == '\r') || (*chr == '\n')))
+			++chr;
+		if ((chr != buf + len) && (*chr == '<')) {
+			scan = linkscan_init(crawl_found, &page);
+			do {
+				linkscan_feed(scan, buf, len);
+			} while ((len = read(fd, buf, CRAWL_READ_SIZE)) > 0);
+			linkscan_free(scan);
+		}
+	}
+
+	free(buf);
+	close(fd);
+}
+
+/**
+ * Creates parent directories of file path (the deepest one is tried
+ * first, it exists for most of files).
+ * \return 0 on success, -1 on fail.
+ */
+static int
+crawl_mkdirs(char *path)
+{
+	char *slash = strrchr(path, '/');
+	int ret = 0;
+
+	if ((slash == NULL) || (slash == path))
+		return (0);
+
+	*slash = '\0';
+	if ((mkdir(path, 0755) == -1) && (errno != EEXIST)) {
+		ret = -1;
+		if ((errno == ENOENT) && (crawl_mkdirs(path) == 0) &&
+				((mkdir(path, 0755) == 0) || (errno == EEXIST)))
+			ret = 0;
+	}
+	*slash = '/';
+
+	return (ret);
+}
+
+/**
+ * Ends download of link of host. Called with crw->lock held.
+ */
+static void
+crawl_release(crawl *crw, crawl_host *host)
+{
+	--host->active;
+	if ((--crw->active == 0) && (crw->queued == 0))
+		pthread_cond_broadcast(&crw->cond);
+}
+
+static void crawl_done(rdw_job *job, void *data);
+
+/**
+ * Submits download of link into engine.
+ * \return 0 on success, -1 on fail.
+ */
+static int
+crawl_submit(crawl *crw, crawl_link *item)
+{
+	const char *resultdir = crw->stx->resultdir;
+	size_t dirln = strlen(resultdir);
+	crawl_job *cjob = malloc(sizeof (crawl_job));
+	char *key = crawl_key(item->url), *path;
+	rdw_dest dest;
+
+	path = malloc(dirln + strlen(key) + 2);
+	sprintf(path, "%s%s%s", resultdir, ((dirln != 0) &&
+			(resultdir[dirln - 1] == '/')) ? "" : "/", key);
+	free(key);
+	if (crawl_mkdirs(path) == -1) {
+		log_error(NULL, errno, "directory of %s couldn't be "
+				"created", path);
+		free(path);
+		free(cjob);
+		return (-1);
+	}
+
+	cjob->crw = crw;
+	cjob->host = item->host;
+	cjob->depth = item->depth;
+	memset(&dest, 0, sizeof (dest));
+	dest.fd = -1;
+	dest.path = path;
+	dest.done = crawl_done;
+	dest.data = cjob;
+
+	if (rdw_submit(crw->ctx, item->url, NULL, &dest) == NULL) {
+		free(path);
+		free(cjob);
+		return (-1);
+	}
+	free(path);
+	return (0);
+}
+
+/**
+ * Submits queued links of hosts which download less links than host limit.
+ */
+static void
+crawl_dispatch(crawl *crw)
+{
+	crawl_link *ready, **rtail, *item;
+	crawl_host *host;
+	int refill;
+
+	do {
+		refill = 0;
+		ready = NULL;
+		rtail = &ready;
+		pthread_mutex_lock(&crw->lock);
+		for (host = crw->hosts; host != NULL; host = host->next) {
+			while ((host->active < crw->stx->hostlimit) &&
+					((item = host->queue) != NULL)) {
+				if ((host->queue = item->next) == NULL)
+					host->qtail = &host->queue;
+				++host->active;
+				++crw->active;
+				--crw->queued;
+				item->next = NULL;
+				*rtail = item;
+				rtail = &item->next;
+			}
+		}
+		pthread_mutex_unlock(&crw->lock);
+
+		// slots of links which failed at once are refilled
+		while ((item = ready) != NULL) {
+			ready = item->next;
+			if (crawl_submit(crw, item) == -1) {
+				pthread_mutex_lock(&crw->lock);
+				++crw->failed;
+				crawl_release(crw, item->host);
+				pthread_mutex_unlock(&crw->lock);
+				refill = 1;
+			}
+			free(item);
+		}
+	} while (refill);
+}
+
+/**
+ * Download of link finished (called by worker which downloaded it), page
+ * is scanned for links unless it is at maximal depth.
+ */
+static void
+crawl_done(rdw_job *job, void *data)
+{
+	crawl_job *cjob = data;
+	crawl *crw = cjob->crw;
+	int maxdepth = crw->stx->depth;
+	int done = (rdw_job_state(job) == RDW_DONE);
+
+	if (done) {
+		printf("%s successfully downloaded! (%s)\n", rdw_job_path(job),
+				rdw_job_url(job));
+		if ((maxdepth == 0) || (cjob->depth < maxdepth))
+			crawl_scan(crw, rdw_job_path(job),
+					rdw_job_location(job), cjob->depth + 1);
+	}
+	rdw_job_free(job);
+
+	pthread_mutex_lock(&crw->lock);
+	if (done)
+		++crw->files;
+	else
+		++crw->failed;
+	crawl_release(crw, cjob->host);
+	pthread_mutex_unlock(&crw->lock);
+	free(cjob);
+
+	crawl_dispatch(crw);
+}
+
+/**
+ * Mirrors links of settings recursively (downloads them, links of their
+ * pages and so on) into result directory.
+ * \return 0 if all found links were downloaded, -1 otherwise.
+ */
+int
+crawl_run(const prgstx *stx)
+{
+	crawl crw;
+	crawl_host *host;
+	crawl_link *item;
+	char *url, *prefix, *auth;
+	size_t len;
+	int idx, ret = 0;
+
+	memset(&crw, 0, sizeof (crawl));
+	crw.stx = stx;
+	if ((crw.ctx = rdw_init(stx, stx->workers)) == NULL)
+		return (-1);
+	pthread_mutex_init(&crw.lock, NULL);
+	pthread_cond_init(&crw.cond, NULL);
+	for (idx = 0; idx != CRAWL_SHARDS; ++idx) {
+		pthread_mutex_init(&crw.shards[idx].lock, NULL);
+		crw.shards[idx].size = CRAWL_SHARD_SLOTS;
+		crw.shards[idx].slots = calloc(CRAWL_SHARD_SLOTS,
+				sizeof (uint64_t));
+	}
+
+	crw.scope = calloc(stx->numlinks + 1, sizeof (char *));
+	if (stx->include != NULL) {
+		if ((crw.scope[0] = crawl_normalize(stx->include)) == NULL) {
+			log_error(NULL, 0, "%s not valid http link!!!",
+					stx->include);
+			ret = -1;
+		} else {
+			crw.scopenum = 1;
+		}
+	}
+
+	for (idx = 0; (ret == 0) && (idx != stx->numlinks); ++idx) {
+		if ((url = crawl_normalize(stx->links[idx])) == NULL) {
+			log_error(NULL, 0, "%s not valid http link!!!",
+					stx->links[idx]);
+			ret = -1;
+			continue;
+		}
+		// default scope is directory of seed
+		if (stx->include == NULL) {
+			auth = strstr(url, "://") + 3;
+			for (len = strcspn(auth, "?"); auth[len - 1] != '/';
+					--len)
+				;
+			prefix = strndup(url, auth + len - url);
+			crw.scope[crw.scopenum++] = prefix;
+		}
+		crawl_add(&crw, url, 0, 1);
+		free(url);
+	}
+
+	if (ret == 0) {
+		crawl_dispatch(&crw);
+		pthread_mutex_lock(&crw.lock);
+		while ((crw.active > 0) || (crw.queued > 0))
+			pthread_cond_wait(&crw.cond, &crw.lock);
+		pthread_mutex_unlock(&crw.lock);
+	}
+	rdw_shutdown(crw.ctx);
+
+	printf("\n%lld files downloaded, %lld failed\n", crw.files,
+			crw.failed);
+	if (crw.failed > 0)
+		ret = -1;
+
+	while ((host = crw.hosts) != NULL) {
+		crw.hosts = host->next;
+		while ((item = host->queue) != NULL) {
+			host->queue = item->next;
+			free(item);
+		}
+		free(host->name);
+		free(host);
+	}
+	for (idx = 0; idx != crw.scopenum; ++idx)
+		free(crw.scope[idx]);
+	free(crw.scope);
+	for (idx = 0; idx != CRAWL_SHARDS; ++idx) {
+		free(crw.shards[idx].slots);
+		pthread_mutex_destroy(&crw.shards[idx].lock);
+	}
+	pthread_cond_destroy(&crw.cond);
+	pthread_mutex_destroy(&crw.lock);
+
+	return (ret);
+}
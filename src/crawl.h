@@ -0,0 +1,13 @@
+#ifndef CRAWL_H
+#define	CRAWL_H
+
+#include "defaults.h"
+
+#define	CRAWL_SHARDS 64		// locks of link set
+#define	CRAWL_SHARD_SLOTS 1024	// initial fingerprints of one shard
+#define	CRAWL_READ_SIZE (64 * 1024)	// pages are scanned by reads of
+#define	CRAWL_INDEX "index.html"	// file of link ending with slash
+
+int crawl_run(const prgstx *stx);
+
+#endif /* CRAWL_H */
@@ -0,0 +1,752 @@
+/*!
+ * \file
+ * \brief Daemon mode (jobs submitted over unix socket) and its client.
+ *
+ *  Daemon keeps one download context (workers, connections, TLS sessions,
+ *  resolver cache and circuit breakers) alive for all jobs and accepts
+ *  line commands on unix domain socket. Fields of lines are separated by
+ *  tabs:
+ *
+ *  - SUBMIT priority chunks resultdir url  -> QUEUED id url
+ *  - CANCEL id
+ *  - PRIORITY id priority                  -> PRIORITY id priority
+ *  - WATCH id  (events of job go to this connection)  -> WATCH id
+ *  - LIST  -> JOB id state received total url ... END
+ *
+ *  Events of jobs are streamed to connection which submitted (or watches)
+ *  them: RUNNING id, PROGRESS id received total chunkmap, DONE id path,
+ *  FAILED id url, CANCELLED id url. Errors are answered by ERROR message.
+ *
+ *  Every queued job is written into journal (Q record), its start (R),
+ *  priority changes (P) and end (F) too. Daemon started with existing
+ *  journal resumes unfinished jobs; partial file of a job which was running
+ *  is removed first, so the job starts again.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/time.h>
+
+#include "daemon.h"
+#include "log.h"
+#include "rdwget.h"
+#include "linkparser.h"
+
+typedef struct
+{
+	int fd;
+	char buf[DAEMON_LINE_MAX];
+	size_t len;
+} dclient;
+
+typedef struct djob
+{
+	long id;
+	rdw_job *job;
+	dclient *client;	// connection receiving events, NULL if none
+	int priority;
+	char *resultdir;
+	char *url;
+	prgstx stx;		// settings of job (resultdir points above)
+	int running;
+	long long int received, total;
+	struct djob *next;
+} djob;
+
+/**
+ * State of daemon. lock guards jobs, clients and journal, it is taken by
+ * workers reporting start and progress of jobs.
+ */
+typedef struct
+{
+	rdw_ctx *ctx;
+	const prgstx *stx;
+	pthread_mutex_t lock;
+	djob *jobs;
+	long nextid;
+	int journal;
+	dclient *clients[DAEMON_MAX_CLIENTS];
+} dstate;
+
+static dstate dmn = { .lock = PTHREAD_MUTEX_INITIALIZER, .journal = -1 };
+static int sigpipefd[2] = { -1, -1 };
+
+static const char *state_names[] =
+	{ "queued", "running", "done", "failed", "cancelled" };
+
+/**
+ * Sends formatted line to client. Progress (nowait) is dropped if socket
+ * buffer of client is full, other lines wait at most DAEMON_SEND_TIMEOUT.
+ * Has to be called with dmn.lock held.
+ */
+static void
+daemon_send(dclient *client, int nowait, const char *format, ...)
+{
+	char line[DAEMON_LINE_MAX];
+	va_list args;
+	int len;
+
+	if (client == NULL)
+		return;
+
+	va_start(args, format);
+	len = vsnprintf(line, sizeof (line) - 1, format, args);
+	va_end(args);
+	if ((len < 0) || (len >= (int) sizeof (line) - 1))
+		return;
+	line[len++] = '\n';
+
+	send(client->fd, line, len, MSG_NOSIGNAL | (nowait ? MSG_DONTWAIT : 0));
+}
+
+/**
+ * Appends record to journal and flushes it to disk.
+ * Has to be called with dmn.lock held.
+ */
+static void
+journal_write(const char *format, ...)
+{
+	char line[DAEMON_LINE_MAX];
+	va_list args;
+	int len;
+
+	if (dmn.journal == -1)
+		return;
+
+	va_start(args, format);
+	len = vsnprintf(line, sizeof (line) - 1, format, args);
+	va_end(args);
+	if ((len < 0) || (len >= (int) sizeof (line) - 1))
+		return;
+	line[len++] = '\n';
+
+	if ((write(dmn.journal, line, len) != len) ||
+			(fdatasync(dmn.journal) == -1))
+		log_error(NULL, errno, "journal");
+}
+
+static djob *
+daemon_job_find(long id)
+{
+	djob *dj;
+
+	for (dj = dmn.jobs; dj != NULL; dj = dj->next) {
+		if (dj->id == id)
+			return (dj);
+	}
+	return (NULL);
+}
+
+static void
+daemon_job_start(rdw_job *job, void *data)
+{
+	djob *dj = data;
+
+	pthread_mutex_lock(&dmn.lock);
+	dj->running = 1;
+	journal_write("R\t%ld", dj->id);
+	daemon_send(dj->client, 0, "RUNNING\t%ld", dj->id);
+	pthread_mutex_unlock(&dmn.lock);
+}
+
+static void
+daemon_job_progress(rdw_job *job, long long int received,
+		long long int total, const char *chunkmap, void *data)
+{
+	djob *dj = data;
+
+	pthread_mutex_lock(&dmn.lock);
+	dj->received = received;
+	dj->total = total;
+	daemon_send(dj->client, 1, "PROGRESS\t%ld\t%lld\t%lld\t%s", dj->id,
+			received, total, chunkmap);
+	pthread_mutex_unlock(&dmn.lock);
+}
+
+/**
+ * Creates job and submits it into download context (id 0 assigns new id).
+ * Has to be called with dmn.lock held.
+ * \return new job, NULL if url isn't valid link.
+ */
+static djob *
+daemon_job_submit(long id, int priority, int chunks, const char *resultdir,
+		const char *url)
+{
+	djob *dj = calloc(1, sizeof (djob));
+	rdw_dest dest;
+
+	dj->id = (id > 0) ? id : dmn.nextid;
+	if (dj->id >= dmn.nextid)
+		dmn.nextid = dj->id + 1;
+	dj->priority = priority;
+	dj->resultdir = strdup(resultdir);
+	dj->url = strdup(url);
+	dj->stx = *dmn.stx;
+	dj->stx.chunks = chunks;
+	dj->stx.resultdir = dj->resultdir;
+
+	memset(&dest, 0, sizeof (dest));
+	dest.fd = -1;
+	dest.start = daemon_job_start;
+	dest.progress = daemon_job_progress;
+	dest.data = dj;
+	dest.priority = priority;
+
+	if ((dj->job = rdw_submit(dmn.ctx, url, &dj->stx, &dest)) == NULL) {
+		free(dj->resultdir);
+		free(dj->url);
+		free(dj);
+		return (NULL);
+	}
+	journal_write("Q\t%ld\t%d\t%d\t%s\t%s\t%s", dj->id, priority, chunks,
+			resultdir, rdw_job_path(dj->job), url);
+
+	dj->next = dmn.jobs;
+	dmn.jobs = dj;
+
+	return (dj);
+}
+
+/**
+ * Reports finished job to its client and forgets it.
+ * Has to be called with dmn.lock held.
+ */
+static void
+daemon_job_finish(rdw_job *job)
+{
+	djob **item, *dj;
+	rdw_state state = rdw_job_state(job);
+
+	for (item = &dmn.jobs; *item != NULL; item = &(*item)->next) {
+		if ((*item)->job == job)
+			break;
+	}
+	if ((dj = *item) == NULL)
+		return;
+	*item = dj->next;
+
+	journal_write("F\t%ld", dj->id);
+	if (state == RDW_DONE)
+		daemon_send(dj->client, 0, "DONE\t%ld\t%s", dj->id,
+				rdw_job_path(job));
+	else
+		daemon_send(dj->client, 0, "%s\t%ld\t%s",
+				(state == RDW_CANCELLED) ? "CANCELLED" : "FAILED",
+				dj->id, dj->url);
+
+	rdw_job_free(job);
+	free(dj->resultdir);
+	free(dj->url);
+	free(dj);
+}
+
+/**
+ * Splits line into tab separated fields.
+ * \return number of fields (at most max).
+ */
+static int
+split_fields(char *line, char **fields, int max)
+{
+	int num = 0;
+	char *holder;
+
+	for (fields[num] = strtok_r(line, "\t", &holder);
+			(fields[num] != NULL) && (num < max - 1);
+			fields[num] = strtok_r(NULL, "\t", &holder))
+		++num;
+	if (fields[num] != NULL)
+		++num;
+
+	return (num);
+}
+
+/**
+ * Executes one command line of client.
+ * Has to be called with dmn.lock held.
+ */
+static void
+daemon_command(dclient *client, char *line)
+{
+	char *fields[6];
+	int num = split_fields(line, fields, 6);
+	djob *dj;
+	long id;
+
+	if (num == 0)
+		return;
+
+	if ((strcmp(fields[0], "SUBMIT") == 0) && (num == 5)) {
+		// 0 chunks = by profile of server
+		if ((fields[2][0] == '\0') || (fields[2][strspn(fields[2],
+				"0123456789")] != '\0')) {
+			daemon_send(client, 0, "ERROR\t%s\tnumber of chunks "
+					"must be a number", fields[4]);
+			return;
+		}
+		if ((dj = daemon_job_submit(0, atoi(fields[1]),
+				atoi(fields[2]), fields[3], fields[4])) == NULL) {
+			daemon_send(client, 0, "ERROR\t%s\tnot valid link",
+					fields[4]);
+			return;
+		}
+		dj->client = client;
+		daemon_send(client, 0, "QUEUED\t%ld\t%s", dj->id, dj->url);
+		return;
+	}
+
+	if (strcmp(fields[0], "LIST") == 0) {
+		for (dj = dmn.jobs; dj != NULL; dj = dj->next)
+			daemon_send(client, 0, "JOB\t%ld\t%s\t%lld\t%lld\t%s",
+					dj->id, state_names[dj->running ?
+					RDW_RUNNING : RDW_QUEUED], dj->received,
+					dj->total, dj->url);
+		daemon_send(client, 0, "END");
+		return;
+	}
+
+	id = (num > 1) ? atol(fields[1]) : 0;
+	if ((num < 2) || ((dj = daemon_job_find(id)) == NULL)) {
+		daemon_send(client, 0, "ERROR\t%s\tunknown job",
+				(num > 1) ? fields[1] : "");
+		return;
+	}
+
+	if ((strcmp(fields[0], "CANCEL") == 0) && (num == 2)) {
+		rdw_cancel(dj->job);
+	} else if ((strcmp(fields[0], "PRIORITY") == 0) && (num == 3)) {
+		dj->priority = atoi(fields[2]);
+		rdw_set_priority(dj->job, dj->priority);
+		journal_write("P\t%ld\t%d", dj->id, dj->priority);
+		daemon_send(client, 0, "PRIORITY\t%ld\t%d", dj->id,
+				dj->priority);
+	} else if ((strcmp(fields[0], "WATCH") == 0) && (num == 2)) {
+		dj->client = client;
+		daemon_send(client, 0, "WATCH\t%ld", dj->id);
+	} else {
+		daemon_send(client, 0, "ERROR\t%s\tunknown command",
+				fields[0]);
+	}
+}
+
+/**
+ * Reads commands of client.
+ * \return 0 while client stays connected, -1 when it disconnected.
+ */
+static int
+daemon_client_read(dclient *client)
+{
+	ssize_t readed;
+	char *start, *end;
+
+	readed = read(client->fd, client->buf + client->len,
+			sizeof (client->buf) - client->len);
+	if (readed <= 0)
+		return (-1);
+	client->len += readed;
+
+	pthread_mutex_lock(&dmn.lock);
+	start = client->buf;
+	while ((end = memchr(start, '\n', client->len -
+			(start - client->buf))) != NULL) {
+		*end = '\0';
+		daemon_command(client, start);
+		start = end + 1;
+	}
+	pthread_mutex_unlock(&dmn.lock);
+
+	client->len -= start - client->buf;
+	memmove(client->buf, start, client->len);
+	if (client->len == sizeof (client->buf)) {
+		log_error(NULL, 0, "command of client is too long");
+		return (-1);
+	}
+
+	return (0);
+}
+
+static void
+daemon_client_close(int idx)
+{
+	dclient *client = dmn.clients[idx];
+	djob *dj;
+
+	pthread_mutex_lock(&dmn.lock);
+	for (dj = dmn.jobs; dj != NULL; dj = dj->next) {
+		if (dj->client == client)
+			dj->client = NULL;
+	}
+	dmn.clients[idx] = NULL;
+	pthread_mutex_unlock(&dmn.lock);
+
+	close(client->fd);
+	free(client);
+}
+
+static void
+daemon_accept(int sockfd)
+{
+	struct timeval tv = { DAEMON_SEND_TIMEOUT, 0 };
+	dclient *client;
+	int fd, idx;
+
+	if ((fd = accept(sockfd, NULL, NULL)) == -1)
+		return;
+	for (idx = 0; idx != DAEMON_MAX_CLIENTS; ++idx) {
+		if (dmn.clients[idx] == NULL)
+			break;
+	}
+	if (idx == DAEMON_MAX_CLIENTS) {
+		log_error(NULL, 0, "too many clients of daemon");
+		close(fd);
+		return;
+	}
+
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+	client = calloc(1, sizeof (dclient));
+	client->fd = fd;
+	dmn.clients[idx] = client;
+}
+
+/**
+ * Replays journal: unfinished jobs are submitted again and journal is
+ * rewritten with them only.
+ * \return 0 on success, -1 if journal can't be opened.
+ */
+static int
+journal_resume(const char *path)
+{
+	typedef struct jrec
+	{
+		long id;
+		int priority, chunks, running, finished;
+		char *resultdir, *path, *url;
+		struct jrec *next;
+	} jrec;
+	jrec *recs = NULL, **tail = &recs, *rec;
+	char *line = NULL, *fields[7];
+	char *tmppath = _strcat(path, ".new");
+	size_t linesize = 0;
+	ssize_t len;
+	FILE *jfile;
+	long id;
+	int num;
+
+	if ((jfile = fopen(path, "r")) != NULL) {
+		while ((len = getline(&line, &linesize, jfile)) > 0) {
+			if (line[len - 1] == '\n')
+				line[len - 1] = '\0';
+			num = split_fields(line, fields, 7);
+			if (num < 2)
+				continue;
+			id = atol(fields[1]);
+			if ((fields[0][0] == 'Q') && (num == 7)) {
+				rec = calloc(1, sizeof (jrec));
+				rec->id = id;
+				rec->priority = atoi(fields[2]);
+				rec->chunks = atoi(fields[3]);
+				rec->resultdir = strdup(fields[4]);
+				rec->path = strdup(fields[5]);
+				rec->url = strdup(fields[6]);
+				*tail = rec;
+				tail = &rec->next;
+				continue;
+			}
+			for (rec = recs; rec != NULL; rec = rec->next) {
+				if (rec->id == id)
+					break;
+			}
+			if (rec == NULL)
+				continue;
+			if (fields[0][0] == 'R')
+				rec->running = 1;
+			else if (fields[0][0] == 'F')
+				rec->finished = 1;
+			else if ((fields[0][0] == 'P') && (num == 3))
+				rec->priority = atoi(fields[2]);
+		}
+		free(line);
+		fclose(jfile);
+	}
+
+	if ((dmn.journal = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC |
+			O_CLOEXEC, S_IRUSR | S_IWUSR)) == -1) {
+		log_error(NULL, errno, "Couldn't create journal %s",
+				tmppath);
+		free(tmppath);
+		return (-1);
+	}
+
+	while ((rec = recs) != NULL) {
+		recs = rec->next;
+		if (!rec->finished) {
+			// partial file of interrupted job would block it
+			if (rec->running && (unlink(rec->path) == 0))
+				log_info(NULL, "removed partial file %s",
+						rec->path);
+			pthread_mutex_lock(&dmn.lock);
+			if (daemon_job_submit(rec->id, rec->priority,
+					rec->chunks, rec->resultdir,
+					rec->url) != NULL)
+				log_info(NULL, "resumed job %ld %s",
+						rec->id, rec->url);
+			pthread_mutex_unlock(&dmn.lock);
+		}
+		free(rec->resultdir);
+		free(rec->path);
+		free(rec->url);
+		free(rec);
+	}
+
+	if (rename(tmppath, path) == -1)
+		log_error(NULL, errno, "Couldn't replace journal %s", path);
+	free(tmppath);
+
+	return (0);
+}
+
+static void
+daemon_signal(int sig)
+{
+	char note = (char) sig;
+
+	if (write(sigpipefd[1], &note, 1) == -1)
+		return;
+}
+
+/**
+ * Creates listening unix socket on path (refuses path of running daemon).
+ * \return socket, -1 on fail.
+ */
+static int
+daemon_listen(const char *path)
+{
+	struct sockaddr_un addr;
+	mode_t mask;
+	int sockfd, ret;
+
+	if (strlen(path) >= sizeof (addr.sun_path)) {
+		log_error(NULL, 0, "socket path %s is too long", path);
+		return (-1);
+	}
+	memset(&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	if ((sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+		log_error(NULL, errno, "socket");
+		return (-1);
+	}
+	if (connect(sockfd, (struct sockaddr *) &addr, sizeof (addr)) == 0) {
+		log_error(NULL, 0, "daemon already listens on %s", path);
+		close(sockfd);
+		return (-1);
+	}
+	unlink(path);
+
+	// only owner may submit jobs
+	mask = umask(S_IRWXG | S_IRWXO);
+	ret = bind(sockfd, (struct sockaddr *) &addr, sizeof (addr));
+	umask(mask);
+	if ((ret == -1) || (listen(sockfd, SOMAXCONN) == -1)) {
+		log_error(NULL, errno, "Couldn't listen on %s", path);
+		close(sockfd);
+		return (-1);
+	}
+
+	return (sockfd);
+}
+
+/**
+ * Runs daemon listening on stx->daemon until SIGINT or SIGTERM. Unfinished
+ * jobs stay in journal and are resumed by the next daemon.
+ * \return 0 on success, -1 on fail.
+ */
+int
+daemon_run(const prgstx *stx)
+{
+	struct pollfd pfds[DAEMON_MAX_CLIENTS + 3];
+	int cidx[DAEMON_MAX_CLIENTS + 3];
+	struct sigaction sa;
+	char *jpath;
+	rdw_job *job;
+	char note;
+	int sockfd, nfds, idx;
+
+	if ((sockfd = daemon_listen(stx->daemon)) == -1)
+		return (-1);
+
+	if ((pipe(sigpipefd) == -1) || ((dmn.ctx = rdw_init(stx,
+			stx->workers)) == NULL)) {
+		close(sockfd);
+		return (-1);
+	}
+	fcntl(sigpipefd[0], F_SETFD, FD_CLOEXEC);
+	fcntl(sigpipefd[1], F_SETFD, FD_CLOEXEC);
+	memset(&sa, 0, sizeof (sa));
+	sa.sa_handler = daemon_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	dmn.stx = stx;
+	dmn.nextid = 1;
+	jpath = (stx->journal != NULL) ? strdup(stx->journal) :
+			_strcat(stx->daemon, DAEMON_JOURNAL_SUFFIX);
+	if (journal_resume(jpath) == -1)
+		log_error(NULL, 0, "jobs won't be journalled");
+	free(jpath);
+
+	printf("daemon listens on %s\n", stx->daemon);
+	fflush(stdout);
+
+	for (;;) {
+		pfds[0].fd = sockfd;
+		pfds[1].fd = sigpipefd[0];
+		pfds[2].fd = rdw_fd(dmn.ctx);
+		for (nfds = 3, idx = 0; idx != DAEMON_MAX_CLIENTS; ++idx) {
+			if (dmn.clients[idx] != NULL) {
+				cidx[nfds] = idx;
+				pfds[nfds++].fd = dmn.clients[idx]->fd;
+			}
+		}
+		for (idx = 0; idx != nfds; ++idx)
+			pfds[idx].events = POLLIN;
+
+		if (poll(pfds, nfds, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			log_error(NULL, errno, "poll");
+			break;
+		}
+
+		if (pfds[1].revents & POLLIN) {
+			if (read(sigpipefd[0], &note, 1) == 1)
+				log_info(NULL, "daemon stopped by signal %d",
+						note);
+			break;
+		}
+		if (pfds[2].revents & POLLIN) {
+			pthread_mutex_lock(&dmn.lock);
+			while ((job = rdw_poll(dmn.ctx, 0)) != NULL)
+				daemon_job_finish(job);
+			pthread_mutex_unlock(&dmn.lock);
+		}
+		for (idx = 3; idx != nfds; ++idx) {
+			if ((pfds[idx].revents & (POLLIN | POLLHUP | POLLERR)) &&
+					(daemon_client_read(
+					dmn.clients[cidx[idx]]) == -1))
+				daemon_client_close(cidx[idx]);
+		}
+		if (pfds[0].revents & POLLIN)
+			daemon_accept(sockfd);
+	}
+
+	close(sockfd);
+	unlink(stx->daemon);
+	for (idx = 0; idx != DAEMON_MAX_CLIENTS; ++idx) {
+		if (dmn.clients[idx] != NULL)
+			daemon_client_close(idx);
+	}
+
+	// interrupted jobs stay unfinished in journal
+	pthread_mutex_lock(&dmn.lock);
+	if (dmn.journal != -1)
+		close(dmn.journal);
+	dmn.journal = -1;
+	pthread_mutex_unlock(&dmn.lock);
+	rdw_shutdown(dmn.ctx);
+
+	return (0);
+}
+
+/**
+ * Submits links of stx into daemon listening on stx->submit and waits for
+ * them like download of rdwget itself.
+ * \return 0 if all links were downloaded, -1 otherwise.
+ */
+int
+daemon_submit(const prgstx *stx)
+{
+	struct sockaddr_un addr;
+	char resultdir[PATH_MAX];
+	char *line = NULL, *fields[4];
+	size_t linesize = 0;
+	ssize_t len;
+	FILE *sock;
+	int sockfd, lnkidx, num, pending = stx->numlinks, ret = 0;
+	long id;
+
+	if ((strlen(stx->submit) >= sizeof (addr.sun_path)) ||
+			(realpath(stx->resultdir, resultdir) == NULL)) {
+		log_error(NULL, 0, "result directory %s or socket %s "
+				"isn't valid", stx->resultdir, stx->submit);
+		return (-1);
+	}
+	memset(&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, stx->submit);
+
+	if (((sockfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) ||
+			(connect(sockfd, (struct sockaddr *) &addr,
+			sizeof (addr)) == -1)) {
+		log_error(NULL, errno, "Couldn't connect to daemon %s",
+				stx->submit);
+		return (-1);
+	}
+	sock = fdopen(sockfd, "r+");
+
+	for (lnkidx = 0; lnkidx != stx->numlinks; ++lnkidx)
+		fprintf(sock, "SUBMIT\t%d\t%d\t%s\t%s\n", stx->priority,
+				stx->chunks, resultdir, stx->links[lnkidx]);
+	fflush(sock);
+
+	printf("\nWait please for downloading all links...\n\n");
+
+	while ((pending > 0) && ((len = getline(&line, &linesize, sock)) > 0)) {
+		if (line[len - 1] == '\n')
+			line[len - 1] = '\0';
+		if ((num = split_fields(line, fields, 4)) < 2)
+			continue;
+		id = atol(fields[1]);
+
+		if (strcmp(fields[0], "QUEUED") == 0) {
+			printf("downloading link %s\n", fields[2]);
+		} else if (strcmp(fields[0], "DONE") == 0) {
+			printf("%s successfully downloaded! (job %ld)\n",
+					fields[2], id);
+			--pending;
+		} else if ((strcmp(fields[0], "FAILED") == 0) ||
+				(strcmp(fields[0], "CANCELLED") == 0)) {
+			log_error(NULL, 0, "%s %s (job %ld)", fields[0],
+					fields[2], id);
+			--pending;
+			ret = -1;
+		} else if (strcmp(fields[0], "ERROR") == 0) {
+			log_error(NULL, 0, "%s: %s", fields[1],
+					(num > 2) ? fields[2] : "");
+			--pending;
+			ret = -1;
+		}
+	}
+	if (pending > 0) {
+		log_error(NULL, 0, "daemon closed connection");
+		ret = -1;
+	}
+
+	free(line);
+	fclose(sock);
+
+	return (ret);
+}
@@ -0,0 +1,14 @@
+#ifndef DAEMON_H
+#define	DAEMON_H
+
+#include "defaults.h"
+
+#define	DAEMON_JOURNAL_SUFFIX ".journal"
+#define	DAEMON_MAX_CLIENTS 64
+#define	DAEMON_LINE_MAX 8192
+#define	DAEMON_SEND_TIMEOUT 1	// seconds a slow client may block status
+
+int daemon_run(const prgstx *stx);
+int daemon_submit(const prgstx *stx);
+
+#endif /* DAEMON_H */
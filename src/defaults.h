@@ -9,6 +9,7 @@
 #include <stddef.h>
 #include <stdio.h> // stdlog (errors for logging)
 #include <errno.h>
+#include <pthread.h>
 
 // BIG FILES SETTINGS
 // #define _LARGEFILE64_SOURCE
@@ -18,41 +19,224 @@
 #define	STRTOOFF_T strtol
 #endif
 
-// # define MAX_MAP_SIZE 0x7FFFFFFF;
-// long long int MAX_MAP_SIZE = 0x7FFFFFFF;
-
 #define	stdlog stderr
 #define	log_ERROR "ERROR:"
 
 typedef enum
 {
-	HTTP, FTP, UNKNOWN
+	HTTP, HTTPS, FTP, UNKNOWN
 } protocols;
 
-#define	D_CHUNKS 1
+/**
+ * When downloaded file is forced to disk (DUR_BATCH syncs files finished
+ * together by one sync of their filesystem).
+ */
+typedef enum
+{
+	DUR_NONE, DUR_END, DUR_BATCH
+} dur_policy;
+
+/**
+ * Progress display of rdwget (PROGRESS_AUTO = redrawn on terminal,
+ * periodic lines otherwise).
+ */
+typedef enum
+{
+	PROGRESS_AUTO, PROGRESS_LINE, PROGRESS_NONE
+} progress_mode;
+
+/**
+ * Decompression of .gz and .xz links while they are downloaded (UNPACK_BOTH
+ * keeps compressed file too).
+ */
+typedef enum
+{
+	UNPACK_OFF, UNPACK_ONLY, UNPACK_BOTH
+} unpack_mode;
+
+/**
+ * Order in which links of batch start (ORDER_SIZE = smallest first,
+ * ORDER_DEADLINE = earliest deadline first), explicit priorities of links
+ * go first in every order.
+ */
+typedef enum
+{
+	ORDER_GIVEN, ORDER_SIZE, ORDER_DEADLINE
+} order_policy;
+
+/**
+ * Lines log records are written as (LOG_JSON = one JSON object per line
+ * with all fields of record).
+ */
+typedef enum
+{
+	LOG_TEXT, LOG_JSON
+} log_format;
+
+#define	D_CHUNKS CHUNKS_AUTO
+#define	CHUNKS_AUTO 0	// chunks of link by profile of its server
 #define	D_RESULT_DIR "./"
 
 #define	D_NUMLINKS 0
 #define	D_LINKS NULL
 
+#define	D_TCP_FASTOPEN 0
+#define	D_RCVBUF 0
+#define	D_CONGESTION NULL
+#define	D_CONNECT_TIMEOUT 0
+#define	D_READ_TIMEOUT 0
+#define	D_HEDGE 0
+#define	D_RETRIES 0
+#define	D_RETRY_WAIT 1
+#define	D_TLS_VERIFY 1
+#define	D_CA_FILE NULL
+#define	D_HTTP2 0
+#define	D_WORKERS 4
+#define	D_PRIORITY 0
+#define	D_DURABILITY DUR_END
+#define	D_WRITEBACK (8 * 1024 * 1024)
+#define	D_PROGRESS PROGRESS_AUTO
+#define	D_RECURSIVE 0
+#define	D_DEPTH 5
+#define	D_INCLUDE NULL
+#define	D_HOST_LIMIT 2
+#define	D_MAX_REDIRECTS 10
+#define	D_MEM_BUDGET 0
+#define	D_DELTA NULL
+#define	D_MANIFEST NULL
+#define	D_METALINK NULL
+#define	D_UNPACK UNPACK_OFF
+#define	D_ORDER ORDER_GIVEN
+#define	D_SMALL (64 * 1024)
+#define	D_KEEPALIVE 4
+#define	D_PACK NULL
+#define	D_PROFILE NULL
+#define	D_COORDINATOR NULL
+#define	D_JOIN NULL
+#define	D_SEND_BACK 0
+#define	D_LOG NULL
+#define	D_LOG_FORMAT LOG_TEXT
+
+struct metalink;
+
+/**
+ * Socket profile applied to every connection of one program run.
+ * Zero (or NULL) values keep the kernel defaults.
+ */
 typedef struct
 {
-	int chunks;
+	int tfo;		// TCP Fast Open (data in SYN on repeat connects)
+	int rcvbuf;		// SO_RCVBUF size in bytes
+	const char *congestion;	// TCP_CONGESTION algorithm name (e.g. bbr)
+	int conntimeout;	// connect timeout in seconds
+	int readtimeout;	// read timeout in seconds
+	int keepalive;		// idle connections kept per server, 0 = off
+} sockprf;
+
+typedef struct
+{
+	int chunks;	// CHUNKS_AUTO = by profile of server
 	const char *resultdir;
 
 	int numlinks;
 	char **links;
 	int ipv6;
+	sockprf sprf;
+	int hedge;	// stall time (seconds) before hedging chunk, 0 = off
+	int retries;	// retries of every chunk
+	int retrywait;	// base backoff between chunk retries (seconds)
+	int tlsverify;	// verify certificates of https servers
+	const char *cafile;	// CA certificates (NULL = system store)
+	int http2;	// multiplex chunks as streams of http/2 session
+	const char *daemon;	// control socket of daemon mode (NULL = off)
+	const char *submit;	// socket of daemon to submit links to
+	const char *journal;	// journal of daemon jobs (NULL = socket.journal)
+	int priority;	// priority of submitted links
+	int workers;	// downloads running at once (daemon, mirror, batch)
+	dur_policy durability;	// syncing of downloaded files
+	long long int writeback;	// written bytes flushed at once, 0 = off
+	const char *output;	// file of all links, "-" = stream to stdout
+	const char *pack;	// tar archive of all links (NULL = file each)
+	const char *profile;	// store of server profiles (NULL = not kept)
+	const char *coordinator;	// address ranges of links are leased
+					// on to workers (NULL = off)
+	const char *join;	// coordinator this worker leases ranges from
+	int sendback;	// worker sends ranges to coordinator instead of
+			// writing them into shared result directory
+	const char *trace;	// chrome trace of connections and chunks
+	const char *log;	// file of errors and status (NULL = stdlog)
+	log_format logformat;
+	progress_mode progress;	// progress display of rdwget
+	int recursive;	// mirror links found in downloaded pages
+	int depth;	// links followed from seed links, 0 = unlimited
+	const char *include;	// prefix of mirrored links (NULL = directory
+				// of every seed link)
+	int hostlimit;	// links of one host downloaded at once (mirror)
+	int maxredirs;	// redirects followed by one link
+	long long int membudget;	// mapped and buffered data of process,
+					// 0 = unlimited
+	const char *delta;	// previous copy updated by delta (NULL = off)
+	const char *manifest;	// block checksums of link (NULL = link.zsync)
+	const struct metalink *metalink;	// mirrors and piece digests of
+						// link, or NULL
+	unpack_mode unpack;	// decompression of .gz and .xz links
+	order_policy order;	// order of links of batch
+	long long int small;	// files up to size skip header request and
+				// chunks, 0 = off
 } prgstx;
 
+/**
+ * Progress of link download (received bytes of total file size) and status
+ * map of its chunks, one character per chunk: CHUNKMAP_* or decile of range
+ * received by running chunk ('0' - '9').
+ */
+typedef void (*lnk_progress_cb)(void *data, long long int received,
+		long long int total, const char *chunkmap);
+
+/**
+ * Range start - end of file fd was downloaded (its chunk or hedge
+ * finished), called by chunk manager thread.
+ */
+typedef void (*lnk_verify_cb)(void *data, int fd, long long int start,
+		long long int end);
+
+#define	CHUNKMAP_IDLE '.'	// nothing received yet
+#define	CHUNKMAP_DONE '#'
+#define	CHUNKMAP_FAILED 'x'
+#define	CHUNKMAP_HEDGED 'h'	// hedged copy of the rest is running
+#define	CHUNKMAP_STALLED 's'
+
 typedef struct
 {
 	protocols prot;
 	char *hostname;
+	int port;
 	char *rquri;
 	char *filename;
-	int chunknum;
+	int chunknum;		// CHUNKS_AUTO = by profile of server
+	const sockprf *sprf;
+	int hedge;
+	int retries;
+	int retrywait;
+	int http2;
+	int maxredirs;	// redirects followed, link is pointed to the last one
+	int redirected;	// link points to location of redirect
+	dur_policy durability;
+	long long int writeback;
+	const char *delta;	// previous copy reused by delta update, or NULL
+	const char *manifest;	// block checksums of link, NULL = link.zsync
+	const struct metalink *metalink;	// mirrors and piece digests
+	unpack_mode unpack;	// link is decompressed as it arrives
+	long long int small;	// links up to size are fetched by one GET
 
+	const char *path;	// destination file, NULL = resultdir/host_uri
+	int destfd;		// file opened by caller, -1 = create path
+	int stream;		// destfd gets file in order (pipe, socket)
+	int cancel;		// set (atomically) to abort download
+	lnk_progress_cb progress;	// called every monitor period, or NULL
+	void *progressdata;
+	lnk_verify_cb verify;	// called for every finished range, or NULL
+	void *verifydata;
 } lnk;
 
 #define	CHUNK_NUM_DEF 1
@@ -64,22 +248,31 @@ typedef struct
 #endif
 
 #define	PROTOCOL_HTTP "http://"
+#define	PROTOCOL_HTTPS "https://"
 #define	PROTOCOL_FTP "ftp://"
 #define	HTTP_VERSION "HTTP/1.1"
 #define	HTTP_METHOD_GET "GET"
 #define	HTTP_METHOD_HEAD "HEAD"
 #define	HTTP_HEAD_CONTLEN "Content-Length:"
 #define	HTTP_HEAD_CONTTYPE "Content-Type:"
+#define	HTTP_HEAD_RETRYAFTER "Retry-After:"
+#define	HTTP_HEAD_LOCATION "Location:"
+#define	HTTP_HEAD_CONTRANGE "Content-Range:"
+#define	HTTP_HEAD_CONNECTION "Connection:"
 
 #define	HTTP_CONTTYPE_DEF "text/plain"
 
 #define	HTTP_STATUSCODE_OK 200
 #define	HTTP_STATUSCODE_PARTIAL 206
+#define	HTTP_STATUSCODE_TIMEOUT 408
 #define	HTTP_STATUSCODE_BAD_RANGE 416
+#define	HTTP_STATUSCODE_TOO_MANY 429
+#define	HTTP_STATUSCODE_UNAVAILABLE 503
 #define	HTTP_PORT 80
+#define	HTTPS_PORT 443
 #define	HTTP_RQ_HOST "Host:"
 #define	HTTP_RQ_RANGE_BYTES "Range: bytes="
-#define	RANGE_BYTES_MAX_LEN 12
+#define	RANGE_BYTES_MAX_LEN 21	// LLONG_MIN with its sign and NUL
 #define	CRLF "\r\n"
 #define	WS " "
 
@@ -93,6 +286,17 @@ typedef int statcode;
 typedef int http_sockfd;
 typedef int file_fd;
 
+struct ssl_st;
+
+/**
+ * Connection to http server, tls is NULL for plain http.
+ */
+typedef struct
+{
+	http_sockfd fd;
+	struct ssl_st *tls;
+} http_conn;
+
 // typedef struct
 // {
 //	char *memory;
@@ -110,19 +314,63 @@ typedef struct
 	off_t clen;
 	char *ctype;
 	http_statcode_grp statcodegrp;
+	int retryafter;	// Retry-After in seconds, -1 if not sent
+	char *location;	// Location of redirect, NULL if not sent
+	long long int total;	// file size of Content-Range, -1 if not sent
+	int keepalive;	// connection can carry the next request
 } lnk_http_header;
 
 // -----------------------------------------------------------------------------
 
+/**
+ * States of one download attempt of chunk range.
+ */
+typedef enum
+{
+	CH_RUNNING, CH_DONE, CH_FAILED, CH_CANCELLED
+} chunk_state;
+
+/**
+ * Shared control of all chunk attempts of one file.
+ * Guards state and sockfd of every attempt, cond is signalled whenever
+ * an attempt finishes.
+ */
 typedef struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int running;	// number of running attempts
+} chunk_ctl;
+
+typedef struct chunk_bounds
 {
 	long long int startpos, endpos;
 	size_t memlen;
 	lnk_http_header *lnk_header;
 	lnk *lnk;
 	file_fd fd;
-	int mpidx;
 	char *memory;
+
+	// attempt tracking (received is updated without lock)
+	long long int received;	// bytes of range received so far
+	chunk_state state;
+	http_sockfd sockfd;	// socket of running attempt, -1 if none
+	chunk_ctl *ctl;		// NULL if chunk is not tracked
+	struct chunk_bounds *twin; // hedged copy of range (or its original)
+	pthread_t thr;
+	int spawned;		// thr was created and has to be joined
+	statcode status;	// status code of last response, 0 if none
+	int retryafter;		// Retry-After of last response, -1 if none
+	int keepalive;		// connection of last response can be reused
+
+	// stall detection (touched by chunk manager only)
+	double started;
+	double lastchange;
+	long long int lastrecv;
+
+	// writeback (file positions, touched by chunk manager only)
+	long long int wbdone;	// written data before are synced and dropped
+	long long int wbpos;	// writeback of data before was started
 } chunk_bounds;
 
 typedef struct
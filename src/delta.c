@@ -0,0 +1,755 @@
+/*!
+ * \file
+ * \brief Delta update of previous copy of file by block checksum manifest.
+ *
+ *  Manifest (zsync 0.6 format, link + DELTA_MANIFEST_EXT by default) keeps
+ *  rolling checksum and MD4 of every block of file. Previous copy is
+ *  scanned for these blocks at every byte offset (rolling checksum, MD4
+ *  only on hit) by several threads, each one scanning its part of the
+ *  copy. Found blocks are copied from previous copy, only ranges of blocks
+ *  not found are downloaded by chunks, so update costs about the size of
+ *  the change. Result is checked by SHA-1 of manifest.
+ */
+
+#define	_GNU_SOURCE	// copy_file_range
+#define	OPENSSL_SUPPRESS_DEPRECATED	// MD4 of zsync is legacy digest
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <openssl/md4.h>
+#include <openssl/evp.h>
+
+#include "delta.h"
+#include "threadmanager.h"
+#include "linkparser.h"
+#include "membudget.h"
+#include "trace.h"
+#include "log.h"
+
+#define	DELTA_HASH_MUL 2654435761U	// multiplicative hash of checksums
+#define	DELTA_HASH_MUL2 2246822519U
+#define	DELTA_BITHASH_BITS 3	// filter bits per bucket of block index
+
+/**
+ * Index of blocks of manifest by rolling checksum, shared by scan threads.
+ * Bit filter rejects most positions of old copy without touching buckets.
+ */
+typedef struct
+{
+	const delta_manifest *mf;
+	uint32_t mask;		// bits of rolling checksum kept by manifest
+	int bits;		// log2 of number of buckets
+	unsigned char *bithash;
+	int *heads;		// first block of bucket, -1 if empty
+	int *next;		// next block of the same bucket
+	uint32_t *keys;		// rolling checksum of every block
+	long long int *source;	// block position in old copy, -1 = not found
+	file_fd fd;		// old copy
+	long long int size;
+} delta_index;
+
+/**
+ * Part of old copy scanned by one thread: blocks starting in it.
+ */
+typedef struct
+{
+	delta_index *idx;
+	long long int start, end;
+	pthread_t thr;
+} delta_part;
+
+/**
+ * Parses header line value of key (as "key: value") of manifest header.
+ * \return value, NULL if line is another key.
+ */
+static const char *
+delta_header_value(const char *line, const char *key)
+{
+	size_t len = strlen(key);
+
+	if ((strncmp(line, key, len) != 0) || (line[len] != ':'))
+		return (NULL);
+	line += len + 1;
+	while (*line == ' ')
+		++line;
+	return (line);
+}
+
+/**
+ * Parses manifest buf of len bytes (header lines, empty line and checksums
+ * of blocks).
+ * \return new manifest, NULL if it isn't valid.
+ */
+delta_manifest *
+delta_manifest_parse(const char *buf, size_t len)
+{
+	delta_manifest *mf = calloc(1, sizeof (delta_manifest));
+	const char *end = buf + len, *eol, *value;
+	char line[256];
+	long long int per;
+	size_t linelen;
+	int version = 0, idx;
+	unsigned int byte;
+
+	mf->length = -1;
+	for (;;) {
+		if ((eol = memchr(buf, '\n', end - buf)) == NULL)
+			goto fail;
+		linelen = eol - buf;
+		if (linelen >= sizeof (line))
+			linelen = sizeof (line) - 1;
+		memcpy(line, buf, linelen);
+		line[linelen] = '\0';
+		buf = eol + 1;
+		if (linelen == 0)
+			break;
+
+		if (delta_header_value(line, "zsync") != NULL) {
+			version = 1;
+		} else if ((value = delta_header_value(line, "Blocksize")) !=
+				NULL) {
+			mf->blocksize = atoi(value);
+		} else if ((value = delta_header_value(line, "Length")) !=
+				NULL) {
+			mf->length = strtoll(value, NULL, 10);
+		} else if ((value = delta_header_value(line,
+				"Hash-Lengths")) != NULL) {
+			if (sscanf(value, "%d,%d,%d", &mf->seqmatches,
+					&mf->rsumbytes,
+					&mf->checksumbytes) != 3)
+				goto fail;
+		} else if ((value = delta_header_value(line, "SHA-1")) !=
+				NULL) {
+			if (strlen(value) < 40)
+				goto fail;
+			for (idx = 0; idx != 20; ++idx) {
+				if (sscanf(value + 2 * idx, "%2x", &byte) != 1)
+					goto fail;
+				mf->sha1[idx] = (unsigned char) byte;
+			}
+			mf->hassha1 = 1;
+		}
+	}
+
+	if ((!version) || (mf->length < 0) || (mf->blocksize < 1) ||
+			(mf->blocksize > DELTA_BLOCK_MAX) ||
+			((mf->blocksize & (mf->blocksize - 1)) != 0) ||
+			(mf->seqmatches < 1) || (mf->seqmatches > 2) ||
+			(mf->rsumbytes < 1) || (mf->rsumbytes > 4) ||
+			(mf->checksumbytes < 3) ||
+			(mf->checksumbytes > DELTA_CHECKSUM_MAX))
+		goto fail;
+	while ((1 << mf->blockshift) != mf->blocksize)
+		++mf->blockshift;
+	mf->blocks = mf->length / mf->blocksize +
+			((mf->length % mf->blocksize != 0) ? 1 : 0);
+
+	// checksums of all blocks have to be there
+	per = mf->rsumbytes + mf->checksumbytes;
+	if ((mf->blocks > INT32_MAX) || ((end - buf) / per < mf->blocks))
+		goto fail;
+	mf->sums = malloc(mf->blocks * per + 1);
+	memcpy(mf->sums, buf, mf->blocks * per);
+
+	return (mf);
+fail:
+	free(mf);
+	return (NULL);
+}
+
+void
+delta_manifest_free(delta_manifest *mf)
+{
+	free(mf->sums);
+	free(mf);
+}
+
+/**
+ * Computes rolling checksum a, b of len bytes of data.
+ */
+static void
+delta_rsum(const unsigned char *data, size_t len, uint16_t *a, uint16_t *b)
+{
+	uint16_t sa = 0, sb = 0;
+
+	for (; len > 0; --len) {
+		sa += *data;
+		sb += len * *(data++);
+	}
+	*a = sa;
+	*b = sb;
+}
+
+/**
+ * \return position of hash of rolling checksums of block and of the next
+ * one (0 if manifest matches single blocks) in bit filter, bucket is
+ * position >> DELTA_BITHASH_BITS.
+ */
+static uint32_t
+delta_hash(const delta_index *idx, uint32_t key, uint32_t next)
+{
+	return (((key * DELTA_HASH_MUL) ^ (next * DELTA_HASH_MUL2)) >>
+			(32 - idx->bits - DELTA_BITHASH_BITS));
+}
+
+/**
+ * Indexes blocks of manifest by their rolling checksum (and by checksum of
+ * the next block if two blocks have to match in a row, the last block is
+ * then checked at every position).
+ */
+static void
+delta_index_init(delta_index *idx, const delta_manifest *mf)
+{
+	const unsigned char *sum = mf->sums;
+	unsigned char rsum[4];
+	uint32_t hash;
+	int blk;
+
+	idx->mf = mf;
+	idx->mask = 0xFFFFFFFFU >> (8 * (4 - mf->rsumbytes));
+	for (idx->bits = 4; (idx->bits < 29) &&
+			((1LL << idx->bits) < mf->blocks); ++idx->bits)
+		;
+	idx->bithash = calloc(1, (1 << idx->bits));
+	idx->heads = malloc(sizeof (int) << idx->bits);
+	memset(idx->heads, 0xFF, sizeof (int) << idx->bits);
+	idx->next = malloc(sizeof (int) * (mf->blocks + 1));
+	idx->keys = malloc(sizeof (uint32_t) * (mf->blocks + 1));
+	idx->source = malloc(sizeof (long long int) * (mf->blocks + 1));
+
+	// rsum is kept as the last bytes of big endian a, b
+	for (blk = 0; blk < mf->blocks; ++blk) {
+		sum = mf->sums + (long long int) blk * (mf->rsumbytes +
+				mf->checksumbytes);
+		memset(rsum, 0, sizeof (rsum));
+		memcpy(rsum + 4 - mf->rsumbytes, sum, mf->rsumbytes);
+		idx->keys[blk] = ((uint32_t) rsum[0] << 24) |
+				((uint32_t) rsum[1] << 16) |
+				((uint32_t) rsum[2] << 8) | rsum[3];
+		idx->source[blk] = -1;
+	}
+	for (blk = mf->blocks - 1; blk >= 0; --blk) {
+		if (mf->seqmatches == 1)
+			hash = delta_hash(idx, idx->keys[blk], 0);
+		else if (blk + 1 < mf->blocks)
+			hash = delta_hash(idx, idx->keys[blk],
+					idx->keys[blk + 1]);
+		else
+			continue;
+		idx->bithash[hash >> 3] |= 1 << (hash & 7);
+		idx->next[blk] = idx->heads[hash >> DELTA_BITHASH_BITS];
+		idx->heads[hash >> DELTA_BITHASH_BITS] = blk;
+	}
+}
+
+static void
+delta_index_free(delta_index *idx)
+{
+	free(idx->bithash);
+	free(idx->heads);
+	free(idx->next);
+	free(idx->keys);
+}
+
+/**
+ * \return 1 if MD4 of block at data matches checksum of block blk.
+ */
+static int
+delta_checksum_ok(const delta_manifest *mf, long long int blk,
+		const unsigned char *data)
+{
+	unsigned char md[MD4_DIGEST_LENGTH];
+
+	MD4(data, mf->blocksize, md);
+	return (memcmp(md, mf->sums + blk * (mf->rsumbytes +
+			mf->checksumbytes) + mf->rsumbytes,
+			mf->checksumbytes) == 0);
+}
+
+/**
+ * Records position pos of block blk in old copy unless it was found before.
+ */
+static void
+delta_found(delta_index *idx, int blk, long long int pos)
+{
+	long long int unknown = -1;
+
+	__atomic_compare_exchange_n(&idx->source[blk], &unknown, pos, 0,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+/**
+ * Reads len bytes of old copy at pos, copy is followed by blocks of zeros
+ * (as the last block of manifest is padded).
+ * \return bytes read, less than len at end.
+ */
+static size_t
+delta_fill(const delta_index *idx, unsigned char *buf, long long int pos,
+		size_t len)
+{
+	long long int vsize = idx->size + (long long int)
+			idx->mf->blocksize * idx->mf->seqmatches;
+	size_t got = 0;
+	ssize_t rd;
+
+	while ((got < len) && (pos + (long long int) got < idx->size)) {
+		rd = pread(idx->fd, buf + got, (idx->size - pos - got <
+				(long long int) (len - got)) ? (size_t)
+				(idx->size - pos - got) : len - got, pos + got);
+		if (rd <= 0)
+			return (got);
+		got += rd;
+	}
+	if ((got < len) && (pos + (long long int) got < vsize)) {
+		rd = (vsize - pos - got < (long long int) (len - got)) ?
+				(ssize_t) (vsize - pos - got) :
+				(ssize_t) (len - got);
+		memset(buf + got, 0, rd);
+		got += rd;
+	}
+	return (got);
+}
+
+/**
+ * Checks whether window at data (at position pos of old copy) is block of
+ * manifest: its rolling checksum is key and key2 is rolling checksum of the
+ * next window (used if manifest wants two blocks in a row).
+ * \return 1 if some block was found, 0 otherwise.
+ */
+static int
+delta_check(delta_index *idx, uint32_t key, uint32_t key2,
+		const unsigned char *data, long long int pos)
+{
+	const delta_manifest *mf = idx->mf;
+	int seq = (mf->seqmatches > 1);
+	uint32_t hash = delta_hash(idx, key, (seq) ? key2 : 0);
+	int blk, last = mf->blocks - 1, found = 0;
+
+	// the last block has no next one
+	if ((seq) && (key == idx->keys[last]) && (__atomic_load_n(
+			&idx->source[last], __ATOMIC_RELAXED) == -1) &&
+			(delta_checksum_ok(mf, last, data))) {
+		delta_found(idx, last, pos);
+		found = 1;
+	}
+
+	if ((idx->bithash[hash >> 3] & (1 << (hash & 7))) == 0)
+		return (found);
+	for (blk = idx->heads[hash >> DELTA_BITHASH_BITS]; blk != -1;
+			blk = idx->next[blk]) {
+		if ((idx->keys[blk] != key) || ((seq) &&
+				(idx->keys[blk + 1] != key2)) ||
+				(__atomic_load_n(&idx->source[blk],
+				__ATOMIC_RELAXED) != -1))
+			continue;
+		if ((!delta_checksum_ok(mf, blk, data)) || ((seq) &&
+				(!delta_checksum_ok(mf, blk + 1,
+				data + mf->blocksize))))
+			continue;
+		delta_found(idx, blk, pos);
+		if (seq)
+			delta_found(idx, blk + 1, pos + mf->blocksize);
+		found = 1;
+	}
+
+	return (found);
+}
+
+/**
+ * Scans part of old copy for blocks of manifest (function for one thread).
+ * Window (two windows if manifest wants two blocks in a row) rolls byte by
+ * byte, after found block it moves behind the block.
+ * param data of type (delta_part *).
+ */
+static void *
+delta_scan(void *data)
+{
+	delta_part *part = (delta_part *) data;
+	delta_index *idx = part->idx;
+	const delta_manifest *mf = idx->mf;
+	size_t bs = mf->blocksize;
+	size_t span = bs * mf->seqmatches;
+	size_t bufsize = DELTA_READ_SIZE + span + 1;
+	unsigned char *buf = malloc(bufsize);
+	long long int bufpos = part->start;	// position of buf in old copy
+	size_t len, off = 0, got;
+	int eof, rolling = 0;
+	uint16_t a = 0, b = 0, a2 = 0, b2 = 0;
+	unsigned char out, mid;
+
+	membudget_charge(bufsize);
+	len = delta_fill(idx, buf, bufpos, bufsize);
+	eof = (len < bufsize);
+	while (bufpos + (long long int) off < part->end) {
+		if ((off + span + 1 > len) && (!eof)) {
+			memmove(buf, buf + off, len - off);
+			bufpos += off;
+			len -= off;
+			off = 0;
+			got = delta_fill(idx, buf + len, bufpos + len,
+					bufsize - len);
+			eof = (got < bufsize - len);
+			len += got;
+			continue;
+		}
+		if (off + span > len)
+			break;
+
+		if (!rolling) {
+			delta_rsum(buf + off, bs, &a, &b);
+			if (span > bs)
+				delta_rsum(buf + off + bs, bs, &a2, &b2);
+			rolling = 1;
+		}
+		if (delta_check(idx, (((uint32_t) a << 16) | b) & idx->mask,
+				(((uint32_t) a2 << 16) | b2) & idx->mask,
+				buf + off, bufpos + off)) {
+			off += bs;
+			rolling = 0;
+			continue;
+		}
+
+		if (off + span == len)
+			break;
+		out = buf[off];
+		mid = buf[off + bs];
+		a += mid - out;
+		b += a - ((uint16_t) out << mf->blockshift);
+		if (span > bs) {
+			a2 += buf[off + span] - mid;
+			b2 += a2 - ((uint16_t) mid << mf->blockshift);
+		}
+		++off;
+	}
+
+	free(buf);
+	membudget_release(bufsize);
+	return (NULL);
+}
+
+/**
+ * Finds blocks of manifest in old copy fd of size bytes by threads scanning
+ * its parts in parallel.
+ * \return position of every block in old copy (-1 if it wasn't found).
+ */
+long long int *
+delta_match(const delta_manifest *mf, file_fd fd, long long int size,
+		int threads)
+{
+	delta_index idx;
+	delta_part *parts;
+	long long int partlen;
+	int partnum, pidx;
+
+	delta_index_init(&idx, mf);
+	idx.fd = fd;
+	idx.size = size;
+
+	if ((long long int) threads > size / DELTA_PART_MIN)
+		threads = (int) (size / DELTA_PART_MIN);
+	partnum = (threads < 1) ? 1 : threads;
+	partlen = (size + partnum - 1) / partnum;
+	parts = calloc(partnum, sizeof (delta_part));
+	for (pidx = 0; pidx != partnum; ++pidx) {
+		parts[pidx].idx = &idx;
+		parts[pidx].start = pidx * partlen;
+		parts[pidx].end = (pidx + 1 == partnum) ? size :
+				(pidx + 1) * partlen;
+		if ((pidx > 0) && (pthread_create(&parts[pidx].thr, NULL,
+				delta_scan, &parts[pidx]) != 0))
+			delta_scan(&parts[pidx]);
+	}
+	delta_scan(&parts[0]);
+	for (pidx = 1; pidx != partnum; ++pidx)
+		pthread_join(parts[pidx].thr, NULL);
+	free(parts);
+
+	delta_index_free(&idx);
+	return (idx.source);
+}
+
+/**
+ * Downloads manifest of link into memory.
+ * \return manifest, NULL if it can't be downloaded or isn't valid.
+ */
+static delta_manifest *
+delta_manifest_fetch(const lnk *link)
+{
+	delta_manifest *mf = NULL;
+	char *url, *base, *buf;
+	FILE *tmp;
+	lnk mlink;
+	struct stat st;
+
+	if (link->manifest != NULL) {
+		url = strdup(link->manifest);
+	} else {
+		base = link_url(link);
+		url = _strcat(base, DELTA_MANIFEST_EXT);
+		free(base);
+	}
+	memset(&mlink, 0, sizeof (lnk));
+	if ((tmp = tmpfile()) == NULL) {
+		log_error(link, errno, "tmpfile");
+		free(url);
+		return (NULL);
+	}
+	if (link_parse(url, &mlink) == -1) {
+		log_error(link, 0, "manifest link %s isn't valid", url);
+		fclose(tmp);
+		free(url);
+		return (NULL);
+	}
+	mlink.chunknum = 1;
+	mlink.sprf = link->sprf;
+	mlink.retries = link->retries;
+	mlink.retrywait = link->retrywait;
+	mlink.http2 = link->http2;
+	mlink.maxredirs = link->maxredirs;
+	mlink.durability = DUR_NONE;
+	mlink.destfd = fileno(tmp);
+
+	if ((thr_mgr_downloadfile(NULL, &mlink) == 0) &&
+			(fstat(fileno(tmp), &st) == 0) &&
+			(st.st_size <= DELTA_MANIFEST_MAX)) {
+		buf = malloc(st.st_size + 1);
+		if (pread(fileno(tmp), buf, st.st_size, 0) == st.st_size)
+			mf = delta_manifest_parse(buf, st.st_size);
+		free(buf);
+		if (mf == NULL)
+			log_error(link, 0, "manifest %s isn't valid", url);
+	}
+
+	link_free(&mlink);
+	fclose(tmp);
+	free(url);
+	return (mf);
+}
+
+/**
+ * Copies len bytes at from of old copy into file fd at to.
+ * \return 0 on success, -1 on fail.
+ */
+static int
+delta_copy_range(file_fd oldfd, long long int from, file_fd fd,
+		long long int to, long long int len)
+{
+	loff_t inpos = from, outpos = to;
+	char *buf;
+	ssize_t rd = 0;
+
+	// kernel copies (or shares extents) if it can
+	while ((len > 0) && ((rd = copy_file_range(oldfd, &inpos, fd,
+			&outpos, len, 0)) > 0))
+		len -= rd;
+	if (len == 0)
+		return (0);
+	if (rd == 0)
+		return (-1);
+
+	buf = malloc(DELTA_READ_SIZE);
+	while ((len > 0) && ((rd = pread(oldfd, buf,
+			(len < DELTA_READ_SIZE) ? len : DELTA_READ_SIZE,
+			inpos)) > 0) &&
+			(pwrite(fd, buf, rd, outpos) == rd)) {
+		inpos += rd;
+		outpos += rd;
+		len -= rd;
+	}
+	free(buf);
+	return ((len == 0) ? 0 : -1);
+}
+
+/**
+ * Copies blocks found in old copy (of size bytes) into file fd, blocks
+ * following each other in both files are copied at once.
+ * \return copied bytes, -1 on fail.
+ */
+static long long int
+delta_copy(const delta_manifest *mf, const long long int *source,
+		file_fd oldfd, long long int size, file_fd fd)
+{
+	long long int blk, last, from, len, copied = 0;
+
+	for (blk = 0; blk < mf->blocks; blk = last) {
+		if (source[blk] == -1) {
+			last = blk + 1;
+			continue;
+		}
+		for (last = blk + 1; (last < mf->blocks) && (source[last] ==
+				source[blk] + ((last - blk) << mf->blockshift));
+				++last)
+			;
+		from = source[blk];
+		len = ((last < mf->blocks) ? last << mf->blockshift :
+				mf->length) - (blk << mf->blockshift);
+		copied += len;
+		// zeros behind end of old copy are in allocated file already
+		if (from + len > size)
+			len = size - from;
+		if ((len > 0) && (delta_copy_range(oldfd, from, fd,
+				blk << mf->blockshift, len) == -1))
+			return (-1);
+	}
+
+	return (copied);
+}
+
+/**
+ * Plans ranges of blocks not found in old copy. Ranges closer than
+ * DELTA_GAP_MAX are joined and ranges longer than missing bytes per chunk
+ * are split, so that chunks get similar parts.
+ * \return new plan.
+ */
+static chunk_plan *
+delta_plan(const delta_manifest *mf, const long long int *source, int chunks)
+{
+	chunk_plan *plan = chunkplan_empty(mf->length, mf->blocksize);
+	long long int blk, start, end, missing = 0, piece;
+	int ridx;
+
+	for (blk = 0; blk < mf->blocks; ++blk) {
+		if (source[blk] != -1)
+			continue;
+		start = blk << mf->blockshift;
+		end = ((blk + 1 < mf->blocks) ? (blk + 1) << mf->blockshift :
+				mf->length) - 1;
+		missing += end + 1 - start;
+		if ((plan->num > 0) && (start - plan->ranges[plan->num -
+				1].end - 1 <= DELTA_GAP_MAX))
+			plan->ranges[plan->num - 1].end = end;
+		else
+			chunkplan_add(plan, start, end);
+	}
+
+	piece = missing / ((chunks < 1) ? 1 : chunks);
+	if (piece < CHUNKPLAN_MIN_SIZE)
+		piece = CHUNKPLAN_MIN_SIZE;
+	piece = (piece + mf->blocksize - 1) & ~((long long int)
+			mf->blocksize - 1);
+	for (ridx = 0; ridx < plan->num; ++ridx)
+		if (plan->ranges[ridx].end - plan->ranges[ridx].start >= piece)
+			chunkplan_split(plan, ridx, plan->ranges[ridx].start +
+					piece);
+
+	return (plan);
+}
+
+/**
+ * Checks SHA-1 of file fd against manifest.
+ * \return 0 if it matches, -1 otherwise.
+ */
+static int
+delta_verify(const delta_manifest *mf, file_fd fd)
+{
+	EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+	unsigned char md[EVP_MAX_MD_SIZE];
+	char *buf = malloc(DELTA_READ_SIZE);
+	long long int pos = 0;
+	ssize_t rd = 0;
+	unsigned int mdlen;
+
+	EVP_DigestInit_ex(ctx, EVP_sha1(), NULL);
+	while ((pos < mf->length) && ((rd = pread(fd, buf, DELTA_READ_SIZE,
+			pos)) > 0)) {
+		EVP_DigestUpdate(ctx, buf, rd);
+		pos += rd;
+	}
+	EVP_DigestFinal_ex(ctx, md, &mdlen);
+	EVP_MD_CTX_free(ctx);
+	free(buf);
+
+	return (((pos == mf->length) && (memcmp(md, mf->sha1, 20) == 0)) ?
+			0 : -1);
+}
+
+/**
+ * Downloads link as update of its previous copy link->delta: blocks found
+ * in the copy are copied, the rest is downloaded. Link is downloaded whole
+ * if the copy or manifest can't be used.
+ * \return 0 on success, -1 on fail.
+ */
+int
+delta_download(const char *resultdir, lnk *link, lnk_http_header *linkh)
+{
+	delta_manifest *mf;
+	long long int *source;
+	long long int reused, missing = 0;
+	chunk_plan *plan;
+	file_fd oldfd, fd;
+	struct stat st;
+	double start;
+	int ret, ridx;
+
+	if (((oldfd = open(link->delta, O_RDONLY)) == -1) ||
+			(fstat(oldfd, &st) == -1)) {
+		log_error(link, errno, "previous copy %s can't be read, "
+				"downloading whole %s", link->delta,
+				link->rquri);
+		if (oldfd != -1)
+			close(oldfd);
+		return (thr_mgr_downloadallchunks(resultdir, link, linkh));
+	}
+	start = trace_begin();
+	if (((mf = delta_manifest_fetch(link)) == NULL) ||
+			(mf->length != linkh->clen)) {
+		log_error(link, 0, "no manifest of %s matches it, "
+				"downloading whole file", link->rquri);
+		if (mf != NULL)
+			delta_manifest_free(mf);
+		close(oldfd);
+		return (thr_mgr_downloadallchunks(resultdir, link, linkh));
+	}
+	trace_end("delta_manifest", start, link, -1, 0);
+
+	start = trace_begin();
+	source = delta_match(mf, oldfd, st.st_size,
+			(int) sysconf(_SC_NPROCESSORS_ONLN));
+	trace_end("delta_match", start, link, 0, st.st_size - 1);
+
+	if ((fd = thr_mgr_createfile(resultdir, link, mf->length)) == -1) {
+		free(source);
+		delta_manifest_free(mf);
+		close(oldfd);
+		return (-1);
+	}
+
+	start = trace_begin();
+	reused = delta_copy(mf, source, oldfd, st.st_size, fd);
+	trace_end("delta_copy", start, link, -1, 0);
+	plan = delta_plan(mf, source, link->chunknum);
+	free(source);
+	close(oldfd);
+
+	if (reused == -1) {
+		log_error(link, 0, "blocks of %s couldn't be copied "
+				"into %s", link->delta, link->filename);
+		ret = -1;
+	} else {
+		for (ridx = 0; ridx != plan->num; ++ridx)
+			missing += plan->ranges[ridx].end + 1 -
+					plan->ranges[ridx].start;
+		log_info(link, "%s: %lld of %lld bytes reused from %s, "
+				"downloading %lld bytes in %d ranges",
+				link->filename, reused, mf->length, link->delta,
+				missing, plan->num);
+		ret = thr_mgr_downloadplan(link, linkh, fd, plan);
+	}
+	chunkplan_free(plan);
+
+	start = trace_begin();
+	if ((ret == 0) && (mf->hassha1) && (delta_verify(mf, fd) == -1)) {
+		log_error(link, 0, "%s doesn't match SHA-1 of "
+				"manifest", link->filename);
+		ret = -1;
+	}
+	trace_end("delta_verify", start, link, -1, 0);
+	delta_manifest_free(mf);
+
+	return (thr_mgr_closefile(link, fd, ret));
+}
@@ -0,0 +1,39 @@
+#ifndef DELTA_H
+#define	DELTA_H
+
+#include "defaults.h"
+
+#define	DELTA_MANIFEST_EXT ".zsync"	// default manifest is link + extension
+#define	DELTA_MANIFEST_MAX (512 * 1024 * 1024)	// larger ones are refused
+#define	DELTA_READ_SIZE (4 * 1024 * 1024)	// old copy is read by pieces of
+#define	DELTA_PART_MIN (16 * 1024 * 1024)	// least part scanned by thread
+#define	DELTA_GAP_MAX (16 * 1024)	// matched gaps downloaded with ranges
+#define	DELTA_BLOCK_MAX (16 * 1024 * 1024)
+#define	DELTA_CHECKSUM_MAX 16	// MD4
+
+/**
+ * Block checksums of file (zsync manifest). Every block (the last one padded
+ * by zeros) has rsumbytes of rolling checksum and checksumbytes of MD4.
+ */
+typedef struct
+{
+	long long int length;	// size of file
+	int blocksize;		// power of 2
+	int blockshift;
+	long long int blocks;
+	int seqmatches;		// blocks which have to match in a row (1 or 2)
+	int rsumbytes;
+	int checksumbytes;
+	int hassha1;
+	unsigned char sha1[20];	// of whole file
+	unsigned char *sums;	// checksums of blocks in order
+} delta_manifest;
+
+delta_manifest *delta_manifest_parse(const char *buf, size_t len);
+void delta_manifest_free(delta_manifest *mf);
+long long int *delta_match(const delta_manifest *mf, file_fd fd,
+		long long int size, int threads);
+int delta_download(const char *resultdir, lnk *link,
+		lnk_http_header *linkh);
+
+#endif /* DELTA_H */
@@ -0,0 +1,358 @@
+/*!
+ * \file
+ * \brief Performance profiles of servers kept across runs.
+ *
+ *  Profile of server (protocol://host:port) holds its range support,
+ *  keep-alive behaviour and http/2 support as they were last seen, the best
+ *  number of connections for one file, smoothed round trip time and
+ *  throughput (weighted averages, HOSTPROF_DECAY per sample). Links without
+ *  explicit number of chunks start with the best count at once; every
+ *  HOSTPROF_TRIAL_EVERY-th file of the server tries twice (or half) the count
+ *  and the better one is kept, 429 and 503 responses bound the count. Store
+ *  is a text file with line of tab separated fields per server, profiles of
+ *  other runs written meanwhile are merged when it is saved.
+ */
+
+#define	_GNU_SOURCE	// getline
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "hostprof.h"
+#include "linkparser.h"
+#include "log.h"
+
+typedef struct hostprof
+{
+	char *key;		// protocol://host:port
+	int traits[3];		// hostprof_trait values, -1 = unknown
+	int conns;		// best connections per file, 0 = unknown
+	int limit;		// server throttled more connections, 0 = none
+	double rtt;		// seconds, 0 = unknown
+	double rate;		// bytes per second with conns, 0 = unknown
+	int trials;		// downloads of HOSTPROF_MIN_SAMPLE and more
+	time_t updated;
+	struct hostprof *next;
+} hostprof;
+
+static hostprof *profiles = NULL;
+static pthread_mutex_t profiles_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * \return key of server of link (caller frees it).
+ */
+static char *
+hostprof_key(const lnk *link)
+{
+	size_t len = strlen(link->hostname) + 32;
+	char *key = malloc(len);
+
+	snprintf(key, len, "%s%s:%d", (link->prot == HTTPS) ? PROTOCOL_HTTPS :
+			PROTOCOL_HTTP, link->hostname, link->port);
+	return (key);
+}
+
+/**
+ * Finds profile of key, creates an unknown one if create is set.
+ * Has to be called with profiles_lock held.
+ * \return profile, NULL if there is none.
+ */
+static hostprof *
+hostprof_find(const char *key, int create)
+{
+	hostprof *prof;
+
+	for (prof = profiles; prof != NULL; prof = prof->next) {
+		if (strcmp(prof->key, key) == 0)
+			return (prof);
+	}
+	if (!create)
+		return (NULL);
+
+	prof = calloc(1, sizeof (hostprof));
+	prof->key = strdup(key);
+	prof->traits[HOSTPROF_RANGES] = -1;
+	prof->traits[HOSTPROF_KEEPALIVE] = -1;
+	prof->traits[HOSTPROF_HTTP2] = -1;
+	prof->updated = time(NULL);
+	prof->next = profiles;
+	profiles = prof;
+
+	return (prof);
+}
+
+/**
+ * \return profile of server of link (created if create is set), NULL if
+ * there is none. Has to be called with profiles_lock held.
+ */
+static hostprof *
+hostprof_of(const lnk *link, int create)
+{
+	char *key = hostprof_key(link);
+	hostprof *prof = hostprof_find(key, create);
+
+	free(key);
+	return (prof);
+}
+
+/**
+ * Adds profiles of store path which aren't known yet (missing store is
+ * empty), profiles unused for HOSTPROF_TTL are left out.
+ * \return 0 on success, -1 if store can't be read.
+ */
+int
+hostprof_load(const char *path)
+{
+	char *line = NULL, key[1024];
+	size_t linesize = 0;
+	hostprof prof, *known;
+	long updated;
+	time_t now = time(NULL);
+	FILE *file;
+
+	if ((file = fopen(path, "r")) == NULL)
+		return (errno == ENOENT ? 0 : -1);
+
+	pthread_mutex_lock(&profiles_lock);
+	while (getline(&line, &linesize, file) > 0) {
+		if ((line[0] == '#') || (sscanf(line, "%1023s %d %d %d %d %d "
+				"%lf %lf %d %ld", key,
+				&prof.traits[HOSTPROF_RANGES],
+				&prof.traits[HOSTPROF_KEEPALIVE],
+				&prof.traits[HOSTPROF_HTTP2], &prof.conns,
+				&prof.limit, &prof.rtt, &prof.rate,
+				&prof.trials, &updated) != 10) ||
+				(updated + HOSTPROF_TTL < now) ||
+				(hostprof_find(key, 0) != NULL))
+			continue;
+		known = hostprof_find(key, 1);
+		memcpy(known->traits, prof.traits, sizeof (prof.traits));
+		known->conns = prof.conns;
+		known->limit = prof.limit;
+		known->rtt = prof.rtt;
+		known->rate = prof.rate;
+		known->trials = prof.trials;
+		known->updated = updated;
+	}
+	pthread_mutex_unlock(&profiles_lock);
+	free(line);
+	fclose(file);
+
+	return (0);
+}
+
+/**
+ * Writes all profiles into store path (merged with profiles saved there
+ * by other runs meanwhile), store is replaced at once.
+ * \return 0 on success, -1 on fail.
+ */
+int
+hostprof_save(const char *path)
+{
+	char *tmppath = _strcat(path, ".new");
+	hostprof *prof;
+	FILE *file;
+	int ret = 0;
+
+	hostprof_load(path);
+	if ((file = fopen(tmppath, "w")) == NULL) {
+		log_error(NULL, errno, "Couldn't create host profiles %s",
+				tmppath);
+		free(tmppath);
+		return (-1);
+	}
+
+	fprintf(file, "# server ranges keep-alive http2 connections limit "
+			"rtt rate files updated\n");
+	pthread_mutex_lock(&profiles_lock);
+	for (prof = profiles; prof != NULL; prof = prof->next)
+		fprintf(file, "%s\t%d\t%d\t%d\t%d\t%d\t%.6f\t%.0f\t%d\t"
+				"%ld\n", prof->key,
+				prof->traits[HOSTPROF_RANGES],
+				prof->traits[HOSTPROF_KEEPALIVE],
+				prof->traits[HOSTPROF_HTTP2], prof->conns,
+				prof->limit, prof->rtt, prof->rate,
+				prof->trials, (long) prof->updated);
+	pthread_mutex_unlock(&profiles_lock);
+
+	if ((fclose(file) == EOF) || (rename(tmppath, path) == -1)) {
+		log_error(NULL, errno, "Couldn't save host profiles %s",
+				path);
+		ret = -1;
+	}
+	free(tmppath);
+
+	return (ret);
+}
+
+/**
+ * \return trait of server of link (1 = yes, 0 = no), -1 if it is unknown.
+ */
+int
+hostprof_get(const lnk *link, hostprof_trait trait)
+{
+	hostprof *prof;
+	int value = -1;
+
+	pthread_mutex_lock(&profiles_lock);
+	if ((prof = hostprof_of(link, 0)) != NULL)
+		value = prof->traits[trait];
+	pthread_mutex_unlock(&profiles_lock);
+
+	return (value);
+}
+
+/**
+ * Records trait of server of link seen in its response.
+ */
+void
+hostprof_note(const lnk *link, hostprof_trait trait, int value)
+{
+	hostprof *prof;
+
+	pthread_mutex_lock(&profiles_lock);
+	prof = hostprof_of(link, 1);
+	prof->traits[trait] = (value != 0);
+	prof->updated = time(NULL);
+	pthread_mutex_unlock(&profiles_lock);
+}
+
+/**
+ * Records round trip time (seconds) measured on connection to server of
+ * link.
+ */
+void
+hostprof_rtt(const lnk *link, double rtt)
+{
+	hostprof *prof;
+
+	if (rtt <= 0)
+		return;
+	pthread_mutex_lock(&profiles_lock);
+	prof = hostprof_of(link, 1);
+	prof->rtt = (prof->rtt > 0) ? prof->rtt + HOSTPROF_DECAY *
+			(rtt - prof->rtt) : rtt;
+	pthread_mutex_unlock(&profiles_lock);
+}
+
+/**
+ * Chooses number of connections for file of size bytes of server of link:
+ * the best count known (one for unknown server or server without ranges),
+ * every HOSTPROF_TRIAL_EVERY-th file of size over HOSTPROF_MIN_SAMPLE tries
+ * twice or half of it. Chunk has to last HOSTPROF_RTT_CHUNK round trips at
+ * least with throughput of one connection.
+ * \return number of chunks, at least 1.
+ */
+int
+hostprof_chunks(const lnk *link, long long int size)
+{
+	hostprof *prof;
+	long long int minchunk;
+	int conns = 1, max = HOSTPROF_CONNS_MAX;
+
+	pthread_mutex_lock(&profiles_lock);
+	if (((prof = hostprof_of(link, 0)) == NULL) ||
+			(prof->traits[HOSTPROF_RANGES] == 0)) {
+		pthread_mutex_unlock(&profiles_lock);
+		return (1);
+	}
+	if (prof->conns > 0)
+		conns = prof->conns;
+	if ((prof->limit > 0) && (prof->limit < max))
+		max = prof->limit;
+
+	// trials alternate between more and fewer connections
+	if ((size >= HOSTPROF_MIN_SAMPLE) &&
+			(++prof->trials % HOSTPROF_TRIAL_EVERY == 0))
+		conns = (((prof->trials / HOSTPROF_TRIAL_EVERY) % 2) ||
+				(conns == 1)) ? conns * 2 : conns / 2;
+	if ((prof->rtt > 0) && (prof->rate > 0) && (prof->conns > 0)) {
+		minchunk = (long long int) (prof->rate / prof->conns *
+				prof->rtt * HOSTPROF_RTT_CHUNK);
+		if ((minchunk > 0) && (size / minchunk < conns))
+			conns = (int) (size / minchunk);
+	}
+	pthread_mutex_unlock(&profiles_lock);
+
+	if (conns > max)
+		conns = max;
+	return ((conns < 1) ? 1 : conns);
+}
+
+/**
+ * Records download of bytes of server of link by conns connections which
+ * took secs seconds. Count of trial replaces the best one if it was
+ * HOSTPROF_GAIN faster (or isn't slower with fewer connections), throttled
+ * download (429 or 503) lowers the limit below conns.
+ */
+void
+hostprof_sample(const lnk *link, int conns, long long int bytes, double secs,
+		int throttled)
+{
+	hostprof *prof;
+	double rate;
+
+	if ((conns < 1) || (secs <= 0) || ((bytes < HOSTPROF_MIN_SAMPLE) &&
+			(!throttled)))
+		return;
+	rate = bytes / secs;
+
+	pthread_mutex_lock(&profiles_lock);
+	prof = hostprof_of(link, 1);
+	prof->updated = time(NULL);
+	if (throttled) {
+		prof->limit = (conns > 1) ? conns - 1 : 1;
+		if ((prof->conns == 0) || (prof->conns > prof->limit))
+			prof->conns = prof->limit;
+	} else if ((prof->conns == 0) || (prof->rate <= 0)) {
+		prof->conns = conns;
+		prof->rate = rate;
+	} else if (conns == prof->conns) {
+		prof->rate += HOSTPROF_DECAY * (rate - prof->rate);
+	} else if (((conns > prof->conns) &&
+			(rate > prof->rate * (1 + HOSTPROF_GAIN))) ||
+			((conns < prof->conns) &&
+			(rate >= prof->rate * (1 - HOSTPROF_GAIN)))) {
+		prof->conns = conns;
+		prof->rate = rate;
+	}
+	pthread_mutex_unlock(&profiles_lock);
+}
+
+/**
+ * Estimates download time of size bytes of server of link from its round
+ * trip time and throughput (mean of all known servers for unknown one).
+ * \return seconds, -1 if no throughput is known.
+ */
+double
+hostprof_estimate(const lnk *link, long long int size)
+{
+	hostprof *prof, *own;
+	double rtt = 0, rate = 0, est = -1;
+	int num = 0;
+
+	pthread_mutex_lock(&profiles_lock);
+	if (((own = hostprof_of(link, 0)) != NULL) && (own->rate > 0)) {
+		rtt = own->rtt;
+		rate = own->rate;
+	} else {
+		for (prof = profiles; prof != NULL; prof = prof->next) {
+			if (prof->rate <= 0)
+				continue;
+			rtt += prof->rtt;
+			rate += prof->rate;
+			++num;
+		}
+		rtt = (num > 0) ? rtt / num : 0;
+		rate = (num > 0) ? rate / num : 0;
+	}
+	pthread_mutex_unlock(&profiles_lock);
+
+	// header request and the first response take a round trip each
+	if (rate > 0)
+		est = 2 * rtt + size / rate;
+	return (est);
+}
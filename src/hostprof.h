@@ -0,0 +1,36 @@
+#ifndef HOSTPROF_H
+#define	HOSTPROF_H
+
+#include "defaults.h"
+
+#define	HOSTPROF_DECAY 0.25	// weight of new sample of rate and rtt
+#define	HOSTPROF_GAIN 0.1	// trial count is taken if it is 10 % better
+#define	HOSTPROF_TRIAL_EVERY 4	// every 4th sized download tries a count
+#define	HOSTPROF_CONNS_MAX 32
+#define	HOSTPROF_MIN_SAMPLE (1024 * 1024)	// smaller downloads don't
+						// measure throughput
+#define	HOSTPROF_RTT_CHUNK 8	// chunk lasts at least 8 round trips
+#define	HOSTPROF_TTL (30 * 24 * 3600)	// profile unused for 30 days is
+					// dropped
+#define	HOSTPROF_FILE ".rdwget-hosts"	// store of rdwget in home directory
+
+/**
+ * Learned behaviour of server (1 = yes, 0 = no, -1 = unknown).
+ */
+typedef enum
+{
+	HOSTPROF_RANGES, HOSTPROF_KEEPALIVE, HOSTPROF_HTTP2
+} hostprof_trait;
+
+int hostprof_load(const char *path);
+int hostprof_save(const char *path);
+
+int hostprof_get(const lnk *link, hostprof_trait trait);
+void hostprof_note(const lnk *link, hostprof_trait trait, int value);
+void hostprof_rtt(const lnk *link, double rtt);
+int hostprof_chunks(const lnk *link, long long int size);
+void hostprof_sample(const lnk *link, int conns, long long int bytes,
+		double secs, int throttled);
+double hostprof_estimate(const lnk *link, long long int size);
+
+#endif /* HOSTPROF_H */
@@ -0,0 +1,485 @@
+/*!
+ * \file
+ * \brief HPACK header compression (rfc7541) for http/2 transport.
+ *
+ *  Decoder implements complete rfc7541 (static and dynamic table, Huffman
+ *  coded strings). Encoder emits only indexed fields and literals without
+ *  indexing, so that it needs no dynamic table of its own.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "hpack.h"
+
+#define	HPACK_ENTRY_OVERHEAD 32
+#define	HPACK_STATIC_LEN 61
+#define	HPACK_HUFF_EOS 256
+
+typedef struct
+{
+	const char *name;
+	const char *value;
+} hpack_static;
+
+static const hpack_static static_table[HPACK_STATIC_LEN] = {
+	{ ":authority", "" }, { ":method", "GET" }, { ":method", "POST" },
+	{ ":path", "/" }, { ":path", "/index.html" }, { ":scheme", "http" },
+	{ ":scheme", "https" }, { ":status", "200" }, { ":status", "204" },
+	{ ":status", "206" }, { ":status", "304" }, { ":status", "400" },
+	{ ":status", "404" }, { ":status", "500" }, { "accept-charset", "" },
+	{ "accept-encoding", "gzip, deflate" }, { "accept-language", "" },
+	{ "accept-ranges", "" }, { "accept", "" },
+	{ "access-control-allow-origin", "" }, { "age", "" },
+	{ "allow", "" }, { "authorization", "" }, { "cache-control", "" },
+	{ "content-disposition", "" }, { "content-encoding", "" },
+	{ "content-language", "" }, { "content-length", "" },
+	{ "content-location", "" }, { "content-range", "" },
+	{ "content-type", "" }, { "cookie", "" }, { "date", "" },
+	{ "etag", "" }, { "expect", "" }, { "expires", "" }, { "from", "" },
+	{ "host", "" }, { "if-match", "" }, { "if-modified-since", "" },
+	{ "if-none-match", "" }, { "if-range", "" },
+	{ "if-unmodified-since", "" }, { "last-modified", "" },
+	{ "link", "" }, { "location", "" }, { "max-forwards", "" },
+	{ "proxy-authenticate", "" }, { "proxy-authorization", "" },
+	{ "range", "" }, { "referer", "" }, { "refresh", "" },
+	{ "retry-after", "" }, { "server", "" }, { "set-cookie", "" },
+	{ "strict-transport-security", "" }, { "transfer-encoding", "" },
+	{ "user-agent", "" }, { "vary", "" }, { "via", "" },
+	{ "www-authenticate", "" }
+};
+
+typedef struct
+{
+	unsigned int code;
+	int bits;
+} hpack_code;
+
+static const hpack_code huff_codes[HPACK_HUFF_EOS + 1] = {
+	{ 0x1ff8, 13 }, { 0x7fffd8, 23 }, { 0xfffffe2, 28 },
+	{ 0xfffffe3, 28 }, { 0xfffffe4, 28 }, { 0xfffffe5, 28 },
+	{ 0xfffffe6, 28 }, { 0xfffffe7, 28 }, { 0xfffffe8, 28 },
+	{ 0xffffea, 24 }, { 0x3ffffffc, 30 }, { 0xfffffe9, 28 },
+	{ 0xfffffea, 28 }, { 0x3ffffffd, 30 }, { 0xfffffeb, 28 },
+	{ 0xfffffec, 28 }, { 0xfffffed, 28 }, { 0xfffffee, 28 },
+	{ 0xfffffef, 28 }, { 0xffffff0, 28 }, { 0xffffff1, 28 },
+	{ 0xffffff2, 28 }, { 0x3ffffffe, 30 }, { 0xffffff3, 28 },
+	{ 0xffffff4, 28 }, { 0xffffff5, 28 }, { 0xffffff6, 28 },
+	{ 0xffffff7, 28 }, { 0xffffff8, 28 }, { 0xffffff9, 28 },
+	{ 0xffffffa, 28 }, { 0xffffffb, 28 }, { 0x14, 6 }, { 0x3f8, 10 },
+	{ 0x3f9, 10 }, { 0xffa, 12 }, { 0x1ff9, 13 }, { 0x15, 6 },
+	{ 0xf8, 8 }, { 0x7fa, 11 }, { 0x3fa, 10 }, { 0x3fb, 10 },
+	{ 0xf9, 8 }, { 0x7fb, 11 }, { 0xfa, 8 }, { 0x16, 6 }, { 0x17, 6 },
+	{ 0x18, 6 }, { 0x0, 5 }, { 0x1, 5 }, { 0x2, 5 }, { 0x19, 6 },
+	{ 0x1a, 6 }, { 0x1b, 6 }, { 0x1c, 6 }, { 0x1d, 6 }, { 0x1e, 6 },
+	{ 0x1f, 6 }, { 0x5c, 7 }, { 0xfb, 8 }, { 0x7ffc, 15 }, { 0x20, 6 },
+	{ 0xffb, 12 }, { 0x3fc, 10 }, { 0x1ffa, 13 }, { 0x21, 6 },
+	{ 0x5d, 7 }, { 0x5e, 7 }, { 0x5f, 7 }, { 0x60, 7 }, { 0x61, 7 },
+	{ 0x62, 7 }, { 0x63, 7 }, { 0x64, 7 }, { 0x65, 7 }, { 0x66, 7 },
+	{ 0x67, 7 }, { 0x68, 7 }, { 0x69, 7 }, { 0x6a, 7 }, { 0x6b, 7 },
+	{ 0x6c, 7 }, { 0x6d, 7 }, { 0x6e, 7 }, { 0x6f, 7 }, { 0x70, 7 },
+	{ 0x71, 7 }, { 0x72, 7 }, { 0xfc, 8 }, { 0x73, 7 }, { 0xfd, 8 },
+	{ 0x1ffb, 13 }, { 0x7fff0, 19 }, { 0x1ffc, 13 }, { 0x3ffc, 14 },
+	{ 0x22, 6 }, { 0x7ffd, 15 }, { 0x3, 5 }, { 0x23, 6 }, { 0x4, 5 },
+	{ 0x24, 6 }, { 0x5, 5 }, { 0x25, 6 }, { 0x26, 6 }, { 0x27, 6 },
+	{ 0x6, 5 }, { 0x74, 7 }, { 0x75, 7 }, { 0x28, 6 }, { 0x29, 6 },
+	{ 0x2a, 6 }, { 0x7, 5 }, { 0x2b, 6 }, { 0x76, 7 }, { 0x2c, 6 },
+	{ 0x8, 5 }, { 0x9, 5 }, { 0x2d, 6 }, { 0x77, 7 }, { 0x78, 7 },
+	{ 0x79, 7 }, { 0x7a, 7 }, { 0x7b, 7 }, { 0x7ffe, 15 }, { 0x7fc, 11 },
+	{ 0x3ffd, 14 }, { 0x1ffd, 13 }, { 0xffffffc, 28 }, { 0xfffe6, 20 },
+	{ 0x3fffd2, 22 }, { 0xfffe7, 20 }, { 0xfffe8, 20 }, { 0x3fffd3, 22 },
+	{ 0x3fffd4, 22 }, { 0x3fffd5, 22 }, { 0x7fffd9, 23 },
+	{ 0x3fffd6, 22 }, { 0x7fffda, 23 }, { 0x7fffdb, 23 },
+	{ 0x7fffdc, 23 }, { 0x7fffdd, 23 }, { 0x7fffde, 23 },
+	{ 0xffffeb, 24 }, { 0x7fffdf, 23 }, { 0xffffec, 24 },
+	{ 0xffffed, 24 }, { 0x3fffd7, 22 }, { 0x7fffe0, 23 },
+	{ 0xffffee, 24 }, { 0x7fffe1, 23 }, { 0x7fffe2, 23 },
+	{ 0x7fffe3, 23 }, { 0x7fffe4, 23 }, { 0x1fffdc, 21 },
+	{ 0x3fffd8, 22 }, { 0x7fffe5, 23 }, { 0x3fffd9, 22 },
+	{ 0x7fffe6, 23 }, { 0x7fffe7, 23 }, { 0xffffef, 24 },
+	{ 0x3fffda, 22 }, { 0x1fffdd, 21 }, { 0xfffe9, 20 },
+	{ 0x3fffdb, 22 }, { 0x3fffdc, 22 }, { 0x7fffe8, 23 },
+	{ 0x7fffe9, 23 }, { 0x1fffde, 21 }, { 0x7fffea, 23 },
+	{ 0x3fffdd, 22 }, { 0x3fffde, 22 }, { 0xfffff0, 24 },
+	{ 0x1fffdf, 21 }, { 0x3fffdf, 22 }, { 0x7fffeb, 23 },
+	{ 0x7fffec, 23 }, { 0x1fffe0, 21 }, { 0x1fffe1, 21 },
+	{ 0x3fffe0, 22 }, { 0x1fffe2, 21 }, { 0x7fffed, 23 },
+	{ 0x3fffe1, 22 }, { 0x7fffee, 23 }, { 0x7fffef, 23 },
+	{ 0xfffea, 20 }, { 0x3fffe2, 22 }, { 0x3fffe3, 22 },
+	{ 0x3fffe4, 22 }, { 0x7ffff0, 23 }, { 0x3fffe5, 22 },
+	{ 0x3fffe6, 22 }, { 0x7ffff1, 23 }, { 0x3ffffe0, 26 },
+	{ 0x3ffffe1, 26 }, { 0xfffeb, 20 }, { 0x7fff1, 19 },
+	{ 0x3fffe7, 22 }, { 0x7ffff2, 23 }, { 0x3fffe8, 22 },
+	{ 0x1ffffec, 25 }, { 0x3ffffe2, 26 }, { 0x3ffffe3, 26 },
+	{ 0x3ffffe4, 26 }, { 0x7ffffde, 27 }, { 0x7ffffdf, 27 },
+	{ 0x3ffffe5, 26 }, { 0xfffff1, 24 }, { 0x1ffffed, 25 },
+	{ 0x7fff2, 19 }, { 0x1fffe3, 21 }, { 0x3ffffe6, 26 },
+	{ 0x7ffffe0, 27 }, { 0x7ffffe1, 27 }, { 0x3ffffe7, 26 },
+	{ 0x7ffffe2, 27 }, { 0xfffff2, 24 }, { 0x1fffe4, 21 },
+	{ 0x1fffe5, 21 }, { 0x3ffffe8, 26 }, { 0x3ffffe9, 26 },
+	{ 0xffffffd, 28 }, { 0x7ffffe3, 27 }, { 0x7ffffe4, 27 },
+	{ 0x7ffffe5, 27 }, { 0xfffec, 20 }, { 0xfffff3, 24 },
+	{ 0xfffed, 20 }, { 0x1fffe6, 21 }, { 0x3fffe9, 22 },
+	{ 0x1fffe7, 21 }, { 0x1fffe8, 21 }, { 0x7ffff3, 23 },
+	{ 0x3fffea, 22 }, { 0x3fffeb, 22 }, { 0x1ffffee, 25 },
+	{ 0x1ffffef, 25 }, { 0xfffff4, 24 }, { 0xfffff5, 24 },
+	{ 0x3ffffea, 26 }, { 0x7ffff4, 23 }, { 0x3ffffeb, 26 },
+	{ 0x7ffffe6, 27 }, { 0x3ffffec, 26 }, { 0x3ffffed, 26 },
+	{ 0x7ffffe7, 27 }, { 0x7ffffe8, 27 }, { 0x7ffffe9, 27 },
+	{ 0x7ffffea, 27 }, { 0x7ffffeb, 27 }, { 0xffffffe, 28 },
+	{ 0x7ffffec, 27 }, { 0x7ffffed, 27 }, { 0x7ffffee, 27 },
+	{ 0x7ffffef, 27 }, { 0x7fffff0, 27 }, { 0x3ffffee, 26 },
+	{ 0x3fffffff, 30 }
+};
+
+/**
+ * Node of Huffman decoding tree, leaves have sym >= 0.
+ */
+typedef struct
+{
+	short child[2];
+	short sym;
+} huff_node;
+
+static huff_node huff_tree[2 * (HPACK_HUFF_EOS + 1)];
+static pthread_once_t huff_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Builds Huffman decoding tree from code table (once per process).
+ */
+static void
+huff_tree_build(void)
+{
+	int nodes = 1;
+	int sym, bit, node;
+
+	memset(huff_tree, 0, sizeof (huff_tree));
+	huff_tree[0].sym = -1;
+
+	for (sym = 0; sym <= HPACK_HUFF_EOS; ++sym) {
+		node = 0;
+		for (bit = huff_codes[sym].bits - 1; bit >= 0; --bit) {
+			int b = (huff_codes[sym].code >> bit) & 1;
+
+			if (huff_tree[node].child[b] == 0) {
+				huff_tree[nodes].sym = -1;
+				huff_tree[node].child[b] = (short) nodes++;
+			}
+			node = huff_tree[node].child[b];
+		}
+		huff_tree[node].sym = (short) sym;
+	}
+}
+
+/**
+ * Decodes Huffman coded string of len bytes into newly allocated string.
+ * \return decoded string, NULL if coding is invalid.
+ */
+static char *
+huff_decode(const unsigned char *str, size_t len)
+{
+	// the shortest code has 5 bits
+	char *out = malloc(len * 8 / 5 + 1);
+	size_t olen = 0, idx;
+	int node = 0, depth = 0, ones = 1;
+	int bit, b;
+
+	pthread_once(&huff_once, huff_tree_build);
+
+	for (idx = 0; idx != len; ++idx) {
+		for (bit = 7; bit >= 0; --bit) {
+			b = (str[idx] >> bit) & 1;
+			node = huff_tree[node].child[b];
+			++depth;
+			ones &= b;
+			if (node == 0)
+				goto invalid;
+			if (huff_tree[node].sym >= 0) {
+				if (huff_tree[node].sym == HPACK_HUFF_EOS)
+					goto invalid;
+				out[olen++] = (char) huff_tree[node].sym;
+				node = 0;
+				depth = 0;
+				ones = 1;
+			}
+		}
+	}
+	// padding has to be a prefix of EOS (all ones) shorter than 8 bits
+	if ((depth > 7) || (!ones))
+		goto invalid;
+
+	out[olen] = '\0';
+	return (out);
+
+invalid:
+	free(out);
+	return (NULL);
+}
+
+/**
+ * Decodes integer with prefix of prefix bits at *pos (rfc7541 5.1).
+ * \return 0 on success, -1 if block is truncated or value too big.
+ */
+static int
+hpack_get_int(const unsigned char **pos, const unsigned char *end,
+		int prefix, size_t *value)
+{
+	size_t max = (1 << prefix) - 1;
+	int shift = 0;
+
+	if (*pos >= end)
+		return (-1);
+	*value = *((*pos)++) & max;
+	if (*value < max)
+		return (0);
+
+	do {
+		if ((*pos >= end) || (shift > 28))
+			return (-1);
+		*value += (size_t)(**pos & 0x7F) << shift;
+		shift += 7;
+	} while (*((*pos)++) & 0x80);
+
+	return (0);
+}
+
+/**
+ * Decodes string literal at *pos (rfc7541 5.2).
+ * \return newly allocated string, NULL on fail.
+ */
+static char *
+hpack_get_str(const unsigned char **pos, const unsigned char *end)
+{
+	int huff;
+	size_t len;
+	char *str;
+
+	if (*pos >= end)
+		return (NULL);
+	huff = **pos & 0x80;
+	if ((hpack_get_int(pos, end, 7, &len) == -1) ||
+			(len > (size_t)(end - *pos)))
+		return (NULL);
+
+	if (huff) {
+		str = huff_decode(*pos, len);
+	} else {
+		str = malloc(len + 1);
+		memcpy(str, *pos, len);
+		str[len] = '\0';
+	}
+	*pos += len;
+
+	return (str);
+}
+
+/**
+ * Evicts the oldest entries until table size fits max.
+ */
+static void
+hpack_evict(hpack_table *table, size_t max)
+{
+	while ((table->size > max) && (table->count > 0)) {
+		hpack_entry *old = &table->entries[--table->count];
+
+		table->size -= old->size;
+		free(old->name);
+		free(old->value);
+	}
+}
+
+/**
+ * Adds entry to dynamic table (takes ownership of name and value).
+ */
+static void
+hpack_add(hpack_table *table, char *name, char *value)
+{
+	size_t size = strlen(name) + strlen(value) + HPACK_ENTRY_OVERHEAD;
+
+	hpack_evict(table, (size > table->maxsize) ? 0 :
+			table->maxsize - size);
+	if (size > table->maxsize) {
+		// entry larger than table only empties the table
+		free(name);
+		free(value);
+		return;
+	}
+
+	if (table->count == table->alloc) {
+		table->alloc = table->alloc ? table->alloc * 2 : 16;
+		table->entries = realloc(table->entries,
+				sizeof (hpack_entry) * table->alloc);
+	}
+	memmove(table->entries + 1, table->entries,
+			sizeof (hpack_entry) * table->count);
+	table->entries[0].name = name;
+	table->entries[0].value = value;
+	table->entries[0].size = size;
+	++table->count;
+	table->size += size;
+}
+
+/**
+ * Looks up field with index idx in static or dynamic table.
+ * \return 0 on success, -1 if index is out of tables.
+ */
+static int
+hpack_lookup(const hpack_table *table, size_t idx, const char **name,
+		const char **value)
+{
+	if (idx == 0)
+		return (-1);
+	if (idx <= HPACK_STATIC_LEN) {
+		*name = static_table[idx - 1].name;
+		*value = static_table[idx - 1].value;
+		return (0);
+	}
+	idx -= HPACK_STATIC_LEN + 1;
+	if (idx >= (size_t) table->count)
+		return (-1);
+	*name = table->entries[idx].name;
+	*value = table->entries[idx].value;
+	return (0);
+}
+
+/**
+ * Initializes dynamic table of decoder with max size limit.
+ */
+void
+hpack_table_init(hpack_table *table, size_t limit)
+{
+	table->entries = NULL;
+	table->count = table->alloc = 0;
+	table->size = 0;
+	table->maxsize = table->limit = limit;
+}
+
+/**
+ * Releases entries of dynamic table.
+ */
+void
+hpack_table_free(hpack_table *table)
+{
+	hpack_evict(table, 0);
+	free(table->entries);
+	table->entries = NULL;
+	table->alloc = 0;
+}
+
+/**
+ * Decodes complete header block of len bytes and calls field for every
+ * decoded header field. Dynamic table is updated as the block requires.
+ * \return 0 on success, -1 if block is invalid (connection error).
+ */
+int
+hpack_decode(hpack_table *table, const unsigned char *block, size_t len,
+		hpack_field_cb field, void *data)
+{
+	const unsigned char *pos = block, *end = block + len;
+	const char *sname, *svalue;
+	char *name, *value;
+	size_t idx;
+	int incr;
+
+	while (pos < end) {
+		if (*pos & 0x80) {			// indexed field
+			if ((hpack_get_int(&pos, end, 7, &idx) == -1) ||
+					(hpack_lookup(table, idx, &sname,
+					&svalue) == -1))
+				return (-1);
+			field(data, sname, svalue);
+			continue;
+		}
+		if ((*pos & 0xE0) == 0x20) {		// table size update
+			if ((hpack_get_int(&pos, end, 5, &idx) == -1) ||
+					(idx > table->limit))
+				return (-1);
+			table->maxsize = idx;
+			hpack_evict(table, idx);
+			continue;
+		}
+
+		// literal with incremental indexing, without or never indexed
+		incr = ((*pos & 0xC0) == 0x40);
+		if (hpack_get_int(&pos, end, incr ? 6 : 4, &idx) == -1)
+			return (-1);
+		if (idx == 0) {
+			name = hpack_get_str(&pos, end);
+		} else if (hpack_lookup(table, idx, &sname, &svalue) == 0) {
+			name = strdup(sname);
+		} else {
+			return (-1);
+		}
+		if ((name == NULL) || ((value = hpack_get_str(&pos, end)) ==
+				NULL)) {
+			free(name);
+			return (-1);
+		}
+
+		field(data, name, value);
+		if (incr) {
+			hpack_add(table, name, value);
+		} else {
+			free(name);
+			free(value);
+		}
+	}
+
+	return (0);
+}
+
+/**
+ * Encodes integer value with prefix of prefix bits, first byte keeps
+ * flags in bits over prefix.
+ * \return number of written bytes.
+ */
+static size_t
+hpack_put_int(unsigned char *buf, int prefix, unsigned char flags,
+		size_t value)
+{
+	size_t max = (1 << prefix) - 1;
+	size_t len = 1;
+
+	if (value < max) {
+		buf[0] = flags | (unsigned char) value;
+		return (1);
+	}
+	buf[0] = flags | (unsigned char) max;
+	value -= max;
+	while (value >= 0x80) {
+		buf[len++] = (unsigned char)((value & 0x7F) | 0x80);
+		value >>= 7;
+	}
+	buf[len++] = (unsigned char) value;
+
+	return (len);
+}
+
+/**
+ * Encodes field with index idx of static table.
+ * \return number of written bytes.
+ */
+size_t
+hpack_put_indexed(unsigned char *buf, int idx)
+{
+	return (hpack_put_int(buf, 7, 0x80, idx));
+}
+
+/**
+ * Encodes literal field without indexing with name of static table index
+ * nameidx and raw (not Huffman coded) value. buf has to have place for
+ * strlen(value) + 10 bytes.
+ * \return number of written bytes.
+ */
+size_t
+hpack_put_literal(unsigned char *buf, int nameidx, const char *value)
+{
+	size_t vlen = strlen(value);
+	size_t len = hpack_put_int(buf, 4, 0x00, nameidx);
+
+	len += hpack_put_int(buf + len, 7, 0x00, vlen);
+	memcpy(buf + len, value, vlen);
+
+	return (len + vlen);
+}
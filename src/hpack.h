@@ -0,0 +1,47 @@
+#ifndef HPACK_H
+#define	HPACK_H
+
+#include <stddef.h>
+
+#define	HPACK_TABLE_SIZE 4096	// SETTINGS_HEADER_TABLE_SIZE of decoder
+
+// indexes of static table used by request encoder
+#define	HPACK_IDX_AUTHORITY 1
+#define	HPACK_IDX_METHOD_GET 2
+#define	HPACK_IDX_PATH 4
+#define	HPACK_IDX_SCHEME_HTTP 6
+#define	HPACK_IDX_SCHEME_HTTPS 7
+#define	HPACK_IDX_RANGE 50
+
+typedef struct
+{
+	char *name;
+	char *value;
+	size_t size;	// name + value + 32 (rfc7541 4.1)
+} hpack_entry;
+
+/**
+ * Dynamic table of decoder (newest entry first).
+ */
+typedef struct
+{
+	hpack_entry *entries;
+	int count;
+	int alloc;
+	size_t size;	// current size of entries
+	size_t maxsize;	// max size set by encoder (dynamic table size update)
+	size_t limit;	// max size announced in SETTINGS
+} hpack_table;
+
+typedef void (*hpack_field_cb)(void *data, const char *name,
+		const char *value);
+
+void hpack_table_init(hpack_table *table, size_t limit);
+void hpack_table_free(hpack_table *table);
+int hpack_decode(hpack_table *table, const unsigned char *block, size_t len,
+		hpack_field_cb field, void *data);
+
+size_t hpack_put_indexed(unsigned char *buf, int idx);
+size_t hpack_put_literal(unsigned char *buf, int nameidx, const char *value);
+
+#endif /* HPACK_H */
@@ -0,0 +1,1064 @@
+/*!
+ * \file
+ * \brief HTTP/2 transport (rfc7540) multiplexing chunk ranges as streams.
+ *
+ *  All links of the same server share one connection (session). Every chunk
+ *  is one stream of the session carrying GET request with range of the
+ *  chunk, so parallel ranges don't need parallel connections. Session is
+ *  negotiated by ALPN on https links and by prior knowledge (h2c) on http
+ *  links, servers which refuse it are remembered and downloaded over
+ *  HTTP/1.1 (server that merely couldn't be reached is tried again).
+ *
+ *  Reader thread of session receives all frames and copies DATA of streams
+ *  straight into chunk memory (or file). Receive windows are large
+ *  (H2_STREAM_WINDOW, or receive buffer of socket profile if it is bigger,
+ *  and H2_CONN_WINDOW) so that flow control doesn't limit high
+ *  bandwidth-delay paths.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "http2.h"
+#include "hpack.h"
+#include "httpclient.h"
+#include "linkparser.h"
+#include "retry.h"
+#include "tls.h"
+#include "trace.h"
+#include "log.h"
+#include "membudget.h"
+
+#define	H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define	H2_FRAME_HEADER 9
+#define	H2_RBUF_SIZE (64 * 1024)
+#define	H2_ALPN "\x02h2\x08http/1.1"
+#define	H2_PREFACE_TIMEOUT 10	// seconds to wait for SETTINGS of server
+
+// frame types
+#define	H2_DATA 0x0
+#define	H2_HEADERS 0x1
+#define	H2_RST_STREAM 0x3
+#define	H2_SETTINGS 0x4
+#define	H2_PUSH_PROMISE 0x5
+#define	H2_PING 0x6
+#define	H2_GOAWAY 0x7
+#define	H2_WINDOW_UPDATE 0x8
+#define	H2_CONTINUATION 0x9
+
+// frame flags
+#define	H2_END_STREAM 0x1
+#define	H2_ACK 0x1
+#define	H2_END_HEADERS 0x4
+#define	H2_PADDED 0x8
+#define	H2_PRIORITY 0x20
+
+// settings
+#define	H2_SET_HEADER_TABLE_SIZE 0x1
+#define	H2_SET_ENABLE_PUSH 0x2
+#define	H2_SET_MAX_CONCURRENT_STREAMS 0x3
+#define	H2_SET_INITIAL_WINDOW_SIZE 0x4
+#define	H2_SET_MAX_FRAME_SIZE 0x5
+
+// error codes
+#define	H2_PROTOCOL_ERROR 0x1
+#define	H2_FRAME_SIZE_ERROR 0x6
+#define	H2_CANCEL 0x8
+
+typedef struct h2_stream
+{
+	uint32_t id;
+	chunk_bounds *bounds;	// NULL for header (HEAD) request
+	lnk_http_header *linkh;
+	statcode status;
+	long long int received;
+	long long int unacked;	// received bytes not returned to window
+	int done;		// 0 running, 1 finished, -1 failed
+	int busy;		// reader is writing data of stream
+	struct h2_stream *next;
+} h2_stream;
+
+typedef struct h2_session
+{
+	char *key;		// scheme://host:port
+	http_conn conn;
+	pthread_mutex_t lock;	// guards streams and state
+	pthread_mutex_t wlock;	// serializes frames written to connection
+	pthread_cond_t cond;	// signalled on any stream or state change
+	pthread_t reader;
+	int dead;		// connection failed or closed
+	int goaway;		// server doesn't accept new streams
+	int refs;
+	int timeout;		// read timeout of socket profile (seconds)
+	uint32_t nextid;
+	uint32_t maxstreams;
+	uint32_t active;
+	long long int window;	// stream receive window
+	long long int connunacked;
+	h2_stream *streams;
+	hpack_table hpack;
+
+	unsigned char rbuf[H2_RBUF_SIZE];
+	size_t rpos, rlen;
+	unsigned char *block;	// header block being received
+	size_t blocklen, blockalloc;
+
+	struct h2_session *next;
+} h2_session;
+
+typedef struct h2_server
+{
+	char *key;
+	struct h2_server *next;
+} h2_server;
+
+static h2_session *sessions = NULL;
+static h2_server *refused = NULL;	// servers which don't speak http/2
+static h2_server *connecting = NULL;	// servers whose session is being set up
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sessions_cond = PTHREAD_COND_INITIALIZER;
+
+static void h2_session_put(h2_session *s);
+
+/**
+ * Creates key of session of link (scheme://host:port).
+ * \return newly allocated key.
+ */
+static char *
+h2_key(const lnk *link)
+{
+	char *hostport, *key;
+	char sport[8];
+
+	snprintf(sport, sizeof (sport), ":%d", link->port);
+	hostport = _strcat(link->hostname, sport);
+	key = _strcat((link->prot == HTTPS) ? PROTOCOL_HTTPS : PROTOCOL_HTTP,
+			hostport);
+	free(hostport);
+	return (key);
+}
+
+static void
+h2_put32(unsigned char *buf, uint32_t value)
+{
+	buf[0] = (unsigned char)(value >> 24);
+	buf[1] = (unsigned char)(value >> 16);
+	buf[2] = (unsigned char)(value >> 8);
+	buf[3] = (unsigned char) value;
+}
+
+static uint32_t
+h2_get32(const unsigned char *buf)
+{
+	return (((uint32_t) buf[0] << 24) | ((uint32_t) buf[1] << 16) |
+			((uint32_t) buf[2] << 8) | buf[3]);
+}
+
+/**
+ * Writes frame into connection. Caller has to hold s->wlock.
+ * \return 0 on success, -1 on fail.
+ */
+static int
+h2_frame_write(h2_session *s, int type, int flags, uint32_t sid,
+		const unsigned char *payload, size_t len)
+{
+	unsigned char hdr[H2_FRAME_HEADER];
+	size_t done;
+	ssize_t wr;
+
+	hdr[0] = (unsigned char)(len >> 16);
+	hdr[1] = (unsigned char)(len >> 8);
+	hdr[2] = (unsigned char) len;
+	hdr[3] = (unsigned char) type;
+	hdr[4] = (unsigned char) flags;
+	h2_put32(hdr + 5, sid & 0x7FFFFFFF);
+
+	if (http_write(&s->conn, hdr, H2_FRAME_HEADER) != H2_FRAME_HEADER)
+		return (-1);
+	for (done = 0; done != len; done += wr) {
+		if ((wr = http_write(&s->conn, payload + done,
+				len - done)) <= 0)
+			return (-1);
+	}
+	return (0);
+}
+
+/**
+ * Writes frame into connection (takes s->wlock).
+ * \return 0 on success, -1 on fail.
+ */
+static int
+h2_frame_send(h2_session *s, int type, int flags, uint32_t sid,
+		const unsigned char *payload, size_t len)
+{
+	int ret;
+
+	pthread_mutex_lock(&s->wlock);
+	ret = h2_frame_write(s, type, flags, sid, payload, len);
+	pthread_mutex_unlock(&s->wlock);
+
+	return (ret);
+}
+
+static int
+h2_window_update(h2_session *s, uint32_t sid, long long int increment)
+{
+	unsigned char payload[4];
+
+	h2_put32(payload, (uint32_t) increment);
+	return (h2_frame_send(s, H2_WINDOW_UPDATE, 0, sid, payload, 4));
+}
+
+static int
+h2_rst_stream(h2_session *s, uint32_t sid, uint32_t error)
+{
+	unsigned char payload[4];
+
+	h2_put32(payload, error);
+	return (h2_frame_send(s, H2_RST_STREAM, 0, sid, payload, 4));
+}
+
+/**
+ * Waits until data can be read from connection (at most read timeout of
+ * socket profile if there are streams waiting for data).
+ * \return 0 if data are ready, -1 on timeout or fail.
+ */
+static int
+h2_wait_input(h2_session *s)
+{
+	struct pollfd pfd;
+	int ret;
+
+	if ((s->conn.tls != NULL) && (tls_pending(s->conn.tls) > 0))
+		return (0);
+
+	pfd.fd = s->conn.fd;
+	pfd.events = POLLIN;
+	for (;;) {
+		ret = poll(&pfd, 1, (s->timeout > 0) ? s->timeout * 1000 : -1);
+		if (ret > 0)
+			return (0);
+		if ((ret == -1) && (errno != EINTR))
+			return (-1);
+		if (ret == 0) {
+			// idle session may wait for ever
+			pthread_mutex_lock(&s->lock);
+			ret = (s->active > 0);
+			pthread_mutex_unlock(&s->lock);
+			if (ret)
+				return (-1);
+		}
+	}
+}
+
+/**
+ * Receives exactly len bytes from connection into dst (dst may be NULL to
+ * discard data). Large reads go straight into dst, small ones through
+ * read buffer of session.
+ * \return 0 on success, -1 on fail (or end of connection).
+ */
+static int
+h2_recv(h2_session *s, void *dst, size_t len)
+{
+	unsigned char *out = dst;
+	size_t part;
+	ssize_t rd;
+
+	while (len > 0) {
+		if (s->rpos != s->rlen) {
+			part = s->rlen - s->rpos;
+			if (part > len)
+				part = len;
+			if (out != NULL) {
+				memcpy(out, s->rbuf + s->rpos, part);
+				out += part;
+			}
+			s->rpos += part;
+			len -= part;
+			continue;
+		}
+
+		if (h2_wait_input(s) == -1)
+			return (-1);
+		if ((out != NULL) && (len >= H2_RBUF_SIZE / 2)) {
+			if ((rd = http_read(&s->conn, out, len)) <= 0)
+				return (-1);
+			out += rd;
+			len -= rd;
+			continue;
+		}
+		if ((rd = http_read(&s->conn, s->rbuf, H2_RBUF_SIZE)) <= 0)
+			return (-1);
+		s->rpos = 0;
+		s->rlen = (size_t) rd;
+	}
+
+	return (0);
+}
+
+/**
+ * Finds stream sid of session. Caller has to hold s->lock.
+ */
+static h2_stream *
+h2_stream_find(h2_session *s, uint32_t sid)
+{
+	h2_stream *st;
+
+	for (st = s->streams; st != NULL; st = st->next) {
+		if (st->id == sid)
+			return (st);
+	}
+	return (NULL);
+}
+
+/**
+ * Header field callback of HPACK decoder, fills response of stream.
+ */
+static void
+h2_on_field(void *data, const char *name, const char *value)
+{
+	h2_stream *st = data;
+
+	if (st == NULL)
+		return;
+	if (strcmp(name, ":status") == 0) {
+		st->status = atoi(value);
+		st->linkh->statcodegrp = http_str2statuscode_grp((char *) value);
+	} else if (strcmp(name, "content-length") == 0) {
+		st->linkh->clen = STRTOOFF_T(value, NULL, 10);
+	} else if ((strcmp(name, "content-type") == 0) &&
+			(st->bounds == NULL) && (st->linkh->ctype == NULL)) {
+		st->linkh->ctype = strdup(value);
+	} else if (strcmp(name, "retry-after") == 0) {
+		st->linkh->retryafter = retry_after_parse(value);
+	} else if ((strcmp(name, "location") == 0) && (st->bounds == NULL) &&
+			(st->linkh->location == NULL)) {
+		st->linkh->location = strdup(value);
+	}
+}
+
+/**
+ * Finishes stream (done is 1 on success, -1 on fail). Caller has to hold
+ * s->lock.
+ */
+static void
+h2_stream_finish(h2_session *s, h2_stream *st, int done)
+{
+	if (st->done == 0)
+		st->done = done;
+	pthread_cond_broadcast(&s->cond);
+}
+
+/**
+ * Receives HEADERS frame (and its CONTINUATION frames) and decodes the
+ * header block.
+ * \return 0 on success, -1 on connection error.
+ */
+static int
+h2_on_headers(h2_session *s, uint32_t sid, int flags, size_t len)
+{
+	unsigned char hdr[H2_FRAME_HEADER];
+	unsigned char padlen = 0;
+	size_t skip = 0;
+	h2_stream *st;
+	int ret;
+
+	if (flags & H2_PADDED) {
+		if ((len < 1) || (h2_recv(s, &padlen, 1) == -1))
+			return (-1);
+		--len;
+	}
+	if (flags & H2_PRIORITY)
+		skip = 5;
+	if (len < skip + padlen)
+		return (-1);
+
+	s->blocklen = 0;
+	for (;;) {
+		len -= skip + padlen;
+		if (s->blocklen + len > s->blockalloc) {
+			s->blockalloc = s->blocklen + len;
+			s->block = realloc(s->block, s->blockalloc);
+		}
+		if ((h2_recv(s, NULL, skip) == -1) ||
+				(h2_recv(s, s->block + s->blocklen, len) == -1) ||
+				(h2_recv(s, NULL, padlen) == -1))
+			return (-1);
+		s->blocklen += len;
+		if (flags & H2_END_HEADERS)
+			break;
+
+		// CONTINUATION of the same stream has to follow
+		if (h2_recv(s, hdr, H2_FRAME_HEADER) == -1)
+			return (-1);
+		len = ((size_t) hdr[0] << 16) | ((size_t) hdr[1] << 8) | hdr[2];
+		if ((hdr[3] != H2_CONTINUATION) || ((h2_get32(hdr + 5) &
+				0x7FFFFFFF) != sid) || (len > H2_MAX_FRAME))
+			return (-1);
+		flags = (flags & H2_END_STREAM) | hdr[4];
+		skip = padlen = 0;
+	}
+
+	pthread_mutex_lock(&s->lock);
+	st = h2_stream_find(s, sid);
+	if ((st != NULL) && (st->done != 0))
+		st = NULL;
+	// block has to be decoded even for unknown streams (dynamic table)
+	ret = hpack_decode(&s->hpack, s->block, s->blocklen, h2_on_field, st);
+	if ((ret == 0) && (st != NULL) && (st->status >= 200)) {
+		if ((st->bounds != NULL) &&
+				(st->status != HTTP_STATUSCODE_PARTIAL)) {
+			log_range(LOG_ERROR, st->bounds->lnk,
+					st->bounds->startpos,
+					st->bounds->endpos, 0, "Response "
+					"message not PARTIAL CONTENT: status "
+					"code:%i", st->status);
+			h2_stream_finish(s, st, -1);
+			pthread_mutex_unlock(&s->lock);
+			h2_rst_stream(s, sid, H2_CANCEL);
+			return (0);
+		}
+		if (flags & H2_END_STREAM)
+			h2_stream_finish(s, st, (st->bounds == NULL) ? 1 :
+					(st->received == st->bounds->memlen) ?
+					1 : -1);
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	return (ret);
+}
+
+/**
+ * Receives DATA frame into memory (or file) of chunk of its stream and
+ * returns received bytes to flow control windows.
+ * \return 0 on success, -1 on connection error.
+ */
+static int
+h2_on_data(h2_session *s, uint32_t sid, int flags, size_t len)
+{
+	unsigned char padlen = 0;
+	size_t datalen = len, left, part;
+	chunk_bounds *bounds = NULL;
+	h2_stream *st;
+	long long int fpos, unacked = 0;
+	ssize_t rd;
+	int ret = 0, overflow = 0;
+
+	if (flags & H2_PADDED) {
+		if ((len < 1) || (h2_recv(s, &padlen, 1) == -1))
+			return (-1);
+		datalen = len - 1;
+	}
+	if (datalen < padlen)
+		return (-1);
+	datalen -= padlen;
+
+	// busy stream is kept by its waiter until data are written
+	pthread_mutex_lock(&s->lock);
+	st = h2_stream_find(s, sid);
+	if ((st != NULL) && (st->done == 0) && (st->bounds != NULL)) {
+		bounds = st->bounds;
+		st->busy = 1;
+		overflow = (st->received + (long long int) datalen >
+				(long long int) bounds->memlen);
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	if ((bounds == NULL) || overflow) {
+		ret = h2_recv(s, NULL, datalen);
+	} else if (bounds->memory != NULL) {
+		ret = h2_recv(s, bounds->memory + st->received, datalen);
+	} else {
+		// memory couldn't be mapped, write directly into file
+		fpos = http_chunk_filepos(bounds) + st->received;
+		for (left = datalen; left > 0; left -= part) {
+			if (s->rpos == s->rlen) {
+				if ((h2_wait_input(s) == -1) ||
+						((rd = http_read(&s->conn, s->rbuf,
+						H2_RBUF_SIZE)) <= 0)) {
+					ret = -1;
+					break;
+				}
+				s->rpos = 0;
+				s->rlen = (size_t) rd;
+			}
+			part = s->rlen - s->rpos;
+			if (part > left)
+				part = left;
+			if (pwrite(bounds->fd, s->rbuf + s->rpos, part, fpos)
+					!= (ssize_t) part)
+				overflow = 1;
+			s->rpos += part;
+			fpos += part;
+		}
+	}
+	if ((ret == 0) && (h2_recv(s, NULL, padlen) == -1))
+		ret = -1;
+
+	pthread_mutex_lock(&s->lock);
+	if (bounds != NULL) {
+		st->busy = 0;
+		st->unacked += len;
+		if (overflow) {
+			h2_stream_finish(s, st, -1);
+		} else {
+			st->received += datalen;
+			__atomic_store_n(&bounds->received, st->received,
+					__ATOMIC_RELEASE);
+			if (flags & H2_END_STREAM)
+				h2_stream_finish(s, st, (st->received ==
+						(long long int) bounds->memlen) ?
+						1 : -1);
+		}
+		if ((st->done == 0) && (st->unacked >= s->window / 2)) {
+			unacked = st->unacked;
+			st->unacked = 0;
+		}
+		pthread_cond_broadcast(&s->cond);
+	}
+	s->connunacked += len;
+	pthread_mutex_unlock(&s->lock);
+
+	if (ret == -1)
+		return (-1);
+	if (overflow)
+		h2_rst_stream(s, sid, H2_CANCEL);
+	if ((unacked > 0) && (h2_window_update(s, sid, unacked) == -1))
+		return (-1);
+	if (s->connunacked >= H2_CONN_WINDOW / 2) {
+		if (h2_window_update(s, 0, s->connunacked) == -1)
+			return (-1);
+		s->connunacked = 0;
+	}
+
+	return (0);
+}
+
+/**
+ * Receives SETTINGS frame and acknowledges it.
+ * \return 0 on success, -1 on connection error.
+ */
+static int
+h2_on_settings(h2_session *s, int flags, size_t len)
+{
+	unsigned char item[6];
+	uint32_t value;
+
+	if (flags & H2_ACK)
+		return ((len == 0) ? 0 : -1);
+	if (len % 6 != 0)
+		return (-1);
+
+	for (; len > 0; len -= 6) {
+		if (h2_recv(s, item, 6) == -1)
+			return (-1);
+		value = h2_get32(item + 2);
+		if ((((item[0] << 8) | item[1]) ==
+				H2_SET_MAX_CONCURRENT_STREAMS)) {
+			pthread_mutex_lock(&s->lock);
+			s->maxstreams = value;
+			pthread_cond_broadcast(&s->cond);
+			pthread_mutex_unlock(&s->lock);
+		}
+	}
+
+	return (h2_frame_send(s, H2_SETTINGS, H2_ACK, 0, NULL, 0));
+}
+
+/**
+ * Receives one frame and dispatches it.
+ * \return 0 on success, -1 on connection error (or end of connection).
+ */
+static int
+h2_frame_read(h2_session *s)
+{
+	unsigned char hdr[H2_FRAME_HEADER];
+	unsigned char payload[8];
+	size_t len;
+	uint32_t sid, lastid;
+	int type, flags;
+	h2_stream *st;
+
+	if (h2_recv(s, hdr, H2_FRAME_HEADER) == -1)
+		return (-1);
+	len = ((size_t) hdr[0] << 16) | ((size_t) hdr[1] << 8) | hdr[2];
+	type = hdr[3];
+	flags = hdr[4];
+	sid = h2_get32(hdr + 5) & 0x7FFFFFFF;
+
+	if (len > H2_MAX_FRAME)
+		return (-1);
+
+	switch (type) {
+	case H2_DATA:
+		return (h2_on_data(s, sid, flags, len));
+	case H2_HEADERS:
+		return (h2_on_headers(s, sid, flags, len));
+	case H2_SETTINGS:
+		return (h2_on_settings(s, flags, len));
+	case H2_RST_STREAM:
+		if ((len != 4) || (h2_recv(s, payload, 4) == -1))
+			return (-1);
+		pthread_mutex_lock(&s->lock);
+		if ((st = h2_stream_find(s, sid)) != NULL)
+			h2_stream_finish(s, st, -1);
+		pthread_mutex_unlock(&s->lock);
+		return (0);
+	case H2_PING:
+		if ((len != 8) || (h2_recv(s, payload, 8) == -1))
+			return (-1);
+		if (flags & H2_ACK)
+			return (0);
+		return (h2_frame_send(s, H2_PING, H2_ACK, 0, payload, 8));
+	case H2_GOAWAY:
+		if ((len < 8) || (h2_recv(s, payload, 8) == -1) ||
+				(h2_recv(s, NULL, len - 8) == -1))
+			return (-1);
+		lastid = h2_get32(payload) & 0x7FFFFFFF;
+		pthread_mutex_lock(&s->lock);
+		s->goaway = 1;
+		for (st = s->streams; st != NULL; st = st->next) {
+			if (st->id > lastid)
+				h2_stream_finish(s, st, -1);
+		}
+		pthread_cond_broadcast(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+		return (0);
+	case H2_PUSH_PROMISE:
+		// push was disabled in our settings
+		return (-1);
+	default:
+		// PRIORITY, WINDOW_UPDATE (we send no data) and unknown frames
+		return (h2_recv(s, NULL, len));
+	}
+}
+
+/**
+ * Reader of session (function for one thread). When the connection ends,
+ * all its streams fail and session is removed from shared sessions.
+ * param data of type (h2_session *).
+ */
+static void *
+h2_reader(void *data)
+{
+	h2_session *s = data;
+	h2_session **item;
+	h2_stream *st;
+
+	while (h2_frame_read(s) == 0)
+		;
+
+	pthread_mutex_lock(&sessions_lock);
+	for (item = &sessions; *item != NULL; item = &(*item)->next) {
+		if (*item == s) {
+			*item = s->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&sessions_lock);
+
+	pthread_mutex_lock(&s->lock);
+	s->dead = 1;
+	for (st = s->streams; st != NULL; st = st->next)
+		h2_stream_finish(s, st, -1);
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+
+	h2_session_put(s);
+	return (NULL);
+}
+
+/**
+ * Connects new session to server of link and exchanges connection
+ * preface and settings. *declined is set if the server answered but
+ * doesn't speak http/2 (ALPN or preface refused), failure to connect or
+ * timeout leaves it 0.
+ * \return new session, NULL on fail.
+ */
+static h2_session *
+h2_session_new(const lnk *link, char *key, int *declined)
+{
+	h2_session *s = calloc(1, sizeof (h2_session));
+	unsigned char settings[18];
+	unsigned char hdr[H2_FRAME_HEADER];
+	size_t len;
+
+	*declined = 0;
+	membudget_charge(sizeof (h2_session));
+	s->key = key;
+	s->window = H2_STREAM_WINDOW;
+	if ((link->sprf != NULL) && (link->sprf->rcvbuf > s->window))
+		s->window = link->sprf->rcvbuf;
+	s->timeout = (link->sprf != NULL) ? link->sprf->readtimeout : 0;
+	s->nextid = 1;
+	s->maxstreams = H2_MAX_STREAMS;
+	s->refs = 1;	// reference of reader
+	hpack_table_init(&s->hpack, HPACK_TABLE_SIZE);
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_mutex_init(&s->wlock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+
+	if (http_connect(&s->conn, link, H2_ALPN) == -1) {
+		s->conn.fd = -1;
+		goto fail;
+	}
+	if ((s->conn.tls != NULL) && (!tls_alpn_h2(s->conn.tls))) {
+		*declined = 1;
+		goto fail;
+	}
+
+	settings[0] = 0;
+	settings[1] = H2_SET_ENABLE_PUSH;
+	h2_put32(settings + 2, 0);
+	settings[6] = 0;
+	settings[7] = H2_SET_INITIAL_WINDOW_SIZE;
+	h2_put32(settings + 8, (uint32_t) s->window);
+	settings[12] = 0;
+	settings[13] = H2_SET_MAX_FRAME_SIZE;
+	h2_put32(settings + 14, H2_MAX_FRAME);
+
+	if ((http_write(&s->conn, H2_PREFACE, strlen(H2_PREFACE)) !=
+			(ssize_t) strlen(H2_PREFACE)) ||
+			(h2_frame_write(s, H2_SETTINGS, 0, 0, settings,
+			sizeof (settings)) == -1) ||
+			(h2_window_update(s, 0, H2_CONN_WINDOW - 65535) == -1))
+		goto fail;
+
+	// server preface is SETTINGS frame (HTTP/1.1 server answers other),
+	// the preface is waited for as a stream
+	s->active = 1;
+	if (s->timeout <= 0)
+		s->timeout = H2_PREFACE_TIMEOUT;
+	if (h2_recv(s, hdr, H2_FRAME_HEADER) == -1)
+		goto fail;
+	s->active = 0;
+	s->timeout = (link->sprf != NULL) ? link->sprf->readtimeout : 0;
+	len = ((size_t) hdr[0] << 16) | ((size_t) hdr[1] << 8) | hdr[2];
+	if ((hdr[3] != H2_SETTINGS) || (hdr[4] & H2_ACK) ||
+			(len > H2_MAX_FRAME) ||
+			(h2_on_settings(s, hdr[4], len) == -1)) {
+		*declined = 1;
+		goto fail;
+	}
+
+	if (pthread_create(&s->reader, NULL, h2_reader, s) != 0)
+		goto fail;
+	pthread_detach(s->reader);
+
+	return (s);
+
+fail:
+	if (s->conn.fd != -1)
+		http_close(&s->conn);
+	hpack_table_free(&s->hpack);
+	free(s);
+	membudget_release(sizeof (h2_session));
+	return (NULL);
+}
+
+/**
+ * \return nonzero if key of server is in list.
+ */
+static int
+h2_server_listed(const h2_server *list, const char *key)
+{
+	for (; list != NULL; list = list->next) {
+		if (strcmp(list->key, key) == 0)
+			return (1);
+	}
+	return (0);
+}
+
+/**
+ * Gets session of server of link (shared or newly connected one) and holds
+ * reference of it. Session is connected without sessions_lock, other
+ * threads wanting the same server wait for it (one connection per server).
+ * \return session, NULL if http/2 session can't be used for link.
+ */
+static h2_session *
+h2_session_get(const lnk *link)
+{
+	char *key = h2_key(link);
+	h2_session *s;
+	h2_server *item, **prev;
+	int declined;
+
+	pthread_mutex_lock(&sessions_lock);
+	for (;;) {
+		if (h2_server_listed(refused, key)) {
+			pthread_mutex_unlock(&sessions_lock);
+			free(key);
+			return (NULL);
+		}
+		for (s = sessions; s != NULL; s = s->next) {
+			pthread_mutex_lock(&s->lock);
+			if ((strcmp(s->key, key) == 0) && (!s->dead) &&
+					(!s->goaway)) {
+				++s->refs;
+				pthread_mutex_unlock(&s->lock);
+				pthread_mutex_unlock(&sessions_lock);
+				free(key);
+				return (s);
+			}
+			pthread_mutex_unlock(&s->lock);
+		}
+		if (!h2_server_listed(connecting, key))
+			break;
+		pthread_cond_wait(&sessions_cond, &sessions_lock);
+	}
+	item = malloc(sizeof (h2_server));
+	item->key = key;
+	item->next = connecting;
+	connecting = item;
+	pthread_mutex_unlock(&sessions_lock);
+
+	s = h2_session_new(link, key, &declined);
+
+	pthread_mutex_lock(&sessions_lock);
+	for (prev = &connecting; *prev != item; prev = &(*prev)->next)
+		;
+	*prev = item->next;
+	if (s != NULL) {
+		free(item);
+		++s->refs;
+		s->next = sessions;
+		sessions = s;
+	} else if (declined) {
+		item->next = refused;
+		refused = item;
+	} else {
+		// server which couldn't be reached is tried by next request
+		free(item);
+		free(key);
+	}
+	pthread_cond_broadcast(&sessions_cond);
+	pthread_mutex_unlock(&sessions_lock);
+
+	return (s);
+}
+
+/**
+ * Releases reference of session, the last one frees it.
+ */
+static void
+h2_session_put(h2_session *s)
+{
+	int refs;
+
+	pthread_mutex_lock(&s->lock);
+	refs = --s->refs;
+	pthread_mutex_unlock(&s->lock);
+	if (refs > 0)
+		return;
+
+	http_close(&s->conn);
+	hpack_table_free(&s->hpack);
+	pthread_cond_destroy(&s->cond);
+	pthread_mutex_destroy(&s->wlock);
+	pthread_mutex_destroy(&s->lock);
+	free(s->block);
+	free(s->key);
+	free(s);
+	membudget_release(sizeof (h2_session));
+}
+
+/**
+ * Sends request of link as new stream of session and waits for its end.
+ * bounds is range of GET request or NULL for HEAD request. Stream of chunk
+ * cancelled by chunk manager is reset.
+ * \return 0 on success, -1 on fail.
+ */
+static int
+h2_stream_run(h2_session *s, const lnk *link, chunk_bounds *bounds,
+		lnk_http_header *linkh)
+{
+	h2_stream *st = calloc(1, sizeof (h2_stream));
+	h2_stream **item;
+	unsigned char *block;
+	char *authority;
+	char range[2 * RANGE_BYTES_MAX_LEN + 8] = "";
+	char sport[8];
+	size_t len = 0;
+	struct timespec wakeup;
+	int ret, cancelled = 0;
+
+	// request header block
+	snprintf(sport, sizeof (sport), ":%d", link->port);
+	authority = (link->port == ((link->prot == HTTPS) ? HTTPS_PORT :
+			HTTP_PORT)) ? strdup(link->hostname) :
+			_strcat(link->hostname, sport);
+	if (bounds != NULL)
+		snprintf(range, sizeof (range), "bytes=%lli-%lli",
+				bounds->startpos, bounds->endpos);
+	block = malloc(strlen(authority) + strlen(link->rquri) +
+			strlen(range) + 64);
+	if (bounds != NULL)
+		len += hpack_put_indexed(block, HPACK_IDX_METHOD_GET);
+	else
+		len += hpack_put_literal(block, HPACK_IDX_METHOD_GET,
+				HTTP_METHOD_HEAD);
+	len += hpack_put_indexed(block + len, (link->prot == HTTPS) ?
+			HPACK_IDX_SCHEME_HTTPS : HPACK_IDX_SCHEME_HTTP);
+	len += hpack_put_literal(block + len, HPACK_IDX_AUTHORITY, authority);
+	len += hpack_put_literal(block + len, HPACK_IDX_PATH, link->rquri);
+	if (bounds != NULL)
+		len += hpack_put_literal(block + len, HPACK_IDX_RANGE, range);
+	free(authority);
+
+	st->bounds = bounds;
+	st->linkh = linkh;
+	linkh->clen = 0;
+	linkh->ctype = NULL;
+	linkh->statcodegrp = STAT_UNKNOWN;
+	linkh->retryafter = -1;
+	linkh->location = NULL;
+
+	// reserve place among concurrent streams of session
+	pthread_mutex_lock(&s->lock);
+	while ((!s->dead) && (!s->goaway) && (s->active >= s->maxstreams))
+		pthread_cond_wait(&s->cond, &s->lock);
+	if (s->dead || s->goaway) {
+		pthread_mutex_unlock(&s->lock);
+		free(block);
+		free(st);
+		return (-1);
+	}
+	++s->active;
+	pthread_mutex_unlock(&s->lock);
+
+	// stream ids have to grow in order of their HEADERS frames
+	pthread_mutex_lock(&s->wlock);
+	pthread_mutex_lock(&s->lock);
+	st->id = s->nextid;
+	s->nextid += 2;
+	st->next = s->streams;
+	s->streams = st;
+	pthread_mutex_unlock(&s->lock);
+	ret = h2_frame_write(s, H2_HEADERS, H2_END_HEADERS | H2_END_STREAM,
+			st->id, block, len);
+	pthread_mutex_unlock(&s->wlock);
+	free(block);
+
+	pthread_mutex_lock(&s->lock);
+	if (ret == -1)
+		h2_stream_finish(s, st, -1);
+	while (st->done == 0) {
+		clock_gettime(CLOCK_REALTIME, &wakeup);
+		++wakeup.tv_sec;
+		pthread_cond_timedwait(&s->cond, &s->lock, &wakeup);
+		if ((st->done == 0) && (bounds != NULL) &&
+				(__atomic_load_n(&bounds->state,
+				__ATOMIC_RELAXED) == CH_CANCELLED)) {
+			h2_stream_finish(s, st, -1);
+			cancelled = 1;
+		}
+	}
+	while (st->busy)
+		pthread_cond_wait(&s->cond, &s->lock);
+	for (item = &s->streams; *item != NULL; item = &(*item)->next) {
+		if (*item == st) {
+			*item = st->next;
+			break;
+		}
+	}
+	--s->active;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+
+	if (cancelled)
+		h2_rst_stream(s, st->id, H2_CANCEL);
+	if (bounds != NULL) {
+		bounds->status = st->status;
+		bounds->retryafter = linkh->retryafter;
+	}
+	ret = (st->done == 1) ? 0 : -1;
+	free(st);
+	if (linkh->ctype == NULL)
+		linkh->ctype = strdup(HTTP_CONTTYPE_DEF);
+
+	return (ret);
+}
+
+/**
+ * Checks (and remembers) if server of link speaks http/2.
+ * \return nonzero if link can be downloaded over http/2.
+ */
+int
+h2_available(const lnk *link)
+{
+	h2_session *s = h2_session_get(link);
+
+	if (s == NULL)
+		return (0);
+	h2_session_put(s);
+	return (1);
+}
+
+/**
+ * Function obtains header data of link over http/2 session (HEAD request)
+ * and saves it into allocated structure lnk_http_header pointed by linkhp.
+ * \return 0 on success, -1 on fail.
+ */
+int
+h2_link_header(lnk *link, lnk_http_header **linkhp)
+{
+	h2_session *s;
+	double start = trace_begin();
+	int ret;
+
+	if ((s = h2_session_get(link)) == NULL)
+		return (-1);
+	*linkhp = malloc(sizeof (lnk_http_header));
+	ret = h2_stream_run(s, link, NULL, *linkhp);
+	h2_session_put(s);
+	trace_end("link_header", start, link, -1, 0);
+
+	// redirect is followed by caller
+	if ((ret == 0) && ((*linkhp)->statcodegrp == REDIRECT) &&
+			((*linkhp)->location != NULL))
+		return (0);
+	if ((ret == 0) && (((*linkhp)->statcodegrp != SUCCESS) ||
+			((*linkhp)->clen == 0))) {
+		log_error(link, 0, "Response header of %s doesn't"
+				" contain length", link->rquri);
+		ret = -1;
+	}
+	if (ret == -1) {
+		link_header_free(*linkhp);
+		free(*linkhp);
+	}
+
+	return (ret);
+}
+
+/**
+ * Function obtains chunk data bounds over http/2 session and writes it into
+ * memory (or file) of bounds. The range is one stream of session shared by
+ * all chunks (and links) of the server.
+ * \return 0 on success, -1 on fail.
+ */
+int
+h2_link_write_chunk(chunk_bounds *bounds)
+{
+	lnk_http_header linkh;
+	h2_session *s;
+	double start = trace_begin();
+	int ret;
+
+	if ((s = h2_session_get(bounds->lnk)) == NULL)
+		return (-1);
+	ret = h2_stream_run(s, bounds->lnk, bounds, &linkh);
+	h2_session_put(s);
+	link_header_free(&linkh);
+	trace_end("h2_stream", start, bounds->lnk, http_chunk_filepos(bounds),
+			http_chunk_filepos(bounds) + bounds->memlen - 1);
+
+	return (ret);
+}
@@ -0,0 +1,15 @@
+#ifndef HTTP2_H
+#define	HTTP2_H
+
+#include "defaults.h"
+
+#define	H2_STREAM_WINDOW (16 * 1024 * 1024)	// min receive window of stream
+#define	H2_CONN_WINDOW 0x7FFFFFFF		// receive window of connection
+#define	H2_MAX_FRAME (256 * 1024)		// max frame size we accept
+#define	H2_MAX_STREAMS 100	// concurrent streams until server says
+
+int h2_available(const lnk *link);
+int h2_link_header(lnk *link, lnk_http_header **linkhp);
+int h2_link_write_chunk(chunk_bounds *bounds);
+
+#endif /* HTTP2_H */
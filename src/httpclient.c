@@ -10,20 +10,69 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/socket.h>
-#include <netdb.h>		// gethostbyname, h_errno
+#include <sys/time.h>		// struct timeval
+#include <netinet/in.h>
+#include <netinet/tcp.h>	// TCP_CONGESTION, TCP_FASTOPEN_CONNECT
+#include <netdb.h>		// getaddrinfo
 #include <arpa/inet.h>		// inet_pton
 #include <string.h>		// strlen, NULL
+#include <strings.h>		// strncasecmp
 #include <unistd.h>		// rite
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
 #include <assert.h>
 
 #include "httpclient.h"
 #include "linkparser.h"
+#include "retry.h"
+#include "tls.h"
+#include "trace.h"
+#include "log.h"
+#include "membudget.h"
+#include "hostprof.h"
 
 #define	HTTP_BUFF_SIZE 100
+#define	HTTP_WBUFF_SIZE 10000	// receive buffer of chunk written by pwrite
 
-static long long int MAX_MAP_SIZE = (long long int) 0x80000000;
+#ifndef TCP_FASTOPEN_CONNECT
+#define	TCP_FASTOPEN_CONNECT 30	// linux >= 4.11
+#endif
+
+#define	DNS_CACHE_TTL 60	// seconds resolved address is reused
+#define	POOL_IDLE_SEC 4		// idle connection is closed after
+
+/**
+ * Resolved address of hostname:port, shared by all connections of process.
+ */
+typedef struct dns_entry
+{
+	char *key;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	time_t expires;
+	struct dns_entry *next;
+} dns_entry;
+
+static dns_entry *dns_cache = NULL;
+static pthread_mutex_t dns_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Idle persistent connection to server key (protocol://hostname:port),
+ * shared by all links of process.
+ */
+typedef struct pool_entry
+{
+	char *key;
+	http_conn conn;
+	time_t expires;
+	struct pool_entry *next;
+} pool_entry;
+
+static pool_entry *conn_pool = NULL;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
 
-extern int h_errno;
 // extern int errno;
 
 
@@ -56,50 +105,79 @@ static const char *http_chunk =
 		CRLF CRLF;
 
 
+/**
+ * Acknowledges data received on connection at once (until kernel returns
+ * to delayed acknowledgements). Set once the request is sent: server may
+ * hold body back until header is acknowledged (Nagle), delayed
+ * acknowledgement would stall every response of persistent connection.
+ * Failure only costs the delay.
+ */
+static void
+http_quickack(http_conn *conn)
+{
+	int on = 1;
+
+	setsockopt(conn->fd, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof (on));
+}
+
 /**
  * Sends request for header information to socket about link specified in lnk.
  * \return 0 on success, -1 on fail.
  */
 int
-http_header_req(http_sockfd sockfd, lnk *link)
+http_header_req(http_conn *conn, lnk *link)
 {
 	char * hd_rq_str;
+	// terminating zero isn't sent, connection may carry the next request
 	size_t hd_len = _sprintf(2, &hd_rq_str, http_header, link->rquri,
-			link->hostname);
-	if (write(sockfd, (const void *) hd_rq_str, hd_len) == -1) {
-		fprintf(stdlog, log_ERROR
-		"header file couldn't be sent in link:%s", link->hostname);
+			link->hostname) - 1;
+	if (http_write(conn, (const void *) hd_rq_str, hd_len) == -1) {
+		log_error(link, 0, "header file couldn't be sent in link:%s",
+				link->hostname);
 		return (-1);
 	}
 	free(hd_rq_str);
+	http_quickack(conn);
 
 	return (0);
 }
 
 /**
  * Recieves header from http server, parses it and saves found information
- * into linh.
+ * into linh (redirect with location is left to caller). Other responses
+ * than 200 are logged as errors of link.
  * \return 0 on success, -1 on fail.
  */
 int
-http_header_res(http_sockfd sockfd, lnk_http_header *linkh)
+http_header_res(http_conn *conn, const lnk *link, lnk_http_header *linkh)
 {
-	headerbufs *hbufs = malloc(sizeof (headerbufs));
-	if (http_header_read(sockfd, hbufs) == -1)
-		return (-1);
-	if (link_header_parse(hbufs->hdata, linkh) != HTTP_STATUSCODE_OK)
+	headerbufs hbufs;
+	statcode status;
+
+	if (http_header_read(conn, &hbufs) == -1)
 		return (-1);
+	status = link_header_parse(hbufs.hdata, linkh);
 
-	free(hbufs->hdata);
-	free(hbufs->remain);
-	free(hbufs);
+	free(hbufs.hdata);
+	free(hbufs.remain);
 
-	return (0);
+	// redirect is followed by caller
+	if ((linkh->statcodegrp == REDIRECT) && (linkh->location != NULL))
+		return (0);
+	free(linkh->location);
+	linkh->location = NULL;
+	if (status == HTTP_STATUSCODE_OK)
+		return (0);
+	// unparsable header was reported by parser
+	if (status > 0)
+		log_error(link, 0, "%s%s responded with status code %d",
+				link->hostname, link->rquri, status);
+	return (-1);
 }
 
 /*
  * Function converts char* status code into http_statcode_grp enum.
- * \return	if code is NULL or unknown returns UNKNOWN
+ * \return	if code is NULL or unknown returns STAT_UNKNOWN
  * 		else returns value from http_statcode_grp enum.
  */
 http_statcode_grp
@@ -107,7 +185,7 @@ http_str2statuscode_grp(char *code)
 {
 	char nr;
 	if (code == NULL)
-		return (UNKNOWN);
+		return (STAT_UNKNOWN);
 	nr = code[0];
 	if (nr == '1')
 		return (INFORM);
@@ -119,64 +197,371 @@ http_str2statuscode_grp(char *code)
 		return (CLIENT_ERR);
 	if (nr == '5')
 		return (SERVER_ERR);
-	return (UNKNOWN);
+	return (STAT_UNKNOWN);
 }
 
 /**
- * Creates socket for http client.
- * \return http_sockfg (socket filedescriptor)
+ * Creates socket for http client and applies socket profile sprf on it
+ * (sprf may be NULL). Options which kernel refuses are reported and skipped.
+ * \return http_sockfg (socket filedescriptor), -1 on fail.
  */
 http_sockfd
-http_socket(void)
+http_socket(const sockprf *sprf)
 {
+	http_sockfd sockfd;
+	int on = 1;
+	struct timeval tv;
+
 #ifdef HTTP_IPV6_SOCKS
-	return (socket(AF_INET6, SOCK_STREAM, 0));
+	sockfd = socket(AF_INET6, SOCK_STREAM, 0);
 #else
-	return (socket(AF_INET, SOCK_STREAM, 0));
+	sockfd = socket(AF_INET, SOCK_STREAM, 0);
 #endif
+	if ((sockfd == -1) || (sprf == NULL))
+		return (sockfd);
+
+	// receive window has to be set before connect to get window scaling
+	if ((sprf->rcvbuf > 0) && (setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF,
+			&sprf->rcvbuf, sizeof (sprf->rcvbuf)) == -1))
+		log_error(NULL, errno, "setsockopt SO_RCVBUF");
+
+	if ((sprf->congestion != NULL) && (setsockopt(sockfd, IPPROTO_TCP,
+			TCP_CONGESTION, sprf->congestion,
+			strlen(sprf->congestion)) == -1))
+		log_error(NULL, errno, "congestion control %s not "
+				"available, using default", sprf->congestion);
+
+	if ((sprf->tfo) && (setsockopt(sockfd, IPPROTO_TCP,
+			TCP_FASTOPEN_CONNECT, &on, sizeof (on)) == -1))
+		log_error(NULL, errno, "setsockopt TCP_FASTOPEN_CONNECT");
+
+	if (sprf->readtimeout > 0) {
+		tv.tv_sec = sprf->readtimeout;
+		tv.tv_usec = 0;
+		if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv,
+				sizeof (tv)) == -1)
+			log_error(NULL, errno, "setsockopt SO_RCVTIMEO");
+	}
+
+	return (sockfd);
 }
 
 /**
- * Connects to socket to hostname specified in link.
- * \return 0 on success, -1 on fail.
+ * Connects socket to address addr, waits at most timeout seconds for
+ * the connection to be established (timeout <= 0 waits for ever).
+ * \return 0 on success, -1 on fail (errno is set).
  */
-int
-http_connect(http_sockfd *sockfd, const lnk *link)
+static int
+http_connect_timed(http_sockfd sockfd, const struct sockaddr *addr,
+		socklen_t addrlen, int timeout)
 {
-	*sockfd = http_socket();
+	int flags, err;
+	socklen_t errlen = sizeof (err);
+	struct pollfd pfd;
 
-	struct hostent *hp;
-	const char *hstr_err;
+	if (timeout <= 0)
+		return (connect(sockfd, addr, addrlen));
 
-	if ((hp = gethostbyname(link->hostname)) == NULL) {
-		hstr_err = hstrerror(h_errno);
-		fprintf(stdlog,
-		log_ERROR "Couldn't resolve host name in link: %s message:%s\n",
-		link->hostname, hstr_err);
+	if ((flags = fcntl(sockfd, F_GETFL)) == -1)
 		return (-1);
+	if (fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) == -1)
+		return (-1);
+
+	if (connect(sockfd, addr, addrlen) == -1) {
+		if (errno != EINPROGRESS)
+			return (-1);
+
+		pfd.fd = sockfd;
+		pfd.events = POLLOUT;
+		if ((err = poll(&pfd, 1, timeout * 1000)) <= 0) {
+			if (err == 0)
+				errno = ETIMEDOUT;
+			return (-1);
+		}
+		if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &err,
+				&errlen) == -1)
+			return (-1);
+		if (err != 0) {
+			errno = err;
+			return (-1);
+		}
 	}
 
+	return (fcntl(sockfd, F_SETFL, flags));
+}
+
+/**
+ * Resolves hostname and port of link into addr (cached for DNS_CACHE_TTL
+ * seconds, so that chunks and repeated jobs don't ask resolver again).
+ * \return 0 on success, -1 on fail.
+ */
+static int
+http_resolve(const lnk *link, struct sockaddr_storage *addr,
+		socklen_t *addrlen)
+{
+	struct addrinfo hints, *ai;
+	dns_entry *entry;
+	char sport[8];
+	char *key;
+	time_t now = time(NULL);
+	double start;
+	int err;
+
+	snprintf(sport, sizeof (sport), ":%d", link->port);
+	key = _strcat(link->hostname, sport);
+
+	pthread_mutex_lock(&dns_lock);
+	for (entry = dns_cache; entry != NULL; entry = entry->next) {
+		if ((strcmp(entry->key, key) == 0) && (entry->expires > now)) {
+			memcpy(addr, &entry->addr, entry->addrlen);
+			*addrlen = entry->addrlen;
+			pthread_mutex_unlock(&dns_lock);
+			free(key);
+			return (0);
+		}
+	}
+	pthread_mutex_unlock(&dns_lock);
+
+	start = trace_begin();
+	memset(&hints, 0, sizeof (hints));
 #ifdef HTTP_IPV6_SOCKS
-	struct sockaddr_in6 sin;
-	sin.sin6_family = AF_INET6;
-	sin.sin6_port = htons(HTTP_PORT);
-	sin.sin6_addr = *((struct in6_addr *)hp->h_addr_list[0]);
+	hints.ai_family = AF_INET6;
 #else
-	struct sockaddr_in sin;
-	sin.sin_family = AF_INET;
-	sin.sin_port = htons(HTTP_PORT);
-	sin.sin_addr = *((struct in_addr *) hp->h_addr_list[0]);
+	hints.ai_family = AF_INET;
 #endif
-	if (connect(*sockfd, (struct sockaddr *) &sin,
-					sizeof (sin)) == -1) {
-		fprintf(stdlog, log_ERROR "Could't connect to hostname: %s\n",
+	hints.ai_socktype = SOCK_STREAM;
+
+	err = getaddrinfo(link->hostname, sport + 1, &hints, &ai);
+	trace_end("resolve", start, link, -1, 0);
+	if (err != 0) {
+		log_error(link, 0, "Couldn't resolve host name in link: %s "
+				"message:%s", link->hostname,
+				gai_strerror(err));
+		free(key);
+		return (-1);
+	}
+	memcpy(addr, ai->ai_addr, ai->ai_addrlen);
+	*addrlen = ai->ai_addrlen;
+	freeaddrinfo(ai);
+
+	pthread_mutex_lock(&dns_lock);
+	for (entry = dns_cache; entry != NULL; entry = entry->next) {
+		if (strcmp(entry->key, key) == 0)
+			break;
+	}
+	if (entry == NULL) {
+		entry = malloc(sizeof (dns_entry));
+		entry->key = key;
+		entry->next = dns_cache;
+		dns_cache = entry;
+	} else {
+		free(key);
+	}
+	memcpy(&entry->addr, addr, *addrlen);
+	entry->addrlen = *addrlen;
+	entry->expires = now + DNS_CACHE_TTL;
+	pthread_mutex_unlock(&dns_lock);
+
+	return (0);
+}
+
+/**
+ * Connects to hostname and port specified in link (https links negotiate
+ * TLS on the connection and offer alpn protocols if it isn't NULL). Socket
+ * is created and connected due to link->sprf socket profile.
+ * \return 0 on success, -1 on fail.
+ */
+int
+http_connect(http_conn *conn, const lnk *link, const char *alpn)
+{
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	double start, tlsstart;
+
+	conn->fd = -1;
+	conn->tls = NULL;
+
+	if (http_resolve(link, &addr, &addrlen) == -1)
+		return (-1);
+	start = trace_begin();
+
+	if ((conn->fd = http_socket(link->sprf)) == -1) {
+		log_error(link, errno, "socket");
+		return (-1);
+	}
+
+	if (http_connect_timed(conn->fd, (struct sockaddr *) &addr, addrlen,
+			(link->sprf == NULL) ? 0 :
+			link->sprf->conntimeout) == -1) {
+		log_error(link, errno, "Couldn't connect to hostname: %s",
 				link->hostname);
+		close(conn->fd);
 		return (-1);
 	}
+	trace_end("connect", start, link, -1, 0);
+
+	if (link->prot == HTTPS) {
+		tlsstart = trace_begin();
+		conn->tls = tls_connect(conn->fd, link->hostname, link->port,
+				alpn);
+		trace_end("tls_handshake", tlsstart, link, -1, 0);
+		if (conn->tls == NULL) {
+			close(conn->fd);
+			return (-1);
+		}
+	}
 
 	return (0);
 }
 
+/**
+ * \return key of server of link in connection pool.
+ */
+static char *
+http_pool_key(const lnk *link)
+{
+	size_t len = strlen(link->hostname) + 32;
+	char *key = malloc(len);
+
+	snprintf(key, len, "%s%s:%d", (link->prot == HTTPS) ? PROTOCOL_HTTPS :
+			PROTOCOL_HTTP, link->hostname, link->port);
+	return (key);
+}
+
+/**
+ * \return nonzero if idle connection was closed by server (or sent
+ * something unexpected).
+ */
+static int
+http_pool_stale(const http_conn *conn)
+{
+	struct pollfd pfd;
+
+	pfd.fd = conn->fd;
+	pfd.events = POLLIN;
+	return (poll(&pfd, 1, 0) != 0);
+}
+
+/**
+ * Takes idle connection to server of link from pool, connects a new one if
+ * there is none (see http_connect).
+ * \return 1 if connection was reused, 0 if it is new, -1 on fail.
+ */
+int
+http_pool_take(http_conn *conn, const lnk *link)
+{
+	pool_entry **entryp, *entry;
+	char *key = http_pool_key(link);
+	time_t now = time(NULL);
+	int found = 0;
+
+	pthread_mutex_lock(&pool_lock);
+	entryp = &conn_pool;
+	while ((!found) && ((entry = *entryp) != NULL)) {
+		if ((entry->expires > now) && (strcmp(entry->key, key) != 0)) {
+			entryp = &entry->next;
+			continue;
+		}
+		*entryp = entry->next;
+		if ((entry->expires > now) &&
+				(!http_pool_stale(&entry->conn))) {
+			*conn = entry->conn;
+			found = 1;
+		} else {
+			http_close(&entry->conn);
+		}
+		free(entry->key);
+		free(entry);
+	}
+	pthread_mutex_unlock(&pool_lock);
+	free(key);
+
+	if (found)
+		return (1);
+	return (http_connect(conn, link, NULL));
+}
+
+/**
+ * Returns connection to server of link into pool if it is reusable (the
+ * whole response was read and server keeps it open) and server has fewer
+ * than link->sprf->keepalive idle connections, closes it otherwise.
+ */
+void
+http_pool_give(http_conn *conn, const lnk *link, int reusable)
+{
+	pool_entry *entry;
+	char *key;
+	int idle = 0;
+
+	if ((!reusable) || (link->sprf == NULL) ||
+			(link->sprf->keepalive <= 0)) {
+		http_close(conn);
+		return;
+	}
+
+	key = http_pool_key(link);
+	pthread_mutex_lock(&pool_lock);
+	for (entry = conn_pool; entry != NULL; entry = entry->next)
+		idle += (strcmp(entry->key, key) == 0);
+	if (idle < link->sprf->keepalive) {
+		entry = malloc(sizeof (pool_entry));
+		entry->key = key;
+		entry->conn = *conn;
+		entry->expires = time(NULL) + POOL_IDLE_SEC;
+		entry->next = conn_pool;
+		conn_pool = entry;
+		key = NULL;
+	}
+	pthread_mutex_unlock(&pool_lock);
+
+	// connection is in pool unless key is left
+	if (key != NULL) {
+		free(key);
+		http_close(conn);
+	}
+}
+
+/**
+ * \return smoothed round trip time of connection measured by kernel
+ * (seconds), -1 if it isn't known. Connection which carried bulk data
+ * counts its queueing delay too.
+ */
+double
+http_rtt(const http_conn *conn)
+{
+	struct tcp_info info;
+	socklen_t len = sizeof (info);
+
+	if ((getsockopt(conn->fd, IPPROTO_TCP, TCP_INFO, &info, &len) == -1) ||
+			(info.tcpi_rtt == 0))
+		return (-1);
+	return (info.tcpi_rtt / 1e6);
+}
+
+/**
+ * Reads data from http connection (decrypted if connection uses TLS).
+ * \return number of bytes read, 0 on end of connection, -1 on fail.
+ */
+ssize_t
+http_read(http_conn *conn, void *buf, size_t len)
+{
+	if (conn->tls != NULL)
+		return (tls_read(conn->tls, buf, len));
+	return (read(conn->fd, buf, len));
+}
+
+/**
+ * Writes data into http connection.
+ * \return number of bytes written, -1 on fail.
+ */
+ssize_t
+http_write(http_conn *conn, const void *buf, size_t len)
+{
+	if (conn->tls != NULL)
+		return (tls_write(conn->tls, buf, len));
+	return (send(conn->fd, buf, len, MSG_NOSIGNAL));
+}
+
 /**
  * Function obtains header data from http sever.
  * Function connects to hostname specified
@@ -188,51 +573,157 @@ http_connect(http_sockfd *sockfd, const lnk *link)
 int
 http_link_header(lnk *link, lnk_http_header **linkhp)
 {
-	http_sockfd sockfd;
-	if (http_connect(&sockfd, link) == -1)
-		return (-1);
-	*linkhp = malloc(sizeof (lnk_http_header));
+	http_conn conn;
+	double start = trace_begin();
+	int reused;
 
-	if ((http_header_req(sockfd, link)) == -1)
-		return (-1);
-	if ((http_header_res(sockfd, *linkhp)) == -1)
+	if ((reused = http_pool_take(&conn, link)) == -1)
 		return (-1);
+	*linkhp = calloc(1, sizeof (lnk_http_header));
+
+	while (((http_header_req(&conn, link)) == -1) ||
+			((http_header_res(&conn, link, *linkhp)) == -1)) {
+		http_close(&conn);
+		link_header_free(*linkhp);
+		// server may have closed idle connection before responding
+		if ((!reused) || ((*linkhp)->statcodegrp != STAT_UNKNOWN) ||
+				(http_connect(&conn, link, NULL) == -1)) {
+			free(*linkhp);
+			return (-1);
+		}
+		reused = 0;
+	}
 
-	return (http_close(sockfd));
+	hostprof_note(link, HOSTPROF_KEEPALIVE, (*linkhp)->keepalive);
+	hostprof_rtt(link, http_rtt(&conn));
+	http_pool_give(&conn, link, (*linkhp)->keepalive);
+	trace_end("link_header", start, link, -1, 0);
+	return (0);
 }
 
 /**
- * Sends request for range data to socket specified in bounds structure.
+ * Sends request for range first - last of link.
  * \return 0 on success, -1 on fail.
  */
 int
-http_chunk_req(http_sockfd sockfd, chunk_bounds* bounds)
+http_range_req(http_conn *conn, const lnk *link, long long int first,
+		long long int last)
 {
-	char *ch_rq_str;
-	char *sstartpos;
-	char *sendpos;
+	char *rq_str;
+	char sstartpos[RANGE_BYTES_MAX_LEN];
+	char sendpos[RANGE_BYTES_MAX_LEN];
+	size_t rq_len;
+	int ret = 0;
+
+	snprintf(sstartpos, sizeof (sstartpos), "%lli", first);
+	snprintf(sendpos, sizeof (sendpos), "%lli", last);
+	rq_len = _sprintf(4, &rq_str, http_chunk, link->rquri, link->hostname,
+			sstartpos, sendpos) - 1;
+	if (http_write(conn, (const void *) rq_str, rq_len) == -1) {
+		log_range(LOG_ERROR, link, first, last, 0, "range request "
+				"couldn't be sent in link:%s", link->hostname);
+		ret = -1;
+	} else {
+		http_quickack(conn);
+	}
+	free(rq_str);
 
-	sstartpos = malloc(RANGE_BYTES_MAX_LEN);
-	sendpos = malloc(RANGE_BYTES_MAX_LEN);
+	return (ret);
+}
 
-	snprintf(sstartpos, RANGE_BYTES_MAX_LEN, "%li", bounds->startpos);
-	snprintf(sendpos, RANGE_BYTES_MAX_LEN, "%li", bounds->endpos);
+/**
+ * Sends header requests of num links (of one server) at once and reads
+ * their responses in order into linkhs. Redirects aren't followed.
+ * \return number of responses read (the rest of links has to be asked
+ * again), -1 if requests couldn't be sent.
+ */
+int
+http_link_headers(http_conn *conn, lnk *links, int num,
+		lnk_http_header *linkhs)
+{
+	char *rq_str, *rqs = NULL, *buff, *end;
+	size_t rq_len, rqs_len = 0, size = 0, bufsize = HTTP_BUFF_SIZE * 10;
+	ssize_t sz;
+	int idx, done = 0;
+
+	for (idx = 0; idx != num; ++idx) {
+		rq_len = _sprintf(2, &rq_str, http_header, links[idx].rquri,
+				links[idx].hostname) - 1;
+		rqs = realloc(rqs, rqs_len + rq_len);
+		memcpy(rqs + rqs_len, rq_str, rq_len);
+		rqs_len += rq_len;
+		free(rq_str);
+	}
+	if (http_write(conn, rqs, rqs_len) != (ssize_t) rqs_len) {
+		free(rqs);
+		return (-1);
+	}
+	free(rqs);
+	http_quickack(conn);
+
+	// responses to HEAD have no body, they follow one another
+	buff = malloc(bufsize);
+	while (done != num) {
+		buff[size] = '\0';
+		if ((end = strstr(buff, CRLF CRLF)) != NULL) {
+			*end = '\0';
+			link_header_parse(buff, &linkhs[done++]);
+			size -= end + 4 - buff;
+			memmove(buff, end + 4, size);
+			continue;
+		}
+		if (size + HTTP_BUFF_SIZE >= bufsize)
+			buff = realloc(buff, bufsize *= 2);
+		if ((sz = http_read(conn, buff + size, HTTP_BUFF_SIZE)) <= 0)
+			break;
+		size += sz;
+	}
+	free(buff);
+
+	// connection is reusable only if nothing is left unread
+	for (idx = 0; idx != done; ++idx)
+		linkhs[idx].keepalive = linkhs[idx].keepalive && (size == 0);
+	return (done);
+}
 
-	size_t hd_len = _sprintf(4, &ch_rq_str, http_chunk, bounds->lnk->rquri,
-			bounds->lnk->hostname, sstartpos, sendpos);
-	if (write(sockfd, (const void *) ch_rq_str, hd_len) == -1) {
-		fprintf(stdlog, log_ERROR
-				"chunk request couldn't be sent in link:%s",
+/**
+ * Sends request for range data to socket specified in bounds structure.
+ * \return 0 on success, -1 on fail.
+ */
+int
+http_chunk_req(http_conn *conn, chunk_bounds* bounds)
+{
+	char *ch_rq_str;
+	char sstartpos[RANGE_BYTES_MAX_LEN];
+	char sendpos[RANGE_BYTES_MAX_LEN];
+	size_t hd_len;
+	double start = trace_begin();
+
+	snprintf(sstartpos, sizeof (sstartpos), "%lli", bounds->startpos);
+	snprintf(sendpos, sizeof (sendpos), "%lli", bounds->endpos);
+
+	hd_len = _sprintf(4, &ch_rq_str, http_chunk, bounds->lnk->rquri,
+			bounds->lnk->hostname, sstartpos, sendpos) - 1;
+	if (http_write(conn, (const void *) ch_rq_str, hd_len) == -1) {
+		log_range(LOG_ERROR, bounds->lnk, http_chunk_filepos(bounds),
+				http_chunk_filepos(bounds) + bounds->memlen - 1,
+				0, "chunk request couldn't be sent in link:%s",
 				bounds->lnk->hostname);
+		free(ch_rq_str);
 		return (-1);
 	}
+	free(ch_rq_str);
+	http_quickack(conn);
+	trace_end("chunk_req", start, bounds->lnk, http_chunk_filepos(bounds),
+			http_chunk_filepos(bounds) + bounds->memlen - 1);
 	return (0);
 }
 
 /**
  * Parses http header contained in buffer (ended with '\\0' character).
  * Function fills linkh with specified information and returns
- * status code contained in header.
+ * status code contained in header. Content type and location of linkh are
+ * allocated (also on fail) and released by link_header_free.
  * \return	On fail returns -1 (if header doesn't contain status code
  *		(if header is invalid))
  */
@@ -242,13 +733,19 @@ link_header_parse(char *buff, lnk_http_header* linkh)
 	char *tok, *hd, *hd_protocol, *hd_statuscode; //  *hd_reason_phase;
 	char *occur;
 	char *slholder, *hdholder;
+	statcode status;
+	int hasctype = 0;
 
 	size_t head_len_conl = strlen(HTTP_HEAD_CONTLEN);
 	size_t head_len_cont = strlen(HTTP_HEAD_CONTTYPE);
 
 	linkh->clen = 0;
-	linkh->ctype = HTTP_CONTTYPE_DEF;
-	linkh->statcodegrp = UNKNOWN;
+	linkh->ctype = NULL;
+	linkh->statcodegrp = STAT_UNKNOWN;
+	linkh->retryafter = -1;
+	linkh->location = NULL;
+	linkh->total = -1;
+	linkh->keepalive = 0;
 
 	tok = _strtok(&hdholder, buff, CRLF);
 
@@ -258,37 +755,94 @@ link_header_parse(char *buff, lnk_http_header* linkh)
 	// d_reason_phase = strdup(slholder);// strtok(&slholder, NULL, WS);
 
 	if (hd_statuscode == NULL) {
-		fprintf(stdlog, log_ERROR "Couldn't read link response"
+		log_error(NULL, 0, "Couldn't read link response"
 				" status line (in parsing)");
+		free(hd);
 		return (-1);
 	}
 
 	linkh->statcodegrp = http_str2statuscode_grp(hd_statuscode);
+	status = atoi(hd_statuscode);
+	// HTTP/1.1 connections are persistent unless server closes them
+	linkh->keepalive = (strcmp(hd_protocol, HTTP_VERSION) == 0);
+	free(hd);
 
 	while ((tok = _strtok(&hdholder, NULL, CRLF)) != NULL) {
 		if ((occur = strstr(tok, HTTP_HEAD_CONTLEN)) != NULL) {
+			errno = 0;
 			linkh->clen = STRTOOFF_T(occur+head_len_conl, NULL, 10);
 			if (errno == ERANGE) {
-				fprintf(stdlog, log_ERROR
-						"Unrecognized content "
+				log_error(NULL, 0, "Unrecognized content "
 						"length (value out of range)");
 				return (-1);
 			}
 			continue;
 		}
 		if ((occur = strstr(tok, HTTP_HEAD_CONTTYPE)) != NULL) {
-			linkh->ctype = _trim(strdup(occur+head_len_cont));
+			// repeated content type is ignored
+			if (!hasctype)
+				linkh->ctype = _trim(strdup(occur +
+						head_len_cont));
+			hasctype = 1;
+			continue;
+		}
+		if (strncasecmp(tok, HTTP_HEAD_CONTRANGE,
+				strlen(HTTP_HEAD_CONTRANGE)) == 0) {
+			// bytes first-last/total
+			if (((occur = strchr(tok, '/')) != NULL) &&
+					(occur[1] != '*'))
+				linkh->total = strtoll(occur + 1, NULL, 10);
+			continue;
 		}
+		if (strncasecmp(tok, HTTP_HEAD_CONNECTION,
+				strlen(HTTP_HEAD_CONNECTION)) == 0) {
+			occur = tok + strlen(HTTP_HEAD_CONNECTION);
+			occur += strspn(occur, WS);
+			if (strncasecmp(occur, "close", 5) == 0)
+				linkh->keepalive = 0;
+			else if (strncasecmp(occur, "keep-alive", 10) == 0)
+				linkh->keepalive = 1;
+			continue;
+		}
+		if ((occur = strstr(tok, HTTP_HEAD_RETRYAFTER)) != NULL) {
+			linkh->retryafter = retry_after_parse(occur +
+					strlen(HTTP_HEAD_RETRYAFTER));
+			continue;
+		}
+		// Content-Location doesn't redirect
+		if ((linkh->statcodegrp == REDIRECT) &&
+				(linkh->location == NULL) &&
+				(strncasecmp(tok, HTTP_HEAD_LOCATION,
+				strlen(HTTP_HEAD_LOCATION)) == 0))
+			linkh->location = _trim(strdup(tok +
+					strlen(HTTP_HEAD_LOCATION)));
 	}
 
-	if ((linkh->clen == 0) || (linkh->ctype == '\0')) {
-		fprintf(stdlog, log_ERROR "Response header doesn't"
+	if (linkh->ctype == NULL)
+		linkh->ctype = strdup(HTTP_CONTTYPE_DEF);
+
+	// only successful responses have to carry the entity
+	if ((linkh->statcodegrp == SUCCESS) &&
+			((linkh->clen == 0) || (linkh->ctype == NULL))) {
+		log_error(NULL, 0, "Response header doesn't"
 				" contain length or content type");
 		return (-1);
 	}
 
-	return (atoi(hd_statuscode));
-	//  return (0);
+	return (status);
+}
+
+/**
+ * Releases content type and location of header filled by link_header_parse
+ * (linkh itself is left to the caller).
+ */
+void
+link_header_free(lnk_http_header *linkh)
+{
+	free(linkh->ctype);
+	free(linkh->location);
+	linkh->ctype = NULL;
+	linkh->location = NULL;
 }
 
 /**
@@ -304,7 +858,7 @@ link_header_parse(char *buff, lnk_http_header* linkh)
  * \return 0 on success, -1 on fail.
  */
 int
-http_header_read(http_sockfd sockfd, headerbufs *hbufs)
+http_header_read(http_conn *conn, headerbufs *hbufs)
 {
 //	hbufs->
 	size_t size = 1;
@@ -316,13 +870,13 @@ http_header_read(http_sockfd sockfd, headerbufs *hbufs)
 	char http_buf[HTTP_BUFF_SIZE];
 	ssize_t sz;
 
-	while ((sz = read(sockfd, http_buf, HTTP_BUFF_SIZE)) > 0) {
+	while ((sz = http_read(conn, http_buf, HTTP_BUFF_SIZE)) > 0) {
 		osize = size;
 		size += sz;
 		while (size > curr_buf_size) {
 			curr_buf_size *= 2;
 			if ((buff = realloc(buff, curr_buf_size)) == NULL) {
-				fprintf(stdlog, log_ERROR "http buffer "
+				log_error(NULL, 0, "http buffer "
 						"couldn't be reallocated");
 				return (-1);
 			}
@@ -334,7 +888,8 @@ http_header_read(http_sockfd sockfd, headerbufs *hbufs)
 	}
 
 	if (rpos == NULL) {
-		fprintf(stdlog, log_ERROR "Header couldn't be read!");
+		log_error(NULL, 0, "Header couldn't be read!");
+		free(buff);
 		return (-1);
 	}
 
@@ -355,124 +910,211 @@ http_header_read(http_sockfd sockfd, headerbufs *hbufs)
 	return (0);
 }
 
+/**
+ * Publishes socket of running chunk attempt, so that chunk manager can
+ * cancel it (by shutdown of the socket).
+ * \return 0 on success, -1 if the attempt was already cancelled.
+ */
+static int
+http_chunk_attach(chunk_bounds *bounds, http_sockfd sockfd)
+{
+	int ret = 0;
+
+	if (bounds->ctl == NULL) {
+		bounds->sockfd = sockfd;
+		return (0);
+	}
+
+	pthread_mutex_lock(&bounds->ctl->lock);
+	if (bounds->state == CH_CANCELLED)
+		ret = -1;
+	else
+		bounds->sockfd = sockfd;
+	pthread_mutex_unlock(&bounds->ctl->lock);
+
+	return (ret);
+}
+
+/**
+ * Withdraws socket published by http_chunk_attach before it is closed.
+ */
+static void
+http_chunk_detach(chunk_bounds *bounds)
+{
+	if (bounds->ctl != NULL)
+		pthread_mutex_lock(&bounds->ctl->lock);
+	bounds->sockfd = -1;
+	if (bounds->ctl != NULL)
+		pthread_mutex_unlock(&bounds->ctl->lock);
+}
+
+/**
+ * \return nonzero if chunk attempt was cancelled by chunk manager.
+ */
+static int
+http_chunk_cancelled(chunk_bounds *bounds)
+{
+	return (__atomic_load_n(&bounds->state, __ATOMIC_RELAXED) ==
+			CH_CANCELLED);
+}
+
+/**
+ * \return position in file where data of chunk are written when its memory
+ * couldn't be mapped.
+ */
+long long int
+http_chunk_filepos(const chunk_bounds *bounds)
+{
+	return (bounds->startpos);
+}
+
 /**
  * Recieves data of range specified in bounds and writes it into memory buffer.
  * Data were requested by
- * function http_chunk_req(http_sockfd sockfd, chunk_bounds* bounds).
+ * function http_chunk_req(http_conn *conn, chunk_bounds* bounds).
  * \return 0 on success, -1 on fail.
  */
 int
-http_chunk_res(http_sockfd sockfd, char *memory, size_t memlen,
+http_chunk_res(http_conn *conn, char *memory, size_t memlen,
 		chunk_bounds* bounds) // ODO bounds pomocna
 {
-	headerbufs *hbufs = malloc(sizeof (headerbufs));
-	lnk_http_header* linkh = malloc(sizeof (lnk_http_header));
+	headerbufs hbufs;
+	lnk_http_header linkh;
 	statcode scode;
 	size_t toread;
-	size_t readed;
-	file_fd chfd;
+	ssize_t readed;
+	long long int fpos;
 	long long int readsz = 0;
 	char *wbuffer;
-	int wbuffersize = 10000;
+	int wbuffersize = HTTP_WBUFF_SIZE;
+	long long int first = http_chunk_filepos(bounds);
+	double start = trace_begin();
+	int ret = -1;
 
-	if (http_header_read(sockfd, hbufs) == -1)
+	if (http_header_read(conn, &hbufs) == -1)
 		return (-1);
-	if ((scode = link_header_parse(hbufs->hdata, linkh))
-			!= HTTP_STATUSCODE_PARTIAL) {
-		fprintf(stdlog, log_ERROR
+	trace_end("header_read", start, bounds->lnk, first, first + memlen - 1);
+	start = trace_begin();
+	scode = link_header_parse(hbufs.hdata, &linkh);
+	free(hbufs.hdata);
+	bounds->status = scode;
+	bounds->retryafter = linkh.retryafter;
+	bounds->keepalive = linkh.keepalive;
+	// server without ranges sends the whole file, which is fine for the
+	// only chunk of file
+	if ((scode == HTTP_STATUSCODE_PARTIAL) ||
+			(scode == HTTP_STATUSCODE_OK))
+		hostprof_note(bounds->lnk, HOSTPROF_RANGES,
+				scode == HTTP_STATUSCODE_PARTIAL);
+	if ((scode == HTTP_STATUSCODE_OK) && (first == 0) &&
+			(bounds->lnk_header != NULL) &&
+			(bounds->lnk_header->clen == (off_t) memlen))
+		scode = HTTP_STATUSCODE_PARTIAL;
+	if (scode != HTTP_STATUSCODE_PARTIAL) {
+		log_range(LOG_ERROR, bounds->lnk, first, first + memlen - 1, 0,
 				"Response message not PARTIAL CONTENT:"
 				" status code:%i", scode);
-		return (-1);
+		goto out;
 	}
 
-	if (linkh->clen != memlen) {
-		fprintf(stdlog,
-				log_ERROR "Range in response douesn't"
-				" despond to range in request\n");
-		return (-1);
+	if (linkh.clen != memlen) {
+		log_range(LOG_ERROR, bounds->lnk, first, first + memlen - 1, 0,
+				"Range in response doesn't"
+				" correspond to range in request");
+		goto out;
 	}
 
-	toread = memlen - hbufs->rlen;
-	readsz = hbufs->rlen;
+	toread = memlen - hbufs.rlen;
+	readsz = hbufs.rlen;
 
-	// memory couldn't be mapped, write directly into file
+	// memory couldn't be mapped, write directly into file (pwrite keeps
+	// chunks sharing file descriptor independent)
 	if (memory == NULL) {
-		if ((chfd = dup(bounds->fd)) == -1) {
-			fprintf(stdlog, log_ERROR
-					"Cannot duplicate fd for chunk %s,"
-					"Aborting", bounds->lnk->rquri);
-			return (-1);
-		}
-
-		if (lseek(chfd, ((long long int)bounds->mpidx) * MAX_MAP_SIZE +
-				bounds->startpos, SEEK_SET) == -1) {
-			fprintf(stdlog, log_ERROR
-					"Cannot lseek file for chunk %s,"
-					"Aborting", bounds->lnk->rquri);
-			return (-1);
-		}
-		// TODO
-		if (write(chfd, hbufs->remain, hbufs->rlen) != hbufs->rlen) {
-			fprintf(stdlog, log_ERROR
+		fpos = http_chunk_filepos(bounds);
+		if (pwrite(bounds->fd, hbufs.remain, hbufs.rlen, fpos) !=
+				hbufs.rlen) {
+			log_range(LOG_ERROR, bounds->lnk, first,
+					first + memlen - 1, errno,
 					"Cannot write whole buffer into file"
 					" for chunk %s, Aborting",
 					bounds->lnk->rquri);
-			return (-1);
+			goto out;
 		}
+		__atomic_store_n(&bounds->received, readsz, __ATOMIC_RELAXED);
 
 		wbuffer = malloc(wbuffersize);
+		membudget_charge(HTTP_WBUFF_SIZE);
 
 		if (wbuffersize > toread) {
 			wbuffersize = toread;
 		}
 
 		while ((toread > 0) && ((readed =
-				read(sockfd, wbuffer, wbuffersize)) > 0)) {
+				http_read(conn, wbuffer, wbuffersize)) > 0)) {
+			if (pwrite(bounds->fd, wbuffer, readed, fpos +
+					readsz) != readed)
+				break;
 			readsz += readed;
-			memory += readed;
 			toread -= readed;
-
-			write(chfd, wbuffer, wbuffersize);
+			__atomic_store_n(&bounds->received, readsz,
+					__ATOMIC_RELAXED);
 
 			if (wbuffersize > toread) {
 				wbuffersize = toread;
 			}
 		}
 
-		free(hbufs->hdata);
-		free(hbufs->remain);
-		free(hbufs);
-
-		close(chfd);
 		free(wbuffer);
-		return (0);
+		membudget_release(HTTP_WBUFF_SIZE);
+		if ((toread > 0) && (http_chunk_cancelled(bounds)))
+			goto out;
+		if (toread > 0) {
+			log_range(LOG_ERROR, bounds->lnk, first,
+					first + memlen - 1,
+					(readed == 0) ? 0 : errno,
+					"Cannot write whole chunk into file "
+					"for chunk %s, Aborting",
+					bounds->lnk->rquri);
+			goto out;
+		}
+
+		trace_end("body_receive", start, bounds->lnk, first,
+				first + memlen - 1);
+		ret = 0;
+		goto out;
 	}
 
-	// copy data into mapped memory
-	memcpy(memory, hbufs->remain, hbufs->rlen);
+	// copy data into mapped memory (received bytes are published after
+	// they are written, streamed output reads them meanwhile)
+	memcpy(memory, hbufs.remain, hbufs.rlen);
+	__atomic_store_n(&bounds->received, readsz, __ATOMIC_RELEASE);
 
-	memory += hbufs->rlen;
-	while ((toread > 0) && ((readed = read(sockfd, memory, toread)) > 0)) {
+	memory += hbufs.rlen;
+	while ((toread > 0) &&
+			((readed = http_read(conn, memory, toread)) > 0)) {
 		readsz += readed;
 		memory += readed;
 		toread -= readed;
+		__atomic_store_n(&bounds->received, readsz, __ATOMIC_RELEASE);
 	}
 
+	if ((toread > 0) && (http_chunk_cancelled(bounds)))
+		goto out;
 	if (toread > 0) {
-		perror("read");
-		fprintf(stdlog,
-				log_ERROR
+		log_range(LOG_ERROR, bounds->lnk, first, first + memlen - 1,
+				(readed == 0) ? 0 : errno,
 				"Cannot write whole buffer into mapped memory "
-				"for chunk %s,"
-				"Aborting", bounds->lnk->rquri);
-		return (-1);
+				"for chunk %s, Aborting", bounds->lnk->rquri);
+		goto out;
 	}
 
-	free(hbufs->hdata);
-	free(hbufs->remain);
-	free(hbufs);
+	trace_end("body_receive", start, bounds->lnk, first, first + memlen - 1);
+	ret = 0;
 
-	return (0);
+out:
+	link_header_free(&linkh);
+	free(hbufs.remain);
+	return (ret);
 }
 
 /**
@@ -486,30 +1128,50 @@ http_chunk_res(http_sockfd sockfd, char *memory, size_t memlen,
 int
 http_link_write_chunk(chunk_bounds* bounds)
 {
-	http_sockfd sockfd;
-	if (http_connect(&sockfd, bounds->lnk) == -1)
-		return (-1);
-	if (http_chunk_req(sockfd, bounds) == -1)
-		return (-1);
-	if ((http_chunk_res(sockfd, bounds->memory,
-			bounds->memlen, bounds)) == -1)
+	http_conn conn;
+	int reused, ret = -1;
+
+	if ((reused = http_pool_take(&conn, bounds->lnk)) == -1)
 		return (-1);
+	for (;;) {
+		bounds->keepalive = 0;
+		if (http_chunk_attach(bounds, conn.fd) == -1) {
+			http_close(&conn);
+			return (-1);
+		}
+		if ((http_chunk_req(&conn, bounds) != -1) &&
+				(http_chunk_res(&conn, bounds->memory,
+				bounds->memlen, bounds) != -1))
+			ret = 0;
+		http_chunk_detach(bounds);
+
+		// server may have closed idle connection before responding
+		if ((ret == 0) || (!reused) || (bounds->status != 0) ||
+				(http_chunk_cancelled(bounds)))
+			break;
+		http_close(&conn);
+		if (http_connect(&conn, bounds->lnk, NULL) == -1)
+			return (-1);
+		reused = 0;
+	}
+
+	http_pool_give(&conn, bounds->lnk, (ret == 0) && (bounds->keepalive));
 
-	return (http_close(sockfd));
+	return (ret);
 }
 
 /**
- * Closes http socket.
+ * Closes http connection (and its TLS layer).
  * \return 0 on success, -1 on fail.
  */
 int
-http_close(http_sockfd sockfd)
+http_close(http_conn *conn)
 {
-	char *strerr;
-	if (close(sockfd) != 0) {
-		strerr = strerror(errno);
-		fprintf(stdlog, strerr);
-		free(strerr);
+	if (conn->tls != NULL)
+		tls_close(conn->tls);
+	conn->tls = NULL;
+	if (close(conn->fd) != 0) {
+		log_error(NULL, errno, "close");
 		return (-1);
 	}
 	return (0);
@@ -1,23 +1,36 @@
 #ifndef HTTPCLIENT_H
 #define	HTTPCLIENT_H
+#include <sys/types.h>
 #include "defaults.h"
 
-http_sockfd http_socket(void);
+http_sockfd http_socket(const sockprf *sprf);
 
-int http_connect(http_sockfd *sockfd, const lnk *link);
-int http_close(http_sockfd sockfd);
+int http_connect(http_conn *conn, const lnk *link, const char *alpn);
+int http_close(http_conn *conn);
+int http_pool_take(http_conn *conn, const lnk *link);
+void http_pool_give(http_conn *conn, const lnk *link, int reusable);
+double http_rtt(const http_conn *conn);
+ssize_t http_read(http_conn *conn, void *buf, size_t len);
+ssize_t http_write(http_conn *conn, const void *buf, size_t len);
 
 statcode link_header_parse(char *buff, lnk_http_header* linkh);
-int http_header_req(http_sockfd sockfd, lnk *link);
-int http_header_res(http_sockfd sockfd, lnk_http_header *linkh);
-int http_header_read(http_sockfd sockfd, headerbufs *hbufs);
+void link_header_free(lnk_http_header *linkh);
+int http_header_req(http_conn *conn, lnk *link);
+int http_header_res(http_conn *conn, const lnk *link,
+		lnk_http_header *linkh);
+int http_header_read(http_conn *conn, headerbufs *hbufs);
 
 int http_link_header(lnk *link, lnk_http_header **linkhp);
+int http_link_headers(http_conn *conn, lnk *links, int num,
+		lnk_http_header *linkhs);
+int http_range_req(http_conn *conn, const lnk *link, long long int first,
+		long long int last);
 
-int http_chunk_req(http_sockfd sockfd, chunk_bounds* bounds);
-int http_chunk_res(http_sockfd sockfd, char *memory, size_t memlen,
+int http_chunk_req(http_conn *conn, chunk_bounds* bounds);
+int http_chunk_res(http_conn *conn, char *memory, size_t memlen,
 		chunk_bounds* bounds);
 int http_link_write_chunk(chunk_bounds* bounds);
+long long int http_chunk_filepos(const chunk_bounds *bounds);
 
 http_statcode_grp http_str2statuscode_grp(char *code);
 
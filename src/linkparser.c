@@ -9,9 +9,12 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>	// ERANGE
+#include <limits.h>	// LLONG_MAX
 #include <ctype.h>	// isspace
+#include <strings.h>	// strncasecmp
 #include <stdarg.h>	// _sprintf
 #include "linkparser.h"
+#include "log.h"
 
 /**
  * Strips whitespaces from the beginning and end of a string.
@@ -78,18 +81,55 @@ _sprintf(int num, char **filledstr, const char *format, ...)
 
 	va_start(ap, format);
 	if (vsprintf((*filledstr), format, ap) != argln) {
-		fprintf(stdlog, log_ERROR
-				"sprintf bad length"
-				" in %s:%d\n", __FILE__, __LINE__);
+		log_error(NULL, 0, "sprintf bad length in %s:%d",
+				__FILE__, __LINE__);
 		// return (-1);
 	}
 	va_end(ap);
 
-	(filledstr)[argln] = '\0';
+	(*filledstr)[argln] = '\0';
 
 	return (argln + 1);
 }
 
+/**
+ * Converts string with optional binary suffix (k, M, G) into number of bytes
+ * (e.g. "64k" is 65536) and saves it into size.
+ * \return 0 on success, -1 if str is not a valid size (or it overflows).
+ */
+int
+_strtosize(const char *str, long long int *size)
+{
+	char *end;
+	long long int num;
+	int shift = 0;
+
+	errno = 0;
+	num = strtoll(str, &end, 10);
+	if ((errno == ERANGE) || (end == str) || (num < 0))
+		return (-1);
+
+	switch (*end) {
+	case 'g': case 'G':
+		shift += 10;
+		/* FALLTHROUGH */
+	case 'm': case 'M':
+		shift += 10;
+		/* FALLTHROUGH */
+	case 'k': case 'K':
+		shift += 10;
+		++end;
+		break;
+	default:
+		break;
+	}
+	if ((*end != '\0') || (num > (LLONG_MAX >> shift)))
+		return (-1);
+
+	*size = num << shift;
+	return (0);
+}
+
 /**
  * Converts string in str to protocols type contained in prots.
  */
@@ -101,6 +141,11 @@ strtoprot(char *str, protocols* prots)
 		return;
 	}
 
+	if (strcmp(str, PROTOCOL_HTTPS) == 0) {
+		*prots = HTTPS;
+		return;
+	}
+
 	if (strcmp(str, PROTOCOL_FTP) == 0) {
 		*prots = FTP;
 		return;
@@ -139,7 +184,30 @@ _strndup(char *str, size_t num)
 }
 
 /**
- * Parses http link and saves parsed info into lnk structure.
+ * Converts decimal port of len characters at str.
+ * \return port, -1 if it isn't a number in 1 - 65535.
+ */
+static int
+link_port(const char *str, size_t len)
+{
+	char digits[8];
+	char *end;
+	long int port;
+
+	if ((len == 0) || (len >= sizeof (digits)))
+		return (-1);
+	memcpy(digits, str, len);
+	digits[len] = '\0';
+	errno = 0;
+	port = strtol(digits, &end, 10);
+	if ((errno != 0) || (*end != '\0') || (port < 1) || (port > 65535))
+		return (-1);
+	return ((int) port);
+}
+
+/**
+ * Parses http (or https) link and saves parsed info into lnk structure.
+ * Port is set to default port of protocol if link doesn't contain it.
  * \return 0 on success, else -1 (if linkstr is not valid http link)
  */
 int
@@ -149,20 +217,25 @@ link_parse(char *linkstr, lnk *link)
 	regex_t re;
 	char *protocol;
 	size_t rquriln;
-	int matchsize = 8;
+	int matchsize = 10;
 	regmatch_t match[matchsize];
 
 	if (regcomp(&re, LINK_REGEXP, REG_EXTENDED) != 0) {
 		// error
-		fprintf(stdlog, "NOT COMPILED\n");
+		log_error(NULL, 0, "link expression not compiled");
 		return (-1);
 	}
-	status = regexec(&re, linkstr, (size_t) 8, match, 0);
+	status = regexec(&re, linkstr, (size_t) matchsize, match, 0);
 	regfree(&re);
 	if (status != 0) {
 		// error
-		fprintf(stdlog, log_ERROR "%s not valid http link!!!\n",
-				linkstr);
+		log_error(NULL, 0, "%s not valid http link!!!", linkstr);
+		return (-1);
+	}
+	if ((match[4].rm_so != -1) && (link_port(linkstr + match[4].rm_so,
+			(size_t) (match[4].rm_eo - match[4].rm_so)) == -1)) {
+		log_error(NULL, 0, "%s not valid http link (port out of "
+				"range)", linkstr);
 		return (-1);
 	}
 
@@ -170,16 +243,21 @@ link_parse(char *linkstr, lnk *link)
 			(size_t) (match[1].rm_eo - match[1].rm_so));
 	strtoprot(protocol, &link->prot);
 
-	rquriln = (size_t) (match[3].rm_eo - match[3].rm_so);
+	rquriln = (size_t) (match[5].rm_eo - match[5].rm_so);
 
 	link->hostname = _strndup(linkstr + match[2].rm_so,
 			(size_t) (match[2].rm_eo - match[2].rm_so));
+	if (match[4].rm_so != -1)
+		link->port = link_port(linkstr + match[4].rm_so,
+				(size_t) (match[4].rm_eo - match[4].rm_so));
+	else
+		link->port = (link->prot == HTTPS) ? HTTPS_PORT : HTTP_PORT;
 	if (rquriln == 0)
-	link->rquri = URI_BASENAME;
+	link->rquri = strdup(URI_BASENAME);
 	else
-	link->rquri = _strndup(linkstr + match[3].rm_so, rquriln);
-	link->filename = _strndup(linkstr + match[6].rm_so,
-			(size_t) (match[6].rm_eo - match[6].rm_so));
+	link->rquri = _strndup(linkstr + match[5].rm_so, rquriln);
+	link->filename = _strndup(linkstr + match[8].rm_so,
+			(size_t) (match[8].rm_eo - match[8].rm_so));
 
 	free(protocol);
 
@@ -198,7 +276,7 @@ match(const char *string, char *pattern)
 
 	if (regcomp(&re, pattern, REG_EXTENDED|REG_NOSUB) != 0) {
 		// error
-		fprintf(stderr, "NOT COMPILED\n");
+		log_error(NULL, 0, "pattern %s not compiled", pattern);
 		return (0);
 	}
 	status = regexec(&re, string, (size_t) 0, NULL, 0);
@@ -283,3 +361,218 @@ mk_filename(const char *resultdir, lnk *link)
 	link->filename = newfilename;
 
 }
+
+/**
+ * Copies len bytes of src to dst, bytes not allowed in request line are
+ * percent-encoded (dst must have room for 3 * len bytes).
+ * \return end of copied data in dst.
+ */
+static char *
+link_encode(char *dst, const char *src, size_t len)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	unsigned char chr;
+
+	while (len-- > 0) {
+		chr = *(src++);
+		if ((chr <= ' ') || (chr >= 0x7F) || (chr == '"') ||
+				(chr == '<') || (chr == '>')) {
+			*(dst++) = '%';
+			*(dst++) = hex[chr >> 4];
+			*(dst++) = hex[chr & 0xF];
+		} else {
+			*(dst++) = chr;
+		}
+	}
+	return (dst);
+}
+
+/**
+ * Resolves reference ref found in page (absolute or relative link) against
+ * absolute link base (NULL if ref has to be absolute) and normalizes it:
+ * lower case scheme and host, no default port, no fragment, no empty and
+ * dot segments of path, percent-encoded spaces and control characters.
+ * \return new http(s) link, NULL if ref doesn't refer to http(s) link.
+ */
+char *
+link_resolve(const char *base, const char *ref)
+{
+	const char *scheme, *auth, *chr, *end, *port;
+	const char *basepath = "";
+	size_t schemeln, authln, baseln = 0, refln, segln;
+	char *path, *seg, *next, *url, *out, *pathstart;
+	int trailing = 0, relative = 0;
+
+	while (isspace((unsigned char) *ref))
+		++ref;
+	for (end = ref; (*end != '\0') && (*end != '#'); ++end)
+		;
+	while ((end > ref) && isspace((unsigned char) end[-1]))
+		--end;
+
+	// scheme of ref (letter followed by letters, digits, +, - or .)
+	for (chr = ref; (chr != end) && (isalnum((unsigned char) *chr) ||
+			(*chr == '+') || (*chr == '-') || (*chr == '.')); ++chr)
+		;
+	if ((chr != ref) && (chr != end) && (*chr == ':') &&
+			isalpha((unsigned char) *ref)) {
+		schemeln = chr - ref;
+		if (!(((schemeln == 4) && (strncasecmp(ref, "http", 4) == 0)) ||
+				((schemeln == 5) &&
+				(strncasecmp(ref, "https", 5) == 0))) ||
+				(end - chr < 3) ||
+				(strncmp(chr, "://", 3) != 0))
+			return (NULL);
+		scheme = ref;
+		auth = chr + 3;
+	} else {
+		if ((base == NULL) || (ref == end) ||
+				((chr = strstr(base, "://")) == NULL))
+			return (NULL);
+		scheme = base;
+		schemeln = chr - base;
+		auth = chr + 3;
+		if ((end - ref >= 2) && (strncmp(ref, "//", 2) == 0)) {
+			auth = ref + 2;
+		} else {
+			// relative ref continues path of base
+			authln = strcspn(auth, "/?");
+			basepath = auth + authln;
+			if (*ref == '/') {
+				baseln = 0;
+			} else {
+				baseln = strcspn(basepath, "?");
+				while ((*ref != '?') && (baseln > 0) &&
+						(basepath[baseln - 1] != '/'))
+					--baseln;
+			}
+			relative = 1;
+		}
+	}
+	if (!relative) {
+		for (authln = 0; (auth + authln != end) &&
+				(strchr("/?", auth[authln]) == NULL); ++authln)
+			;
+		ref = auth + authln;
+	}
+
+	// host (without user) and port (without default one)
+	port = memchr(auth, ':', authln);
+	if ((authln == 0) || (port == auth) ||
+			(memchr(auth, '@', authln) != NULL) ||
+			((authln == 1) && (*auth == '.')) ||
+			((authln == 2) && (strncmp(auth, "..", 2) == 0)))
+		return (NULL);
+	for (chr = (port != NULL) ? port + 1 : auth + authln;
+			chr != auth + authln; ++chr) {
+		if (!isdigit((unsigned char) *chr))
+			return (NULL);
+	}
+	if ((port != NULL) && (port + 1 != auth + authln) &&
+			(link_port(port + 1, auth + authln - port - 1) == -1))
+		return (NULL);
+
+	// path (with query) to normalize
+	refln = end - ref;
+	path = malloc(baseln + refln + 2);
+	path[0] = '/';
+	memcpy(path + 1, basepath, baseln);
+	memcpy(path + 1 + baseln, ref, refln);
+	path[1 + baseln + refln] = '\0';
+	seg = path + 1;
+	if (*seg == '/')
+		++seg;
+
+	url = malloc(schemeln + 3 + authln + 3 * (baseln + refln) + 8);
+	for (out = url; schemeln-- > 0; ++scheme)
+		*(out++) = tolower((unsigned char) *scheme);
+	out = stpcpy(out, "://");
+	for (chr = auth; chr != ((port != NULL) ? port : auth + authln); ++chr)
+		*(out++) = tolower((unsigned char) *chr);
+	if ((port != NULL) && (port + 1 != auth + authln) &&
+			(link_port(port + 1, auth + authln - port - 1) !=
+			((url[4] == 's') ? HTTPS_PORT : HTTP_PORT)))
+		out = link_encode(out, port, auth + authln - port);
+
+	// segments of path, query is kept as it is
+	pathstart = out;
+	for (;;) {
+		next = seg + strcspn(seg, "/?");
+		segln = next - seg;
+		trailing = (segln == 0) || ((segln == 1) && (*seg == '.'));
+		if ((segln == 2) && (strncmp(seg, "..", 2) == 0)) {
+			trailing = 1;
+			while ((out != pathstart) && (*(--out) != '/'))
+				;
+		} else if (!trailing) {
+			*(out++) = '/';
+			out = link_encode(out, seg, segln);
+		}
+		if (*next != '/')
+			break;
+		seg = next + 1;
+	}
+	if ((trailing) || (out == pathstart))
+		*(out++) = '/';
+	out = link_encode(out, next, strlen(next));
+	*out = '\0';
+
+	free(path);
+	return (url);
+}
+
+/**
+ * \return new absolute link of host, port and request uri of link (default
+ * port is left out).
+ */
+char *
+link_url(const lnk *link)
+{
+	const char *scheme = (link->prot == HTTPS) ? PROTOCOL_HTTPS :
+			PROTOCOL_HTTP;
+	int defport = (link->prot == HTTPS) ? HTTPS_PORT : HTTP_PORT;
+	char *url = malloc(strlen(scheme) + strlen(link->hostname) +
+			strlen(link->rquri) + 8);
+
+	if (link->port == defport)
+		sprintf(url, "%s%s%s", scheme, link->hostname, link->rquri);
+	else
+		sprintf(url, "%s%s:%d%s", scheme, link->hostname, link->port,
+				link->rquri);
+	return (url);
+}
+
+/**
+ * Points link to absolute link url (redirect), protocol, host, port and
+ * request uri are replaced, filename of link stays.
+ * \return 0 on success, -1 if url isn't valid link.
+ */
+int
+link_retarget(lnk *link, char *url)
+{
+	lnk target;
+
+	memset(&target, 0, sizeof (target));
+	if (link_parse(url, &target) == -1)
+		return (-1);
+
+	free(link->hostname);
+	free(link->rquri);
+	free(target.filename);
+	link->prot = target.prot;
+	link->hostname = target.hostname;
+	link->port = target.port;
+	link->rquri = target.rquri;
+	return (0);
+}
+
+/**
+ * Releases strings of link filled by link_parse.
+ */
+void
+link_free(lnk *link)
+{
+	free(link->hostname);
+	free(link->rquri);
+	free(link->filename);
+}
@@ -3,17 +3,24 @@
 
 #include "defaults.h"
 
-#define	LINK_REGEXP "^(http://)?([^/]+)(/(([^/]+/)*([^/]+))?)?$"
+#define	LINK_REGEXP \
+	"^(https?://)?([^/:]+)(:([0-9]+))?(/(([^/]+/)*([^/]*))?)?$"
 
 void strtoprot(char *str, protocols* prots);
 char *_strtok(char **holder, char *s, const char *delim);
 size_t _sprintf(int num, char **filledstr, const char *format, ...);
 char *_trim(char *str);
+char *_strcat(const char *first, const char *second);
+int _strtosize(const char *str, long long int *size);
 size_t _strnlen(const char *str, size_t maxlen);
 char *_strndup(char *str, size_t num);
 char *_strtr(char *str, char from, char to);
 int match(const char *string, char *pattern);
 int link_parse(char *linkstr, lnk *link);
+char *link_resolve(const char *base, const char *ref);
+char *link_url(const lnk *link);
+int link_retarget(lnk *link, char *url);
+void link_free(lnk *link);
 
 void create_rand_filename(lnk *link);
 void mk_filename(const char *resultdir, lnk *link);
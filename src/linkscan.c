@@ -0,0 +1,305 @@
+/*!
+ * \file
+ * \brief Streaming extraction of links from HTML pages.
+ *
+ *  Scanner is a state machine of HTML tokenizer reduced to what finds links:
+ *  tags, their attributes, comments and raw text of scripts and styles.
+ *  Page is fed in pieces of any size (as read from file) and every value of
+ *  href or src attribute is reported as soon as it ends, so the page is
+ *  never held in memory. Directory listings of servers are HTML pages too.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "linkscan.h"
+
+typedef enum
+{
+	LS_TEXT,	// text between tags
+	LS_OPEN,	// after <
+	LS_BANG,	// after <!
+	LS_COMMENT,	// <!-- comment -->
+	LS_DECL,	// <!DOCTYPE ...> and ends of raw text tags
+	LS_NAME,	// tag name
+	LS_ATTRS,	// between attributes
+	LS_ATTRNAME,
+	LS_AFTERNAME,	// attribute name ended, = may follow
+	LS_BEFOREVALUE,
+	LS_VALUE,
+	LS_RAW		// text of script or style, ends by its end tag
+} ls_state;
+
+struct linkscan
+{
+	ls_state state;
+	char tag[LINKSCAN_NAME_MAX + 1];
+	size_t taglen;
+	int closing;		// end tag
+	char attr[LINKSCAN_NAME_MAX + 1];
+	size_t attrlen;
+	char quote;		// quote of value, 0 if value isn't quoted
+	int keep;		// value is link
+	char value[LINKSCAN_VALUE_MAX + 1];
+	size_t valuelen;	// LINKSCAN_VALUE_MAX + 1 if value was too long
+	int dashes;		// dashes before > in comment
+	char rawend[LINKSCAN_NAME_MAX + 3];	// </tag ending raw text
+	size_t rawmatch;	// characters of rawend matched
+	linkscan_cb found;
+	void *data;
+};
+
+/**
+ * Creates scanner reporting links of page to found.
+ * \return new scanner.
+ */
+linkscan *
+linkscan_init(linkscan_cb found, void *data)
+{
+	linkscan *scan = calloc(1, sizeof (linkscan));
+
+	scan->found = found;
+	scan->data = data;
+	return (scan);
+}
+
+void
+linkscan_free(linkscan *scan)
+{
+	free(scan);
+}
+
+/**
+ * Reports value of attribute (entities &amp; decoded) if it is link.
+ */
+static void
+linkscan_value(linkscan *scan)
+{
+	char *src, *dst;
+
+	if ((!scan->keep) || (scan->valuelen > LINKSCAN_VALUE_MAX))
+		return;
+	scan->value[scan->valuelen] = '\0';
+
+	for (src = dst = scan->value; *src != '\0'; ++dst) {
+		if (strncmp(src, "&amp;", 5) == 0) {
+			*dst = '&';
+			src += 5;
+		} else {
+			*dst = *(src++);
+		}
+	}
+	*dst = '\0';
+
+	if (*scan->value != '\0')
+		scan->found(scan->data, scan->value);
+}
+
+/**
+ * Appends len bytes of buf to value of attribute if it is link, value longer
+ * than LINKSCAN_VALUE_MAX is marked as too long.
+ */
+static void
+linkscan_append(linkscan *scan, const char *buf, size_t len)
+{
+	if ((!scan->keep) || (scan->valuelen > LINKSCAN_VALUE_MAX))
+		return;
+	if (scan->valuelen + len > LINKSCAN_VALUE_MAX) {
+		scan->valuelen = LINKSCAN_VALUE_MAX + 1;
+		return;
+	}
+	memcpy(scan->value + scan->valuelen, buf, len);
+	scan->valuelen += len;
+}
+
+/**
+ * Starts value of attribute, it is link if attribute is href or src (of
+ * any tag but base).
+ */
+static void
+linkscan_startvalue(linkscan *scan)
+{
+	scan->attr[scan->attrlen] = '\0';
+	scan->tag[scan->taglen] = '\0';
+	scan->keep = (!scan->closing) && (strcmp(scan->tag, "base") != 0) &&
+			((strcmp(scan->attr, "href") == 0) ||
+			(strcmp(scan->attr, "src") == 0));
+	scan->valuelen = 0;
+	scan->state = LS_VALUE;
+}
+
+/**
+ * Ends tag, text of script and style is skipped up to their end tag.
+ */
+static void
+linkscan_endtag(linkscan *scan)
+{
+	scan->tag[scan->taglen] = '\0';
+	if ((!scan->closing) && ((strcmp(scan->tag, "script") == 0) ||
+			(strcmp(scan->tag, "style") == 0))) {
+		scan->rawend[0] = '<';
+		scan->rawend[1] = '/';
+		strcpy(scan->rawend + 2, scan->tag);
+		scan->rawmatch = 0;
+		scan->state = LS_RAW;
+	} else {
+		scan->state = LS_TEXT;
+	}
+	scan->closing = 0;
+	scan->taglen = 0;
+}
+
+/**
+ * Feeds next len bytes of page into scanner.
+ */
+void
+linkscan_feed(linkscan *scan, const char *buf, size_t len)
+{
+	const char *end = buf + len, *stop;
+	char chr;
+
+	while (buf != end) {
+		switch (scan->state) {
+		case LS_TEXT:
+			// text is skipped at once
+			if ((buf = memchr(buf, '<', end - buf)) == NULL)
+				return;
+			++buf;
+			scan->state = LS_OPEN;
+			continue;
+		case LS_VALUE:
+			if (scan->quote == 0)
+				break;
+			// quoted value is copied at once
+			stop = memchr(buf, scan->quote, end - buf);
+			if (stop == NULL)
+				stop = end;
+			linkscan_append(scan, buf, stop - buf);
+			if ((buf = stop) == end)
+				return;
+			++buf;
+			linkscan_value(scan);
+			scan->state = LS_ATTRS;
+			continue;
+		default:
+			break;
+		}
+
+		chr = *(buf++);
+		switch (scan->state) {
+		case LS_OPEN:
+			if (chr == '!') {
+				scan->dashes = 0;
+				scan->state = LS_BANG;
+			} else if ((chr == '/') && (!scan->closing)) {
+				scan->closing = 1;
+			} else if (isalpha((unsigned char) chr)) {
+				scan->tag[0] = tolower((unsigned char) chr);
+				scan->taglen = 1;
+				scan->state = LS_NAME;
+			} else if (chr != '<') {
+				scan->closing = 0;
+				scan->state = LS_TEXT;
+			}
+			break;
+		case LS_BANG:
+			if ((chr == '-') && (++scan->dashes == 2)) {
+				scan->dashes = 0;
+				scan->state = LS_COMMENT;
+			} else if (chr == '>') {
+				scan->state = LS_TEXT;
+			} else if (chr != '-') {
+				scan->state = LS_DECL;
+			}
+			break;
+		case LS_COMMENT:
+			if ((chr == '>') && (scan->dashes >= 2))
+				scan->state = LS_TEXT;
+			else
+				scan->dashes = (chr == '-') ?
+						scan->dashes + 1 : 0;
+			break;
+		case LS_DECL:
+			if (chr == '>')
+				scan->state = LS_TEXT;
+			break;
+		case LS_NAME:
+			if (chr == '>') {
+				linkscan_endtag(scan);
+			} else if ((isspace((unsigned char) chr)) ||
+					(chr == '/')) {
+				scan->state = LS_ATTRS;
+			} else if (scan->taglen != LINKSCAN_NAME_MAX) {
+				scan->tag[scan->taglen++] =
+						tolower((unsigned char) chr);
+			}
+			break;
+		case LS_ATTRS:
+		case LS_AFTERNAME:
+			if (chr == '>') {
+				linkscan_endtag(scan);
+			} else if ((chr == '=') &&
+					(scan->state == LS_AFTERNAME)) {
+				scan->state = LS_BEFOREVALUE;
+			} else if ((!isspace((unsigned char) chr)) &&
+					(chr != '/')) {
+				scan->attr[0] = tolower((unsigned char) chr);
+				scan->attrlen = 1;
+				scan->state = LS_ATTRNAME;
+			} else if (chr == '/') {
+				scan->state = LS_ATTRS;
+			}
+			break;
+		case LS_ATTRNAME:
+			if (chr == '>') {
+				linkscan_endtag(scan);
+			} else if (chr == '=') {
+				scan->state = LS_BEFOREVALUE;
+			} else if (isspace((unsigned char) chr)) {
+				scan->state = LS_AFTERNAME;
+			} else if (chr == '/') {
+				scan->state = LS_ATTRS;
+			} else if (scan->attrlen != LINKSCAN_NAME_MAX) {
+				scan->attr[scan->attrlen++] =
+						tolower((unsigned char) chr);
+			}
+			break;
+		case LS_BEFOREVALUE:
+			if (chr == '>') {
+				linkscan_endtag(scan);
+			} else if ((chr == '"') || (chr == '\'')) {
+				scan->quote = chr;
+				linkscan_startvalue(scan);
+			} else if (!isspace((unsigned char) chr)) {
+				scan->quote = 0;
+				linkscan_startvalue(scan);
+				linkscan_append(scan, &chr, 1);
+			}
+			break;
+		case LS_VALUE:
+			// unquoted value
+			if (isspace((unsigned char) chr) || (chr == '>')) {
+				linkscan_value(scan);
+				if (chr == '>')
+					linkscan_endtag(scan);
+				else
+					scan->state = LS_ATTRS;
+			} else {
+				linkscan_append(scan, &chr, 1);
+			}
+			break;
+		case LS_RAW:
+			if (tolower((unsigned char) chr) ==
+					scan->rawend[scan->rawmatch])
+				++scan->rawmatch;
+			else
+				scan->rawmatch = (chr == '<') ? 1 : 0;
+			if (scan->rawend[scan->rawmatch] == '\0')
+				scan->state = LS_DECL;
+			break;
+		default:
+			break;
+		}
+	}
+}
@@ -0,0 +1,21 @@
+#ifndef LINKSCAN_H
+#define	LINKSCAN_H
+
+#include <stddef.h>
+
+#define	LINKSCAN_NAME_MAX 15	// longer tag and attribute names are cut
+#define	LINKSCAN_VALUE_MAX 4096	// longer links are dropped
+
+/**
+ * Link (value of href or src attribute) found in page, called while page
+ * is fed into scanner.
+ */
+typedef void (*linkscan_cb)(void *data, const char *ref);
+
+typedef struct linkscan linkscan;
+
+linkscan *linkscan_init(linkscan_cb found, void *data);
+void linkscan_feed(linkscan *scan, const char *buf, size_t len);
+void linkscan_free(linkscan *scan);
+
+#endif /* LINKSCAN_H */
@@ -0,0 +1,402 @@
+/*!
+ * \file
+ * \brief Asynchronous log of errors and status of downloads.
+ *
+ *  Thread formats its record (level, link, byte range, errno, time and
+ *  message) into ring of its own, which only the thread writes and only the
+ *  log thread reads, so logging takes neither lock nor stdio of the thread.
+ *  Log thread writes records of all rings in order of their time every
+ *  LOG_DRAIN_MS as text or JSON lines. Full ring drops the record and counts
+ *  it (error storm never blocks the thread), drops are reported in the log.
+ *  Until log_open (and after log_close) records are written at once.
+ */
+
+#define	_GNU_SOURCE	// strerror_r returns string
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "log.h"
+
+typedef struct
+{
+	double time;		// seconds since epoch
+	log_level level;
+	int err;		// errno of failure, 0 = none
+	long long int start;	// range of link, -1 = none
+	long long int end;
+	char link[LOG_LINK_MAX];	// empty = record of no link
+	char msg[LOG_MSG_MAX];
+} log_rec;
+
+typedef struct log_ring
+{
+	log_rec recs[LOG_RING];
+	unsigned long head;	// records written by owner thread
+	unsigned long tail;	// records written out by log thread
+	unsigned long seen;	// head taken by the running drain
+	unsigned long dropped;	// records lost while ring was full
+	unsigned long reported;	// drops written out
+	int dead;		// owner thread exited
+	struct log_ring *next;
+} log_ring;
+
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_wake = PTHREAD_COND_INITIALIZER;
+static pthread_key_t log_key;
+static pthread_t log_thr;
+static log_ring *log_rings;	// new rings are added at the front
+static FILE *log_out;
+static log_format log_fmt;
+static int log_enabled;
+static int log_stop;
+
+static double
+log_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/**
+ * Writes string escaped for JSON.
+ */
+static void
+log_json_str(FILE *out, const char *str)
+{
+	for (; *str != '\0'; ++str) {
+		if ((*str == '"') || (*str == '\\'))
+			fprintf(out, "\\%c", *str);
+		else if ((unsigned char) *str < ' ')
+			fprintf(out, "\\u%04x", (unsigned char) *str);
+		else
+			putc(*str, out);
+	}
+}
+
+/**
+ * Writes record as line of format.
+ */
+static void
+log_print(FILE *out, log_format format, const log_rec *rec)
+{
+	char errbuf[128];
+	const char *errstr = NULL;
+
+	if (rec->err != 0)
+		errstr = strerror_r(rec->err, errbuf, sizeof (errbuf));
+
+	if (format == LOG_TEXT) {
+		fprintf(out, "%s%s%s%s\n", (rec->level == LOG_ERROR) ?
+				log_ERROR : "", rec->msg,
+				(errstr != NULL) ? ": " : "",
+				(errstr != NULL) ? errstr : "");
+		return;
+	}
+
+	fprintf(out, "{\"time\":%.6f,\"level\":\"%s\",\"msg\":\"", rec->time,
+			(rec->level == LOG_ERROR) ? "error" : "info");
+	log_json_str(out, rec->msg);
+	putc('"', out);
+	if (rec->link[0] != '\0') {
+		fprintf(out, ",\"link\":\"");
+		log_json_str(out, rec->link);
+		putc('"', out);
+	}
+	if (rec->start >= 0)
+		fprintf(out, ",\"start\":%lld,\"end\":%lld", rec->start,
+				rec->end);
+	if (errstr != NULL) {
+		fprintf(out, ",\"errno\":%d,\"error\":\"", rec->err);
+		log_json_str(out, errstr);
+		putc('"', out);
+	}
+	fprintf(out, "}\n");
+}
+
+/**
+ * Marks ring of exiting thread, log thread frees it when it is written out.
+ */
+static void
+log_ring_exit(void *data)
+{
+	log_ring *ring = data;
+
+	__atomic_store_n(&ring->dead, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * \return ring of calling thread (created by its first record), NULL if it
+ * can't be allocated.
+ */
+static log_ring *
+log_ring_own(void)
+{
+	log_ring *ring;
+
+	if ((ring = pthread_getspecific(log_key)) != NULL)
+		return (ring);
+	if ((ring = calloc(1, sizeof (log_ring))) == NULL)
+		return (NULL);
+	pthread_setspecific(log_key, ring);
+
+	pthread_mutex_lock(&log_lock);
+	ring->next = log_rings;
+	log_rings = ring;
+	pthread_mutex_unlock(&log_lock);
+
+	return (ring);
+}
+
+/**
+ * Writes records the threads published so far in order of their time and
+ * frees rings of exited threads.
+ */
+static void
+log_drain(void)
+{
+	log_ring *first, *ring, *next, **prev;
+	log_rec *rec, lost;
+	unsigned long dropped;
+
+	pthread_mutex_lock(&log_lock);
+	first = log_rings;
+	pthread_mutex_unlock(&log_lock);
+
+	// rings are added before first, so the list after it is stable
+	for (ring = first; ring != NULL; ring = ring->next)
+		ring->seen = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	for (;;) {
+		rec = NULL;
+		next = NULL;
+		for (ring = first; ring != NULL; ring = ring->next) {
+			if ((ring->tail != ring->seen) && ((rec == NULL) ||
+					(ring->recs[ring->tail % LOG_RING].time
+					< rec->time))) {
+				rec = &ring->recs[ring->tail % LOG_RING];
+				next = ring;
+			}
+		}
+		if (rec == NULL)
+			break;
+		log_print(log_out, log_fmt, rec);
+		__atomic_store_n(&next->tail, next->tail + 1, __ATOMIC_RELEASE);
+	}
+
+	memset(&lost, 0, sizeof (lost));
+	lost.time = log_now();
+	lost.level = LOG_ERROR;
+	lost.start = -1;
+	for (ring = first; ring != NULL; ring = next) {
+		next = ring->next;
+		dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+		if (dropped != ring->reported) {
+			snprintf(lost.msg, sizeof (lost.msg), "%lu log records "
+					"of thread dropped (ring full)",
+					dropped - ring->reported);
+			log_print(log_out, log_fmt, &lost);
+			ring->reported = dropped;
+		}
+
+		// head of exited thread is final once dead is seen
+		if ((!__atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE)) ||
+				(__atomic_load_n(&ring->head,
+				__ATOMIC_ACQUIRE) != ring->tail))
+			continue;
+		pthread_mutex_lock(&log_lock);
+		for (prev = &log_rings; *prev != ring; prev = &(*prev)->next)
+			;
+		*prev = next;
+		pthread_mutex_unlock(&log_lock);
+		free(ring);
+	}
+	fflush(log_out);
+}
+
+static void *
+log_thread(void *arg)
+{
+	struct timespec wake;
+	int stop;
+
+	(void) arg;
+	do {
+		pthread_mutex_lock(&log_lock);
+		if (!log_stop) {
+			clock_gettime(CLOCK_REALTIME, &wake);
+			wake.tv_nsec += LOG_DRAIN_MS * 1000000L;
+			wake.tv_sec += wake.tv_nsec / 1000000000L;
+			wake.tv_nsec %= 1000000000L;
+			pthread_cond_timedwait(&log_wake, &log_lock, &wake);
+		}
+		stop = log_stop;
+		pthread_mutex_unlock(&log_lock);
+		log_drain();
+	} while (!stop);
+
+	return (NULL);
+}
+
+/**
+ * Starts writing of records by log thread into file path (appended, NULL
+ * = stdlog) as lines of format.
+ * \return 0 on success, -1 on fail.
+ */
+int
+log_open(const char *path, log_format format)
+{
+	if (path == NULL) {
+		log_out = stdlog;
+	} else if ((log_out = fopen(path, "ae")) == NULL) {
+		fprintf(stdlog, log_ERROR "Couldn't open log %s ", path);
+		perror("fopen");
+		return (-1);
+	}
+	log_fmt = format;
+	log_stop = 0;
+
+	if (pthread_key_create(&log_key, log_ring_exit) != 0) {
+		perror("log");
+		if (log_out != stdlog)
+			fclose(log_out);
+		return (-1);
+	}
+	if (pthread_create(&log_thr, NULL, log_thread, NULL) != 0) {
+		perror("log");
+		pthread_key_delete(log_key);
+		if (log_out != stdlog)
+			fclose(log_out);
+		return (-1);
+	}
+	__atomic_store_n(&log_enabled, 1, __ATOMIC_RELEASE);
+
+	return (0);
+}
+
+/**
+ * Writes out all records and stops log thread, records of threads still
+ * running are written at once from now on.
+ */
+void
+log_close(void)
+{
+	log_ring *ring;
+
+	if (!__atomic_load_n(&log_enabled, __ATOMIC_ACQUIRE))
+		return;
+	__atomic_store_n(&log_enabled, 0, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&log_lock);
+	log_stop = 1;
+	pthread_cond_signal(&log_wake);
+	pthread_mutex_unlock(&log_lock);
+	pthread_join(log_thr, NULL);
+
+	// rings of running threads aren't reachable once the key is gone
+	pthread_key_delete(log_key);
+	while ((ring = log_rings) != NULL) {
+		log_rings = ring->next;
+		free(ring);
+	}
+	if (log_out != stdlog)
+		fclose(log_out);
+	log_out = NULL;
+}
+
+/**
+ * Records message of format and args with link and its range start - end
+ * (start -1 = none) and errno err (0 = none). Trailing newline of message
+ * is left out, every record is written as one line.
+ */
+static void
+log_vwrite(log_level level, const lnk *link, long long int start,
+		long long int end, int err, const char *format, va_list args)
+{
+	log_ring *ring = NULL;
+	log_rec *rec, now;
+	unsigned long head = 0;
+	size_t len;
+
+	if (__atomic_load_n(&log_enabled, __ATOMIC_ACQUIRE))
+		ring = log_ring_own();
+	if (ring != NULL) {
+		head = ring->head;
+		if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >=
+				LOG_RING) {
+			__atomic_store_n(&ring->dropped, ring->dropped + 1,
+					__ATOMIC_RELAXED);
+			return;
+		}
+		rec = &ring->recs[head % LOG_RING];
+	} else {
+		rec = &now;
+	}
+
+	rec->time = log_now();
+	rec->level = level;
+	rec->err = err;
+	rec->start = start;
+	rec->end = end;
+	rec->link[0] = '\0';
+	if ((link != NULL) && (link->hostname != NULL))
+		snprintf(rec->link, sizeof (rec->link), "%s%s", link->hostname,
+				(link->rquri != NULL) ? link->rquri : "");
+	vsnprintf(rec->msg, sizeof (rec->msg), format, args);
+	len = strlen(rec->msg);
+	while ((len > 0) && ((rec->msg[len - 1] == '\n') ||
+			(rec->msg[len - 1] == ' ')))
+		rec->msg[--len] = '\0';
+
+	if (ring != NULL)
+		__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	else
+		log_print(stdlog, LOG_TEXT, rec);
+}
+
+/**
+ * Records status message of link (NULL = of no link).
+ */
+void
+log_info(const lnk *link, const char *format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	log_vwrite(LOG_INFO, link, -1, -1, 0, format, args);
+	va_end(args);
+}
+
+/**
+ * Records error of link (NULL = of no link) caused by errno err (0 =
+ * none).
+ */
+void
+log_error(const lnk *link, int err, const char *format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	log_vwrite(LOG_ERROR, link, -1, -1, err, format, args);
+	va_end(args);
+}
+
+/**
+ * Records message of level about range start - end of link caused by
+ * errno err (0 = none).
+ */
+void
+log_range(log_level level, const lnk *link, long long int start,
+		long long int end, int err, const char *format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	log_vwrite(level, link, start, end, err, format, args);
+	va_end(args);
+}
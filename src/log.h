@@ -0,0 +1,29 @@
+#ifndef LOG_H
+#define	LOG_H
+
+#include "defaults.h"
+
+#define	LOG_RING 64		// records a thread holds before they're dropped
+#define	LOG_MSG_MAX 256		// longer message is cut
+#define	LOG_LINK_MAX 128	// host and uri of record (longer is cut)
+#define	LOG_DRAIN_MS 20		// period of writing records out
+
+/**
+ * Level of log record (LOG_INFO = status, printed without prefix).
+ */
+typedef enum
+{
+	LOG_INFO, LOG_ERROR
+} log_level;
+
+int log_open(const char *path, log_format format);
+void log_close(void);
+void log_info(const lnk *link, const char *format, ...)
+		__attribute__((format(printf, 2, 3)));
+void log_error(const lnk *link, int err, const char *format, ...)
+		__attribute__((format(printf, 3, 4)));
+void log_range(log_level level, const lnk *link, long long int start,
+		long long int end, int err, const char *format, ...)
+		__attribute__((format(printf, 6, 7)));
+
+#endif /* LOG_H */
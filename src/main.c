@@ -3,13 +3,26 @@
 #include <unistd.h>
 #include <getopt.h>
 #include <string.h>
+#include <signal.h>
+#include <limits.h>	// LLONG_MAX
 
 // #define	NDEBUG // uncomment if not debugging mode
 #include <assert.h>
 
 #include "defaults.h"
 #include "utils.h"
-#include "threadmanager.h"
+#include "rdwget.h"
+#include "linkparser.h"
+#include "daemon.h"
+#include "trace.h"
+#include "log.h"
+#include "progress.h"
+#include "crawl.h"
+#include "metalink.h"
+#include "schedule.h"
+#include "pack.h"
+#include "hostprof.h"
+#include "coord.h"
 
 /**
  * \mainpage
@@ -37,6 +50,8 @@
  * \section SYNOPSIS
  * rdwget [options] http_links...
  *
+ * Links are http://host[:port]/path or https://host[:port]/path.
+ *
  * \section DESCRIPTION
  * rdwget is threaded wget like file download manager with simultaneous download
  * chunks for every link (HTTP server must send <b>Content-Length</b> and
@@ -70,10 +85,205 @@
  * 	server)
  *
  *  \section OPTIONS
- *  - <b>-c or --chunks=num</b> (if not specified, default is set to 1
- *  Downloads every http link in num chunks. (default is one chunk)
+ *  - <b>-c or --chunks=num</b>
+ *  Downloads every http link in num chunks (default is the best number
+ *  learned for its server, one chunk for unknown server).
+ *  Ranges are aligned to filesystem blocks, small files get fewer chunks
+ *  (at least 64 KiB each).
  *  - <b>-result-dir or -R</b>
  *  Result directory (where files will be downloaded)
+ *  - <b>-O or --output-document=file</b>
+ *  Downloads link into file. With file - links are written to standard
+ *  output one after another, every link in order while its pieces are
+ *  still fetched in parallel (through bounded reorder buffer).
+ *  - <b>-A or --pack=file</b>
+ *  Appends downloaded links to tar archive file (with index file.idx)
+ *  instead of a file each.
+ *  - <b>-H or --hedge=sec</b>
+ *  Hedges chunk (requests rest of its range on a new connection) if it
+ *  receives nothing for sec seconds or is much slower than other chunks,
+ *  the first finished copy is kept.
+ *  - <b>-n or --retries=num</b>
+ *  Retries failed chunk num times, every retry continues from the last
+ *  received byte (default is no retry).
+ *  - <b>-w or --retry-wait=sec</b>
+ *  Base wait before retry (doubled with every retry, default 1 second).
+ *  - <b>-m or --max-redirect=num</b>
+ *  Follows at most num redirects of link (default 10). Chunks and later
+ *  links of the same directory go to the final location at once.
+ *  - <b>-k or --no-check-certificate</b>
+ *  Doesn't verify certificates of https servers.
+ *  - <b>-a or --ca-certificate=file</b>
+ *  Verifies https servers against CA certificates in file.
+ *  - <b>-2 or --http2</b>
+ *  Downloads chunks as parallel streams of one HTTP/2 connection per server.
+ *  - <b>-F or --tcp-fastopen</b>
+ *  Sends request data in SYN of repeated connections (TCP Fast Open).
+ *  - <b>-b or --rcvbuf=size</b>
+ *  Socket receive buffer size (suffixes k, M, G allowed).
+ *  - <b>-B or --bdp=rate,rtt</b>
+ *  Sets receive buffer to bandwidth-delay product of rate (bytes per second,
+ *  suffixes k, M, G allowed) and round trip time rtt (in milliseconds).
+ *  - <b>-C or --congestion=algorithm</b>
+ *  TCP congestion control algorithm (e.g. bbr, cubic).
+ *  - <b>-T or --connect-timeout=sec</b>
+ *  Gives up connecting to server after sec seconds.
+ *  - <b>-t or --read-timeout=sec</b>
+ *  Gives up chunk if no data arrives for sec seconds.
+ *  - <b>-g or --small=size</b>
+ *  Links up to size (default 64k, 0 = off) are fetched by one request on
+ *  persistent connection, without header request and chunks.
+ *  - <b>-K or --keep-alive=num</b>
+ *  Idle persistent connections kept per server (default 4, 0 = off).
+ *  - <b>-Y or --profile=file</b>
+ *  Store of server profiles learned by downloads (default ~/.rdwget-hosts,
+ *  none keeps them for one run only).
+ *  - <b>-d or --durability=policy</b>
+ *  When downloaded files are synced to disk: none, end (fdatasync of every
+ *  file before it is reported downloaded, default) or batch (files
+ *  finished together are synced by one sync of their filesystem).
+ *  - <b>-s or --writeback=size</b>
+ *  Writes received data back to disk and drops them from page cache every
+ *  size bytes of chunk (default 8M, 0 leaves it to the kernel).
+ *  - <b>-M or --mem-budget=size</b>
+ *  Limits memory of mapped files and receive and reorder buffers of all
+ *  downloads (suffixes k, M, G allowed, default unlimited). File whose
+ *  mapping doesn't fit is written through pwrite, streamed link waits for
+ *  its reorder buffer.
+ *  - <b>-P or --progress=mode</b>
+ *  Progress display: auto (default) redraws total bytes, throughput, ETA
+ *  and chunk map of every running file each second on terminal and prints
+ *  a progress line every 10 seconds otherwise, line always prints lines,
+ *  none turns it off.
+ *  - <b>-x or --trace=file</b>
+ *  Records timeline of resolving, connecting, requests, receiving and disk
+ *  operations of every chunk into file (Chrome trace event JSON, viewable
+ *  in Perfetto).
+ *  - <b>-X or --log=file</b>
+ *  Appends errors and status messages of downloads to file instead of
+ *  stderr. Threads record them without locks, log thread writes them out.
+ *  - <b>-U or --log-format=format</b>
+ *  Log lines as text (default) or json (object per line with time, level,
+ *  message, link, byte range and errno).
+ *  - <b>-r or --recursive</b>
+ *  Mirrors links found in downloaded HTML pages (and directory listings)
+ *  into result-dir/host/path, crawling overlaps downloading.
+ *  - <b>-l or --level=depth</b>
+ *  Follows links at most depth pages deep from links given (default 5,
+ *  0 is unlimited).
+ *  - <b>-I or --include=prefix</b>
+ *  Mirrors only links starting with prefix (default is directory of every
+ *  link given).
+ *  - <b>-L or --host-limit=num</b>
+ *  Downloads at most num links of one host at once (default 2).
+ *  - <b>-z or --delta=file</b>
+ *  Downloads link as update of its previous copy file, only blocks not found
+ *  in file are downloaded.
+ *  - <b>-Z or --manifest=url</b>
+ *  Block checksum manifest of link (default is link.zsync).
+ *  - <b>-e or --metalink=file</b>
+ *  Downloads the first file of Metalink file (from link given or the first
+ *  link of metalink) and checks its pieces.
+ *  - <b>-u or --unpack=mode</b>
+ *  Unpacks .gz, .tgz, .xz and .txz links while they are downloaded: only
+ *  keeps unpacked file, both keeps compressed file too.
+ *  - <b>-o or --order=policy</b>
+ *  Starts links of batch in given order (default), smallest first (size)
+ *  or earliest deadline first (deadline).
+ *  - <b>-i or --input=file</b>
+ *  Downloads also links of batch file, one link per line followed by
+ *  optional priority=num, deadline=sec and size=size.
+ *  - <b>-D or --daemon=socket</b>
+ *  Runs as daemon which downloads links submitted over unix socket.
+ *  - <b>-S or --submit=socket</b>
+ *  Submits links to daemon listening on socket and waits for them.
+ *  - <b>-j or --journal=file</b>
+ *  Journal of daemon jobs (default is socket.journal).
+ *  - <b>-p or --priority=num</b>
+ *  Priority of submitted links, higher priority starts first (default 0).
+ *  - <b>-W or --workers=num</b>
+ *  Number of links downloaded at once by daemon, mirror or batch
+ *  (default 4).
+ *  - <b>-G or --coordinator=address</b>
+ *  Leases ranges of links to worker processes joining on address (unix
+ *  socket path or host:port) instead of downloading them.
+ *  - <b>-J or --join=address</b>
+ *  Runs as worker of coordinator on address (no links needed), ranges are
+ *  written into files of result directory shared with coordinator.
+ *  - <b>-E or --send-back</b>
+ *  Worker sends its ranges to coordinator instead of writing them into
+ *  shared result directory.
+ *
+ * \section MIRROR
+ * With -r downloaded HTML pages (and directory listings) are scanned for
+ * links by the worker which downloaded them, so crawling overlaps
+ * downloading. Links within include prefix and depth are deduplicated and
+ * queued per host, at most host-limit of them download at once.
+ *
+ * \section DELTA
+ * With -z block checksums of link (zsync manifest) are downloaded and
+ * previous copy is scanned for the blocks by rolling checksum in parallel.
+ * Found blocks are copied from it, ranges of the rest are downloaded by
+ * chunks and the result is checked by SHA-1 of manifest.
+ *
+ * \section METALINK
+ * With -e size of file is taken from metalink (no header request), chunk
+ * ranges are aligned to its pieces and checked as soon as they finish.
+ * Only pieces which don't match their digests (or whose chunk failed) are
+ * fetched again, from the next link of metalink.
+ *
+ * \section UNPACK
+ * With -u compressed link is downloaded by chunks in order into a pipe and
+ * decoder thread unpacks it at the same time, so download and unpacking
+ * take about as long as the slower of them. Multi-block xz files are
+ * decoded by one thread per CPU.
+ *
+ * \section SCHEDULE
+ * Links of batch are downloaded by workers links at once. With -o size,
+ * -o deadline or priorities (-i) higher priority starts first, then smaller
+ * link (by size of batch file or header requests pipelined per server) or
+ * earlier deadline. Worker of finished link starts the next one at once, so
+ * small files don't wait behind large ones for the same pipe. Links up to
+ * -g size are fetched by one request on persistent connections of their
+ * server. Files per second, mean completion time, time to the first file
+ * and missed deadlines are reported at the end.
+ *
+ * \section PROFILES
+ * Range support, keep-alive and http/2 support of every server, its round
+ * trip time, throughput and the best number of connections for one file
+ * are kept in -Y store. Links without -c start with the best count at once,
+ * every fourth large file tries twice or half as many connections and the
+ * faster count is kept (weighted averages decay older runs), 429 and 503
+ * responses limit the count. -o size orders links by time expected from
+ * profiles of their servers.
+ *
+ * \section PACK
+ * With -A every link is downloaded into memory and writer thread appends it
+ * to tar archive as soon as it finishes, so many small files cost one
+ * sequential write instead of creating, writing and syncing a file each.
+ * Index lists offset of data, size and name of every entry.
+ *
+ * \section DISTRIBUTED
+ * With -G coordinator gets header of every link, creates its file and
+ * splits it into 8 MiB ranges which workers (rdwget -J on the same or other
+ * machines) lease one at a time and download by their own chunks. Worker
+ * renews its lease every second, lease of worker which stopped renewing it
+ * or disconnected goes to another one, so throughput adds up over machines
+ * and a dead worker costs only its current range.
+ *
+ * \section DAEMON
+ * With -D rdwget stays running and downloads links submitted by
+ * rdwget -S socket (or by any client writing tab separated commands SUBMIT,
+ * CANCEL, PRIORITY, WATCH and LIST into socket). Connections, TLS sessions
+ * and resolved addresses are shared by all jobs. Jobs are journalled and
+ * unfinished ones are resumed when daemon starts again.
+ *
+ * \section LIBRARY
+ * Download engine is built also as static library librdwget.a (rdwget.h).
+ * Application creates context with pool of workers (rdw_init), submits jobs
+ * (rdw_submit, url with destination path or descriptor and settings) and
+ * gets finished jobs by done callback, rdw_wait or completion queue
+ * (rdw_poll, rdw_fd). Library never exits the process.
  *
  * \section COMPILATION
  * requirements:
@@ -101,7 +311,7 @@
  * 1TODO Transfer-Encoding: chunked
  *
  * IF LOTS OF TIME REMAINS:
- * 1TODO process bar
+ * 1TODO process bar			DONE
  * 1TODO log
  *
  */
@@ -120,10 +330,130 @@ usage(void)
 	"USAGE: %s [options] http_links...\n"
 	"OPTIONS:\n"
 	"-c or --chunks=num\n"
-	"     Downloads every http link in num chunks. (default is one chunk)\n"
+	"     Downloads every http link in num chunks. (default is learned\n"
+	"     per server, one chunk for unknown server)\n"
 	"-R or --resultdir=dir\n"
 	"     Result directory (where files will be downloaded,"
-	"default is current directory).\n", prgname);
+	"default is current directory).\n"
+	"-O or --output-document=file\n"
+	"     Downloads link into file, - streams links to standard output\n"
+	"     in order (pieces are still fetched in parallel).\n"
+	"-A or --pack=file\n"
+	"     Appends links to tar archive file (index in file.idx) instead\n"
+	"     of creating a file for each.\n"
+	"-H or --hedge=sec\n"
+	"     Requests rest of chunk on a new connection if it receives\n"
+	"     nothing for sec seconds or is much slower than other chunks.\n"
+	"-n or --retries=num\n"
+	"     Retries failed chunk num times from the last received byte.\n"
+	"-w or --retry-wait=sec\n"
+	"     Base wait before retry, doubled with every retry (default 1).\n"
+	"-m or --max-redirect=num\n"
+	"     Follows at most num redirects of link (default 10).\n"
+	"-k or --no-check-certificate\n"
+	"     Doesn't verify certificates of https servers.\n"
+	"-a or --ca-certificate=file\n"
+	"     Verifies https servers against CA certificates in file.\n"
+	"-2 or --http2\n"
+	"     Downloads chunks as streams of one HTTP/2 connection per server.\n"
+	"SOCKET PROFILE:\n"
+	"-F or --tcp-fastopen\n"
+	"     Sends request in SYN of repeated connections (TCP Fast Open).\n"
+	"-b or --rcvbuf=size\n"
+	"     Socket receive buffer size (suffixes k, M, G allowed).\n"
+	"-B or --bdp=rate,rtt\n"
+	"     Receive buffer sized to bandwidth-delay product of rate\n"
+	"     (bytes per second) and round trip time rtt (milliseconds).\n"
+	"-C or --congestion=algorithm\n"
+	"     TCP congestion control algorithm (e.g. bbr, cubic).\n"
+	"-T or --connect-timeout=sec\n"
+	"     Gives up connecting to server after sec seconds.\n"
+	"-t or --read-timeout=sec\n"
+	"     Gives up chunk if no data arrives for sec seconds.\n"
+	"-g or --small=size\n"
+	"     Fetches links up to size by one request on persistent\n"
+	"     connection (default 64k, 0 = off).\n"
+	"-K or --keep-alive=num\n"
+	"     Idle persistent connections kept per server (default 4).\n"
+	"-Y or --profile=file\n"
+	"     Store of learned server profiles (default ~/.rdwget-hosts,\n"
+	"     none = not kept across runs).\n"
+	"DISK:\n"
+	"-d or --durability=none|end|batch\n"
+	"     Syncs every file when downloaded (end, default), files finished\n"
+	"     together by one filesystem sync (batch) or doesn't sync (none).\n"
+	"-s or --writeback=size\n"
+	"     Flushes received data of chunk and drops it from page cache\n"
+	"     every size bytes (default 8M, 0 = off).\n"
+	"-M or --mem-budget=size\n"
+	"     Limits mapped and buffered data of all downloads (default\n"
+	"     unlimited), files over it are written without mapping.\n"
+	"-P or --progress=auto|line|none\n"
+	"     Live progress on terminal (auto), progress line every 10 seconds\n"
+	"     (line, or auto without terminal) or none.\n"
+	"-x or --trace=file\n"
+	"     Records timeline of connections and chunks into file\n"
+	"     (Chrome trace JSON, e.g. for Perfetto).\n"
+	"-X or --log=file\n"
+	"     Appends errors and status messages to file (default stderr).\n"
+	"-U or --log-format=text|json\n"
+	"     Log lines as text (default) or JSON objects with time, level,\n"
+	"     link, range and errno.\n"
+	"MIRROR:\n"
+	"-r or --recursive\n"
+	"     Mirrors links found in downloaded HTML pages and directory\n"
+	"     listings into result-dir/host/path.\n"
+	"-l or --level=depth\n"
+	"     Follows links at most depth pages deep (default 5,\n"
+	"     0 = no limit).\n"
+	"-I or --include=prefix\n"
+	"     Mirrors links starting with prefix (default is directory\n"
+	"     of every link).\n"
+	"-L or --host-limit=num\n"
+	"     Downloads at most num links of one host at once (default 2).\n"
+	"DELTA:\n"
+	"-z or --delta=file\n"
+	"     Updates previous copy file of link, downloads only blocks\n"
+	"     which aren't found in it.\n"
+	"-Z or --manifest=url\n"
+	"     Block checksums (zsync) of link (default is link.zsync).\n"
+	"METALINK:\n"
+	"-e or --metalink=file\n"
+	"     Downloads file of metalink (links given are optional), checks\n"
+	"     its pieces and fetches failed ones again from mirrors.\n"
+	"UNPACK:\n"
+	"-u or --unpack=mode\n"
+	"     Unpacks .gz and .xz links as they arrive, mode is only\n"
+	"     (unpacked file) or both (compressed file is kept too).\n"
+	"SCHEDULE:\n"
+	"-o or --order=given|size|deadline\n"
+	"     Starts links in given order, smallest first or earliest\n"
+	"     deadline first.\n"
+	"-i or --input=file\n"
+	"     Downloads also links of file, one per line with optional\n"
+	"     priority=num, deadline=sec and size=size.\n"
+	"DAEMON:\n"
+	"-D or --daemon=socket\n"
+	"     Downloads links submitted over unix socket (no links needed).\n"
+	"-S or --submit=socket\n"
+	"     Submits links to daemon on socket and waits for them.\n"
+	"-j or --journal=file\n"
+	"     Journal of daemon jobs (default is socket.journal).\n"
+	"-p or --priority=num\n"
+	"     Priority of submitted links, higher starts first (default 0).\n"
+	"-W or --workers=num\n"
+	"     Links downloaded at once by daemon, mirror or batch\n"
+	"     (default 4).\n"
+	"DISTRIBUTED:\n"
+	"-G or --coordinator=address\n"
+	"     Leases ranges of links to workers joining on unix socket path\n"
+	"     or host:port.\n"
+	"-J or --join=address\n"
+	"     Downloads ranges leased by coordinator on address into shared\n"
+	"     result directory (no links needed).\n"
+	"-E or --send-back\n"
+	"     Worker sends ranges to coordinator instead of writing them.\n",
+	prgname);
 	exit(1);
 }
 
@@ -131,12 +461,94 @@ static struct option longopts[] =
 	{
 		{ "chunks", required_argument, NULL, 'c' },
 		{ "result-dir", required_argument, NULL, 'R' },
+		{ "hedge", required_argument, NULL, 'H' },
+		{ "retries", required_argument, NULL, 'n' },
+		{ "retry-wait", required_argument, NULL, 'w' },
+		{ "max-redirect", required_argument, NULL, 'm' },
+		{ "no-check-certificate", no_argument, NULL, 'k' },
+		{ "ca-certificate", required_argument, NULL, 'a' },
+		{ "http2", no_argument, NULL, '2' },
+		{ "tcp-fastopen", no_argument, NULL, 'F' },
+		{ "rcvbuf", required_argument, NULL, 'b' },
+		{ "bdp", required_argument, NULL, 'B' },
+		{ "congestion", required_argument, NULL, 'C' },
+		{ "connect-timeout", required_argument, NULL, 'T' },
+		{ "read-timeout", required_argument, NULL, 't' },
+		{ "output-document", required_argument, NULL, 'O' },
+		{ "pack", required_argument, NULL, 'A' },
+		{ "durability", required_argument, NULL, 'd' },
+		{ "writeback", required_argument, NULL, 's' },
+		{ "mem-budget", required_argument, NULL, 'M' },
+		{ "small", required_argument, NULL, 'g' },
+		{ "keep-alive", required_argument, NULL, 'K' },
+		{ "trace", required_argument, NULL, 'x' },
+		{ "log", required_argument, NULL, 'X' },
+		{ "log-format", required_argument, NULL, 'U' },
+		{ "progress", required_argument, NULL, 'P' },
+		{ "recursive", no_argument, NULL, 'r' },
+		{ "level", required_argument, NULL, 'l' },
+		{ "include", required_argument, NULL, 'I' },
+		{ "host-limit", required_argument, NULL, 'L' },
+		{ "delta", required_argument, NULL, 'z' },
+		{ "manifest", required_argument, NULL, 'Z' },
+		{ "metalink", required_argument, NULL, 'e' },
+		{ "unpack", required_argument, NULL, 'u' },
+		{ "order", required_argument, NULL, 'o' },
+		{ "input", required_argument, NULL, 'i' },
+		{ "daemon", required_argument, NULL, 'D' },
+		{ "submit", required_argument, NULL, 'S' },
+		{ "journal", required_argument, NULL, 'j' },
+		{ "priority", required_argument, NULL, 'p' },
+		{ "workers", required_argument, NULL, 'W' },
+		{ "profile", required_argument, NULL, 'Y' },
+		{ "coordinator", required_argument, NULL, 'G' },
+		{ "join", required_argument, NULL, 'J' },
+		{ "send-back", no_argument, NULL, 'E' },
 //		{ "sock-ipv6", no_argument, NULL, '6' }
+		{ NULL, 0, NULL, 0 }
 	};
 
 // application local settings
 prgstx programsettings;
 
+// metalink of -e, link is downloaded by its pieces
+static metalink *metalinkfile;
+
+// links of command line and of batch file (-i) with their hints
+static sched_link *schedlinks;
+static int schednum;
+
+/**
+ * Parses bandwidth-delay product specification "rate,rtt" (rate in bytes per
+ * second with optional k, M, G suffix, rtt in milliseconds).
+ * \return receive buffer size in bytes, -1 if spec is invalid (or its
+ * product overflows).
+ */
+static int
+parse_bdp(const char *spec)
+{
+	char *rate = strdup(spec);
+	char *rtt = strchr(rate, ',');
+	long long int bps, ms, bdp;
+
+	if (rtt == NULL) {
+		free(rate);
+		return (-1);
+	}
+	*(rtt++) = '\0';
+
+	if ((_strtosize(rate, &bps) == -1) || ((ms = atoi(rtt)) <= 0)) {
+		free(rate);
+		return (-1);
+	}
+	free(rate);
+
+	if (bps > LLONG_MAX / ms)
+		return (-1);
+	bdp = bps * ms / 1000;
+	return ((bdp > 0x7FFFFFFF) ? 0x7FFFFFFF : (int)bdp);
+}
+
 void
 proc_opts(int argc, char **argv)
 {
@@ -145,21 +557,21 @@ proc_opts(int argc, char **argv)
 
 	int ridx, idx;
 	int opt;
+	long long int size;
 
 	// number of files
 	int linknum, linkidx;
+	const char *batchfile = NULL;
+	const char *home;
+	int noprofile = 0;
 
 	memset(optstring, 0, optlen);
 
 	// programsettings init
-	programsettings.chunks = D_CHUNKS;
-	programsettings.resultdir = D_RESULT_DIR;
-	programsettings.numlinks = 0;
-	programsettings.links = NULL;
-	programsettings.ipv6 = 0;
-
-	// optstring init
-	for (idx = 0, ridx = 0; idx != length(longopts); ++idx, ++ridx) {
+	rdw_settings_init(&programsettings);
+
+	// optstring init (without terminating item of longopts)
+	for (idx = 0, ridx = 0; idx != length(longopts) - 1; ++idx, ++ridx) {
 		assert(ridx < optlen);
 
 		optstring[ridx] = longopts[idx].val;
@@ -180,6 +592,251 @@ proc_opts(int argc, char **argv)
 		case 'R':
 			programsettings.resultdir = optarg;
 			break;
+		case 'H':
+			if ((programsettings.hedge = atoi(optarg)) <= 0) {
+				fprintf(stderr, "hedge stall time must be "
+						"a number\n");
+				exit(1);
+			}
+			break;
+		case 'n':
+			if ((programsettings.retries = atoi(optarg)) < 0) {
+				fprintf(stderr, "number of retries must be "
+						"a number\n");
+				exit(1);
+			}
+			break;
+		case 'm':
+			if ((programsettings.maxredirs = atoi(optarg)) < 0) {
+				fprintf(stderr, "number of redirects must be "
+						"a number\n");
+				exit(1);
+			}
+			break;
+		case 'w':
+			if ((programsettings.retrywait = atoi(optarg)) <= 0) {
+				fprintf(stderr, "retry wait must be "
+						"a number\n");
+				exit(1);
+			}
+			break;
+		case 'k':
+			programsettings.tlsverify = 0;
+			break;
+		case 'a':
+			programsettings.cafile = optarg;
+			break;
+		case '2':
+			programsettings.http2 = 1;
+			break;
+		case 'F':
+			programsettings.sprf.tfo = 1;
+			break;
+		case 'b':
+			if ((_strtosize(optarg, &size) == -1) || (size <= 0) ||
+					(size > 0x7FFFFFFF)) {
+				fprintf(stderr, "receive buffer must be "
+						"a size (e.g. 4M)\n");
+				exit(1);
+			}
+			programsettings.sprf.rcvbuf = (int)size;
+			break;
+		case 'B':
+			if ((programsettings.sprf.rcvbuf =
+					parse_bdp(optarg)) <= 0) {
+				fprintf(stderr, "bdp must be in form "
+						"rate,rtt (e.g. 100M,80)\n");
+				exit(1);
+			}
+			break;
+		case 'C':
+			programsettings.sprf.congestion = optarg;
+			break;
+		case 'T':
+			if ((programsettings.sprf.conntimeout =
+					atoi(optarg)) <= 0) {
+				fprintf(stderr, "connect timeout must be "
+						"a number\n");
+				exit(1);
+			}
+			break;
+		case 't':
+			if ((programsettings.sprf.readtimeout =
+					atoi(optarg)) <= 0) {
+				fprintf(stderr, "read timeout must be "
+						"a number\n");
+				exit(1);
+			}
+			break;
+		case 'O':
+			programsettings.output = optarg;
+			break;
+		case 'A':
+			programsettings.pack = optarg;
+			break;
+		case 'd':
+			if (strcmp(optarg, "none") == 0) {
+				programsettings.durability = DUR_NONE;
+			} else if (strcmp(optarg, "end") == 0) {
+				programsettings.durability = DUR_END;
+			} else if (strcmp(optarg, "batch") == 0) {
+				programsettings.durability = DUR_BATCH;
+			} else {
+				fprintf(stderr, "durability must be none, end "
+						"or batch\n");
+				exit(1);
+			}
+			break;
+		case 's':
+			if ((_strtosize(optarg, &size) == -1) || (size < 0)) {
+				fprintf(stderr, "writeback must be "
+						"a size (e.g. 8M)\n");
+				exit(1);
+			}
+			programsettings.writeback = size;
+			break;
+		case 'M':
+			if ((_strtosize(optarg, &size) == -1) || (size <= 0)) {
+				fprintf(stderr, "mem-budget must be "
+						"a size (e.g. 256M)\n");
+				exit(1);
+			}
+			programsettings.membudget = size;
+			break;
+		case 'g':
+			if ((_strtosize(optarg, &size) == -1) || (size < 0)) {
+				fprintf(stderr, "small must be "
+						"a size (e.g. 64k)\n");
+				exit(1);
+			}
+			programsettings.small = size;
+			break;
+		case 'K':
+			if ((programsettings.sprf.keepalive =
+					atoi(optarg)) < 0) {
+				fprintf(stderr, "keep-alive must be "
+						"a number\n");
+				exit(1);
+			}
+			break;
+		case 'x':
+			programsettings.trace = optarg;
+			break;
+		case 'X':
+			programsettings.log = optarg;
+			break;
+		case 'U':
+			if (strcmp(optarg, "text") == 0) {
+				programsettings.logformat = LOG_TEXT;
+			} else if (strcmp(optarg, "json") == 0) {
+				programsettings.logformat = LOG_JSON;
+			} else {
+				fprintf(stderr, "log format must be text or "
+						"json\n");
+				exit(1);
+			}
+			break;
+		case 'P':
+			if (strcmp(optarg, "auto") == 0) {
+				programsettings.progress = PROGRESS_AUTO;
+			} else if (strcmp(optarg, "line") == 0) {
+				programsettings.progress = PROGRESS_LINE;
+			} else if (strcmp(optarg, "none") == 0) {
+				programsettings.progress = PROGRESS_NONE;
+			} else {
+				fprintf(stderr, "progress must be auto, line "
+						"or none\n");
+				exit(1);
+			}
+			break;
+		case 'r':
+			programsettings.recursive = 1;
+			break;
+		case 'l':
+			if ((programsettings.depth = atoi(optarg)) < 0) {
+				fprintf(stderr, "depth must be a number\n");
+				exit(1);
+			}
+			break;
+		case 'I':
+			programsettings.include = optarg;
+			break;
+		case 'L':
+			if ((programsettings.hostlimit = atoi(optarg)) <= 0) {
+				fprintf(stderr, "host limit must be "
+						"a number\n");
+				exit(1);
+			}
+			break;
+		case 'z':
+			programsettings.delta = optarg;
+			break;
+		case 'Z':
+			programsettings.manifest = optarg;
+			break;
+		case 'e':
+			if ((metalinkfile = metalink_load(optarg)) == NULL)
+				exit(1);
+			programsettings.metalink = metalinkfile;
+			break;
+		case 'u':
+			if (strcmp(optarg, "only") == 0) {
+				programsettings.unpack = UNPACK_ONLY;
+			} else if (strcmp(optarg, "both") == 0) {
+				programsettings.unpack = UNPACK_BOTH;
+			} else {
+				fprintf(stderr, "unpack must be only or both\n");
+				exit(1);
+			}
+			break;
+		case 'o':
+			if (strcmp(optarg, "given") == 0) {
+				programsettings.order = ORDER_GIVEN;
+			} else if (strcmp(optarg, "size") == 0) {
+				programsettings.order = ORDER_SIZE;
+			} else if (strcmp(optarg, "deadline") == 0) {
+				programsettings.order = ORDER_DEADLINE;
+			} else {
+				fprintf(stderr, "order must be given, size "
+						"or deadline\n");
+				exit(1);
+			}
+			break;
+		case 'i':
+			batchfile = optarg;
+			break;
+		case 'D':
+			programsettings.daemon = optarg;
+			break;
+		case 'S':
+			programsettings.submit = optarg;
+			break;
+		case 'j':
+			programsettings.journal = optarg;
+			break;
+		case 'p':
+			programsettings.priority = atoi(optarg);
+			break;
+		case 'W':
+			if ((programsettings.workers = atoi(optarg)) <= 0) {
+				fprintf(stderr, "number of workers must be "
+						"a number\n");
+				exit(1);
+			}
+			break;
+		case 'Y':
+			programsettings.profile = optarg;
+			noprofile = (strcmp(optarg, "none") == 0);
+			break;
+		case 'G':
+			programsettings.coordinator = optarg;
+			break;
+		case 'J':
+			programsettings.join = optarg;
+			break;
+		case 'E':
+			programsettings.sendback = 1;
+			break;
 //		case '6':
 			// # define HTTP_IPV6_SOCKS
 			// programsettings.ipv6 = 1;
@@ -193,33 +850,239 @@ proc_opts(int argc, char **argv)
 		}
 	}
 
+	// profiles are kept in home directory unless told otherwise
+	if (noprofile)
+		programsettings.profile = NULL;
+	else if ((programsettings.profile == NULL) &&
+			((home = getenv("HOME")) != NULL))
+		programsettings.profile = _strcat(home,
+				"/" HOSTPROF_FILE);
+
 	argv += optind;
 
 	linknum = argc - optind;
 
-	if (linknum == 0) {
+	// link of metalink is used if none is given
+	if ((linknum == 0) && (metalinkfile != NULL) &&
+			(metalinkfile->urlnum > 0)) {
+		argv = metalinkfile->urls;
+		linknum = 1;
+	}
+
+	for (linkidx = 0; linkidx != linknum; ++linkidx)
+		if (sched_add(&schedlinks, &schednum, argv[linkidx]) == -1)
+			exit(1);
+	if ((batchfile != NULL) &&
+			(sched_load(batchfile, &schedlinks, &schednum) == -1))
+		exit(1);
+	linknum = schednum;
+
+	if ((linknum == 0) && (programsettings.daemon == NULL) &&
+			(programsettings.join == NULL)) {
 		fprintf(stderr, "there was no link in parameters");
 		usage();
 	}
 
 //	printf("num of http_links: %d\n", linknum);
 
-	programsettings.numlinks = linknum;
-	programsettings.links = malloc(linknum * sizeof (char *) + 1);
+	if ((programsettings.recursive) && (programsettings.output != NULL)) {
+		fprintf(stderr, "recursive mirror can't be downloaded into "
+				"one file\n");
+		exit(1);
+	}
+
+	if ((programsettings.delta != NULL) && ((linknum != 1) ||
+			(programsettings.recursive))) {
+		fprintf(stderr, "only one link can be updated from %s\n",
+				programsettings.delta);
+		exit(1);
+	}
+
+	if ((metalinkfile != NULL) && ((linknum != 1) ||
+			(programsettings.recursive) ||
+			(programsettings.delta != NULL))) {
+		fprintf(stderr, "metalink describes one link, it can't be "
+				"mirrored or updated by delta\n");
+		exit(1);
+	}
 
-	linkidx = 0;
+	if ((programsettings.unpack != UNPACK_OFF) &&
+			((metalinkfile != NULL) ||
+			(programsettings.delta != NULL))) {
+		fprintf(stderr, "link checked by metalink or updated by delta "
+				"can't be unpacked\n");
+		exit(1);
+	}
+
+	if ((programsettings.pack != NULL) &&
+			((programsettings.output != NULL) ||
+			(programsettings.recursive) ||
+			(programsettings.delta != NULL) ||
+			(programsettings.unpack != UNPACK_OFF))) {
+		fprintf(stderr, "links of %s can't be mirrored, streamed, "
+				"updated by delta or unpacked\n",
+				programsettings.pack);
+		exit(1);
+	}
+
+	if ((programsettings.coordinator != NULL) &&
+			((programsettings.recursive) ||
+			(programsettings.pack != NULL) ||
+			(programsettings.delta != NULL) ||
+			(metalinkfile != NULL) ||
+			(programsettings.unpack != UNPACK_OFF) ||
+			((programsettings.output != NULL) &&
+			(strcmp(programsettings.output, "-") == 0)))) {
+		fprintf(stderr, "links leased to workers can't be "
+				"mirrored, streamed, packed, updated by delta, "
+				"checked by metalink or unpacked\n");
+		exit(1);
+	}
 
-	while (*(argv)) {
-//		printf("link nr%d: %s\n", linkidx, *argv);
-		programsettings.links[linkidx++] = *argv;
-		++argv;
+	if ((linknum > 1) && (programsettings.output != NULL) &&
+			(strcmp(programsettings.output, "-") != 0)) {
+		fprintf(stderr, "only one link can be downloaded into %s\n",
+				programsettings.output);
+		exit(1);
 	}
+
+	programsettings.numlinks = linknum;
+	programsettings.links = malloc((linknum + 1) * sizeof (char *));
+
+	for (linkidx = 0; linkidx != linknum; ++linkidx)
+		programsettings.links[linkidx] = schedlinks[linkidx].url;
 	programsettings.links[linkidx] = NULL;
 }
 
+/**
+ * Reports finished job of batch and records its completion time.
+ * \return 0 if job was downloaded, -1 otherwise.
+ */
+static int
+download_done(progress *prg, sched_stats *stats, rdw_job *job, int stream)
+{
+	int ret = 0;
+
+	progress_done(prg, rdw_job_data(job));
+	if (rdw_job_state(job) == RDW_DONE) {
+		sched_stats_done(stats, &schedlinks[progress_idx(prg,
+				rdw_job_data(job))]);
+		progress_message(prg, "%s successfully downloaded! (%s)\n",
+				(stream) ? "-" : rdw_job_path(job),
+				rdw_job_url(job));
+	} else {
+		ret = -1;
+	}
+	rdw_job_free(job);
+	progress_draw(prg);
+
+	return (ret);
+}
+
+/**
+ * Downloads all links of settings and shows their progress. Workers of
+ * links run at once, in order of their priorities and policy of settings
+ * (see schedule.c), a finished one makes way for the next. Links streamed
+ * to stdout (-O -) are downloaded one after another in given order, links
+ * packed by -A are appended to archive as they finish.
+ * \return 0 if all links were downloaded, -1 otherwise.
+ */
+int
+download_links(prgstx *stx)
+{
+	rdw_ctx *ctx;
+	rdw_job *job;
+	rdw_dest dest;
+	pack *pk = NULL;
+	progress *prg;
+	sched_stats stats;
+	FILE *msgs = stdout;
+	int lnkidx, workers, pending = 0, ret = 0;
+
+	memset(&dest, 0, sizeof (dest));
+	dest.fd = -1;
+	dest.progress = progress_update;
+	if ((stx->output != NULL) && (strcmp(stx->output, "-") == 0)) {
+		dest.fd = STDOUT_FILENO;
+		dest.stream = 1;
+		msgs = stderr;
+	} else {
+		dest.path = stx->output;
+	}
+
+	// small links of batch reuse connections of a few workers
+	workers = (stx->numlinks < stx->workers) ? stx->numlinks :
+			stx->workers;
+	if (dest.stream) {
+		workers = 1;
+	} else if (sched_needed(schedlinks, schednum, stx->order)) {
+		if (stx->order == ORDER_SIZE)
+			sched_probe(schedlinks, schednum, stx);
+		sched_order(schedlinks, schednum, stx->order);
+	}
+
+	if ((stx->pack != NULL) && ((dest.pack = pk = pack_open(stx->pack,
+			stx->durability, stx->writeback)) == NULL))
+		return (-1);
+	if ((ctx = rdw_init(stx, workers)) == NULL) {
+		if (pk != NULL)
+			pack_close(pk);
+		return (-1);
+	}
+	prg = progress_init(msgs, stx->progress, stx->numlinks);
+	sched_stats_init(&stats);
+
+	for (lnkidx = 0; lnkidx != schednum; ++lnkidx) {
+		dest.data = progress_file(prg, lnkidx, schedlinks[lnkidx].url);
+		dest.priority = schedlinks[lnkidx].priority;
+		if (rdw_submit(ctx, schedlinks[lnkidx].url, NULL, &dest) !=
+				NULL) {
+			progress_message(prg, "downloading link %s\n",
+					schedlinks[lnkidx].url);
+			++pending;
+		} else {
+			ret = -1;
+		}
+		// links finished meanwhile are counted when they finish
+		while ((job = rdw_poll(ctx, 0)) != NULL) {
+			--pending;
+			if (download_done(prg, &stats, job, dest.stream) == -1)
+				ret = -1;
+		}
+	}
+
+	progress_message(prg, "\nWait please for downloading all links...\n\n");
+
+	while (pending > 0) {
+		if ((job = rdw_poll(ctx, PROGRESS_REFRESH_MS)) == NULL) {
+			progress_draw(prg);
+			continue;
+		}
+		--pending;
+		if (download_done(prg, &stats, job, dest.stream) == -1)
+			ret = -1;
+	}
+
+	if (stats.done > 1)
+		progress_message(prg, "%d files in %.2f s (%.1f files/s): mean "
+				"completion %.2f s, first file after %.2f s, "
+				"%d deadlines missed\n", stats.done, stats.last,
+				stats.done / stats.last, stats.sum / stats.done,
+				stats.first, stats.missed);
+
+	progress_free(prg);
+	rdw_shutdown(ctx);
+	if ((pk != NULL) && (pack_close(pk) == -1))
+		ret = -1;
+
+	return (ret);
+}
+
 int
 main(int argc, char **argv)
 {
+	int ret;
+
 	prgname = argv[0];
 
 	if (argc < 2)
@@ -227,7 +1090,39 @@ main(int argc, char **argv)
 
 	proc_opts(argc, argv);
 
-	thr_mgr_downloadallfiles(&programsettings);
+	// broken connections are reported by write, not by signal
+	signal(SIGPIPE, SIG_IGN);
+
+	if (log_open(programsettings.log, programsettings.logformat) == -1)
+		return (1);
+
+	if ((programsettings.trace != NULL) &&
+			(trace_open(programsettings.trace) == -1)) {
+		log_close();
+		return (1);
+	}
+
+	if ((programsettings.profile != NULL) &&
+			(hostprof_load(programsettings.profile) == -1))
+		log_error(NULL, errno, "%s", programsettings.profile);
+
+	if (programsettings.daemon != NULL)
+		ret = daemon_run(&programsettings);
+	else if (programsettings.submit != NULL)
+		ret = daemon_submit(&programsettings);
+	else if (programsettings.coordinator != NULL)
+		ret = coord_run(&programsettings);
+	else if (programsettings.join != NULL)
+		ret = coord_join(&programsettings);
+	else if (programsettings.recursive)
+		ret = crawl_run(&programsettings);
+	else
+		ret = download_links(&programsettings);
 
-	return (0);
+	if ((programsettings.profile != NULL) &&
+			(programsettings.submit == NULL))
+		hostprof_save(programsettings.profile);
+	trace_close();
+	log_close();
+	return ((ret == 0) ? 0 : 1);
 }
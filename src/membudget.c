@@ -0,0 +1,157 @@
+/*!
+ * \file
+ * \brief Memory budget of process shared by all downloads.
+ *
+ *  Mapped windows of files, receive buffers and reorder buffers of streamed
+ *  links are accounted in one budget. Large reservations (reorder buffers)
+ *  wait until they fit, mappings which don't fit are replaced by writing
+ *  into file (membudget_try fails) and small receive buffers are charged
+ *  without waiting, so that no download holding budget waits for it.
+ *  Without limit the usage is only accounted.
+ */
+
+#include <time.h>
+#include <pthread.h>
+
+#include "membudget.h"
+
+static long long int budget_limit;	// 0 = unlimited
+static long long int budget_used;
+static long long int budget_peak;
+static pthread_mutex_t budget_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t budget_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Sets limit of budget in bytes (0 = unlimited).
+ */
+void
+membudget_init(long long int limit)
+{
+	pthread_mutex_lock(&budget_lock);
+	budget_limit = limit;
+	pthread_cond_broadcast(&budget_cond);
+	pthread_mutex_unlock(&budget_lock);
+}
+
+/**
+ * Accounts size bytes. Called with budget_lock held.
+ */
+static void
+membudget_add(long long int size)
+{
+	budget_used += size;
+	if (budget_used > budget_peak)
+		budget_peak = budget_used;
+}
+
+/**
+ * Reserves size bytes, waits until they fit into limit or until *cancel
+ * (if cancel isn't NULL) is set.
+ * \return 0 on success, -1 if size exceeds limit or waiting was cancelled.
+ */
+int
+membudget_reserve(long long int size, const int *cancel)
+{
+	struct timespec wakeup;
+
+	pthread_mutex_lock(&budget_lock);
+	while ((budget_limit > 0) && (budget_used + size > budget_limit)) {
+		if ((size > budget_limit) || ((cancel != NULL) &&
+				(__atomic_load_n(cancel, __ATOMIC_RELAXED)))) {
+			pthread_mutex_unlock(&budget_lock);
+			return (-1);
+		}
+		clock_gettime(CLOCK_REALTIME, &wakeup);
+		wakeup.tv_nsec += MEMBUDGET_POLL_MS * 1000000L;
+		if (wakeup.tv_nsec >= 1000000000L) {
+			++wakeup.tv_sec;
+			wakeup.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&budget_cond, &budget_lock, &wakeup);
+	}
+	membudget_add(size);
+	pthread_mutex_unlock(&budget_lock);
+
+	return (0);
+}
+
+/**
+ * Reserves size bytes if they fit into limit now.
+ * \return 0 on success, -1 if they don't fit.
+ */
+int
+membudget_try(long long int size)
+{
+	int ret = -1;
+
+	pthread_mutex_lock(&budget_lock);
+	if ((budget_limit == 0) || (budget_used + size <= budget_limit)) {
+		membudget_add(size);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&budget_lock);
+
+	return (ret);
+}
+
+/**
+ * Accounts size bytes without waiting (usage may exceed limit for a while).
+ */
+void
+membudget_charge(long long int size)
+{
+	pthread_mutex_lock(&budget_lock);
+	membudget_add(size);
+	pthread_mutex_unlock(&budget_lock);
+}
+
+/**
+ * Releases size bytes reserved or charged before.
+ */
+void
+membudget_release(long long int size)
+{
+	pthread_mutex_lock(&budget_lock);
+	budget_used -= size;
+	pthread_cond_broadcast(&budget_cond);
+	pthread_mutex_unlock(&budget_lock);
+}
+
+/**
+ * \return bytes accounted now.
+ */
+long long int
+membudget_used(void)
+{
+	long long int used;
+
+	pthread_mutex_lock(&budget_lock);
+	used = budget_used;
+	pthread_mutex_unlock(&budget_lock);
+	return (used);
+}
+
+/**
+ * \return the most bytes accounted at once.
+ */
+long long int
+membudget_peak(void)
+{
+	long long int peak;
+
+	pthread_mutex_lock(&budget_lock);
+	peak = budget_peak;
+	pthread_mutex_unlock(&budget_lock);
+	return (peak);
+}
+
+long long int
+membudget_limit(void)
+{
+	long long int limit;
+
+	pthread_mutex_lock(&budget_lock);
+	limit = budget_limit;
+	pthread_mutex_unlock(&budget_lock);
+	return (limit);
+}
@@ -0,0 +1,17 @@
+#ifndef MEMBUDGET_H
+#define	MEMBUDGET_H
+
+#include "defaults.h"
+
+#define	MEMBUDGET_POLL_MS 200	// waiting reservation checks cancel
+
+void membudget_init(long long int limit);
+int membudget_reserve(long long int size, const int *cancel);
+int membudget_try(long long int size);
+void membudget_charge(long long int size);
+void membudget_release(long long int size);
+long long int membudget_used(void);
+long long int membudget_peak(void);
+long long int membudget_limit(void);
+
+#endif /* MEMBUDGET_H */
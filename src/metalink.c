@@ -0,0 +1,754 @@
+/*!
+ * \file
+ * \brief Metalink input: mirrors, size and piece digests of file.
+ *
+ *  Only the first file of Metalink (RFC 5854, or version 3) is read by a
+ *  small scanner of its elements (file, size, url, hash, pieces). Size of
+ *  metalink saves header request, chunk ranges are aligned to pieces and
+ *  every range is checked as soon as its chunk finishes. Pieces which
+ *  don't match (or whose chunk failed) are the only ones fetched again,
+ *  from the next link of metalink. Without piece digests failed ranges are
+ *  re-fetched in units of METALINK_UNIT and the whole file is checked by
+ *  its digest at end.
+ */
+
+#define	_GNU_SOURCE	// memmem
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+
+#include "metalink.h"
+#include "threadmanager.h"
+#include "httpclient.h"
+#include "linkparser.h"
+#include "membudget.h"
+#include "trace.h"
+#include "log.h"
+
+#define	METALINK_NAME_MAX 32	// longer element names are cut
+#define	METALINK_READ_SIZE (4 * 1024 * 1024)	// file is hashed by pieces of
+
+#define	PIECE_MISSING 0
+#define	PIECE_OK 1
+
+/**
+ * Element tag of metalink: name without namespace prefix, attributes and
+ * text which follows it up to the next tag.
+ */
+typedef struct
+{
+	char name[METALINK_NAME_MAX];
+	int end;		// </name>
+	int empty;		// <name/>
+	const char *attrs, *text;
+	size_t attrslen, textlen;
+} metalink_tag;
+
+/**
+ * Pieces of file checked as their ranges land.
+ */
+typedef struct
+{
+	const metalink *ml;
+	lnk *link;
+	const EVP_MD *md;	// digest of pieces, NULL if metalink has none
+	long long int size;	// size of file
+	long long int unit;	// piece (METALINK_UNIT without piece digests)
+	long long int units;
+	char *status;		// PIECE_* of every unit
+	unsigned char *buf;	// one piece
+} metalink_check;
+
+/**
+ * Reads tag at *pos (comments, declarations and processing instructions
+ * are skipped) and moves *pos behind it.
+ * \return 0 on success, -1 at end of buf.
+ */
+static int
+metalink_next_tag(const char **pos, const char *end, metalink_tag *tag)
+{
+	const char *tagpos = *pos, *close, *name, *colon, *next;
+	size_t len;
+
+	for (;;) {
+		if ((tagpos = memchr(tagpos, '<', end - tagpos)) == NULL)
+			return (-1);
+		if ((end - tagpos >= 4) && (memcmp(tagpos, "<!--", 4) == 0)) {
+			if ((close = memmem(tagpos + 4, end - tagpos - 4, "-->",
+					3)) == NULL)
+				return (-1);
+			tagpos = close + 3;
+			continue;
+		}
+		if ((close = memchr(tagpos, '>', end - tagpos)) == NULL)
+			return (-1);
+		if ((tagpos[1] != '?') && (tagpos[1] != '!'))
+			break;
+		tagpos = close + 1;
+	}
+
+	tag->end = (tagpos[1] == '/');
+	name = tagpos + 1 + tag->end;
+	tag->empty = (close > name) && (close[-1] == '/');
+	for (len = 0; (name + len < close) && (name[len] != '/') &&
+			(!isspace((unsigned char) name[len])); ++len)
+		;
+	tag->attrs = name + len;
+	tag->attrslen = close - tag->attrs - tag->empty;
+	if ((colon = memchr(name, ':', len)) != NULL) {
+		len -= colon + 1 - name;
+		name = colon + 1;
+	}
+	if (len >= METALINK_NAME_MAX)
+		len = METALINK_NAME_MAX - 1;
+	memcpy(tag->name, name, len);
+	tag->name[len] = '\0';
+
+	tag->text = close + 1;
+	next = memchr(tag->text, '<', end - tag->text);
+	tag->textlen = ((next != NULL) ? next : end) - tag->text;
+	*pos = close + 1;
+
+	return (0);
+}
+
+/**
+ * Decodes XML entities of len bytes of str.
+ * \return new string.
+ */
+static char *
+metalink_decode(const char *str, size_t len)
+{
+	static const char *entities[][2] = {
+		{ "&amp;", "&" }, { "&lt;", "<" }, { "&gt;", ">" },
+		{ "&quot;", "\"" }, { "&apos;", "'" }
+	};
+	const char *end = str + len;
+	char *decoded = malloc(len + 1), *out = decoded;
+	size_t idx, entlen;
+
+	while (str < end) {
+		for (idx = 0; idx != sizeof (entities) / sizeof (*entities);
+				++idx) {
+			entlen = strlen(entities[idx][0]);
+			if ((end - str >= (long) entlen) && (memcmp(str,
+					entities[idx][0], entlen) == 0))
+				break;
+		}
+		if (idx == sizeof (entities) / sizeof (*entities)) {
+			*(out++) = *(str++);
+		} else {
+			*(out++) = entities[idx][1][0];
+			str += entlen;
+		}
+	}
+	*out = '\0';
+
+	return (decoded);
+}
+
+/**
+ * \return value of attribute name of tag (new string), NULL if tag hasn't
+ * the attribute.
+ */
+static char *
+metalink_attr(const metalink_tag *tag, const char *name)
+{
+	const char *pos = tag->attrs, *end = tag->attrs + tag->attrslen;
+	const char *attr, *value;
+	size_t len = strlen(name), attrlen;
+	char quote;
+
+	for (;;) {
+		while ((pos < end) && (isspace((unsigned char) *pos)))
+			++pos;
+		for (attr = pos; (pos < end) && (*pos != '=') &&
+				(!isspace((unsigned char) *pos)); ++pos)
+			;
+		attrlen = pos - attr;
+		while ((pos < end) && (isspace((unsigned char) *pos)))
+			++pos;
+		if ((pos == end) || (*(pos++) != '='))
+			return (NULL);
+		while ((pos < end) && (isspace((unsigned char) *pos)))
+			++pos;
+		if ((pos == end) || ((*pos != '"') && (*pos != '\'')))
+			return (NULL);
+		quote = *(pos++);
+		value = pos;
+		if ((pos = memchr(pos, quote, end - pos)) == NULL)
+			return (NULL);
+		if ((attrlen == len) && (memcmp(attr, name, len) == 0))
+			return (metalink_decode(value, pos - value));
+		++pos;
+	}
+}
+
+/**
+ * \return text of tag without surrounding white space (new string).
+ */
+static char *
+metalink_text(const metalink_tag *tag)
+{
+	const char *text = tag->text, *end = tag->text + tag->textlen;
+
+	while ((text < end) && (isspace((unsigned char) *text)))
+		++text;
+	while ((end > text) && (isspace((unsigned char) end[-1])))
+		--end;
+	return (metalink_decode(text, end - text));
+}
+
+/**
+ * Normalizes digest name type of metalink (sha-256, SHA256) into name
+ * (sha256, at least METALINK_TYPE_MAX bytes).
+ * \return digest size, -1 if digest isn't known.
+ */
+static int
+metalink_digest(const char *type, char *name)
+{
+	const EVP_MD *md;
+	int len = 0, size;
+
+	for (; (*type != '\0') && (len < METALINK_TYPE_MAX - 1); ++type)
+		if (*type != '-')
+			name[len++] = tolower((unsigned char) *type);
+	name[len] = '\0';
+	if ((*type != '\0') || ((md = EVP_get_digestbyname(name)) == NULL))
+		return (-1);
+	size = EVP_MD_size(md);
+	return (((size > 0) && (size <= METALINK_HASH_MAX)) ? size : -1);
+}
+
+/**
+ * Decodes hex digest text of len bytes into digest.
+ * \return 0 on success, -1 if text isn't digest of len bytes.
+ */
+static int
+metalink_hex(const char *text, unsigned char *digest, int len)
+{
+	unsigned int byte;
+	int idx;
+
+	if (strlen(text) != (size_t) len * 2)
+		return (-1);
+	for (idx = 0; idx != len; ++idx) {
+		if ((!isxdigit((unsigned char) text[2 * idx])) || (!isxdigit(
+				(unsigned char) text[2 * idx + 1])) ||
+				(sscanf(text + 2 * idx, "%2x", &byte) != 1))
+			return (-1);
+		digest[idx] = (unsigned char) byte;
+	}
+	return (0);
+}
+
+/**
+ * Adds link url (only http and https ones) of priority (lower first) to
+ * metalink, links of equal priority keep their order.
+ */
+static void
+metalink_add_url(metalink *ml, int **prios, char *url, int prio)
+{
+	int idx;
+
+	if ((strncmp(url, PROTOCOL_HTTP, strlen(PROTOCOL_HTTP)) != 0) &&
+			(strncmp(url, PROTOCOL_HTTPS,
+			strlen(PROTOCOL_HTTPS)) != 0)) {
+		free(url);
+		return;
+	}
+	ml->urls = realloc(ml->urls, sizeof (char *) * (ml->urlnum + 1));
+	*prios = realloc(*prios, sizeof (int) * (ml->urlnum + 1));
+	for (idx = ml->urlnum; (idx > 0) && ((*prios)[idx - 1] > prio); --idx) {
+		ml->urls[idx] = ml->urls[idx - 1];
+		(*prios)[idx] = (*prios)[idx - 1];
+	}
+	ml->urls[idx] = url;
+	(*prios)[idx] = prio;
+	++ml->urlnum;
+}
+
+/**
+ * \return priority of url tag (priority of version 4, preference of
+ * version 3), lower is better.
+ */
+static int
+metalink_url_prio(const metalink_tag *tag)
+{
+	char *value;
+	int prio = 1000000;
+
+	if ((value = metalink_attr(tag, "priority")) != NULL) {
+		prio = atoi(value);
+	} else if ((value = metalink_attr(tag, "preference")) != NULL) {
+		prio = 1000000 - atoi(value);
+	}
+	free(value);
+	return (prio);
+}
+
+/**
+ * Takes digest of whole file from hash tag, the strongest one is kept.
+ */
+static void
+metalink_add_hash(metalink *ml, const metalink_tag *tag)
+{
+	unsigned char digest[METALINK_HASH_MAX];
+	char name[METALINK_TYPE_MAX];
+	char *type, *text = NULL;
+	int len;
+
+	if (((type = metalink_attr(tag, "type")) != NULL) &&
+			((len = metalink_digest(type, name)) > ml->hashlen) &&
+			(metalink_hex(text = metalink_text(tag), digest,
+			len) == 0)) {
+		memcpy(ml->hash, digest, len);
+		memcpy(ml->hashtype, name, sizeof (name));
+		ml->hashlen = len;
+	}
+	free(text);
+	free(type);
+}
+
+/**
+ * Starts pieces of metalink by pieces tag.
+ * \return 1 if digests of the pieces are taken, 2 if they are skipped (an
+ * unknown digest or pieces given already), -1 if tag isn't valid.
+ */
+static int
+metalink_start_pieces(metalink *ml, const metalink_tag *tag)
+{
+	char *type, *length;
+	int ret = 2;
+
+	if (ml->piecetype[0] != '\0')
+		return (2);
+	type = metalink_attr(tag, "type");
+	length = metalink_attr(tag, "length");
+	if ((type == NULL) || (length == NULL) ||
+			((ml->piecelen = strtoll(length, NULL, 10)) < 1) ||
+			(ml->piecelen > METALINK_PIECE_MAX)) {
+		ret = -1;
+	} else if ((ml->piecehashlen = metalink_digest(type,
+			ml->piecetype)) > 0) {
+		ret = 1;
+	} else {
+		ml->piecetype[0] = '\0';
+	}
+	free(type);
+	free(length);
+
+	return (ret);
+}
+
+/**
+ * Parses metalink buf of len bytes (only its first file is taken).
+ * \return new metalink, NULL if it isn't valid.
+ */
+metalink *
+metalink_parse(const char *buf, size_t len)
+{
+	metalink *ml = calloc(1, sizeof (metalink));
+	const char *pos = buf, *end = buf + len;
+	metalink_tag tag;
+	int files = 0, infile = 0, inpieces = 0, root = 0;
+	long long int piecemax = 0;
+	int *prios = NULL;
+	char *text, *type;
+
+	ml->size = -1;
+	while (metalink_next_tag(&pos, end, &tag) == 0) {
+		if (strcmp(tag.name, "metalink") == 0) {
+			root = 1;
+			continue;
+		}
+		if (strcmp(tag.name, "file") == 0) {
+			if (tag.end)
+				infile = 0;
+			else if ((infile = (++files == 1)) &&
+					(ml->name == NULL))
+				ml->name = metalink_attr(&tag, "name");
+			continue;
+		}
+		if (!infile)
+			continue;
+		if (tag.end) {
+			if (strcmp(tag.name, "pieces") == 0)
+				inpieces = 0;
+			continue;
+		}
+
+		if (strcmp(tag.name, "size") == 0) {
+			text = metalink_text(&tag);
+			if ((text[0] < '0') || (text[0] > '9') || ((ml->size =
+					strtoll(text, NULL, 10)) < 0))
+				ml->size = -2;
+			free(text);
+		} else if (strcmp(tag.name, "url") == 0) {
+			// links of version 3 may be torrents or ftp
+			type = metalink_attr(&tag, "type");
+			if ((type == NULL) || (strcasecmp(type, "http") == 0) ||
+					(strcasecmp(type, "https") == 0))
+				metalink_add_url(ml, &prios,
+						metalink_text(&tag),
+						metalink_url_prio(&tag));
+			free(type);
+		} else if (strcmp(tag.name, "pieces") == 0) {
+			if ((inpieces = metalink_start_pieces(ml, &tag)) == -1)
+				goto fail;
+		} else if ((strcmp(tag.name, "hash") == 0) && (inpieces == 1)) {
+			if (ml->piecenum == piecemax) {
+				piecemax = (piecemax == 0) ? 64 : 2 * piecemax;
+				ml->pieces = realloc(ml->pieces, piecemax *
+						ml->piecehashlen);
+			}
+			text = metalink_text(&tag);
+			if (metalink_hex(text, ml->pieces + ml->piecenum *
+					ml->piecehashlen,
+					ml->piecehashlen) == -1) {
+				free(text);
+				goto fail;
+			}
+			free(text);
+			++ml->piecenum;
+		} else if ((strcmp(tag.name, "hash") == 0) && (inpieces == 0)) {
+			metalink_add_hash(ml, &tag);
+		}
+	}
+
+	// every piece has to have its digest
+	if ((!root) || (files == 0) || (ml->size == -2) ||
+			((ml->piecetype[0] != '\0') && ((ml->size < 0) ||
+			(ml->piecenum != (ml->size + ml->piecelen - 1) /
+			ml->piecelen))))
+		goto fail;
+	free(prios);
+	return (ml);
+fail:
+	free(prios);
+	metalink_free(ml);
+	return (NULL);
+}
+
+/**
+ * Reads and parses metalink file path.
+ * \return new metalink, NULL on fail.
+ */
+metalink *
+metalink_load(const char *path)
+{
+	metalink *ml = NULL;
+	struct stat st;
+	char *buf;
+	int fd;
+
+	if (((fd = open(path, O_RDONLY)) == -1) || (fstat(fd, &st) == -1) ||
+			(st.st_size > METALINK_MAX)) {
+		log_error(NULL, (fd == -1) ? errno : 0, "metalink %s can't "
+				"be read", path);
+		if (fd != -1)
+			close(fd);
+		return (NULL);
+	}
+	buf = malloc(st.st_size + 1);
+	if (pread(fd, buf, st.st_size, 0) == st.st_size)
+		ml = metalink_parse(buf, st.st_size);
+	if (ml == NULL)
+		log_error(NULL, 0, "metalink %s isn't valid", path);
+	free(buf);
+	close(fd);
+
+	return (ml);
+}
+
+void
+metalink_free(metalink *ml)
+{
+	int idx;
+
+	for (idx = 0; idx != ml->urlnum; ++idx)
+		free(ml->urls[idx]);
+	free(ml->urls);
+	free(ml->pieces);
+	free(ml->name);
+	free(ml);
+}
+
+/**
+ * Reads len bytes of file fd at pos into buf.
+ * \return 0 on success, -1 on fail.
+ */
+static int
+metalink_read(file_fd fd, unsigned char *buf, long long int len,
+		long long int pos)
+{
+	ssize_t rd;
+
+	while (len > 0) {
+		if ((rd = pread(fd, buf, len, pos)) <= 0)
+			return (-1);
+		buf += rd;
+		pos += rd;
+		len -= rd;
+	}
+	return (0);
+}
+
+/**
+ * Checks pieces of range start - end of file fd whose chunk finished (link
+ * verify callback), pieces which don't match their digests stay missing.
+ * param data of type (metalink_check *).
+ */
+static void
+metalink_check_range(void *data, int fd, long long int start,
+		long long int end)
+{
+	metalink_check *chk = (metalink_check *) data;
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	long long int unit, pos, len;
+	unsigned int mdlen;
+	double tstart = trace_begin();
+	int bad = 0;
+
+	for (unit = start / chk->unit; unit * chk->unit <= end; ++unit) {
+		if (chk->md == NULL) {
+			chk->status[unit] = PIECE_OK;
+			continue;
+		}
+		pos = unit * chk->unit;
+		len = (chk->size - pos < chk->unit) ? chk->size - pos :
+				chk->unit;
+		if ((metalink_read(fd, chk->buf, len, pos) == 0) &&
+				(EVP_Digest(chk->buf, len, digest, &mdlen,
+				chk->md, NULL) == 1) &&
+				(memcmp(digest, chk->ml->pieces + unit *
+				chk->ml->piecehashlen,
+				chk->ml->piecehashlen) == 0)) {
+			chk->status[unit] = PIECE_OK;
+		} else {
+			chk->status[unit] = PIECE_MISSING;
+			++bad;
+		}
+	}
+	trace_end("verify", tstart, chk->link, start, end);
+
+	if (bad > 0)
+		log_range(LOG_ERROR, chk->link, start, end, 0, "%d pieces of "
+				"%s in %lld-%lld don't match their digests",
+				bad,
+				chk->link->filename, start, end);
+}
+
+/**
+ * Plans ranges of missing pieces, neighbouring pieces are joined and
+ * ranges are split so that chunks get similar parts (of METALINK_RANGE_MAX
+ * at most, so that pieces are checked soon).
+ * \return new plan.
+ */
+static chunk_plan *
+metalink_plan(const metalink_check *chk, int chunks)
+{
+	chunk_plan *plan = chunkplan_empty(chk->size, chk->unit);
+	long long int unit, start, end, missing = 0, piece;
+	int ridx;
+
+	for (unit = 0; unit < chk->units; ++unit) {
+		if (chk->status[unit] == PIECE_OK)
+			continue;
+		start = unit * chk->unit;
+		end = ((unit + 1 < chk->units) ? (unit + 1) * chk->unit :
+				chk->size) - 1;
+		missing += end + 1 - start;
+		if ((plan->num > 0) &&
+				(plan->ranges[plan->num - 1].end + 1 == start))
+			plan->ranges[plan->num - 1].end = end;
+		else
+			chunkplan_add(plan, start, end);
+	}
+
+	piece = missing / ((chunks < 1) ? 1 : chunks);
+	if (piece > METALINK_RANGE_MAX)
+		piece = METALINK_RANGE_MAX;
+	if (piece < CHUNKPLAN_MIN_SIZE)
+		piece = CHUNKPLAN_MIN_SIZE;
+	piece = (piece + chk->unit - 1) / chk->unit * chk->unit;
+	for (ridx = 0; ridx < plan->num; ++ridx)
+		if (plan->ranges[ridx].end - plan->ranges[ridx].start >= piece)
+			chunkplan_split(plan, ridx, plan->ranges[ridx].start +
+					piece);
+
+	return (plan);
+}
+
+/**
+ * Checks digest of whole file fd of size bytes against metalink.
+ * \return 0 if it matches, -1 otherwise.
+ */
+static int
+metalink_check_file(const metalink *ml, file_fd fd, long long int size)
+{
+	EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned char *buf = malloc(METALINK_READ_SIZE);
+	long long int pos = 0;
+	ssize_t rd = 0;
+	unsigned int mdlen = 0;
+
+	EVP_DigestInit_ex(ctx, EVP_get_digestbyname(ml->hashtype), NULL);
+	while ((pos < size) && ((rd = pread(fd, buf, METALINK_READ_SIZE,
+			pos)) > 0)) {
+		EVP_DigestUpdate(ctx, buf, rd);
+		pos += rd;
+	}
+	EVP_DigestFinal_ex(ctx, digest, &mdlen);
+	EVP_MD_CTX_free(ctx);
+	free(buf);
+
+	return (((pos == size) && ((int) mdlen == ml->hashlen) &&
+			(memcmp(digest, ml->hash, mdlen) == 0)) ? 0 : -1);
+}
+
+/**
+ * Points link to the next link of metalink (if it has another one) and
+ * asks for its header, so that failed pieces are fetched from a mirror
+ * and redirects are followed.
+ * \return new header, NULL if link can't be used.
+ */
+static lnk_http_header *
+metalink_next_link(lnk *link, int *urlidx, long long int size)
+{
+	const metalink *ml = link->metalink;
+	lnk_http_header *linkh;
+
+	if (ml->urlnum > 1) {
+		*urlidx = (*urlidx + 1) % ml->urlnum;
+		link_retarget(link, ml->urls[*urlidx]);
+	}
+	if (thr_mgr_linkheader(link, &linkh) == -1)
+		return (NULL);
+	if (linkh->clen != size) {
+		log_error(link, 0, "%s:%d%s has %lld bytes instead of "
+				"%lld", link->hostname, link->port,
+				link->rquri, (long long int) linkh->clen, size);
+		link_header_free(linkh);
+		free(linkh);
+		return (NULL);
+	}
+
+	return (linkh);
+}
+
+/**
+ * Downloads link described by link->metalink, linkh is header of link or
+ * NULL if it wasn't requested (size of metalink is used). Ranges are
+ * checked as they land and failed pieces (the whole file if metalink has no
+ * piece digests) are fetched again at most METALINK_ROUNDS times.
+ * \return 0 on success, -1 on fail.
+ */
+int
+metalink_download(const char *resultdir, lnk *link, lnk_http_header *linkh)
+{
+	const metalink *ml = link->metalink;
+	lnk_http_header mlh, *probed = NULL, *next;
+	metalink_check chk;
+	chunk_plan *plan;
+	long long int missing;
+	int round, ridx, urlidx = 0, ret;
+	file_fd fd;
+
+	if (linkh == NULL) {
+		memset(&mlh, 0, sizeof (mlh));
+		mlh.clen = ml->size;
+		mlh.ctype = HTTP_CONTTYPE_DEF;
+		mlh.statcodegrp = SUCCESS;
+		mlh.retryafter = -1;
+		linkh = &mlh;
+	} else if ((ml->size >= 0) && (linkh->clen != ml->size)) {
+		log_error(link, 0, "%s has %lld bytes, metalink says "
+				"%lld", link->rquri,
+				(long long int) linkh->clen, ml->size);
+		return (-1);
+	}
+
+	memset(&chk, 0, sizeof (chk));
+	chk.ml = ml;
+	chk.link = link;
+	chk.size = linkh->clen;
+	if (ml->piecetype[0] != '\0') {
+		chk.md = EVP_get_digestbyname(ml->piecetype);
+		chk.unit = ml->piecelen;
+		chk.buf = malloc(chk.unit);
+		membudget_charge(chk.unit);
+	} else {
+		chk.unit = METALINK_UNIT;
+	}
+	chk.units = (chk.size + chk.unit - 1) / chk.unit;
+	chk.status = calloc(chk.units + 1, 1);
+
+	if ((fd = thr_mgr_createfile(resultdir, link, chk.size)) == -1) {
+		ret = -1;
+		goto out;
+	}
+
+	link->verify = metalink_check_range;
+	link->verifydata = &chk;
+	plan = metalink_plan(&chk, link->chunknum);
+	for (round = 0; (plan->num > 0) && (round <= METALINK_ROUNDS) &&
+			(!__atomic_load_n(&link->cancel, __ATOMIC_RELAXED));
+			++round) {
+		if (round > 0) {
+			for (ridx = 0, missing = 0; ridx != plan->num; ++ridx)
+				missing += plan->ranges[ridx].end + 1 -
+						plan->ranges[ridx].start;
+			log_info(link, "%s: fetching %lld bytes in %d ranges "
+					"again (round %d of %d)",
+					link->filename, missing, plan->num,
+					round, METALINK_ROUNDS);
+			if ((next = metalink_next_link(link, &urlidx,
+					chk.size)) != NULL) {
+				if (probed != NULL)
+					link_header_free(probed);
+				free(probed);
+				linkh = probed = next;
+			}
+		}
+		thr_mgr_downloadplan(link, linkh, fd, plan);
+		chunkplan_free(plan);
+		plan = metalink_plan(&chk, link->chunknum);
+
+		// without piece digests the whole file is fetched again
+		if ((plan->num == 0) && (chk.md == NULL) &&
+				(ml->hashlen > 0) &&
+				(metalink_check_file(ml, fd, chk.size) == -1)) {
+			log_error(link, 0, "%s doesn't match %s of "
+					"metalink", link->filename,
+					ml->hashtype);
+			memset(chk.status, PIECE_MISSING, chk.units);
+			chunkplan_free(plan);
+			plan = metalink_plan(&chk, link->chunknum);
+		}
+	}
+	ret = (plan->num == 0) ? 0 : -1;
+	chunkplan_free(plan);
+	link->verify = NULL;
+	link->verifydata = NULL;
+
+	ret = thr_mgr_closefile(link, fd, ret);
+
+out:
+	if (probed != NULL)
+		link_header_free(probed);
+	free(probed);
+	free(chk.status);
+	if (chk.buf != NULL) {
+		free(chk.buf);
+		membudget_release(chk.unit);
+	}
+	return (ret);
+}
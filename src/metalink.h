@@ -0,0 +1,40 @@
+#ifndef METALINK_H
+#define	METALINK_H
+
+#include "defaults.h"
+
+#define	METALINK_MAX (64 * 1024 * 1024)	// larger metalink files are refused
+#define	METALINK_PIECE_MAX (64 * 1024 * 1024)	// longest piece checked
+#define	METALINK_UNIT (1024 * 1024)	// re-fetched unit without piece hashes
+#define	METALINK_RANGE_MAX (64 * 1024 * 1024)	// range checked as it lands
+#define	METALINK_ROUNDS 3	// re-fetches of failed pieces
+#define	METALINK_HASH_MAX 64	// SHA-512
+#define	METALINK_TYPE_MAX 16	// digest name without dashes (sha256)
+
+/**
+ * The first file of Metalink (RFC 5854 or version 3): its http(s) links in
+ * order of priority, size and digests of whole file and of its pieces.
+ */
+typedef struct metalink
+{
+	char *name;		// name of file, NULL if not given
+	long long int size;	// -1 if not given
+	int urlnum;
+	char **urls;
+	char hashtype[METALINK_TYPE_MAX];	// digest of file, "" if none
+	int hashlen;
+	unsigned char hash[METALINK_HASH_MAX];
+	char piecetype[METALINK_TYPE_MAX];	// digest of pieces, "" if none
+	int piecehashlen;
+	long long int piecelen;
+	long long int piecenum;
+	unsigned char *pieces;	// digests of pieces in order
+} metalink;
+
+metalink *metalink_parse(const char *buf, size_t len);
+metalink *metalink_load(const char *path);
+void metalink_free(metalink *ml);
+int metalink_download(const char *resultdir, lnk *link,
+		lnk_http_header *linkh);
+
+#endif /* METALINK_H */
@@ -0,0 +1,406 @@
+/*!
+ * \file
+ * \brief Archive of many downloaded files (pack) and its index.
+ *
+ *  Every file is downloaded into memory (memfd, no inode or directory entry
+ *  on disk) and appended as one entry of tar archive by writer thread of
+ *  pack, so many small files become one sequential write instead of a file
+ *  each. Index (archive.idx) has line "offset size name" for every entry,
+ *  offset of its data in archive, for random access without reading tar.
+ *  Names over 100 characters and sizes of 8 GiB and over go to pax headers.
+ */
+
+#define	_GNU_SOURCE	// memfd_create, copy_file_range, sync_file_range
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>	// memfd_create
+
+#include "pack.h"
+#include "linkparser.h"
+#include "log.h"
+
+#define	PACK_COPY_SIZE (1024 * 1024)	// buffer of copy without kernel
+
+/**
+ * Downloaded file waiting for writer.
+ */
+typedef struct pack_item
+{
+	char *name;
+	int fd;
+	long long int size;
+	struct pack_item *next;
+} pack_item;
+
+struct pack
+{
+	char *path;
+	int fd;			// archive
+	FILE *index;
+	long long int offset;	// end of written entries
+	long long int flushed;	// writeback of data before was done
+	long long int writeback;	// bytes flushed at once, 0 = off
+	dur_policy durability;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	// item queued or written
+	pack_item *queue, **qtail;
+	long long int queued;	// staged bytes waiting for writer
+	int stop;
+	int failed;		// an entry couldn't be written
+	pthread_t thr;
+};
+
+/**
+ * Writes whole buffer at pos of archive.
+ * \return 0 on success, -1 on fail.
+ */
+static int
+pack_pwrite(pack *pk, const char *buf, size_t len, long long int pos)
+{
+	ssize_t sz;
+
+	while ((len > 0) && ((sz = pwrite(pk->fd, buf, len, pos)) > 0)) {
+		buf += sz;
+		len -= sz;
+		pos += sz;
+	}
+	return ((len == 0) ? 0 : -1);
+}
+
+/**
+ * Copies len bytes of fd into archive at pos.
+ * \return 0 on success, -1 on fail.
+ */
+static int
+pack_copy(pack *pk, int fd, long long int len, long long int pos)
+{
+	loff_t inpos = 0, outpos = pos;
+	char *buf;
+	ssize_t rd = 0;
+
+	// kernel copies if it can
+	while ((len > 0) && ((rd = copy_file_range(fd, &inpos, pk->fd,
+			&outpos, len, 0)) > 0))
+		len -= rd;
+	if (len == 0)
+		return (0);
+	if (rd == 0)
+		return (-1);
+
+	buf = malloc(PACK_COPY_SIZE);
+	while ((len > 0) && ((rd = pread(fd, buf, (len < PACK_COPY_SIZE) ?
+			len : PACK_COPY_SIZE, inpos)) > 0) &&
+			(pack_pwrite(pk, buf, rd, outpos) == 0)) {
+		inpos += rd;
+		outpos += rd;
+		len -= rd;
+	}
+	free(buf);
+	return ((len == 0) ? 0 : -1);
+}
+
+/**
+ * Fills tar header block of entry name (of size bytes and type).
+ */
+static void
+pack_header(char *block, const char *name, long long int size, char type)
+{
+	size_t len = strlen(name);
+	unsigned int sum = 0;
+	int idx;
+
+	memset(block, 0, PACK_BLOCK);
+	memcpy(block, name, (len < PACK_NAME_MAX) ? len : PACK_NAME_MAX);
+	snprintf(block + 100, 8, "%07o", 0644);
+	snprintf(block + 108, 8, "%07o", 0);
+	snprintf(block + 116, 8, "%07o", 0);
+	snprintf(block + 124, 12, "%011llo", (size <= PACK_SIZE_MAX) ? size :
+			0);
+	snprintf(block + 136, 12, "%011llo", (long long int) time(NULL));
+	block[156] = type;
+	memcpy(block + 257, "ustar", 6);
+	memcpy(block + 263, "00", 2);
+
+	// checksum is counted with its field of blanks
+	memset(block + 148, ' ', 8);
+	for (idx = 0; idx != PACK_BLOCK; ++idx)
+		sum += (unsigned char) block[idx];
+	snprintf(block + 148, 8, "%06o", sum);
+	block[155] = ' ';
+}
+
+/**
+ * Appends pax record "len key=value\n" (len counts the whole record) to
+ * records (of reclen bytes).
+ * \return new records.
+ */
+static char *
+pack_pax_record(char *records, size_t *reclen, const char *key,
+		const char *value)
+{
+	size_t len = strlen(key) + strlen(value) + 3;
+	size_t total = len + 1;
+
+	while (total != len + snprintf(NULL, 0, "%zu", total))
+		total = len + snprintf(NULL, 0, "%zu", total);
+	records = realloc(records, *reclen + total + 1);
+	snprintf(records + *reclen, total + 1, "%zu %s=%s\n", total, key,
+			value);
+	*reclen += total;
+
+	return (records);
+}
+
+/**
+ * Appends item as entry of archive (pax header first if ustar header
+ * can't hold its name or size) and its line of index.
+ * \return 0 on success, -1 on fail.
+ */
+static int
+pack_write_entry(pack *pk, const pack_item *item)
+{
+	char block[PACK_BLOCK], size[24], *records = NULL;
+	long long int pos = pk->offset, data;
+	size_t reclen = 0, pad;
+	int ret = 0;
+
+	if (strlen(item->name) > PACK_NAME_MAX)
+		records = pack_pax_record(records, &reclen, "path",
+				item->name);
+	if (item->size > PACK_SIZE_MAX) {
+		snprintf(size, sizeof (size), "%lld", item->size);
+		records = pack_pax_record(records, &reclen, "size", size);
+	}
+	if (records != NULL) {
+		pack_header(block, "././@PaxHeader", reclen, 'x');
+		pad = (PACK_BLOCK - reclen % PACK_BLOCK) % PACK_BLOCK;
+		records = realloc(records, reclen + pad);
+		memset(records + reclen, 0, pad);
+		ret = ((pack_pwrite(pk, block, PACK_BLOCK, pos) == -1) ||
+				(pack_pwrite(pk, records, reclen + pad,
+				pos + PACK_BLOCK) == -1)) ? -1 : 0;
+		pos += PACK_BLOCK + reclen + pad;
+		free(records);
+	}
+
+	pack_header(block, item->name, item->size, '0');
+	data = pos + PACK_BLOCK;
+	pad = (PACK_BLOCK - item->size % PACK_BLOCK) % PACK_BLOCK;
+	if ((ret == -1) || (pack_pwrite(pk, block, PACK_BLOCK, pos) == -1) ||
+			(pack_copy(pk, item->fd, item->size, data) == -1)) {
+		log_error(NULL, errno, "%s couldn't be written into %s",
+				item->name, pk->path);
+		return (-1);
+	}
+	// padding is written by the next entry (or by end of archive)
+	pk->offset = data + item->size + pad;
+
+	fprintf(pk->index, "%lld %lld %s\n", data, item->size, item->name);
+
+	// written entries are flushed and dropped from page cache
+	if ((pk->writeback > 0) &&
+			(pk->offset - pk->flushed >= pk->writeback)) {
+		sync_file_range(pk->fd, pk->flushed, pk->offset - pk->flushed,
+				SYNC_FILE_RANGE_WAIT_BEFORE |
+				SYNC_FILE_RANGE_WRITE |
+				SYNC_FILE_RANGE_WAIT_AFTER);
+		posix_fadvise(pk->fd, pk->flushed, pk->offset - pk->flushed,
+				POSIX_FADV_DONTNEED);
+		pk->flushed = pk->offset;
+	}
+
+	return (0);
+}
+
+/**
+ * Writer of pack (function for one thread), appends queued files in order
+ * until pack is closed and queue is empty.
+ * param data of type (pack *).
+ */
+static void *
+pack_writer(void *data)
+{
+	pack *pk = data;
+	pack_item *item;
+	int ret;
+
+	pthread_mutex_lock(&pk->lock);
+	for (;;) {
+		while ((!pk->stop) && (pk->queue == NULL))
+			pthread_cond_wait(&pk->cond, &pk->lock);
+		if ((item = pk->queue) == NULL)
+			break;
+		if ((pk->queue = item->next) == NULL)
+			pk->qtail = &pk->queue;
+		pthread_mutex_unlock(&pk->lock);
+
+		ret = pack_write_entry(pk, item);
+		close(item->fd);
+		free(item->name);
+
+		pthread_mutex_lock(&pk->lock);
+		if (ret == -1)
+			pk->failed = 1;
+		pk->queued -= item->size;
+		free(item);
+		pthread_cond_broadcast(&pk->cond);
+	}
+	pthread_mutex_unlock(&pk->lock);
+
+	return (NULL);
+}
+
+/**
+ * Creates archive path (and its index path.idx) and starts its writer.
+ * Archive is synced when closed unless durability is DUR_NONE, every
+ * writeback bytes written are flushed (0 = off).
+ * \return new pack, NULL on fail.
+ */
+pack *
+pack_open(const char *path, dur_policy durability, long long int writeback)
+{
+	pack *pk = calloc(1, sizeof (pack));
+	char *idxpath = _strcat(path, PACK_INDEX_SUFFIX);
+
+	pk->path = strdup(path);
+	pk->durability = durability;
+	pk->writeback = writeback;
+	pk->qtail = &pk->queue;
+	if ((pk->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+			S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) == -1) {
+		log_error(NULL, errno, "Couldn't create file %s", path);
+	} else if ((pk->index = fopen(idxpath, "we")) == NULL) {
+		log_error(NULL, errno, "Couldn't create file %s", idxpath);
+		close(pk->fd);
+	}
+	free(idxpath);
+	if ((pk->fd == -1) || (pk->index == NULL)) {
+		free(pk->path);
+		free(pk);
+		return (NULL);
+	}
+
+	pthread_mutex_init(&pk->lock, NULL);
+	pthread_cond_init(&pk->cond, NULL);
+	if (pthread_create(&pk->thr, NULL, pack_writer, pk) != 0) {
+		log_error(NULL, 0, "writer of %s couldn't be created", path);
+		pthread_cond_destroy(&pk->cond);
+		pthread_mutex_destroy(&pk->lock);
+		fclose(pk->index);
+		close(pk->fd);
+		free(pk->path);
+		free(pk);
+		return (NULL);
+	}
+
+	return (pk);
+}
+
+/**
+ * \return name of entry of link in pack (resultdir/host_uri without
+ * resultdir).
+ */
+char *
+pack_name(const lnk *link)
+{
+	return (_strtr(_strcat(link->hostname, link->rquri), '/', '_'));
+}
+
+/**
+ * Creates memory file which link named name is downloaded into.
+ * \return its descriptor (regular file), -1 on fail.
+ */
+int
+pack_stage(const char *name)
+{
+	int fd;
+
+	if ((fd = memfd_create(name, MFD_CLOEXEC)) == -1)
+		log_error(NULL, errno, "Couldn't stage %s", name);
+	return (fd);
+}
+
+/**
+ * Queues downloaded file fd as entry name of pack and takes it over (it is
+ * closed when written). Waits while more than PACK_QUEUE_MAX bytes wait
+ * for writer, so downloads don't outrun the disk.
+ * \return 0 on success, -1 on fail (an entry couldn't be written).
+ */
+int
+pack_add(pack *pk, const char *name, int fd)
+{
+	pack_item *item;
+	struct stat st;
+	int failed;
+
+	if (fstat(fd, &st) == -1) {
+		log_error(NULL, errno, "fstat");
+		close(fd);
+		return (-1);
+	}
+	item = malloc(sizeof (pack_item));
+	item->name = strdup(name);
+	item->fd = fd;
+	item->size = st.st_size;
+	item->next = NULL;
+
+	pthread_mutex_lock(&pk->lock);
+	while ((pk->queued > 0) && (pk->queued + item->size > PACK_QUEUE_MAX))
+		pthread_cond_wait(&pk->cond, &pk->lock);
+	*pk->qtail = item;
+	pk->qtail = &item->next;
+	pk->queued += item->size;
+	pthread_cond_broadcast(&pk->cond);
+	failed = pk->failed;
+	pthread_mutex_unlock(&pk->lock);
+
+	return (failed ? -1 : 0);
+}
+
+/**
+ * Writes queued files, ends archive (two zero blocks), syncs it with its
+ * index (unless durability of pack is DUR_NONE) and releases pack.
+ * \return 0 if every entry was written, -1 otherwise.
+ */
+int
+pack_close(pack *pk)
+{
+	char end[PACK_BLOCK * 2];
+	int ret;
+
+	pthread_mutex_lock(&pk->lock);
+	pk->stop = 1;
+	pthread_cond_broadcast(&pk->cond);
+	pthread_mutex_unlock(&pk->lock);
+	pthread_join(pk->thr, NULL);
+
+	// rest of failed entry is cut off
+	memset(end, 0, sizeof (end));
+	ret = ((pk->failed) || (pack_pwrite(pk, end, sizeof (end),
+			pk->offset) == -1) ||
+			(ftruncate(pk->fd, pk->offset + sizeof (end)) == -1) ||
+			(fflush(pk->index) == EOF)) ? -1 : 0;
+	if ((ret == 0) && (pk->durability != DUR_NONE) &&
+			((fdatasync(pk->fd) == -1) ||
+			(fdatasync(fileno(pk->index)) == -1))) {
+		log_error(NULL, errno, "%s couldn't be synced", pk->path);
+		ret = -1;
+	}
+	if ((fclose(pk->index) == EOF) || (close(pk->fd) == -1))
+		ret = -1;
+	if (ret == -1)
+		log_error(NULL, 0, "%s is incomplete", pk->path);
+
+	pthread_cond_destroy(&pk->cond);
+	pthread_mutex_destroy(&pk->lock);
+	free(pk->path);
+	free(pk);
+
+	return (ret);
+}
@@ -0,0 +1,22 @@
+#ifndef PACK_H
+#define	PACK_H
+
+#include "defaults.h"
+
+#define	PACK_BLOCK 512			// tar block
+#define	PACK_NAME_MAX 100		// longer names go to pax header
+#define	PACK_SIZE_MAX 077777777777LL	// larger sizes go to pax header
+#define	PACK_QUEUE_MAX (64 * 1024 * 1024)	// staged data waiting for
+						// writer
+#define	PACK_INDEX_SUFFIX ".idx"
+
+typedef struct pack pack;
+
+pack *pack_open(const char *path, dur_policy durability,
+		long long int writeback);
+char *pack_name(const lnk *link);
+int pack_stage(const char *name);
+int pack_add(pack *pk, const char *name, int fd);
+int pack_close(pack *pk);
+
+#endif /* PACK_H */
@@ -0,0 +1,307 @@
+/*!
+ * \file
+ * \brief Live progress display of downloaded links.
+ *
+ *  Workers publish received bytes and chunk map of every file by relaxed
+ *  atomic stores (progress_update), main thread draws them at fixed rate.
+ *  Terminal display is redrawn in place: total bytes, throughput, ETA and
+ *  a line per running file with its chunk map. Without terminal a single
+ *  progress line is printed every PROGRESS_LINE_SEC. Both show memory
+ *  accounted by memory budget (and its limit if it is set).
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "progress.h"
+#include "membudget.h"
+
+typedef struct
+{
+	char name[PROGRESS_NAME_COLS + 1];
+	long long int received, total;
+	char map[PROGRESS_MAP_COLS + 2];	// '+' marks hidden chunks
+	int running;
+	int done;
+} prg_file;
+
+struct progress
+{
+	FILE *out;
+	int tty;		// redraw in place
+	progress_mode mode;
+	prg_file *files;
+	int filenum;
+	int lines;		// lines of terminal display on screen
+	double started;
+	double lastdraw;
+	long long int lastreceived;	// at last draw
+	double rate;		// bytes per second
+};
+
+static double
+progress_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/**
+ * Formats size with binary unit suffix into buf.
+ * \return buf.
+ */
+static char *
+progress_size(char *buf, size_t len, double size)
+{
+	const char *units = "BKMGTP";
+
+	while ((size >= 1024) && (units[1] != '\0')) {
+		size /= 1024;
+		++units;
+	}
+	snprintf(buf, len, (*units == 'B') ? "%.0f%c" : "%.1f%c", size,
+			*units);
+	return (buf);
+}
+
+/**
+ * Creates progress display of files printed into out.
+ * \return new display.
+ */
+progress *
+progress_init(FILE *out, progress_mode mode, int files)
+{
+	progress *prg = calloc(1, sizeof (progress));
+
+	prg->out = out;
+	prg->mode = mode;
+	prg->tty = (mode == PROGRESS_AUTO) && isatty(fileno(out));
+	prg->files = calloc(files, sizeof (prg_file));
+	prg->filenum = files;
+	prg->started = prg->lastdraw = progress_now();
+
+	return (prg);
+}
+
+/**
+ * Names file idx of display.
+ * \return data of progress_update callback of the file.
+ */
+void *
+progress_file(progress *prg, int idx, const char *name)
+{
+	const char *base = strrchr(name, '/');
+
+	// the last path segment is the best short name
+	if ((base != NULL) && (base[1] != '\0'))
+		name = base + 1;
+	snprintf(prg->files[idx].name, sizeof (prg->files[idx].name), "%s",
+			name);
+
+	return (&prg->files[idx]);
+}
+
+/**
+ * \return index of file given by data of its progress_update callback.
+ */
+int
+progress_idx(progress *prg, void *file)
+{
+	return ((prg_file *) file - prg->files);
+}
+
+/**
+ * Progress callback of job (called by its worker), publishes state of file
+ * without lock.
+ */
+void
+progress_update(rdw_job *job, long long int received, long long int total,
+		const char *chunkmap, void *data)
+{
+	prg_file *file = data;
+	int idx;
+
+	for (idx = 0; (idx != PROGRESS_MAP_COLS) && (chunkmap[idx] != '\0');
+			++idx)
+		__atomic_store_n(&file->map[idx], chunkmap[idx],
+				__ATOMIC_RELAXED);
+	if (chunkmap[idx] != '\0')
+		__atomic_store_n(&file->map[idx++], '+', __ATOMIC_RELAXED);
+	__atomic_store_n(&file->map[idx], '\0', __ATOMIC_RELAXED);
+
+	__atomic_store_n(&file->total, total, __ATOMIC_RELAXED);
+	__atomic_store_n(&file->received, received, __ATOMIC_RELAXED);
+	__atomic_store_n(&file->running, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Marks file finished (its job was reported), it leaves terminal display.
+ */
+void
+progress_done(progress *prg, void *file)
+{
+	prg_file *pfile = file;
+
+	pfile->done = 1;
+}
+
+/**
+ * Erases terminal display.
+ */
+static void
+progress_erase(progress *prg)
+{
+	if (prg->lines > 0)
+		fprintf(prg->out, "\033[%dA\033[J", prg->lines);
+	prg->lines = 0;
+}
+
+/**
+ * Sums received and total bytes of all files.
+ * \return number of finished files.
+ */
+static int
+progress_sum(progress *prg, long long int *received, long long int *total)
+{
+	int idx, done = 0;
+
+	*received = *total = 0;
+	for (idx = 0; idx != prg->filenum; ++idx) {
+		*received += __atomic_load_n(&prg->files[idx].received,
+				__ATOMIC_RELAXED);
+		*total += __atomic_load_n(&prg->files[idx].total,
+				__ATOMIC_RELAXED);
+		done += prg->files[idx].done;
+	}
+
+	return (done);
+}
+
+/**
+ * Draws display now.
+ */
+static void
+progress_redraw(progress *prg)
+{
+	char sreceived[16], stotal[16], srate[16], seta[16];
+	char sused[16], slimit[16];
+	char map[PROGRESS_MAP_COLS + 2];
+	long long int received, total, frecv, ftotal;
+	double eta;
+	long long int limit = membudget_limit();
+	int idx, chidx, done, shown = 0;
+	prg_file *file;
+
+	done = progress_sum(prg, &received, &total);
+	eta = (prg->rate >= 1) ? (total - received) / prg->rate : -1;
+	if (eta >= 0)
+		snprintf(seta, sizeof (seta), "%d:%02d:%02d", (int) eta / 3600,
+				((int) eta / 60) % 60, (int) eta % 60);
+	else
+		snprintf(seta, sizeof (seta), "-:--:--");
+	progress_size(sused, sizeof (sused), membudget_used());
+	if (limit > 0)
+		progress_size(slimit, sizeof (slimit), limit);
+
+	progress_erase(prg);
+	fprintf(prg->out, "%s%5.1f%% %s/%s %s/s ETA %s, %d/%d files, "
+			"mem %s%s%s\n",
+			(prg->tty) ? "" : "progress: ",
+			(total > 0) ? 100.0 * received / total : 0.0,
+			progress_size(sreceived, sizeof (sreceived), received),
+			progress_size(stotal, sizeof (stotal), total),
+			progress_size(srate, sizeof (srate), prg->rate), seta,
+			done, prg->filenum, sused, (limit > 0) ? "/" : "",
+			(limit > 0) ? slimit : "");
+	if (!prg->tty) {
+		fflush(prg->out);
+		return;
+	}
+	prg->lines = 1;
+
+	for (idx = 0; (idx != prg->filenum) && (shown != PROGRESS_FILES_MAX);
+			++idx) {
+		file = &prg->files[idx];
+		if ((file->done) || (!__atomic_load_n(&file->running,
+				__ATOMIC_RELAXED)))
+			continue;
+		frecv = __atomic_load_n(&file->received, __ATOMIC_RELAXED);
+		ftotal = __atomic_load_n(&file->total, __ATOMIC_RELAXED);
+		for (chidx = 0; (chidx != sizeof (map) - 1) && ((map[chidx] =
+				__atomic_load_n(&file->map[chidx],
+				__ATOMIC_RELAXED)) != '\0'); ++chidx)
+			;
+		map[chidx] = '\0';
+		fprintf(prg->out, "  %-*s %5.1f%% %9s [%s]\n",
+				PROGRESS_NAME_COLS, file->name,
+				(ftotal > 0) ? 100.0 * frecv / ftotal : 0.0,
+				progress_size(sreceived, sizeof (sreceived),
+				frecv), map);
+		++prg->lines;
+		++shown;
+	}
+	fflush(prg->out);
+}
+
+/**
+ * Draws display if its period passed (PROGRESS_REFRESH_MS on terminal,
+ * PROGRESS_LINE_SEC otherwise).
+ */
+void
+progress_draw(progress *prg)
+{
+	double now = progress_now();
+	long long int received, total;
+
+	if ((prg->mode == PROGRESS_NONE) || (now - prg->lastdraw <
+			((prg->tty) ? PROGRESS_REFRESH_MS / 1000.0 :
+			PROGRESS_LINE_SEC)))
+		return;
+
+	// throughput is averaged over draw periods
+	progress_sum(prg, &received, &total);
+	prg->rate = (prg->lastdraw == prg->started) ?
+			(received - prg->lastreceived) / (now - prg->lastdraw) :
+			(1 - PROGRESS_RATE_WEIGHT) * prg->rate +
+			PROGRESS_RATE_WEIGHT * (received - prg->lastreceived) /
+			(now - prg->lastdraw);
+	prg->lastreceived = received;
+	prg->lastdraw = now;
+
+	progress_redraw(prg);
+}
+
+/**
+ * Prints message above terminal display.
+ */
+void
+progress_message(progress *prg, const char *format, ...)
+{
+	va_list args;
+
+	progress_erase(prg);
+	va_start(args, format);
+	vfprintf(prg->out, format, args);
+	va_end(args);
+	if (prg->tty)
+		progress_redraw(prg);
+	fflush(prg->out);
+}
+
+/**
+ * Erases terminal display and releases it.
+ */
+void
+progress_free(progress *prg)
+{
+	progress_erase(prg);
+	fflush(prg->out);
+	free(prg->files);
+	free(prg);
+}
@@ -0,0 +1,27 @@
+#ifndef PROGRESS_H
+#define	PROGRESS_H
+
+#include <stdio.h>
+#include "defaults.h"
+#include "rdwget.h"
+
+#define	PROGRESS_REFRESH_MS 1000	// redraw period of terminal display
+#define	PROGRESS_LINE_SEC 10		// period of progress lines
+#define	PROGRESS_FILES_MAX 10		// files shown by terminal display
+#define	PROGRESS_NAME_COLS 24
+#define	PROGRESS_MAP_COLS 40		// chunks shown in map of file
+#define	PROGRESS_RATE_WEIGHT 0.3	// weight of last period in throughput
+
+typedef struct progress progress;
+
+progress *progress_init(FILE *out, progress_mode mode, int files);
+void progress_free(progress *prg);
+void *progress_file(progress *prg, int idx, const char *name);
+int progress_idx(progress *prg, void *file);
+void progress_update(rdw_job *job, long long int received,
+		long long int total, const char *chunkmap, void *data);
+void progress_done(progress *prg, void *file);
+void progress_draw(progress *prg);
+void progress_message(progress *prg, const char *format, ...);
+
+#endif /* PROGRESS_H */
@@ -0,0 +1,727 @@
+/*!
+ * \file
+ * \brief Embeddable download engine with asynchronous job API.
+ *
+ *  Context owns a pool of worker threads and a queue of submitted jobs
+ *  (ordered by priority, FIFO within one priority), every worker downloads
+ *  one job at a time (in chunks as configured by settings of job). Finished
+ *  job is reported by its done callback or put into completion queue of
+ *  context, which can be polled (rdw_poll) or waited on through descriptor
+ *  returned by rdw_fd.
+ *
+ *  Library never exits the process, all failures are reported by job state
+ *  (and messages of log, written at once unless log_open started its
+ *  thread). Connections, TLS sessions and circuit breakers are shared by
+ *  all jobs of the process. Embedding application
+ *  should ignore SIGPIPE like rdwget does (TLS writes may raise it).
+ */
+
+#define	_GNU_SOURCE	// syncfs
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "rdwget.h"
+#include "threadmanager.h"
+#include "linkparser.h"
+#include "tls.h"
+#include "membudget.h"
+#include "pack.h"
+#include "log.h"
+
+#define	RDW_SYNC_BATCH 64	// files of one batch sync at most
+#define	RDW_SYNC_DELAY 5	// seconds finished file waits for batch sync
+
+struct rdw_job
+{
+	rdw_ctx *ctx;
+	char *url;
+	char *path;		// destination file, NULL for descriptor
+	char *location;		// final link if job was redirected
+	prgstx stx;		// settings of job (link->sprf points here)
+	lnk link;
+	rdw_dest dest;
+	rdw_state state;
+	int owned;		// worker (or callback) still uses job
+	int detached;		// freed by caller while owned
+	int queued;		// job is in completion queue
+
+	struct rdw_job *next;	// job queue or completion queue
+	struct rdw_job *anext;	// all jobs of context
+	struct rdw_job **aprev;
+};
+
+struct rdw_ctx
+{
+	prgstx stx;		// default settings of jobs
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	// job queued or shutdown
+	pthread_cond_t donecond; // job finished
+	rdw_job *queue, **qtail;
+	rdw_job *done, **dtail;
+	rdw_job *jobs;
+	rdw_job *syncq, **stail;	// downloaded jobs waiting for batch sync
+	int syncnum;
+	struct timespec syncdue;	// batch is synced at latest
+	int active;		// jobs being downloaded
+	int pipefd[2];		// readable while completion queue isn't empty
+	int stop;
+	int workers;
+	pthread_t *threads;
+};
+
+/**
+ * Fills settings with default values of rdwget.
+ */
+void
+rdw_settings_init(prgstx *stx)
+{
+	memset(stx, 0, sizeof (prgstx));
+	stx->chunks = D_CHUNKS;
+	stx->resultdir = D_RESULT_DIR;
+	stx->numlinks = D_NUMLINKS;
+	stx->links = D_LINKS;
+	stx->hedge = D_HEDGE;
+	stx->retries = D_RETRIES;
+	stx->retrywait = D_RETRY_WAIT;
+	stx->tlsverify = D_TLS_VERIFY;
+	stx->cafile = D_CA_FILE;
+	stx->http2 = D_HTTP2;
+	stx->priority = D_PRIORITY;
+	stx->workers = D_WORKERS;
+	stx->durability = D_DURABILITY;
+	stx->writeback = D_WRITEBACK;
+	stx->progress = D_PROGRESS;
+	stx->recursive = D_RECURSIVE;
+	stx->depth = D_DEPTH;
+	stx->include = D_INCLUDE;
+	stx->hostlimit = D_HOST_LIMIT;
+	stx->maxredirs = D_MAX_REDIRECTS;
+	stx->membudget = D_MEM_BUDGET;
+	stx->delta = D_DELTA;
+	stx->manifest = D_MANIFEST;
+	stx->metalink = D_METALINK;
+	stx->unpack = D_UNPACK;
+	stx->order = D_ORDER;
+	stx->pack = D_PACK;
+	stx->profile = D_PROFILE;
+	stx->coordinator = D_COORDINATOR;
+	stx->join = D_JOIN;
+	stx->sendback = D_SEND_BACK;
+	stx->log = D_LOG;
+	stx->logformat = D_LOG_FORMAT;
+	stx->small = D_SMALL;
+	stx->sprf.tfo = D_TCP_FASTOPEN;
+	stx->sprf.rcvbuf = D_RCVBUF;
+	stx->sprf.congestion = D_CONGESTION;
+	stx->sprf.conntimeout = D_CONNECT_TIMEOUT;
+	stx->sprf.readtimeout = D_READ_TIMEOUT;
+	stx->sprf.keepalive = D_KEEPALIVE;
+}
+
+static void
+rdw_job_release(rdw_job *job)
+{
+	*job->aprev = job->anext;
+	if (job->anext != NULL)
+		job->anext->aprev = job->aprev;
+	link_free(&job->link);
+	free(job->location);
+	free(job->path);
+	free(job->url);
+	free(job);
+}
+
+/**
+ * Finishes job in state and notifies its owner. Called with ctx->lock
+ * held, the lock is released while done callback runs.
+ */
+static void
+rdw_finish(rdw_ctx *ctx, rdw_job *job, rdw_state state)
+{
+	char note = 0;
+
+	job->state = state;
+	pthread_cond_broadcast(&ctx->donecond);
+
+	if (job->dest.done == NULL) {
+		job->next = NULL;
+		*ctx->dtail = job;
+		ctx->dtail = &job->next;
+		job->queued = 1;
+		if (write(ctx->pipefd[1], &note, 1) != 1)
+			log_error(&job->link, errno, "completion of %s "
+					"couldn't be signalled", job->url);
+	} else {
+		pthread_mutex_unlock(&ctx->lock);
+		job->dest.done(job, job->dest.data);
+		pthread_mutex_lock(&ctx->lock);
+	}
+
+	job->owned = 0;
+	if (job->detached)
+		rdw_job_release(job);
+}
+
+/**
+ * Puts job into job queue behind queued jobs of the same or higher
+ * priority. Called with ctx->lock held.
+ */
+static void
+rdw_enqueue(rdw_ctx *ctx, rdw_job *job)
+{
+	rdw_job **item;
+
+	for (item = &ctx->queue; *item != NULL; item = &(*item)->next) {
+		if ((*item)->dest.priority < job->dest.priority)
+			break;
+	}
+	if ((job->next = *item) == NULL)
+		ctx->qtail = &job->next;
+	*item = job;
+}
+
+/**
+ * Takes job out of job queue. Called with ctx->lock held.
+ */
+static void
+rdw_dequeue(rdw_ctx *ctx, rdw_job *job)
+{
+	rdw_job **item;
+
+	for (item = &ctx->queue; *item != NULL; item = &(*item)->next) {
+		if (*item == job) {
+			if ((*item = job->next) == NULL)
+				ctx->qtail = item;
+			break;
+		}
+	}
+}
+
+static void
+rdw_job_progress(void *data, long long int received, long long int total,
+		const char *chunkmap)
+{
+	rdw_job *job = data;
+
+	job->dest.progress(job, received, total, chunkmap, job->dest.data);
+}
+
+/**
+ * \return nonzero if downloaded jobs waiting for batch sync should be synced
+ * now. Called with ctx->lock held.
+ */
+static int
+rdw_sync_due(rdw_ctx *ctx)
+{
+	struct timespec now;
+
+	if (ctx->syncq == NULL)
+		return (0);
+	if ((ctx->stop) || (ctx->syncnum >= RDW_SYNC_BATCH) ||
+			((ctx->queue == NULL) && (ctx->active == 0)))
+		return (1);
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (now.tv_sec >= ctx->syncdue.tv_sec);
+}
+
+/**
+ * Syncs downloaded jobs waiting for batch sync, every filesystem of their
+ * files is synced once (syncfs), and finishes them. Called with ctx->lock
+ * held, the lock is released while files are synced.
+ */
+static void
+rdw_sync_batch(rdw_ctx *ctx)
+{
+	rdw_job *batch = ctx->syncq, *job, *next;
+	rdw_state states[RDW_SYNC_BATCH];
+	dev_t devs[RDW_SYNC_BATCH];
+	int devret[RDW_SYNC_BATCH];
+	int devnum = 0, devidx, jobidx, fd;
+	struct stat st;
+
+	ctx->syncq = NULL;
+	ctx->stail = &ctx->syncq;
+	ctx->syncnum = 0;
+	pthread_mutex_unlock(&ctx->lock);
+
+	for (job = batch, jobidx = 0; job != NULL; job = job->next, ++jobidx) {
+		states[jobidx] = RDW_FAILED;
+		fd = (job->link.destfd != -1) ? job->link.destfd :
+				open(job->path, O_RDONLY | O_CLOEXEC);
+		if ((fd == -1) || (fstat(fd, &st) == -1)) {
+			log_error(&job->link, errno, "%s couldn't be synced",
+					job->url);
+			if ((fd != -1) && (fd != job->link.destfd))
+				close(fd);
+			continue;
+		}
+		for (devidx = 0; devidx != devnum; ++devidx) {
+			if (devs[devidx] == st.st_dev)
+				break;
+		}
+		if (devidx == devnum) {
+			devs[devnum] = st.st_dev;
+			if ((devret[devnum++] = syncfs(fd)) == -1)
+				log_error(&job->link, errno, "syncfs");
+		}
+		if (devret[devidx] == 0)
+			states[jobidx] = RDW_DONE;
+		if (job->link.writeback > 0)
+			posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		if (fd != job->link.destfd)
+			close(fd);
+	}
+
+	pthread_mutex_lock(&ctx->lock);
+	for (job = batch, jobidx = 0; job != NULL; job = next, ++jobidx) {
+		next = job->next;
+		rdw_finish(ctx, job, states[jobidx]);
+	}
+}
+
+/**
+ * Worker of context (function for one thread), downloads queued jobs until
+ * context is shut down. Jobs downloaded with DUR_BATCH durability wait for
+ * batch sync, which is done by worker which finds it due.
+ * param data of type (rdw_ctx *).
+ */
+static void *
+rdw_worker(void *data)
+{
+	rdw_ctx *ctx = data;
+	rdw_job *job;
+	int ret;
+
+	pthread_mutex_lock(&ctx->lock);
+	for (;;) {
+		while ((!ctx->stop) && (ctx->queue == NULL) &&
+				(!rdw_sync_due(ctx))) {
+			if (ctx->syncq == NULL)
+				pthread_cond_wait(&ctx->cond, &ctx->lock);
+			else
+				pthread_cond_timedwait(&ctx->cond, &ctx->lock,
+						&ctx->syncdue);
+		}
+		if (rdw_sync_due(ctx)) {
+			rdw_sync_batch(ctx);
+			continue;
+		}
+		if (ctx->stop)
+			break;
+
+		job = ctx->queue;
+		if ((ctx->queue = job->next) == NULL)
+			ctx->qtail = &ctx->queue;
+		job->state = RDW_RUNNING;
+		++ctx->active;
+		pthread_mutex_unlock(&ctx->lock);
+
+		if (job->dest.start != NULL)
+			job->dest.start(job, job->dest.data);
+		if ((job->dest.pack != NULL) && ((job->link.destfd =
+				pack_stage(job->path)) == -1))
+			ret = -1;
+		else
+			ret = thr_mgr_downloadfile(job->stx.resultdir,
+					&job->link);
+		if (job->link.redirected)
+			job->location = link_url(&job->link);
+		// staged file is appended (and closed) by writer of pack
+		if ((job->dest.pack != NULL) && (job->link.destfd != -1)) {
+			if (ret == 0)
+				ret = pack_add(job->dest.pack, job->path,
+						job->link.destfd);
+			else
+				close(job->link.destfd);
+			job->link.destfd = -1;
+		}
+		// unpacked link is stored without suffix of compression
+		if ((ret == 0) && (job->dest.pack == NULL) &&
+				(job->path != NULL) &&
+				(strcmp(job->path, job->link.filename) != 0)) {
+			free(job->path);
+			job->path = strdup(job->link.filename);
+			job->link.path = job->path;
+		}
+
+		pthread_mutex_lock(&ctx->lock);
+		--ctx->active;
+		if ((ret == 0) && (job->link.durability == DUR_BATCH) &&
+				(!job->link.stream)) {
+			if (ctx->syncq == NULL) {
+				clock_gettime(CLOCK_REALTIME, &ctx->syncdue);
+				ctx->syncdue.tv_sec += RDW_SYNC_DELAY;
+			}
+			job->next = NULL;
+			*ctx->stail = job;
+			ctx->stail = &job->next;
+			++ctx->syncnum;
+			continue;
+		}
+		rdw_finish(ctx, job, (ret == 0) ? RDW_DONE :
+				(__atomic_load_n(&job->link.cancel,
+				__ATOMIC_RELAXED)) ? RDW_CANCELLED : RDW_FAILED);
+	}
+	pthread_mutex_unlock(&ctx->lock);
+
+	return (NULL);
+}
+
+/**
+ * Creates context with workers threads (D_WORKERS if workers isn't
+ * positive) downloading jobs. stx are default settings of jobs (NULL for
+ * defaults of rdwget), its TLS settings apply to all jobs.
+ * \return new context, NULL on fail.
+ */
+rdw_ctx *
+rdw_init(const prgstx *stx, int workers)
+{
+	rdw_ctx *ctx = calloc(1, sizeof (rdw_ctx));
+
+	if (stx != NULL)
+		ctx->stx = *stx;
+	else
+		rdw_settings_init(&ctx->stx);
+
+	if (tls_init(ctx->stx.tlsverify, ctx->stx.cafile) == -1)
+		log_error(NULL, 0, "https links can't be downloaded");
+	if (ctx->stx.membudget > 0)
+		membudget_init(ctx->stx.membudget);
+
+	if (pipe(ctx->pipefd) == -1) {
+		log_error(NULL, errno, "pipe");
+		free(ctx);
+		return (NULL);
+	}
+	fcntl(ctx->pipefd[0], F_SETFL, O_NONBLOCK);
+	fcntl(ctx->pipefd[0], F_SETFD, FD_CLOEXEC);
+	fcntl(ctx->pipefd[1], F_SETFD, FD_CLOEXEC);
+
+	pthread_mutex_init(&ctx->lock, NULL);
+	pthread_cond_init(&ctx->cond, NULL);
+	pthread_cond_init(&ctx->donecond, NULL);
+	ctx->qtail = &ctx->queue;
+	ctx->dtail = &ctx->done;
+	ctx->stail = &ctx->syncq;
+
+	if (workers <= 0)
+		workers = D_WORKERS;
+	ctx->threads = malloc(sizeof (pthread_t) * workers);
+	for (ctx->workers = 0; ctx->workers != workers; ++ctx->workers) {
+		if (pthread_create(&ctx->threads[ctx->workers], NULL,
+				rdw_worker, ctx) != 0) {
+			log_error(NULL, 0, "worker thread couldn't be "
+					"created");
+			break;
+		}
+	}
+	if (ctx->workers == 0) {
+		rdw_shutdown(ctx);
+		return (NULL);
+	}
+
+	return (ctx);
+}
+
+/**
+ * Cancels queued and running jobs, stops workers and releases context
+ * together with all its jobs which weren't freed yet.
+ */
+void
+rdw_shutdown(rdw_ctx *ctx)
+{
+	rdw_job *job;
+	int idx;
+
+	pthread_mutex_lock(&ctx->lock);
+	ctx->stop = 1;
+	for (job = ctx->jobs; job != NULL; job = job->anext)
+		__atomic_store_n(&job->link.cancel, 1, __ATOMIC_RELAXED);
+	pthread_cond_broadcast(&ctx->cond);
+	pthread_mutex_unlock(&ctx->lock);
+
+	for (idx = 0; idx != ctx->workers; ++idx)
+		pthread_join(ctx->threads[idx], NULL);
+
+	pthread_mutex_lock(&ctx->lock);
+	while ((job = ctx->queue) != NULL) {
+		ctx->queue = job->next;
+		rdw_finish(ctx, job, RDW_CANCELLED);
+	}
+	pthread_mutex_unlock(&ctx->lock);
+
+	while (ctx->jobs != NULL)
+		rdw_job_release(ctx->jobs);
+
+	close(ctx->pipefd[0]);
+	close(ctx->pipefd[1]);
+	pthread_cond_destroy(&ctx->donecond);
+	pthread_cond_destroy(&ctx->cond);
+	pthread_mutex_destroy(&ctx->lock);
+	free(ctx->threads);
+	free(ctx);
+}
+
+/**
+ * Submits download of url into queue of context. stx are settings of job
+ * (NULL for defaults of context), dest its destination and callbacks (NULL
+ * for file in resultdir and completion queue). Strings of settings have to
+ * stay valid until the job finishes.
+ * \return new job, NULL if url isn't valid link or context is shut down.
+ */
+rdw_job *
+rdw_submit(rdw_ctx *ctx, const char *url, const prgstx *stx,
+		const rdw_dest *dest)
+{
+	rdw_job *job = calloc(1, sizeof (rdw_job));
+	struct stat st;
+
+	job->ctx = ctx;
+	job->url = strdup(url);
+	job->stx = (stx != NULL) ? *stx : ctx->stx;
+	if (dest != NULL) {
+		job->dest = *dest;
+	} else {
+		job->dest.fd = -1;
+	}
+
+	if (link_parse(job->url, &job->link) == -1) {
+		free(job->url);
+		free(job);
+		return (NULL);
+	}
+	job->link.chunknum = job->stx.chunks;
+	job->link.sprf = &job->stx.sprf;
+	job->link.hedge = job->stx.hedge;
+	job->link.retries = job->stx.retries;
+	job->link.retrywait = job->stx.retrywait;
+	job->link.http2 = job->stx.http2;
+	job->link.maxredirs = job->stx.maxredirs;
+	job->link.durability = job->stx.durability;
+	job->link.writeback = job->stx.writeback;
+	job->link.delta = job->stx.delta;
+	job->link.manifest = job->stx.manifest;
+	job->link.metalink = job->stx.metalink;
+	job->link.unpack = job->stx.unpack;
+	job->link.small = job->stx.small;
+	job->link.destfd = job->dest.fd;
+	job->link.stream = (job->dest.fd != -1) && ((job->dest.stream) ||
+			(fstat(job->dest.fd, &st) == -1) ||
+			!S_ISREG(st.st_mode));
+	if (job->dest.pack != NULL) {
+		// link is staged in memory when it starts, pack syncs it
+		job->path = pack_name(&job->link);
+		job->link.durability = DUR_NONE;
+	} else if (job->dest.fd == -1) {
+		if (job->dest.path == NULL)
+			mk_filename(job->stx.resultdir, &job->link);
+		job->path = strdup((job->dest.path != NULL) ? job->dest.path :
+				job->link.filename);
+		job->link.path = job->path;
+	}
+	if (job->dest.progress != NULL) {
+		job->link.progress = rdw_job_progress;
+		job->link.progressdata = job;
+	}
+
+	pthread_mutex_lock(&ctx->lock);
+	if (ctx->stop) {
+		pthread_mutex_unlock(&ctx->lock);
+		link_free(&job->link);
+		free(job->path);
+		free(job->url);
+		free(job);
+		return (NULL);
+	}
+	job->state = RDW_QUEUED;
+	job->owned = 1;
+	job->aprev = &ctx->jobs;
+	if ((job->anext = ctx->jobs) != NULL)
+		ctx->jobs->aprev = &job->anext;
+	ctx->jobs = job;
+	rdw_enqueue(ctx, job);
+	pthread_cond_signal(&ctx->cond);
+	pthread_mutex_unlock(&ctx->lock);
+
+	return (job);
+}
+
+/**
+ * Cancels job. Queued job finishes at once, running one as soon as its
+ * chunks are aborted.
+ */
+void
+rdw_cancel(rdw_job *job)
+{
+	rdw_ctx *ctx = job->ctx;
+
+	pthread_mutex_lock(&ctx->lock);
+	__atomic_store_n(&job->link.cancel, 1, __ATOMIC_RELAXED);
+	if (job->state == RDW_QUEUED) {
+		rdw_dequeue(ctx, job);
+		rdw_finish(ctx, job, RDW_CANCELLED);
+	}
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+/**
+ * Changes priority of job, queued job is moved in job queue.
+ */
+void
+rdw_set_priority(rdw_job *job, int priority)
+{
+	rdw_ctx *ctx = job->ctx;
+
+	pthread_mutex_lock(&ctx->lock);
+	job->dest.priority = priority;
+	if (job->state == RDW_QUEUED) {
+		rdw_dequeue(ctx, job);
+		rdw_enqueue(ctx, job);
+	}
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+/**
+ * Waits until job finishes.
+ * \return final state of job.
+ */
+rdw_state
+rdw_wait(rdw_job *job)
+{
+	rdw_ctx *ctx = job->ctx;
+	rdw_state state;
+
+	pthread_mutex_lock(&ctx->lock);
+	while ((job->state == RDW_QUEUED) || (job->state == RDW_RUNNING))
+		pthread_cond_wait(&ctx->donecond, &ctx->lock);
+	state = job->state;
+	pthread_mutex_unlock(&ctx->lock);
+
+	return (state);
+}
+
+/**
+ * Takes finished job from completion queue, waits at most timeout
+ * milliseconds (negative timeout waits for ever).
+ * \return finished job, NULL if none finished in time.
+ */
+rdw_job *
+rdw_poll(rdw_ctx *ctx, int timeout)
+{
+	struct timespec wakeup;
+	rdw_job *job;
+	char note;
+
+	clock_gettime(CLOCK_REALTIME, &wakeup);
+	wakeup.tv_sec += timeout / 1000;
+	wakeup.tv_nsec += (timeout % 1000) * 1000000L;
+	if (wakeup.tv_nsec >= 1000000000L) {
+		++wakeup.tv_sec;
+		wakeup.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&ctx->lock);
+	while ((ctx->done == NULL) && (timeout != 0)) {
+		if (timeout < 0)
+			pthread_cond_wait(&ctx->donecond, &ctx->lock);
+		else if (pthread_cond_timedwait(&ctx->donecond, &ctx->lock,
+				&wakeup) == ETIMEDOUT)
+			break;
+	}
+	if ((job = ctx->done) != NULL) {
+		if ((ctx->done = job->next) == NULL)
+			ctx->dtail = &ctx->done;
+		job->queued = 0;
+		if (read(ctx->pipefd[0], &note, 1) != 1)
+			log_error(NULL, 0, "completion queue of context is "
+					"out of sync");
+	}
+	pthread_mutex_unlock(&ctx->lock);
+
+	return (job);
+}
+
+/**
+ * \return descriptor which is readable while completion queue of context
+ * isn't empty (for poll, select or event loop of application).
+ */
+int
+rdw_fd(rdw_ctx *ctx)
+{
+	return (ctx->pipefd[0]);
+}
+
+/**
+ * Frees job. Unfinished job is cancelled and freed when its worker
+ * finishes it.
+ */
+void
+rdw_job_free(rdw_job *job)
+{
+	rdw_ctx *ctx = job->ctx;
+	rdw_job **item;
+	char note;
+
+	rdw_cancel(job);
+
+	pthread_mutex_lock(&ctx->lock);
+	if (job->queued) {
+		for (item = &ctx->done; *item != job; item = &(*item)->next)
+			;
+		if ((*item = job->next) == NULL)
+			ctx->dtail = item;
+		if (read(ctx->pipefd[0], &note, 1) != 1)
+			log_error(NULL, 0, "completion queue of context is "
+					"out of sync");
+	}
+	if (job->owned)
+		job->detached = 1;
+	else
+		rdw_job_release(job);
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+rdw_state
+rdw_job_state(rdw_job *job)
+{
+	return (__atomic_load_n(&job->state, __ATOMIC_RELAXED));
+}
+
+const char *
+rdw_job_url(rdw_job *job)
+{
+	return (job->url);
+}
+
+/**
+ * \return link job was downloaded from, url of job unless it was
+ * redirected (valid once job finished).
+ */
+const char *
+rdw_job_location(rdw_job *job)
+{
+	return ((job->location != NULL) ? job->location : job->url);
+}
+
+/**
+ * \return path of destination file (name of entry of packed job), NULL if
+ * job downloads into descriptor of caller.
+ */
+const char *
+rdw_job_path(rdw_job *job)
+{
+	return (job->path);
+}
+
+void *
+rdw_job_data(rdw_job *job)
+{
+	return (job->dest.data);
+}
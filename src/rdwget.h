@@ -0,0 +1,71 @@
+#ifndef RDWGET_H
+#define	RDWGET_H
+
+#include "defaults.h"
+
+struct pack;
+
+/**
+ * States of download job.
+ */
+typedef enum
+{
+	RDW_QUEUED, RDW_RUNNING, RDW_DONE, RDW_FAILED, RDW_CANCELLED
+} rdw_state;
+
+typedef struct rdw_ctx rdw_ctx;
+typedef struct rdw_job rdw_job;
+
+/**
+ * Completion (or start) of job, called by worker thread which downloads
+ * it.
+ */
+typedef void (*rdw_done_cb)(rdw_job *job, void *data);
+
+/**
+ * Progress of job, called by worker thread about every second. chunkmap
+ * shows status of every chunk (CHUNKMAP_* or decile received '0' - '9').
+ */
+typedef void (*rdw_progress_cb)(rdw_job *job, long long int received,
+		long long int total, const char *chunkmap, void *data);
+
+/**
+ * Destination and notification of submitted job. Unset fields (zero,
+ * NULL, fd -1) take defaults.
+ */
+typedef struct
+{
+	const char *path;	// file to create, NULL = resultdir/host_uri
+	int fd;			// regular file opened O_RDWR, -1 = use path
+	int stream;		// write file in order into fd (any other than
+				// regular file is always streamed)
+	rdw_done_cb done;	// NULL = completion goes to completion queue
+	rdw_done_cb start;	// called when worker starts download, or NULL
+	rdw_progress_cb progress;
+	void *data;		// passed to callbacks
+	int priority;		// jobs of higher priority are started first
+	struct pack *pack;	// archive file is appended to (see pack.h),
+				// NULL = path or fd
+} rdw_dest;
+
+void rdw_settings_init(prgstx *stx);
+
+rdw_ctx *rdw_init(const prgstx *stx, int workers);
+void rdw_shutdown(rdw_ctx *ctx);
+
+rdw_job *rdw_submit(rdw_ctx *ctx, const char *url, const prgstx *stx,
+		const rdw_dest *dest);
+void rdw_cancel(rdw_job *job);
+void rdw_set_priority(rdw_job *job, int priority);
+rdw_state rdw_wait(rdw_job *job);
+rdw_job *rdw_poll(rdw_ctx *ctx, int timeout);
+int rdw_fd(rdw_ctx *ctx);
+void rdw_job_free(rdw_job *job);
+
+rdw_state rdw_job_state(rdw_job *job);
+const char *rdw_job_url(rdw_job *job);
+const char *rdw_job_location(rdw_job *job);
+const char *rdw_job_path(rdw_job *job);
+void *rdw_job_data(rdw_job *job);
+
+#endif /* RDWGET_H */
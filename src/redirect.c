@@ -0,0 +1,151 @@
+/*!
+ * \file
+ * \brief Cache of redirects shared by all links of process.
+ *
+ *  Final location of redirected link is remembered for REDIRECT_CACHE_TTL
+ *  seconds. If redirect keeps the file name (only directories differ), the
+ *  directory is remembered, so that other files of the directory go to the
+ *  final location at once too. Otherwise only the link itself is.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "redirect.h"
+#include "linkparser.h"
+
+typedef struct redirect_entry
+{
+	char *from;		// link, or directory ending with slash
+	char *to;
+	int prefix;		// from is directory of links
+	time_t expires;
+	struct redirect_entry *next;
+} redirect_entry;
+
+static redirect_entry *redirects = NULL;
+static pthread_mutex_t redirects_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * \return entry redirecting url (link itself or the longest directory),
+ * NULL if there is none. Called with redirects_lock held.
+ */
+static redirect_entry *
+redirect_find(const char *url, time_t now)
+{
+	redirect_entry *entry, *best = NULL;
+	size_t len, bestlen = 0;
+
+	for (entry = redirects; entry != NULL; entry = entry->next) {
+		if (entry->expires <= now)
+			continue;
+		if (!entry->prefix) {
+			if (strcmp(entry->from, url) == 0)
+				return (entry);
+			continue;
+		}
+		len = strlen(entry->from);
+		if ((len > bestlen) && (strncmp(entry->from, url, len) == 0)) {
+			best = entry;
+			bestlen = len;
+		}
+	}
+	return (best);
+}
+
+/**
+ * \return new final location of link url, NULL if redirect of url isn't
+ * known.
+ */
+char *
+redirect_lookup(const char *url)
+{
+	redirect_entry *entry;
+	char *target = NULL;
+
+	pthread_mutex_lock(&redirects_lock);
+	if ((entry = redirect_find(url, time(NULL))) != NULL)
+		target = (entry->prefix) ?
+				_strcat(entry->to, url + strlen(entry->from)) :
+				strdup(entry->to);
+	pthread_mutex_unlock(&redirects_lock);
+
+	return (target);
+}
+
+/**
+ * \return pointer to the last slash of path of absolute link url.
+ */
+static const char *
+redirect_lastslash(const char *url)
+{
+	const char *path = strchr(strstr(url, "://") + 3, '/');
+	const char *chr, *slash = NULL;
+
+	for (chr = path; (chr != NULL) && (*chr != '\0') && (*chr != '?');
+			++chr) {
+		if (*chr == '/')
+			slash = chr;
+	}
+	return (slash);
+}
+
+/**
+ * Remembers that link from was redirected to final location to.
+ */
+void
+redirect_learn(const char *from, const char *to)
+{
+	const char *fromslash = redirect_lastslash(from);
+	const char *toslash = redirect_lastslash(to);
+	redirect_entry *entry;
+	char *key, *target;
+	int prefix;
+
+	if ((fromslash == NULL) || (toslash == NULL) || (strcmp(from, to) == 0))
+		return;
+
+	// same file name, directory is redirected
+	if ((prefix = (strcmp(fromslash, toslash) == 0))) {
+		key = strndup(from, fromslash - from + 1);
+		target = strndup(to, toslash - to + 1);
+	} else {
+		key = strdup(from);
+		target = strdup(to);
+	}
+
+	pthread_mutex_lock(&redirects_lock);
+	for (entry = redirects; entry != NULL; entry = entry->next) {
+		if ((entry->prefix == prefix) && (strcmp(entry->from, key) == 0))
+			break;
+	}
+	if (entry == NULL) {
+		entry = malloc(sizeof (redirect_entry));
+		entry->from = key;
+		entry->prefix = prefix;
+		entry->next = redirects;
+		redirects = entry;
+	} else {
+		free(key);
+		free(entry->to);
+	}
+	entry->to = target;
+	entry->expires = time(NULL) + REDIRECT_CACHE_TTL;
+	pthread_mutex_unlock(&redirects_lock);
+}
+
+/**
+ * Forgets redirect of url (it led to location which failed).
+ */
+void
+redirect_forget(const char *url)
+{
+	redirect_entry *entry;
+
+	pthread_mutex_lock(&redirects_lock);
+	if ((entry = redirect_find(url, time(NULL))) != NULL)
+		entry->expires = 0;
+	pthread_mutex_unlock(&redirects_lock);
+}
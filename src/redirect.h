@@ -0,0 +1,12 @@
+#ifndef REDIRECT_H
+#define	REDIRECT_H
+
+#include "defaults.h"
+
+#define	REDIRECT_CACHE_TTL 300	// seconds learned redirect is reused
+
+char *redirect_lookup(const char *url);
+void redirect_learn(const char *from, const char *to);
+void redirect_forget(const char *url);
+
+#endif /* REDIRECT_H */
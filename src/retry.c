@@ -0,0 +1,216 @@
+/*!
+ * \file
+ * \brief Retry policy of chunk downloads and per-host circuit breaker.
+ *
+ *  Failed chunk attempts are retried after exponential backoff with jitter
+ *  (or after Retry-After given by server). Every host has a circuit breaker:
+ *  after BREAKER_FAILS consecutive failures the host is closed for cooldown
+ *  period and then only one probing attempt is let through, so that failing
+ *  host doesn't burn retries of all chunks queued for it.
+ */
+
+#define	_GNU_SOURCE	// timegm
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "retry.h"
+#include "log.h"
+
+typedef enum
+{
+	BR_CLOSED, BR_OPEN, BR_HALF_OPEN
+} breaker_state;
+
+typedef struct breaker
+{
+	char *hostname;
+	breaker_state state;
+	int fails;		// consecutive failures
+	int cooldown;		// current open period (seconds)
+	time_t until;		// end of open period
+	struct breaker *next;
+} breaker;
+
+static breaker *breakers = NULL;
+static pthread_mutex_t breakers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t breakers_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Decides if chunk attempt which ended with status code (0 if no response
+ * was received, partial content if transfer of range was interrupted) is
+ * worth of retrying.
+ * \return nonzero if attempt can be retried.
+ */
+int
+retry_status_retryable(statcode code)
+{
+	if ((code <= 0) || (code == HTTP_STATUSCODE_PARTIAL) ||
+			(code == HTTP_STATUSCODE_TIMEOUT) ||
+			(code == HTTP_STATUSCODE_TOO_MANY) || (code >= 500))
+		return (1);
+	return (0);
+}
+
+/**
+ * Parses value of Retry-After header (delay in seconds or HTTP-date).
+ * \return delay in seconds, -1 if value is not valid.
+ */
+int
+retry_after_parse(const char *value)
+{
+	char *end;
+	long delay;
+	struct tm tm;
+	time_t when, now;
+
+	while (*value == ' ')
+		++value;
+
+	delay = strtol(value, &end, 10);
+	if ((end != value) && ((*end == '\0') || (*end == ' ')))
+		return ((delay < 0) ? -1 : (int)delay);
+
+	memset(&tm, 0, sizeof (tm));
+	if (strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm) == NULL)
+		return (-1);
+	when = timegm(&tm);
+	now = time(NULL);
+
+	return ((when > now) ? (int)(when - now) : 0);
+}
+
+/**
+ * Calculates wait before next attempt: basewait * 2^attempt seconds (at most
+ * RETRY_WAIT_MAX) where the second half is random (jitter). Longer
+ * Retry-After of server (retryafter >= 0) takes precedence.
+ * \return wait in milliseconds.
+ */
+int
+retry_backoff(int attempt, int basewait, int retryafter)
+{
+	static __thread unsigned int seed = 0;
+	long long int wait = (long long int) basewait * 1000;
+
+	if (seed == 0)
+		seed = (unsigned int) time(NULL) ^ (unsigned int)
+				(uintptr_t) &seed;
+
+	while ((attempt-- > 0) && (wait < RETRY_WAIT_MAX * 1000))
+		wait *= 2;
+	if (wait > RETRY_WAIT_MAX * 1000)
+		wait = RETRY_WAIT_MAX * 1000;
+	wait = wait / 2 + rand_r(&seed) % (wait / 2 + 1);
+
+	if ((retryafter >= 0) && ((long long int) retryafter * 1000 > wait))
+		wait = (long long int) retryafter * 1000;
+
+	return ((int)wait);
+}
+
+/**
+ * Finds breaker of hostname (creates a closed one if it doesn't exist).
+ * Has to be called with breakers_lock held.
+ */
+static breaker *
+breaker_find(const char *hostname)
+{
+	breaker *br;
+
+	for (br = breakers; br != NULL; br = br->next) {
+		if (strcmp(br->hostname, hostname) == 0)
+			return (br);
+	}
+
+	br = malloc(sizeof (breaker));
+	br->hostname = strdup(hostname);
+	br->state = BR_CLOSED;
+	br->fails = 0;
+	br->cooldown = BREAKER_COOLDOWN;
+	br->until = 0;
+	br->next = breakers;
+	breakers = br;
+
+	return (br);
+}
+
+/**
+ * Waits until circuit breaker of hostname lets attempt of chunk through:
+ * breaker is closed or open period elapsed and this attempt becomes the
+ * probe. Waiting ends early when chunk or its link is cancelled.
+ * \return 0 if attempt was let through, -1 if waiting was cancelled
+ * (breaker_release isn't called then).
+ */
+int
+breaker_acquire(const char *hostname, const chunk_bounds *bound)
+{
+	breaker *br;
+	struct timespec wakeup;
+
+	pthread_mutex_lock(&breakers_lock);
+	br = breaker_find(hostname);
+	for (;;) {
+		if (br->state == BR_CLOSED)
+			break;
+		if ((br->state == BR_OPEN) && (time(NULL) >= br->until)) {
+			br->state = BR_HALF_OPEN;
+			break;
+		}
+		if ((__atomic_load_n(&bound->state, __ATOMIC_RELAXED) !=
+				CH_RUNNING) || (__atomic_load_n(
+				&bound->lnk->cancel, __ATOMIC_RELAXED))) {
+			pthread_mutex_unlock(&breakers_lock);
+			return (-1);
+		}
+
+		// cancelling doesn't signal breakers_cond, it is polled
+		clock_gettime(CLOCK_REALTIME, &wakeup);
+		wakeup.tv_nsec += BREAKER_POLL_MS * 1000000L;
+		if (wakeup.tv_nsec >= 1000000000L) {
+			++wakeup.tv_sec;
+			wakeup.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&breakers_cond, &breakers_lock, &wakeup);
+	}
+	pthread_mutex_unlock(&breakers_lock);
+
+	return (0);
+}
+
+/**
+ * Reports result of attempt let through by breaker_acquire. Success closes
+ * breaker, failure of probe or BREAKER_FAILS consecutive failures opens it
+ * (every reopening doubles the open period). Cancelled attempt changes
+ * nothing, only its probe is handed to the next attempt.
+ */
+void
+breaker_release(const char *hostname, breaker_result result)
+{
+	breaker *br;
+
+	pthread_mutex_lock(&breakers_lock);
+	br = breaker_find(hostname);
+	if (result == BREAKER_NONE) {
+		if (br->state == BR_HALF_OPEN) {
+			br->state = BR_OPEN;
+			br->until = time(NULL);
+		}
+	} else if (result == BREAKER_SUCCESS) {
+		br->state = BR_CLOSED;
+		br->fails = 0;
+		br->cooldown = BREAKER_COOLDOWN;
+	} else if ((br->state == BR_HALF_OPEN) ||
+			(++br->fails >= BREAKER_FAILS)) {
+		if (br->state == BR_HALF_OPEN)
+			br->cooldown = (br->cooldown * 2 > BREAKER_COOLDOWN_MAX)
+					? BREAKER_COOLDOWN_MAX : br->cooldown * 2;
+		br->state = BR_OPEN;
+		br->until = time(NULL) + br->cooldown;
+		log_error(NULL, 0, "host %s keeps failing, pausing its "
+				"requests for %d s", hostname, br->cooldown);
+	}
+	pthread_cond_broadcast(&breakers_cond);
+	pthread_mutex_unlock(&breakers_lock);
+}
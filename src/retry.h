@@ -0,0 +1,28 @@
+#ifndef RETRY_H
+#define	RETRY_H
+
+#include "defaults.h"
+
+#define	RETRY_WAIT_MAX 60	// max backoff (seconds) between chunk attempts
+#define	BREAKER_FAILS 5		// consecutive failures opening host breaker
+#define	BREAKER_COOLDOWN 2	// first open period of host breaker (seconds)
+#define	BREAKER_COOLDOWN_MAX 120
+#define	BREAKER_POLL_MS 100	// check of cancel while host breaker is open
+
+/**
+ * Result of attempt reported to host breaker (BREAKER_NONE = attempt was
+ * cancelled, it tells nothing about the host).
+ */
+typedef enum
+{
+	BREAKER_FAIL, BREAKER_SUCCESS, BREAKER_NONE
+} breaker_result;
+
+int retry_status_retryable(statcode code);
+int retry_after_parse(const char *value);
+int retry_backoff(int attempt, int basewait, int retryafter);
+
+int breaker_acquire(const char *hostname, const chunk_bounds *bound);
+void breaker_release(const char *hostname, breaker_result result);
+
+#endif /* RETRY_H */
@@ -0,0 +1,416 @@
+/*!
+ * \file
+ * \brief Order of links of batch and their completion times.
+ *
+ *  Links of batch start by explicit priority and then by policy: shortest
+ *  first (sizes given by batch file or asked by header requests pipelined
+ *  per server, turned into download times by profiles of servers) or
+ *  earliest deadline first. A batch is downloaded by a pool of workers, so
+ *  a worker freed by finished link starts the next one at once and small
+ *  links don't wait behind large ones. Completion times give mean
+ *  completion time, time to the first file and missed deadlines.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>	// HUGE_VAL
+#include <time.h>
+#include <pthread.h>
+
+#include "schedule.h"
+#include "log.h"
+#include "threadmanager.h"
+#include "httpclient.h"
+#include "linkparser.h"
+#include "smallfile.h"
+#include "hostprof.h"
+
+/**
+ * Header requests of links of unknown size, shared by probing threads.
+ * Links are grouped by server, header requests of group are pipelined.
+ */
+typedef struct
+{
+	sched_link *links;
+	lnk *lnks;		// links of unknown size sorted by server
+	int *idx;		// index of every lnk in links
+	int *groups;		// first lnk of group, groups[groupnum] = end
+	int groupnum;
+	int next;		// the next group to probe (atomic)
+} sched_probes;
+
+/**
+ * Parsed link of unknown size and its index in batch.
+ */
+typedef struct
+{
+	lnk link;
+	int idx;
+} sched_target;
+
+static double
+sched_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/**
+ * Appends link url without hints to links (num of them).
+ * \return 0 on success, -1 on fail.
+ */
+int
+sched_add(sched_link **links, int *num, const char *url)
+{
+	sched_link *grown;
+
+	if ((grown = realloc(*links, (*num + 1) * sizeof (sched_link))) ==
+			NULL)
+		return (-1);
+	*links = grown;
+	grown[*num].url = strdup(url);
+	grown[*num].priority = 0;
+	grown[*num].deadline = -1;
+	grown[*num].size = -1;
+	grown[*num].cost = -1;
+	grown[*num].idx = *num;
+	++*num;
+
+	return (0);
+}
+
+/**
+ * Parses field (priority=num, deadline=sec or size=size) of batch line
+ * into link.
+ * \return 0 on success, -1 if field isn't valid.
+ */
+static int
+sched_field(sched_link *link, const char *field)
+{
+	char *end;
+
+	if (strncmp(field, "priority=", 9) == 0) {
+		link->priority = (int) strtol(field + 9, &end, 10);
+		return (((end == field + 9) || (*end != '\0')) ? -1 : 0);
+	}
+	if (strncmp(field, "deadline=", 9) == 0) {
+		link->deadline = strtod(field + 9, &end);
+		return (((end == field + 9) || (*end != '\0') ||
+				(link->deadline < 0)) ? -1 : 0);
+	}
+	if (strncmp(field, "size=", 5) == 0)
+		return (_strtosize(field + 5, &link->size));
+	return (-1);
+}
+
+/**
+ * Appends links of batch file path to links (num of them). Every line is
+ * a link followed by optional fields priority=num, deadline=sec (from start
+ * of batch) and size=size, separated by blanks. Empty lines and lines
+ * starting with # are skipped.
+ * \return 0 on success, -1 on fail.
+ */
+int
+sched_load(const char *path, sched_link **links, int *num)
+{
+	char line[SCHED_LINE_MAX];
+	char *holder, *token;
+	FILE *file;
+	int lineno = 0, ret = 0;
+
+	if ((file = fopen(path, "r")) == NULL) {
+		log_error(NULL, errno, "batch %s can't be read", path);
+		return (-1);
+	}
+	while ((ret == 0) && (fgets(line, sizeof (line), file) != NULL)) {
+		++lineno;
+		line[strcspn(line, "\r\n")] = '\0';
+		token = _strtok(&holder, line, " \t");
+		while ((token != NULL) && (*token == '\0'))
+			token = _strtok(&holder, NULL, " \t");
+		if ((token == NULL) || (*token == '#'))
+			continue;
+		if ((ret = sched_add(links, num, token)) == -1)
+			break;
+		while ((token = _strtok(&holder, NULL, " \t")) != NULL) {
+			if ((*token != '\0') &&
+					(sched_field(&(*links)[*num - 1],
+					token) == -1)) {
+				log_error(NULL, 0, "%s:%d: field %s "
+						"isn't valid", path, lineno,
+						token);
+				ret = -1;
+				break;
+			}
+		}
+	}
+	fclose(file);
+
+	return (ret);
+}
+
+void
+sched_free(sched_link *links, int num)
+{
+	int idx;
+
+	for (idx = 0; idx != num; ++idx)
+		free(links[idx].url);
+	free(links);
+}
+
+/**
+ * \return 1 if links have to be ordered (by policy or by their priorities
+ * or deadlines), 0 if they can all start at once.
+ */
+int
+sched_needed(const sched_link *links, int num, order_policy policy)
+{
+	int idx;
+
+	if (policy != ORDER_GIVEN)
+		return (1);
+	for (idx = 0; idx != num; ++idx)
+		if ((links[idx].priority != 0) || (links[idx].deadline >= 0))
+			return (1);
+	return (0);
+}
+
+/**
+ * Asks for headers of groups of links (function for one thread). Links
+ * whose pipelined header request didn't succeed (redirects too) are asked
+ * again one by one.
+ * param data of type (sched_probes *).
+ */
+static void *
+sched_probe_run(void *data)
+{
+	sched_probes *probes = (sched_probes *) data;
+	lnk_http_header *linkhs, *linkh;
+	lnk *links;
+	int *batchidx;
+	int group, num, done, idx;
+
+	while ((group = __atomic_fetch_add(&probes->next, 1,
+			__ATOMIC_RELAXED)) < probes->groupnum) {
+		links = &probes->lnks[probes->groups[group]];
+		batchidx = &probes->idx[probes->groups[group]];
+		num = probes->groups[group + 1] - probes->groups[group];
+		linkhs = calloc(num, sizeof (lnk_http_header));
+		done = small_probe(links, num, linkhs);
+		for (idx = 0; idx != num; ++idx) {
+			linkh = &linkhs[idx];
+			if ((idx >= done) || (linkh->statcodegrp != SUCCESS)) {
+				// redirects found are cached for download
+				if (thr_mgr_linkheader(&links[idx],
+						&linkh) == -1)
+					continue;
+			}
+			if (linkh->statcodegrp == SUCCESS)
+				probes->links[batchidx[idx]].size = linkh->clen;
+			if (linkh != &linkhs[idx]) {
+				link_header_free(linkh);
+				free(linkh);
+			}
+		}
+		for (idx = 0; idx != num; ++idx)
+			link_header_free(&linkhs[idx]);
+		free(linkhs);
+	}
+
+	return (NULL);
+}
+
+/**
+ * \return order of servers of links a and b.
+ */
+static int
+sched_cmp_server(const lnk *a, const lnk *b)
+{
+	int cmp;
+
+	if (a->prot != b->prot)
+		return (a->prot - b->prot);
+	if ((cmp = strcmp(a->hostname, b->hostname)) != 0)
+		return (cmp);
+	return (a->port - b->port);
+}
+
+static int
+sched_cmp_target(const void *a, const void *b)
+{
+	return (sched_cmp_server(&((const sched_target *) a)->link,
+			&((const sched_target *) b)->link));
+}
+
+/**
+ * Finds sizes of links which batch didn't give by header requests, grouped
+ * by server (at most SCHED_PROBE_GROUP links each) and pipelined on one
+ * connection, at most SCHED_PROBES_MAX groups are asked at once. Links
+ * failing it stay unknown.
+ */
+void
+sched_probe(sched_link *links, int num, const prgstx *stx)
+{
+	sched_probes probes;
+	sched_target *targets;
+	pthread_t thr[SCHED_PROBES_MAX];
+	int thrnum, idx, lnknum = 0;
+
+	targets = calloc(num, sizeof (sched_target));
+	for (idx = 0; idx != num; ++idx) {
+		if ((links[idx].size >= 0) || (link_parse(links[idx].url,
+				&targets[lnknum].link) == -1))
+			continue;
+		targets[lnknum].link.sprf = &stx->sprf;
+		targets[lnknum].link.maxredirs = stx->maxredirs;
+		targets[lnknum].link.destfd = -1;
+		targets[lnknum++].idx = idx;
+	}
+	qsort(targets, lnknum, sizeof (sched_target), sched_cmp_target);
+
+	probes.links = links;
+	probes.lnks = malloc(lnknum * sizeof (lnk));
+	probes.idx = malloc(lnknum * sizeof (int));
+	probes.groups = malloc((lnknum + 1) * sizeof (int));
+	probes.groupnum = 0;
+	probes.next = 0;
+	for (idx = 0; idx != lnknum; ++idx) {
+		probes.lnks[idx] = targets[idx].link;
+		probes.idx[idx] = targets[idx].idx;
+		if ((idx == 0) || (idx - probes.groups[probes.groupnum - 1] ==
+				SCHED_PROBE_GROUP) || (sched_cmp_server(
+				&probes.lnks[idx - 1], &probes.lnks[idx]) != 0))
+			probes.groups[probes.groupnum++] = idx;
+	}
+	probes.groups[probes.groupnum] = lnknum;
+	free(targets);
+
+	for (thrnum = 0; (thrnum != SCHED_PROBES_MAX) &&
+			(thrnum != probes.groupnum); ++thrnum)
+		if (pthread_create(&thr[thrnum], NULL, sched_probe_run,
+				&probes) != 0)
+			break;
+	// groups left by failed threads are asked here
+	if (thrnum == 0)
+		sched_probe_run(&probes);
+	for (idx = 0; idx != thrnum; ++idx)
+		pthread_join(thr[idx], NULL);
+
+	for (idx = 0; idx != lnknum; ++idx)
+		link_free(&probes.lnks[idx]);
+	free(probes.lnks);
+	free(probes.idx);
+	free(probes.groups);
+}
+
+static int
+sched_cmp_given(const void *a, const void *b)
+{
+	const sched_link *la = a, *lb = b;
+
+	if (la->priority != lb->priority)
+		return ((la->priority > lb->priority) ? -1 : 1);
+	return (la->idx - lb->idx);
+}
+
+static int
+sched_cmp_size(const void *a, const void *b)
+{
+	const sched_link *la = a, *lb = b;
+	double sa = (la->cost < 0) ? HUGE_VAL : la->cost;
+	double sb = (lb->cost < 0) ? HUGE_VAL : lb->cost;
+
+	if ((la->priority != lb->priority) || (sa == sb))
+		return (sched_cmp_given(a, b));
+	return ((sa < sb) ? -1 : 1);
+}
+
+static int
+sched_cmp_deadline(const void *a, const void *b)
+{
+	const sched_link *la = a, *lb = b;
+	double da = (la->deadline < 0) ? -1 : la->deadline;
+	double db = (lb->deadline < 0) ? -1 : lb->deadline;
+
+	// links without deadline follow those with one
+	if ((la->priority != lb->priority) || (da == db))
+		return (sched_cmp_given(a, b));
+	if ((da < 0) || (db < 0))
+		return ((da < 0) ? 1 : -1);
+	return ((da < db) ? -1 : 1);
+}
+
+/**
+ * Sets cost of links of known size: download time expected by profiles of
+ * their servers (round trip and throughput), or the size itself if no
+ * throughput is known.
+ */
+static void
+sched_cost(sched_link *links, int num)
+{
+	lnk link;
+	double est;
+	int idx, bytes = 0;
+
+	for (idx = 0; idx != num; ++idx) {
+		links[idx].cost = -1;
+		if ((links[idx].size < 0) ||
+				(link_parse(links[idx].url, &link) == -1))
+			continue;
+		est = hostprof_estimate(&link, links[idx].size);
+		link_free(&link);
+		links[idx].cost = est;
+		bytes |= (est < 0);
+	}
+	// times and sizes can't be compared
+	for (idx = 0; (bytes) && (idx != num); ++idx)
+		if (links[idx].size >= 0)
+			links[idx].cost = (double) links[idx].size;
+}
+
+/**
+ * Sorts links into order in which they start: by priority and then by
+ * policy (by expected download time for ORDER_SIZE), links equal by both
+ * keep their order of batch.
+ */
+void
+sched_order(sched_link *links, int num, order_policy policy)
+{
+	if (policy == ORDER_SIZE)
+		sched_cost(links, num);
+	qsort(links, num, sizeof (sched_link), (policy == ORDER_SIZE) ?
+			sched_cmp_size : (policy == ORDER_DEADLINE) ?
+			sched_cmp_deadline : sched_cmp_given);
+}
+
+/**
+ * Starts measuring completion times of batch.
+ */
+void
+sched_stats_init(sched_stats *stats)
+{
+	memset(stats, 0, sizeof (sched_stats));
+	stats->started = sched_now();
+	stats->first = -1;
+}
+
+/**
+ * Records completion of link now.
+ */
+void
+sched_stats_done(sched_stats *stats, const sched_link *link)
+{
+	double elapsed = sched_now() - stats->started;
+
+	++stats->done;
+	stats->sum += elapsed;
+	if (stats->first < 0)
+		stats->first = elapsed;
+	stats->last = elapsed;
+	if ((link->deadline >= 0) && (elapsed > link->deadline))
+		++stats->missed;
+}
@@ -0,0 +1,47 @@
+#ifndef SCHEDULE_H
+#define	SCHEDULE_H
+
+#include "defaults.h"
+
+#define	SCHED_LINE_MAX 8192	// longest line of batch file
+#define	SCHED_PROBES_MAX 64	// groups of header requests asked at once
+#define	SCHED_PROBE_GROUP 64	// header requests of one server in group
+
+/**
+ * Link of batch with its scheduling hints.
+ */
+typedef struct
+{
+	char *url;
+	int priority;		// higher starts first
+	double deadline;	// seconds from start of batch, -1 = none
+	long long int size;	// -1 = unknown
+	double cost;		// expected download time (or size), -1 =
+				// unknown
+	int idx;		// position in batch
+} sched_link;
+
+/**
+ * Completion times of links of batch.
+ */
+typedef struct
+{
+	double started;
+	int done;
+	double sum;		// completion times of finished links
+	double first;		// completion of the first link, -1 = none yet
+	double last;		// completion of the last link
+	int missed;		// links finished after their deadline
+} sched_stats;
+
+int sched_add(sched_link **links, int *num, const char *url);
+int sched_load(const char *path, sched_link **links, int *num);
+void sched_free(sched_link *links, int num);
+int sched_needed(const sched_link *links, int num, order_policy policy);
+void sched_probe(sched_link *links, int num, const prgstx *stx);
+void sched_order(sched_link *links, int num, order_policy policy);
+
+void sched_stats_init(sched_stats *stats);
+void sched_stats_done(sched_stats *stats, const sched_link *link);
+
+#endif /* SCHEDULE_H */
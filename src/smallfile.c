@@ -0,0 +1,219 @@
+/*!
+ * \file
+ * \brief Small links fetched by one request on persistent connections.
+ *
+ *  Link up to link->small bytes is asked by one GET of range of that size
+ *  (no header request, no chunks) on idle connection of the server, and
+ *  the connection goes back to the pool for the next link. Response of
+ *  a larger link gives its size, so the link continues by chunks without
+ *  header request. Sizes of many links of one server are asked by header
+ *  requests sent at once on one connection (pipelined).
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "smallfile.h"
+#include "httpclient.h"
+#include "threadmanager.h"
+#include "linkparser.h"
+#include "redirect.h"
+#include "trace.h"
+#include "log.h"
+#include "hostprof.h"
+
+/**
+ * Reads body of len bytes following header of response (its beginning is
+ * in hbufs->remain) into body.
+ * \return 0 on success, -1 on fail.
+ */
+static int
+small_body_read(http_conn *conn, const headerbufs *hbufs, char *body,
+		size_t len)
+{
+	size_t got = (hbufs->rlen < len) ? hbufs->rlen : len;
+	ssize_t sz;
+
+	// more than body means the connection is out of step
+	if (hbufs->rlen > len)
+		return (-1);
+	memcpy(body, hbufs->remain, got);
+	while ((got < len) &&
+			((sz = http_read(conn, body + got, len - got)) > 0))
+		got += sz;
+
+	return ((got == len) ? 0 : -1);
+}
+
+/**
+ * Writes body of link (len bytes) into its destination.
+ * \return 0 on success, -1 on fail.
+ */
+static int
+small_write(const char *resultdir, lnk *link, const char *body, size_t len)
+{
+	file_fd fd;
+	int ret = 0;
+	double start;
+
+	if (link->stream)
+		return (stream_write(link->destfd, body, len));
+
+	if ((fd = thr_mgr_createfile(resultdir, link, len)) == -1)
+		return (-1);
+	start = trace_begin();
+	if (pwrite(fd, body, len, 0) != (ssize_t) len) {
+		log_error(link, errno, "Couldn't write file %s",
+				link->filename);
+		ret = -1;
+	}
+	trace_end("write", start, link, 0, len - 1);
+
+	return (thr_mgr_closefile(link, fd, ret));
+}
+
+/**
+ * Downloads link by one request if it has at most link->small bytes.
+ * Header of larger link (its size in clen) is saved into linkhp, so it
+ * can be downloaded by chunks without asking again.
+ * \return 0 if link was downloaded, -1 on fail, 1 if link has to be
+ * downloaded by chunks (linkhp is NULL if its header has to be asked by
+ * thr_mgr_linkheader, e.g. for redirects).
+ */
+int
+small_download(const char *resultdir, lnk *link, lnk_http_header **linkhp)
+{
+	http_conn conn;
+	headerbufs hbufs;
+	lnk_http_header *linkh;
+	statcode status;
+	long long int size;
+	char *url, *body;
+	int reused, ret = 1;
+	double start;
+
+	*linkhp = NULL;
+
+	// known redirect is taken by header request
+	url = link_url(link);
+	body = redirect_lookup(url);
+	free(url);
+	if (body != NULL) {
+		free(body);
+		return (1);
+	}
+
+	start = trace_begin();
+	if ((reused = http_pool_take(&conn, link)) == -1)
+		return (-1);
+	// server may have closed idle connection before responding
+	while ((http_range_req(&conn, link, 0, link->small - 1) == -1) ||
+			(http_header_read(&conn, &hbufs) == -1)) {
+		http_close(&conn);
+		if ((!reused) || (http_connect(&conn, link, NULL) == -1))
+			return (-1);
+		reused = 0;
+	}
+
+	linkh = malloc(sizeof (lnk_http_header));
+	status = link_header_parse(hbufs.hdata, linkh);
+	free(hbufs.hdata);
+	size = (status == HTTP_STATUSCODE_PARTIAL) ? linkh->total :
+			(status == HTTP_STATUSCODE_OK) ? linkh->clen : -1;
+	// server ignoring range sends the whole file
+	if ((status == HTTP_STATUSCODE_PARTIAL) ||
+			(status == HTTP_STATUSCODE_OK))
+		hostprof_note(link, HOSTPROF_RANGES,
+				status == HTTP_STATUSCODE_PARTIAL);
+	hostprof_note(link, HOSTPROF_KEEPALIVE, linkh->keepalive);
+	hostprof_rtt(link, http_rtt(&conn));
+
+	// body of larger response isn't read (server ignores range), nor
+	// body of redirect or error (it may have no length)
+	if ((size < 0) || (linkh->clen > link->small)) {
+		free(hbufs.remain);
+		http_close(&conn);
+		if (size < 0) {
+			link_header_free(linkh);
+			free(linkh);
+		} else {
+			*linkhp = linkh;
+		}
+		return (1);
+	}
+
+	body = malloc(linkh->clen);
+	if (small_body_read(&conn, &hbufs, body, linkh->clen) == -1) {
+		http_close(&conn);
+		free(hbufs.remain);
+		free(body);
+		link_header_free(linkh);
+		free(linkh);
+		return (1);
+	}
+	free(hbufs.remain);
+	http_pool_give(&conn, link, linkh->keepalive);
+	trace_end("small_get", start, link, 0, linkh->clen - 1);
+
+	if (size == linkh->clen) {
+		ret = small_write(resultdir, link, body, size);
+		if ((ret == 0) && (link->progress != NULL))
+			link->progress(link->progressdata, size, size, "#");
+		link_header_free(linkh);
+		free(linkh);
+	} else {
+		// the first range of larger link is asked again by its chunk
+		linkh->clen = size;
+		*linkhp = linkh;
+	}
+	free(body);
+
+	return (ret);
+}
+
+/**
+ * Asks for headers of num links of one server, SMALL_PIPELINE header
+ * requests are sent at once on persistent connection (unless server is
+ * known to close connections). Redirects aren't followed.
+ * \return number of links whose headers were read into linkhs (the first
+ * ones), the rest has to be asked by thr_mgr_linkheader.
+ */
+int
+small_probe(lnk *links, int num, lnk_http_header *linkhs)
+{
+	http_conn conn;
+	int reused, batch, got, done = 0;
+	double start = trace_begin();
+
+	// server closing connections would answer one request of pipeline
+	if (hostprof_get(links, HOSTPROF_KEEPALIVE) == 0)
+		return (0);
+	if ((reused = http_pool_take(&conn, links)) == -1)
+		return (0);
+	while (done != num) {
+		batch = (num - done < SMALL_PIPELINE) ? num - done :
+				SMALL_PIPELINE;
+		if ((got = http_link_headers(&conn, links + done, batch,
+				linkhs + done)) > 0) {
+			done += got;
+			reused = 0;
+		}
+		if ((got == batch) && (linkhs[done - 1].keepalive))
+			continue;
+
+		// server closed idle connection or closes it after a number of
+		// requests, the rest goes on a new one
+		http_close(&conn);
+		if ((done == num) || ((got <= 0) && (!reused)) ||
+				(http_connect(&conn, links, NULL) == -1))
+			return (done);
+		reused = 0;
+	}
+
+	http_pool_give(&conn, links, 1);
+	trace_end("link_headers", start, links, -1, 0);
+
+	return (done);
+}
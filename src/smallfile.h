@@ -0,0 +1,12 @@
+#ifndef SMALLFILE_H
+#define	SMALLFILE_H
+
+#include "defaults.h"
+
+#define	SMALL_PIPELINE 16	// header requests sent at once on connection
+
+int small_download(const char *resultdir, lnk *link,
+		lnk_http_header **linkhp);
+int small_probe(lnk *links, int num, lnk_http_header *linkhs);
+
+#endif /* SMALLFILE_H */
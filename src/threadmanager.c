@@ -2,392 +2,1202 @@
  * \file
  * \brief Simple threaded manager of files and chunks.
  */
+#define	_GNU_SOURCE	// sync_file_range, fallocate
 #include <stdlib.h>
 #include <stdio.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>	// clock_gettime
 #include <assert.h>
 
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/mman.h>	// memory mapping
+#include <sys/socket.h>	// shutdown
+#include <poll.h>
 #include "threadmanager.h"
 #include "httpclient.h"
 #include "linkparser.h"
+#include "retry.h"
+#include "http2.h"
+#include "trace.h"
+#include "log.h"
+#include "redirect.h"
+#include "membudget.h"
+#include "delta.h"
+#include "metalink.h"
+#include "unpack.h"
+#include "smallfile.h"
+#include "hostprof.h"
 
-// extern long long int MAX_MAP_SIZE;
-// long long int MAX_MAP_SIZE = 0x7FFFFFFF;
-static long long int MAX_MAP_SIZE = (long long int) 0x80000000;
+#define	HEDGE_CHECK_SEC 1		// period of stall detection
+#define	HEDGE_SLOW_FACTOR 4		// slow = under median / factor
+#define	HEDGE_MIN_REMAIN (256 * 1024)	// smaller rests are not hedged
 
+#define	PROGRESS_STALL_SEC 5	// chunk receiving nothing is shown stalled
+
+#define	STREAM_PIECE (4 * 1024 * 1024)	// largest range of streamed file
+#define	STREAM_WINDOW 2			// buffered pieces per chunk thread
+#define	STREAM_POLL_MS 50		// output of partial piece period
+
+/**
+ * Written ranges of one copy of chunk: writeback of [start, pos) starts,
+ * [done, start) (whose writeback started before) is waited for and dropped
+ * from page cache.
+ */
 typedef struct
 {
-	const char *resultdir;
-	lnk *link;
-} downinfo;
+	long long int done, start, pos;
+} wbrange;
 
 /**
- * Downloads one link (function for one thread).
- * param data of type (downinfo *).
+ * Follows redirect of link to location (relative to link). Link is pointed
+ * to the new location.
+ * \return 0 on success, -1 on fail.
  */
-void *
-run_download(void *data)
+static int
+thr_mgr_redirect(lnk *link, const char *location)
 {
-	downinfo *dinfo = (downinfo *) data;
-	//  lnk* link = dinfo->link;// (lnk *) data;
-	lnk_http_header *linkh; // = malloc(sizeof(lnk_http_header));
+	char *url = link_url(link), *target;
+	int ret = -1;
 
-	if (http_link_header(dinfo->link, &linkh) == -1)
-		return (void *) (-1);
-	if (thr_mgr_downloadallchunks(dinfo->resultdir, dinfo->link, linkh)
-			== -1)
-		return (void *) (-1);
-
-	//  sleep(rand() % 5);
-//	printf("I AM THREAD rquri: %s with filesize:%lld and type:%s\n",
-//			dinfo->link->rquri, linkh->clen, linkh->ctype);
+	if (((target = link_resolve(url, location)) != NULL) &&
+			(link_retarget(link, target) == 0)) {
+		log_info(link, "%s redirected to %s", url, target);
+		ret = 0;
+	} else {
+		log_error(link, 0, "redirect of %s to %s can't be "
+				"followed", url, location);
+	}
+	free(target);
+	free(url);
 
-	return (void *) (0);
+	return (ret);
 }
 
 /**
- * Downloads all links specified in prgstx structure by creating thread for
- * every link.
+ * Obtains header of link into linkhp and follows at most link->maxredirs
+ * redirects. Link is pointed to its final location, so its chunks go there
+ * at once. Known redirect (of link or its directory) is taken without asking
+ * the server, the original link is asked again if it fails.
+ * \return 0 on success, -1 on fail.
  */
-void
-thr_mgr_downloadallfiles(prgstx *stx)
+int
+thr_mgr_linkheader(lnk *link, lnk_http_header **linkhp)
 {
-	int lnkidx = 0;
-	int *retval;
-
-
-	pthread_t *downloaders = malloc(sizeof (pthread_t) * stx->numlinks);
-	lnk *links = malloc(sizeof (lnk) * stx->numlinks);
-	int *activepthr = malloc(sizeof (int) * stx->numlinks);
-	downinfo *dinfo = malloc(sizeof (downinfo) * stx->numlinks);
-
-	// set chunk num
-//	links[lnkidx].chunknum = stx->chunks;
-//
-//	dinfo[lnkidx].link = &links[lnkidx];
-//	dinfo[lnkidx].resultdir = stx->resultdir;
-
-//	if (link_parse(stx->links[lnkidx], &links[lnkidx]) != -1) {
-//		run_download(&dinfo[lnkidx]);
-//	}
-
-	for (lnkidx = 0; lnkidx != stx->numlinks; ++lnkidx) {
-		links[lnkidx].chunknum = stx->chunks;
-		if ((activepthr[lnkidx] = link_parse(stx->links[lnkidx],
-				&links[lnkidx])) != -1) {
-			links[lnkidx].chunknum = stx->chunks;
-			printf("downloading link %s%s\n",
-					links[lnkidx].hostname,
-					links[lnkidx].filename);
-			dinfo[lnkidx].link = &links[lnkidx];
-			dinfo[lnkidx].resultdir = stx->resultdir;
-			if (pthread_create(&downloaders[lnkidx], NULL,
-					run_download, &dinfo[lnkidx]) != 0) {
-				fprintf(stdlog, log_ERROR
-						"thread for link %s couldn't "
-						"be created\n",
-						links[lnkidx].rquri);
-				activepthr[lnkidx] = -1;
-			}
+	char *origin = link_url(link), *target, *final;
+	int hops = 0, cached = 0, ret;
+	double start;
+
+	if ((target = redirect_lookup(origin)) != NULL) {
+		if (link_retarget(link, target) == 0) {
+			log_info(link, "%s redirected to %s (cached)",
+					origin, target);
+			cached = 1;
 		}
+		free(target);
 	}
 
-	printf("\nWait please for downloading all links...\n\n");
-
-	for (lnkidx = 0; lnkidx != stx->numlinks; ++lnkidx) {
-		if (activepthr[lnkidx] != -1) {
-			pthread_join(downloaders[lnkidx], (void **) &retval);
-//			printf("RETVAL: %d\n", (int) retval);
-			if (retval == 0) {
-				printf("%s successfully downloaded! "
-						"(http://%s%s)\n",
-						links[lnkidx].filename,
-						links[lnkidx].hostname,
-						links[lnkidx].rquri);
-			}
+	for (;;) {
+		start = trace_begin();
+		// server which doesn't speak http/2 is downloaded over HTTP/1.1
+		// (server known not to speak it isn't asked again)
+		if (link->http2 && ((hostprof_get(link, HOSTPROF_HTTP2) == 0) ||
+				(!h2_available(link)))) {
+			log_info(link, "server %s doesn't support http/2, "
+					"using HTTP/1.1", link->hostname);
+			hostprof_note(link, HOSTPROF_HTTP2, 0);
+			link->http2 = 0;
+		} else if (link->http2) {
+			hostprof_note(link, HOSTPROF_HTTP2, 1);
+		}
+
+		if ((ret = ((link->http2) ? h2_link_header(link, linkhp) :
+				http_link_header(link, linkhp))) == -1) {
+			if (!cached)
+				break;
+			// remembered location may be gone
+			redirect_forget(origin);
+			link_retarget(link, origin);
+			cached = 0;
+			hops = 0;
+			continue;
 		}
+		if ((*linkhp)->statcodegrp != REDIRECT)
+			break;
+
+		trace_end("redirect", start, link, -1, 0);
+		ret = -1;
+		if (hops++ == link->maxredirs)
+			log_error(link, 0, "%s redirected more than %d "
+					"times", origin, link->maxredirs);
+		else
+			ret = thr_mgr_redirect(link, (*linkhp)->location);
+		link_header_free(*linkhp);
+		free(*linkhp);
+		if (ret == -1)
+			break;
 	}
 
-	free(links);
-	free(downloaders);
-	free(activepthr);
+	if ((ret == 0) && (hops > 0)) {
+		final = link_url(link);
+		redirect_learn(origin, final);
+		free(final);
+	}
+	link->redirected = (ret == 0) && ((hops > 0) || (cached));
+	free(origin);
+
+	return (ret);
 }
 
+/**
+ * Downloads one link into resultdir (or into link->path or link->destfd).
+ * \return 0 on success, -1 on fail.
+ */
+int
+thr_mgr_downloadfile(const char *resultdir, lnk *link)
+{
+	lnk_http_header *linkh;
+	int unpack, ret;
+
+	if (__atomic_load_n(&link->cancel, __ATOMIC_RELAXED))
+		return (-1);
+
+	// size given by metalink saves header request (http/2 session is
+	// negotiated by it)
+	if ((link->metalink != NULL) && (link->metalink->size >= 0) &&
+			(!link->stream) && (!link->http2)) {
+		if (link->chunknum == CHUNKS_AUTO)
+			link->chunknum = hostprof_chunks(link,
+					link->metalink->size);
+		return (metalink_download(resultdir, link, NULL));
+	}
+
+	// small link is fetched by one request (larger one gets its size by
+	// it), linkh is asked only if it didn't come
+	linkh = NULL;
+	unpack = (link->unpack != UNPACK_OFF) &&
+			(unpack_format_of(link->rquri) != UNPACK_NONE);
+	if ((link->small > 0) && (!link->http2) && (!unpack) &&
+			(link->metalink == NULL) && (link->delta == NULL) &&
+			((ret = small_download(resultdir, link, &linkh)) != 1))
+		return (ret);
+
+	if ((linkh == NULL) && (thr_mgr_linkheader(link, &linkh) == -1))
+		return (-1);
+	// server of final location (after redirects) decides
+	if (link->chunknum == CHUNKS_AUTO)
+		link->chunknum = hostprof_chunks(link, linkh->clen);
+	if (unpack)
+		ret = unpack_download(resultdir, link, linkh);
+	else if (link->stream)
+		ret = thr_mgr_streamchunks(link, linkh);
+	else if (link->metalink != NULL)
+		ret = metalink_download(resultdir, link, linkh);
+	else if (link->delta != NULL)
+		ret = delta_download(resultdir, link, linkh);
+	else
+		ret = thr_mgr_downloadallchunks(resultdir, link, linkh);
+	link_header_free(linkh);
+	free(linkh);
+
+	return (ret);
+}
+
+/**
+ * \return monotonic time in seconds.
+ */
+static double
+now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/**
+ * Cancels running chunk attempt (its blocked read returns on shutdown).
+ * Has to be called with chunk->ctl->lock held.
+ */
+static void
+chunk_cancel(chunk_bounds *chunk)
+{
+	__atomic_store_n(&chunk->state, CH_CANCELLED, __ATOMIC_RELAXED);
+	if (chunk->sockfd != -1)
+		shutdown(chunk->sockfd, SHUT_RDWR);
+}
+
+/**
+ * Moves chunk range behind bytes already received by failed attempt, so that
+ * next attempt continues from the last received byte.
+ * Has to be called with chunk->ctl->lock held.
+ */
+static void
+chunk_resume(chunk_bounds *chunk, double now)
+{
+	long long int received = __atomic_load_n(&chunk->received,
+			__ATOMIC_RELAXED);
+
+	chunk->startpos += received;
+	chunk->memlen -= (size_t) received;
+	if (chunk->memory != NULL)
+		chunk->memory += received;
+	chunk->received = 0;
+	chunk->started = chunk->lastchange = now;
+	chunk->lastrecv = 0;
+}
+
+/**
+ * Downloads one chunk (function for one thread). Failed attempts are retried
+ * link->retries times from the last received byte after backoff.
+ * When the chunk succeeds, its hedged twin is cancelled.
+ * param data of type (chunk_bounds *).
+ */
 void *
 run_download_chunk(void *data)
 {
 	chunk_bounds *bound = (chunk_bounds *) data;
-//	char *memory;
-//	// int newfd = dup(bound->fd);
-//	if ((memory = mmap(0, bound->memlen, PROT_READ| PROT_WRITE, MAP_SHARED,
-//			bound->fd, bound->startpos)) == MAP_FAILED) {
-//		perror("mmap");
-//		return (void *) (0);
-//	}
-//	bound->memory = memory;
-
-	// TODO LAST complete http requests and results
-	if (http_link_write_chunk(bound) == -1)
-		return (void *) (-1);
-	//  http_chunk_res();
-
-//	TODO munmap let to file_fdtbl
-//	if (munmap(bound->memory, bound->memlen) == -1) {
-//		close(bound->fd);
-//		return (void *)(-1);
-//	}
-
-	//  close(bound->fd);
-	return (void *) (0);
+	chunk_ctl *ctl = bound->ctl;
+	lnk *link = bound->lnk;
+	struct timespec wakeup;
+	int attempt = 0;
+	int wait, ret;
+	double start;
+
+	for (;;) {
+		bound->status = 0;
+		bound->retryafter = -1;
+		// waiting for open breaker of host ends when chunk is cancelled
+		if ((link->retries > 0) && (breaker_acquire(link->hostname,
+				bound) == -1)) {
+			ret = -1;
+			pthread_mutex_lock(&ctl->lock);
+			break;
+		}
+		start = trace_begin();
+		ret = (link->http2) ? h2_link_write_chunk(bound) :
+				http_link_write_chunk(bound);
+		trace_end((ret == -1) ? "chunk_failed" : "chunk", start, link,
+				http_chunk_filepos(bound), http_chunk_filepos(bound) +
+				bound->memlen - 1);
+		// cancelled attempt (e.g. losing hedged twin) says nothing
+		if (link->retries > 0)
+			breaker_release(link->hostname, (ret != -1) ?
+					BREAKER_SUCCESS :
+					(__atomic_load_n(&bound->state,
+					__ATOMIC_RELAXED) == CH_CANCELLED) ?
+					BREAKER_NONE : BREAKER_FAIL);
+
+		pthread_mutex_lock(&ctl->lock);
+		if ((ret != -1) || (bound->state != CH_RUNNING) ||
+				(attempt == link->retries) ||
+				(!retry_status_retryable(bound->status)))
+			break;
+
+		chunk_resume(bound, now_sec());
+		wait = retry_backoff(attempt++, link->retrywait,
+				bound->retryafter);
+		log_range(LOG_INFO, link, bound->startpos, bound->endpos, 0,
+				"retrying chunk %lld-%lld of %s in %d ms "
+				"(retry %d of %d)", bound->startpos,
+				bound->endpos, link->filename, wait, attempt,
+				link->retries);
+
+		// sleep is interrupted if hedged twin finishes the chunk
+		clock_gettime(CLOCK_REALTIME, &wakeup);
+		wakeup.tv_sec += wait / 1000;
+		wakeup.tv_nsec += (wait % 1000) * 1000000L;
+		if (wakeup.tv_nsec >= 1000000000L) {
+			++wakeup.tv_sec;
+			wakeup.tv_nsec -= 1000000000L;
+		}
+		while ((bound->state == CH_RUNNING) &&
+				(pthread_cond_timedwait(&ctl->cond, &ctl->lock,
+				&wakeup) != ETIMEDOUT))
+			;
+		if (bound->state != CH_RUNNING)
+			break;
+		pthread_mutex_unlock(&ctl->lock);
+	}
+
+	if (bound->state == CH_RUNNING)
+		bound->state = (ret == -1) ? CH_FAILED : CH_DONE;
+	if ((bound->state == CH_DONE) && (bound->twin != NULL) &&
+			(bound->twin->state == CH_RUNNING))
+		chunk_cancel(bound->twin);
+	--ctl->running;
+	pthread_cond_broadcast(&ctl->cond);
+	pthread_mutex_unlock(&ctl->lock);
+
+	return ((ret == -1) ? (void *) (-1) : (void *) (0));
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+	return ((x > y) - (x < y));
 }
 
-// allocate file
-// resolve filename
-// map into memory (mmap)
-// create chunk threads, wait for every success, if unsuccessfull
-// -> delete file, report error
 /**
- * Function creates chunks due to link->chunknum parameter and creates one
- * thread for every chunk and downloads the whole file into resultdir.
+ * Starts hedged request for the rest of range of chunk (from byte received
+ * by chunk) on a new connection. Has to be called with ctl->lock held.
+ */
+static void
+chunk_hedge(chunk_bounds *chunk, long long int received, double now)
+{
+	chunk_bounds *hedge = malloc(sizeof (chunk_bounds));
+
+	*hedge = *chunk;
+	hedge->startpos += received;
+	hedge->memlen -= (size_t) received;
+	if (hedge->memory != NULL)
+		hedge->memory += received;
+	hedge->received = 0;
+	hedge->state = CH_RUNNING;
+	hedge->sockfd = -1;
+	hedge->twin = chunk;
+	hedge->started = hedge->lastchange = now;
+	hedge->lastrecv = 0;
+	hedge->wbdone = hedge->wbpos = http_chunk_filepos(hedge);
+	hedge->spawned = 0;
+
+	if (pthread_create(&hedge->thr, NULL, run_download_chunk,
+			hedge) != 0) {
+		free(hedge);
+		return;
+	}
+	hedge->spawned = 1;
+	chunk->twin = hedge;
+	++chunk->ctl->running;
+
+	log_range(LOG_INFO, chunk->lnk, hedge->startpos, hedge->endpos, 0,
+			"hedging stalled chunk %lld-%lld of %s",
+			hedge->startpos, hedge->endpos, chunk->lnk->filename);
+}
+
+/**
+ * Stall detector. Hedges every running chunk which received nothing for
+ * stall seconds or whose throughput fell under 1/HEDGE_SLOW_FACTOR of median
+ * throughput of all chunks of the file. Every chunk is hedged at most once.
+ * Has to be called with ctl->lock held.
+ */
+static void
+hedge_stalled_chunks(chunk_bounds *bounds, int chunknum, int stall)
+{
+	double now = now_sec();
+	double *rates = malloc(sizeof (double) * chunknum);
+	double median, elapsed;
+	long long int recv;
+	int chidx;
+
+	for (chidx = 0; chidx != chunknum; ++chidx) {
+		recv = __atomic_load_n(&bounds[chidx].received,
+				__ATOMIC_RELAXED);
+		if (recv != bounds[chidx].lastrecv) {
+			bounds[chidx].lastrecv = recv;
+			bounds[chidx].lastchange = now;
+		}
+		elapsed = ((bounds[chidx].state == CH_RUNNING) ? now :
+				bounds[chidx].lastchange) - bounds[chidx].started;
+		rates[chidx] = (elapsed > 0) ? recv / elapsed : 0;
+	}
+	qsort(rates, chunknum, sizeof (double), cmp_double);
+	median = rates[chunknum / 2];
+	free(rates);
+
+	for (chidx = 0; chidx != chunknum; ++chidx) {
+		chunk_bounds *chunk = &bounds[chidx];
+
+		if ((chunk->state != CH_RUNNING) || (chunk->twin != NULL) ||
+				(now - chunk->started < stall) ||
+				(chunk->memlen - chunk->lastrecv <
+				HEDGE_MIN_REMAIN))
+			continue;
+		if ((now - chunk->lastchange >= stall) ||
+				(chunk->lastrecv / (now - chunk->started) <
+				median / HEDGE_SLOW_FACTOR))
+			chunk_hedge(chunk, chunk->lastrecv, now);
+	}
+}
+
+/**
+ * Cancels all running attempts of chunks (and their hedges).
+ * Has to be called with ctl->lock held.
+ */
+static void
+cancel_chunks(chunk_bounds *bounds, int chunknum)
+{
+	int chidx;
+
+	for (chidx = 0; chidx != chunknum; ++chidx) {
+		if (bounds[chidx].state == CH_RUNNING)
+			chunk_cancel(&bounds[chidx]);
+		if ((bounds[chidx].twin != NULL) &&
+				(bounds[chidx].twin->state == CH_RUNNING))
+			chunk_cancel(bounds[chidx].twin);
+	}
+}
+
+/**
+ * Sums bytes of file received by chunks (a hedged range counts by the copy
+ * which is further). Has to be called with ctl->lock held.
+ * \return received bytes of file of total size clen.
+ */
+static long long int
+chunks_received(chunk_bounds *bounds, int chunknum, long long int clen)
+{
+	long long int remain, tremain;
+	chunk_bounds *chunk, *twin;
+	int chidx;
+
+	for (chidx = 0; chidx != chunknum; ++chidx) {
+		chunk = &bounds[chidx];
+		twin = chunk->twin;
+		if ((chunk->state == CH_DONE) ||
+				((twin != NULL) && (twin->state == CH_DONE)))
+			continue;
+		remain = chunk->endpos + 1 - chunk->startpos -
+				__atomic_load_n(&chunk->received,
+				__ATOMIC_RELAXED);
+		if (twin != NULL) {
+			tremain = twin->endpos + 1 - twin->startpos -
+					__atomic_load_n(&twin->received,
+					__ATOMIC_RELAXED);
+			if (tremain < remain)
+				remain = tremain;
+		}
+		clen -= remain;
+	}
+
+	return (clen);
+}
+
+/**
+ * \return character of chunk in status map of chunks (CHUNKMAP_*).
+ * Has to be called with ctl->lock held.
+ */
+static char
+chunk_mapchar(chunk_bounds *chunk, double now)
+{
+	chunk_bounds *twin = chunk->twin;
+	long long int recv = __atomic_load_n(&chunk->received,
+			__ATOMIC_RELAXED);
+
+	if (recv != chunk->lastrecv) {
+		chunk->lastrecv = recv;
+		chunk->lastchange = now;
+	}
+
+	if ((chunk->state == CH_DONE) || ((twin != NULL) &&
+			(twin->state == CH_DONE)))
+		return (CHUNKMAP_DONE);
+	if ((chunk->state != CH_RUNNING) && ((twin == NULL) ||
+			(twin->state != CH_RUNNING)))
+		return (CHUNKMAP_FAILED);
+	if (twin != NULL)
+		return (CHUNKMAP_HEDGED);
+	if (now - chunk->lastchange >= PROGRESS_STALL_SEC)
+		return (CHUNKMAP_STALLED);
+	if ((recv == 0) || (chunk->memlen == 0))
+		return (CHUNKMAP_IDLE);
+	return ('0' + (char) (recv * 10 / (long long int) chunk->memlen));
+}
+
+/**
+ * Fills status map of chunks (one character per chunk) for progress.
+ * Has to be called with ctl->lock held.
+ */
+static void
+chunks_map(chunk_bounds *bounds, int chunknum, char *map)
+{
+	double now = now_sec();
+	int chidx;
+
+	for (chidx = 0; chidx != chunknum; ++chidx)
+		map[chidx] = chunk_mapchar(&bounds[chidx], now);
+	map[chunknum] = '\0';
+}
+
+/**
+ * Reports ranges of plan whose chunk (or its hedge) finished since the last
+ * call to link->verify, checked marks ranges reported already. Has to be
+ * called with ctl->lock held, it is released while callback runs.
+ */
+static void
+chunks_verify(chunk_bounds *bounds, int chunknum, const chunk_plan *plan,
+		file_fd fd, char *checked)
+{
+	chunk_bounds *chunk;
+	lnk *link;
+	int chidx;
+
+	for (chidx = 0; chidx != chunknum; ++chidx) {
+		chunk = &bounds[chidx];
+		link = chunk->lnk;
+		if ((checked[chidx]) || ((chunk->state != CH_DONE) &&
+				((chunk->twin == NULL) ||
+				(chunk->twin->state != CH_DONE))))
+			continue;
+		checked[chidx] = 1;
+		pthread_mutex_unlock(&chunk->ctl->lock);
+		link->verify(link->verifydata, fd, plan->ranges[chidx].start,
+				plan->ranges[chidx].end);
+		pthread_mutex_lock(&chunk->ctl->lock);
+	}
+}
+
+/**
+ * Collects ranges written by chunks (and hedges) since the last writeback
+ * when they reach window bytes. Has to be called with ctl->lock held.
+ * \return number of ranges.
+ */
+static int
+writeback_ranges(chunk_bounds *bounds, int chunknum, long long int window,
+		wbrange *ranges)
+{
+	chunk_bounds *chunk;
+	long long int pos;
+	int chidx, num = 0;
+
+	for (chidx = 0; chidx != 2 * chunknum; ++chidx) {
+		chunk = (chidx < chunknum) ? &bounds[chidx] :
+				bounds[chidx - chunknum].twin;
+		if (chunk == NULL)
+			continue;
+		pos = http_chunk_filepos(chunk) +
+				__atomic_load_n(&chunk->received,
+				__ATOMIC_RELAXED);
+		if (pos - chunk->wbpos < window)
+			continue;
+		ranges[num].done = chunk->wbdone;
+		ranges[num].start = chunk->wbpos;
+		ranges[num++].pos = pos;
+		chunk->wbdone = chunk->wbpos;
+		chunk->wbpos = pos;
+	}
+
+	return (num);
+}
+
+/**
+ * Starts writeback of freshly written range and drops range written before
+ * (from mapping of file and from page cache) after its writeback finished,
+ * so that dirty and cached pages of download stay bounded.
+ */
+static void
+writeback_range(file_fd fd, const maptbl *maptable, long long int clen,
+		const wbrange *range)
+{
+	long long int page = sysconf(_SC_PAGESIZE);
+	long long int mapstart = clen - maptable->memlen;
+	long long int start, end;
+	double tstart = trace_begin();
+
+	if (sync_file_range(fd, range->start, range->pos - range->start,
+			SYNC_FILE_RANGE_WRITE) == -1)
+		return;
+	trace_end("writeback_start", tstart, NULL, range->start,
+			range->pos - 1);
+	if (range->start == range->done)
+		return;
+	tstart = trace_begin();
+	sync_file_range(fd, range->done, range->start - range->done,
+			SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+			SYNC_FILE_RANGE_WAIT_AFTER);
+
+	// mapped pages have to be unmapped to leave page cache
+	start = (range->done > mapstart) ? range->done : mapstart;
+	start = (start - mapstart + page - 1) / page * page;
+	end = (range->start - mapstart) / page * page;
+	if ((maptable->memlen > 0) && (maptable->memory != NULL) &&
+			(end > start))
+		madvise(maptable->memory + start, end - start, MADV_DONTNEED);
+
+	posix_fadvise(fd, range->done, range->start - range->done,
+			POSIX_FADV_DONTNEED);
+	trace_end("writeback_drop", tstart, NULL, range->done,
+			range->start - 1);
+}
+
+/**
+ * \return alignment of chunk ranges of file: its filesystem block if it is
+ * a multiple of page, page otherwise.
+ */
+long long int
+chunk_align(file_fd fd)
+{
+	long long int page = sysconf(_SC_PAGESIZE);
+	struct stat st;
+
+	if ((fstat(fd, &st) == 0) && (st.st_blksize > page) &&
+			(st.st_blksize % page == 0))
+		return (st.st_blksize);
+	return (page);
+}
+
+/**
+ * Allocates len bytes of file at once, so that missing space fails download
+ * at start and extents of file are contiguous. File of filesystem without
+ * fallocate is only extended.
  * \return 0 on success, -1 on fail.
  */
-int
-thr_mgr_downloadallchunks(const char *resultdir, lnk *link,
-		lnk_http_header *linkh)
+static int
+file_allocate(file_fd fd, long long int len)
+{
+	struct stat st;
+
+	if ((len == 0) || (fallocate(fd, 0, 0, (off_t) len) == 0))
+		return (0);
+	if ((errno != EOPNOTSUPP) && (errno != ENOSYS))
+		return (-1);
+	if ((fstat(fd, &st) == 0) && (st.st_size >= len))
+		return (0);
+	return (ftruncate(fd, (off_t) len));
+}
+
+/**
+ * Opens destination of link (link->destfd, link->path or file in resultdir)
+ * and allocates size bytes of it.
+ * \return file descriptor, -1 on fail.
+ */
+file_fd
+thr_mgr_createfile(const char *resultdir, lnk *link, long long int size)
 {
 	file_fd fd;
-	char buf = '\0';
-//	int idx = 0;
+	double start;
+
+	if (link->destfd != -1) {
+		fd = link->destfd;
+	} else {
+		if (link->path != NULL) {
+			free(link->filename);
+			link->filename = strdup(link->path);
+		} else {
+			mk_filename(resultdir, link);
+		}
+
+		if ((fd = open(link->filename, O_CREAT| O_EXCL | O_RDWR,
+				S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) == -1) {
+			log_error(link, errno, "Couldn't create file %s",
+					link->filename);
+			return (-1);
+		}
+	}
+
+	// set filesize
+	start = trace_begin();
+	if (file_allocate(fd, size) == -1) {
+		log_error(link, errno, "Couldn't allocate %lld bytes of "
+				"file %s", size, link->filename);
+		if (link->destfd == -1) {
+			close(fd);
+			unlink(link->filename);
+		}
+		return (-1);
+	}
+	trace_end("fallocate", start, link, 0, size - 1);
+
+	return (fd);
+}
+
+/**
+ * Downloads ranges of plan into file fd (of size plan->size), at most
+ * link->chunknum chunk threads run at once (plan may have more ranges).
+ * Ranges out of plan are left as they are.
+ * \return 0 on success, -1 on fail.
+ */
+int
+thr_mgr_downloadplan(lnk *link, lnk_http_header *linkh, file_fd fd,
+		const chunk_plan *plan)
+{
 	int chidx = 0;
-	int *retval;
+	int chunknum = plan->num;
+	int started = 0;
 	int mgrretval;
 	chunk_bounds *bounds;
 	maptbl *maptable;
-	pthread_t *chunkthrs;
-
-	mk_filename(resultdir, link);
+	chunk_ctl ctl;
+	struct timespec wakeup;
+	double now;
+	long long int received, pending = 0;
+	wbrange *ranges;
+	int rangenum, rngidx, throttled = 0;
+	double start, began = now_sec();
+	long long int total;
+	char *map, *checked;
 
-	if ((fd = open(link->filename, O_CREAT| O_EXCL | O_RDWR, S_IRUSR
-			| S_IWUSR | S_IRGRP | S_IROTH)) == -1) {
-		fprintf(stdlog, log_ERROR
-				"Couldn't create file %s ", link->filename);
-		perror("open");
+	if (create_chunk_bounds(&bounds, plan, link, linkh, fd,
+			&maptable) == -1)
 		return (-1);
+	ranges = malloc(sizeof (wbrange) * 2 * (chunknum + 1));
+	map = malloc(chunknum + 1);
+	checked = calloc(chunknum + 1, 1);
+	for (chidx = 0; chidx != chunknum; ++chidx)
+		pending += bounds[chidx].memlen;
+	total = pending;
+
+	pthread_mutex_init(&ctl.lock, NULL);
+	pthread_cond_init(&ctl.cond, NULL);
+	ctl.running = 0;
+
+	// start chunks while threads are free, check stalled chunks, write
+	// back received data and report progress every HEDGE_CHECK_SEC
+	pthread_mutex_lock(&ctl.lock);
+	while ((ctl.running > 0) || ((started != chunknum) &&
+			(!__atomic_load_n(&link->cancel, __ATOMIC_RELAXED)))) {
+		now = now_sec();
+		for (; (started != chunknum) && (ctl.running < link->chunknum) &&
+				(!__atomic_load_n(&link->cancel,
+				__ATOMIC_RELAXED)); ++started) {
+			chidx = started;
+			pending -= bounds[chidx].memlen;
+			bounds[chidx].received = 0;
+			bounds[chidx].state = CH_RUNNING;
+			bounds[chidx].sockfd = -1;
+			bounds[chidx].ctl = &ctl;
+			bounds[chidx].twin = NULL;
+			bounds[chidx].started = bounds[chidx].lastchange = now;
+			bounds[chidx].lastrecv = 0;
+			bounds[chidx].wbdone = bounds[chidx].wbpos =
+					http_chunk_filepos(&bounds[chidx]);
+			bounds[chidx].spawned = 0;
+			if (pthread_create(&bounds[chidx].thr, NULL,
+					run_download_chunk,
+					&bounds[chidx]) != 0) {
+				log_range(LOG_ERROR, link,
+						bounds[chidx].startpos,
+						bounds[chidx].endpos, 0,
+						"thread for chunk %d of "
+						"%s couldn't be created",
+						chidx, link->filename);
+				bounds[chidx].state = CH_CANCELLED;
+				continue;
+			}
+			bounds[chidx].spawned = 1;
+			++ctl.running;
+		}
+		if (ctl.running == 0)
+			break;
+
+		clock_gettime(CLOCK_REALTIME, &wakeup);
+		wakeup.tv_sec += HEDGE_CHECK_SEC;
+		pthread_cond_timedwait(&ctl.cond, &ctl.lock, &wakeup);
+		if (__atomic_load_n(&link->cancel, __ATOMIC_RELAXED)) {
+			cancel_chunks(bounds, started);
+			continue;
+		}
+		if (link->verify != NULL)
+			chunks_verify(bounds, started, plan, fd, checked);
+		if (link->hedge > 0)
+			hedge_stalled_chunks(bounds, started, link->hedge);
+		if (link->progress != NULL) {
+			received = chunks_received(bounds, started,
+					plan->size) - pending;
+			chunks_map(bounds, started, map);
+			memset(map + started, CHUNKMAP_IDLE,
+					chunknum - started);
+			map[chunknum] = '\0';
+			pthread_mutex_unlock(&ctl.lock);
+			link->progress(link->progressdata, received,
+					plan->size, map);
+			pthread_mutex_lock(&ctl.lock);
+		}
+		if ((link->writeback > 0) && ((rangenum = writeback_ranges(
+				bounds, started, link->writeback,
+				ranges)) > 0)) {
+			pthread_mutex_unlock(&ctl.lock);
+			for (rngidx = 0; rngidx != rangenum; ++rngidx)
+				writeback_range(fd, maptable, plan->size,
+						&ranges[rngidx]);
+			pthread_mutex_lock(&ctl.lock);
+		}
 	}
+	// chunks finished with the last ones
+	if ((link->verify != NULL) &&
+			(!__atomic_load_n(&link->cancel, __ATOMIC_RELAXED)))
+		chunks_verify(bounds, started, plan, fd, checked);
+	pthread_mutex_unlock(&ctl.lock);
+	free(ranges);
+	free(checked);
 
-//	if (ftruncate(fd, linkh->clen) != 0)
-//	{
-//		fprintf(stdlog, log_ERROR
-//				"file couldn't be truncated"
-//				" to specified size\n");
-//	}
+	mgrretval = (started == chunknum) ? 0 : -1;
+	for (chidx = 0; chidx != started; ++chidx) {
+		chunk_bounds *hedge = bounds[chidx].twin;
 
-	// set filesize
-	lseek(fd, linkh->clen - 1, SEEK_SET);
-	write(fd, &buf, 1);
+		if (bounds[chidx].spawned)
+			pthread_join(bounds[chidx].thr, NULL);
+		if (hedge != NULL)
+			pthread_join(hedge->thr, NULL);
+		if ((bounds[chidx].state != CH_DONE) &&
+				((hedge == NULL) || (hedge->state != CH_DONE)))
+			mgrretval = -1;
+		throttled |= (bounds[chidx].status ==
+				HTTP_STATUSCODE_TOO_MANY) ||
+				(bounds[chidx].status ==
+				HTTP_STATUSCODE_UNAVAILABLE);
+		free(hedge);
+	}
+	free(bounds);
 
-	create_chunk_bounds(&bounds, link, linkh, fd, &maptable);
-	//  create_chunk_bounds(&bounds, link, linkh, fd);
-	chunkthrs = malloc(sizeof (pthread_t) * link->chunknum);
+	// connections of one http/2 session aren't counted
+	if ((!link->http2) && ((mgrretval == 0) || (throttled)))
+		hostprof_sample(link, (link->chunknum < chunknum) ?
+				link->chunknum : chunknum, total,
+				now_sec() - began, throttled);
 
+	pthread_cond_destroy(&ctl.cond);
+	pthread_mutex_destroy(&ctl.lock);
 
-	for (chidx = 0; chidx != link->chunknum; ++chidx) {
-		pthread_create(&chunkthrs[chidx], NULL,
-				run_download_chunk, &bounds[chidx]);
+	start = trace_begin();
+	if (maptable->memory != NULL) {
+		if (munmap(maptable->memory, maptable->memlen) == -1)
+			log_error(link, errno, "munmap");
+		membudget_release(maptable->memlen);
 	}
+	trace_end("munmap", start, link, -1, 0);
 
-	mgrretval = 0;
-	for (chidx = 0; chidx != link->chunknum; ++chidx) {
-		pthread_join(chunkthrs[chidx], (void **) &retval);
-		if (retval != 0) {
-			mgrretval = (int)retval;
-		}
+	free(maptable);
+
+	if ((mgrretval == 0) && (link->progress != NULL)) {
+		memset(map, CHUNKMAP_DONE, chunknum);
+		link->progress(link->progressdata, plan->size, plan->size,
+				map);
 	}
+	free(map);
+
+	return (mgrretval);
+}
 
-	free(chunkthrs);
+/**
+ * Syncs downloaded file fd of link (due to link->durability) and closes it
+ * (unless it is file of caller). File is removed if download failed
+ * (mgrretval is -1).
+ * \return mgrretval, -1 if file couldn't be synced or closed.
+ */
+int
+thr_mgr_closefile(lnk *link, file_fd fd, int mgrretval)
+{
+	double start;
 
-	if (maptable->memlen != -1) {
-		if (munmap(maptable->memory, maptable->memlen) == -1) {
-			perror("munmap");
+	start = trace_begin();
+	if (mgrretval == 0) {
+		if ((link->durability == DUR_END) && (fdatasync(fd) == -1)) {
+			log_error(link, errno, "%s couldn't be synced",
+					link->filename);
+			mgrretval = -1;
+		} else if (link->durability == DUR_BATCH) {
+			// batch sync finds file written already
+			sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
 		}
+		if (link->writeback > 0)
+			posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
 	}
+	trace_end("sync", start, link, -1, 0);
 
-	free(maptable);
+	// file of caller stays open
+	if (link->destfd != -1)
+		return (mgrretval);
 
 //	fprintf(stdlog, "created:%s\n", link->filename);
+	start = trace_begin();
 	if (close(fd) == -1) {
-		fprintf(stdlog, log_ERROR "File descriptor for filename %s "
-				"couldn't be closed.\n", link->filename);
-		return (-1);
+		log_error(link, errno, "File descriptor for filename %s "
+				"couldn't be closed", link->filename);
+		mgrretval = -1;
 	}
+	trace_end("close", start, link, -1, 0);
+
+	// don't leave incomplete file behind
+	if ((mgrretval == -1) && (unlink(link->filename) == -1))
+		log_error(link, errno, "unlink %s", link->filename);
 
 	return (mgrretval);
 }
 
+// allocate file
+// resolve filename
+// plan chunk ranges and map file into memory (mmap)
+// create chunk threads, wait for every success, if unsuccessfull
+// -> delete file, report error
 /**
- * Creates chunk bounds and maps file into memory or assignes '\\0' to memory.
- * Creates chunk bounds due to link, linkh parameters, maps file into memory
- * and creates maptable containing list of mapping memory witch its sizes to
- * enable use munmap after chunks will be downloaded.
- * Mapping into memory is processed for last chunks (which have ranges at the
- * end modulo MAX_MAP_SIZE). The first chunks will be assigned '\\0' into
- * chunk memory.
+ * Function plans chunks of file due to link->chunknum parameter (aligned
+ * ranges between CHUNKPLAN_MIN_SIZE and CHUNKPLAN_MAX_SIZE), creates one
+ * thread for every chunk and downloads the whole file into resultdir.
  * \return 0 on success, -1 on fail.
  */
 int
-create_chunk_bounds(chunk_bounds **bounds, lnk *link, lnk_http_header *lnkh,
-		file_fd fd, maptbl **maptable)
+thr_mgr_downloadallchunks(const char *resultdir, lnk *link,
+		lnk_http_header *linkh)
 {
-	int map_times = (int) (lnkh->clen / MAX_MAP_SIZE);
-	// modulo size of file moduling MAX_MAP_SIZE
-	int map_mod = (int) (lnkh->clen % MAX_MAP_SIZE);
+	file_fd fd;
+	chunk_plan *plan;
+	int mgrretval;
 
-	int mpidx, chidx, challidx; // , idx;
-	// piece = size of one piece
-	// size = number of items in one mapping memory or res.chunk memory
-	long long int actualpos, filepos;
-	long long int chunkpiece = lnkh->clen
-			/ ((long long int) link->chunknum);
+	if ((fd = thr_mgr_createfile(resultdir, link, linkh->clen)) == -1)
+		return (-1);
 
-	int chunkmp_size = MAX_MAP_SIZE / chunkpiece;
-	long long int chunkmp_piece = MAX_MAP_SIZE
-			/ (long long int) chunkmp_size;
+	plan = chunkplan_new(linkh->clen, link->chunknum, chunk_align(fd),
+			CHUNKPLAN_MIN_SIZE, CHUNKPLAN_MAX_SIZE);
+	if (plan->num != link->chunknum)
+		log_info(link, "%s is downloaded by %d chunks instead of %d "
+				"(chunk size limits)", link->filename,
+				plan->num, link->chunknum);
+	mgrretval = thr_mgr_downloadplan(link, linkh, fd, plan);
+	chunkplan_free(plan);
 
-	int chunk_res_size;
-	long long int chunk_res_piece;
-	char *memory;
+	return (thr_mgr_closefile(link, fd, mgrretval));
+}
 
-	*maptable = malloc(sizeof (maptbl));
-	(*maptable)->memlen = 0;
-	if (map_mod)
-		++((*maptable)->memlen);
-//	(*maptable)->items = malloc(sizeof (mapitem) * (*maptable)->size);
-
-	if (link->chunknum < map_times + (*maptable)->memlen) {
-		fprintf(
-		stdlog, log_ERROR "Number of chunks too small for downloading"
-			" a big file from link %s, setting chunk num to"
-			" %lli\n", link->rquri,
-			map_times + (*maptable)->memlen);
-		link->chunknum = (int)(map_times + (*maptable)->memlen);
-	}
+/**
+ * Writes whole buffer into (non-blocking or interrupted) output.
+ * \return 0 on success, -1 on fail.
+ */
+int
+stream_write(int fd, const char *buf, size_t len)
+{
+	struct pollfd pfd = { fd, POLLOUT, 0 };
+	ssize_t written;
 
-	*bounds = malloc(sizeof (chunk_bounds) * link->chunknum);
-
-	challidx = 0;
-	filepos = 0;
-	mpidx = 0;
-
-	// chunks which are to mmap MAX_MAP_SIZE replace with NULL memory
-	for (; mpidx < map_times; ++mpidx) {
-	// allocaate memory and assign it chunks
-	// which are smaller than max map size
-
-//		if ((memory = mmap(0, (size_t)MAX_MAP_SIZE, PROT_READ |
-//				PROT_WRITE, MAP_SHARED, fd,
-//				(off_t) filepos)) == MAP_FAILED) {
-//			perror("mmap");
-//			memory = '\0';
-// //			return (-1);
-//		}
-//		memory = '\0';
-
-//		(*maptable)->items[mpidx].memlen = MAX_MAP_SIZE;
-//		(*maptable)->items[mpidx].memory = memory;
-
-		actualpos = 0;
-		for (chidx = 0; chidx < chunkmp_size - 1; ++chidx) {
-		// for (chidx = 0; chidx < link->chunknum -1; ++chidx)
-			(*bounds)[challidx].memory = NULL;
-			(*bounds)[challidx].startpos = actualpos;
-			actualpos += chunkmp_piece;
-			(*bounds)[challidx].endpos = actualpos -1;
-			(*bounds)[challidx].memlen = (size_t) (actualpos -
-					(*bounds)[challidx].startpos);
-			(*bounds)[challidx].lnk = link;
-			(*bounds)[challidx].lnk_header = lnkh;
-			(*bounds)[challidx].fd = fd;
-			(*bounds)[challidx].mpidx = mpidx;
-
-			++challidx;
+	while (len > 0) {
+		if ((written = write(fd, buf, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if ((errno == EAGAIN) && (poll(&pfd, 1, -1) != -1))
+				continue;
+			log_error(NULL, errno, "write");
+			return (-1);
 		}
+		buf += written;
+		len -= written;
+	}
+
+	return (0);
+}
+
+/**
+ * Downloads link in pieces and writes it into link->destfd strictly in
+ * order (pipe, socket or terminal). At most link->chunknum threads fetch
+ * pieces, the lowest missing piece first and at most STREAM_WINDOW pieces
+ * per thread ahead of output, so reorder buffer stays bounded. Data of
+ * piece at output are written as they arrive.
+ * \return 0 on success, -1 on fail.
+ */
+int
+thr_mgr_streamchunks(lnk *link, lnk_http_header *linkh)
+{
+	long long int piece = linkh->clen / link->chunknum;
+	long long int pieces, next = 0, cursor = 0, written = 0, avail;
+	long long int limit = membudget_limit();
+	int slotnum = link->chunknum * STREAM_WINDOW;
+	int slotidx, ret = 0;
+	chunk_bounds *slots, *chunk;
+	char **bufs;
+	chunk_ctl ctl;
+	struct timespec wakeup;
+	double lastprogress = now_sec(), start;
+	char *map;
+
+	if (piece > STREAM_PIECE)
+		piece = STREAM_PIECE;
+	if ((limit > 0) && (piece > limit))
+		piece = limit;
+	if (piece < 1)
+		piece = 1;
+	pieces = (linkh->clen + piece - 1) / piece;
+	if (slotnum > pieces)
+		slotnum = (int) pieces;
 
-		(*bounds)[challidx].memory = NULL;
-		(*bounds)[challidx].startpos = actualpos;
-		(*bounds)[challidx].endpos = MAX_MAP_SIZE - 1;
-		(*bounds)[challidx].memlen = (size_t) MAX_MAP_SIZE - actualpos;
-		(*bounds)[challidx].lnk = link;
-		(*bounds)[challidx].lnk_header = lnkh;
-		(*bounds)[challidx].fd = fd;
-		(*bounds)[challidx].mpidx = mpidx;
-		++challidx;
-
-		filepos += MAX_MAP_SIZE;
+	// reorder buffer has to fit into memory budget
+	if ((limit > 0) && (slotnum * piece > limit))
+		slotnum = (int) (limit / piece);
+	if (membudget_try(slotnum * piece) == -1) {
+		log_info(link, "%s waits for %lld bytes of memory budget",
+				link->rquri, slotnum * piece);
+		if (membudget_reserve(slotnum * piece, &link->cancel) == -1)
+			return (-1);
 	}
 
-	chunk_res_size = link->chunknum - challidx;
-	if (map_mod) { // if modulo of page mapping is greater than 0
-		if (map_mod / chunk_res_size == 0) {
-			fprintf(stdlog, log_ERROR
-					"number of chunks of link %s will be "
-					"diminished (-%d chunks) (large file "
-					"doesn't fit memory map size)",
-					link->rquri, map_times);
-			link->chunknum = link->chunknum - map_times;
-			chunk_res_size = link->chunknum - challidx;
+	slots = calloc(slotnum, sizeof (chunk_bounds));
+	bufs = malloc(sizeof (char *) * slotnum);
+	for (slotidx = 0; slotidx != slotnum; ++slotidx)
+		bufs[slotidx] = malloc(piece);
+	map = malloc(slotnum + 1);
+
+	pthread_mutex_init(&ctl.lock, NULL);
+	pthread_cond_init(&ctl.cond, NULL);
+	ctl.running = 0;
+
+	pthread_mutex_lock(&ctl.lock);
+	while (cursor < pieces) {
+		if (__atomic_load_n(&link->cancel, __ATOMIC_RELAXED)) {
+			ret = -1;
+			break;
 		}
 
-		if ((memory = mmap(0, (size_t)(lnkh->clen - filepos),
-				PROT_READ | PROT_WRITE, MAP_SHARED, fd,
-				(off_t) filepos)) == MAP_FAILED) {
-			perror("mmap");
-			memory = '\0';
-//			return (-1);
+		// pieces nearest to output are started first
+		while ((ctl.running < link->chunknum) && (next < pieces) &&
+				(next < cursor + slotnum)) {
+			chunk = &slots[next % slotnum];
+			memset(chunk, 0, sizeof (chunk_bounds));
+			chunk->startpos = next * piece;
+			chunk->endpos = ((next + 1 < pieces) ? chunk->startpos +
+					piece : linkh->clen) - 1;
+			chunk->memlen = (size_t) (chunk->endpos + 1 -
+					chunk->startpos);
+			chunk->memory = bufs[next % slotnum];
+			chunk->lnk = link;
+			chunk->lnk_header = linkh;
+			chunk->fd = -1;
+			chunk->state = CH_RUNNING;
+			chunk->sockfd = -1;
+			chunk->ctl = &ctl;
+			chunk->started = chunk->lastchange = now_sec();
+			if (pthread_create(&chunk->thr, NULL,
+					run_download_chunk, chunk) != 0) {
+				log_error(link, 0, "thread for piece "
+						"%lld of %s couldn't be "
+						"created", next, link->rquri);
+				break;
+			}
+			chunk->spawned = 1;
+			++ctl.running;
+			++next;
+		}
+		if (next == cursor) {
+			ret = -1;
+			break;
+		}
+
+		// written part of piece at output (retry moves its start)
+		chunk = &slots[cursor % slotnum];
+		avail = chunk->startpos - cursor * piece +
+				__atomic_load_n(&chunk->received,
+				__ATOMIC_ACQUIRE);
+		if (avail > written) {
+			pthread_mutex_unlock(&ctl.lock);
+			start = trace_begin();
+			ret = stream_write(link->destfd, bufs[cursor % slotnum] +
+					written, (size_t) (avail - written));
+			trace_end("stream_write", start, link, cursor * piece +
+					written, cursor * piece + avail - 1);
+			pthread_mutex_lock(&ctl.lock);
+			if (ret == -1)
+				break;
+			written = avail;
+			continue;
+		}
+		if (chunk->state == CH_DONE) {
+			pthread_join(chunk->thr, NULL);
+			++cursor;
+			written = 0;
+			continue;
+		}
+		if (chunk->state != CH_RUNNING) {
+			ret = -1;
+			break;
 		}
 
-		(*maptable)->memlen =
-			(size_t)(lnkh->clen - filepos);
-		(*maptable)->memory = memory;
-
-		assert(map_mod / chunk_res_size > 0);
-
-		chunk_res_piece = map_mod / chunk_res_size;
-
-		actualpos = 0;
-		for (chidx = 0; chidx < chunk_res_size - 1; ++chidx) {
-		// for (chidx = 0; chidx < link->chunknum -1; ++chidx)
-			(*bounds)[challidx].memory = (memory == NULL) ? memory :
-					memory + actualpos;
-			(*bounds)[challidx].startpos = actualpos;
-			actualpos += chunk_res_piece;
-			(*bounds)[challidx].endpos = actualpos -1;
-			(*bounds)[challidx].memlen = (size_t) (actualpos -
-					(*bounds)[challidx].startpos);
-			(*bounds)[challidx].lnk = link;
-			(*bounds)[challidx].lnk_header = lnkh;
-			(*bounds)[challidx].fd = fd;
-			(*bounds)[challidx].mpidx = mpidx;
-			++challidx;
+		if ((link->progress != NULL) &&
+				(now_sec() - lastprogress >= HEDGE_CHECK_SEC)) {
+			// map shows pieces from output on
+			lastprogress = now_sec();
+			for (slotidx = 0; cursor + slotidx < next; ++slotidx)
+				map[slotidx] = chunk_mapchar(&slots[(cursor +
+						slotidx) % slotnum],
+						lastprogress);
+			map[slotidx] = '\0';
+			pthread_mutex_unlock(&ctl.lock);
+			link->progress(link->progressdata, cursor * piece +
+					written, linkh->clen, map);
+			pthread_mutex_lock(&ctl.lock);
 		}
+		clock_gettime(CLOCK_REALTIME, &wakeup);
+		wakeup.tv_nsec += STREAM_POLL_MS * 1000000L;
+		if (wakeup.tv_nsec >= 1000000000L) {
+			++wakeup.tv_sec;
+			wakeup.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&ctl.cond, &ctl.lock, &wakeup);
+	}
 
-		(*bounds)[challidx].memory = (memory == NULL) ? memory :
-				memory + actualpos;
-		(*bounds)[challidx].startpos = actualpos;
-		(*bounds)[challidx].endpos = map_mod - 1;
-		(*bounds)[challidx].memlen = (size_t) map_mod - actualpos;
-		(*bounds)[challidx].lnk = link;
-		(*bounds)[challidx].lnk_header = lnkh;
-		(*bounds)[challidx].fd = fd;
-		(*bounds)[challidx].mpidx = mpidx;
-		++challidx;
+	// pieces ahead of output are aborted after failure
+	for (slotidx = 0; cursor + slotidx < next; ++slotidx) {
+		chunk = &slots[(cursor + slotidx) % slotnum];
+		if (chunk->state == CH_RUNNING)
+			chunk_cancel(chunk);
 	}
+	while (ctl.running > 0)
+		pthread_cond_wait(&ctl.cond, &ctl.lock);
+	pthread_mutex_unlock(&ctl.lock);
+	for (; cursor < next; ++cursor)
+		pthread_join(slots[cursor % slotnum].thr, NULL);
 
-	assert(challidx == link->chunknum);
+	for (slotidx = 0; slotidx != slotnum; ++slotidx)
+		free(bufs[slotidx]);
+	free(bufs);
+	free(slots);
+	membudget_release(slotnum * piece);
+	pthread_cond_destroy(&ctl.cond);
+	pthread_mutex_destroy(&ctl.lock);
+
+	if ((ret == 0) && (link->progress != NULL))
+		link->progress(link->progressdata, linkh->clen, linkh->clen,
+				"");
+	free(map);
+
+	return (ret);
+}
+
+/**
+ * Creates chunk bounds of ranges of plan and maps file into memory. File
+ * whose mapping doesn't fit into memory budget (or address space) isn't
+ * mapped, its chunks write received data into file instead. maptable keeps
+ * the mapping to enable munmap after chunks are downloaded.
+ * \return 0 on success, -1 on fail.
+ */
+int
+create_chunk_bounds(chunk_bounds **bounds, const chunk_plan *plan,
+		lnk *link, lnk_http_header *lnkh, file_fd fd, maptbl **maptable)
+{
+	char *memory = NULL;
+	int chidx;
+
+	if ((*bounds = calloc(plan->num + 1, sizeof (chunk_bounds))) == NULL)
+		return (-1);
+	*maptable = malloc(sizeof (maptbl));
+
+	// mapping which doesn't fit into memory budget is replaced by writing
+	// into file
+	if ((plan->size == 0) ||
+			((long long int) (size_t) plan->size != plan->size)) {
+		memory = NULL;
+	} else if (membudget_try(plan->size) == -1) {
+		log_info(link, "mapping of %s (%lld bytes) exceeds memory "
+				"budget, writing into file", link->rquri,
+				plan->size);
+	} else if ((memory = mmap(0, (size_t) plan->size, PROT_READ |
+			PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		log_error(link, errno, "mmap");
+		membudget_release(plan->size);
+		memory = NULL;
+	}
+	(*maptable)->memory = memory;
+	(*maptable)->memlen = (memory == NULL) ? 0 : plan->size;
+
+	for (chidx = 0; chidx != plan->num; ++chidx) {
+		(*bounds)[chidx].startpos = plan->ranges[chidx].start;
+		(*bounds)[chidx].endpos = plan->ranges[chidx].end;
+		(*bounds)[chidx].memlen = (size_t) (plan->ranges[chidx].end -
+				plan->ranges[chidx].start + 1);
+		(*bounds)[chidx].memory = (memory == NULL) ? NULL :
+				memory + plan->ranges[chidx].start;
+		(*bounds)[chidx].lnk = link;
+		(*bounds)[chidx].lnk_header = lnkh;
+		(*bounds)[chidx].fd = fd;
+	}
 
 	return (0);
 }
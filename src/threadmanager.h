@@ -2,13 +2,23 @@
 #define	THREADMANAGER_H
 
 #include "defaults.h"
+#include "chunkplan.h"
 
-void thr_mgr_downloadallfiles(prgstx *);
+int thr_mgr_downloadfile(const char *resultdir, lnk *link);
+int thr_mgr_linkheader(lnk *link, lnk_http_header **linkhp);
 
 int thr_mgr_downloadallchunks(const char *resultdir,
 		lnk *link, lnk_http_header *linkh);
-int create_chunk_bounds(chunk_bounds **bounds, lnk *link,
-		lnk_http_header *lnkh, file_fd fd, maptbl **mptbl);
+file_fd thr_mgr_createfile(const char *resultdir, lnk *link,
+		long long int size);
+int thr_mgr_downloadplan(lnk *link, lnk_http_header *linkh, file_fd fd,
+		const chunk_plan *plan);
+int thr_mgr_closefile(lnk *link, file_fd fd, int mgrretval);
+int thr_mgr_streamchunks(lnk *link, lnk_http_header *linkh);
+int stream_write(int fd, const char *buf, size_t len);
+long long int chunk_align(file_fd fd);
+int create_chunk_bounds(chunk_bounds **bounds, const chunk_plan *plan,
+		lnk *link, lnk_http_header *lnkh, file_fd fd, maptbl **mptbl);
 
 
 
@@ -0,0 +1,282 @@
+/*!
+ * \file
+ * \brief TLS layer of http client (https links).
+ *
+ *  All connections share one client context with session cache keyed by
+ *  host and port, so that only the first connection to the server (usually
+ *  the header request) pays for full handshake and all chunk connections
+ *  resume its session. Kernel TLS offload is enabled where OpenSSL and
+ *  kernel support it, records are then decrypted by kernel and data are read
+ *  straight into chunk memory.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include "tls.h"
+#include "linkparser.h"
+#include "log.h"
+
+typedef struct tls_session
+{
+	char *key;		// host:port
+	SSL_SESSION *session;
+	struct tls_session *next;
+} tls_session;
+
+static SSL_CTX *tls_ctx = NULL;
+static pthread_mutex_t tls_lock = PTHREAD_MUTEX_INITIALIZER;	// of tls_init
+static int tls_keyidx = -1;	// ex_data index of session key in SSL
+
+static tls_session *sessions = NULL;
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Saves session of connection under key, the old session of the same key
+ * is released.
+ */
+static void
+tls_session_put(const char *key, SSL_SESSION *session)
+{
+	tls_session *item;
+
+	pthread_mutex_lock(&sessions_lock);
+	for (item = sessions; item != NULL; item = item->next) {
+		if (strcmp(item->key, key) == 0)
+			break;
+	}
+	if (item == NULL) {
+		item = malloc(sizeof (tls_session));
+		item->key = strdup(key);
+		item->session = NULL;
+		item->next = sessions;
+		sessions = item;
+	}
+	if (item->session != NULL)
+		SSL_SESSION_free(item->session);
+	item->session = session;
+	pthread_mutex_unlock(&sessions_lock);
+}
+
+/**
+ * Sets cached session of key (if any) to be resumed by connection tls.
+ */
+static void
+tls_session_resume(const char *key, SSL *tls)
+{
+	tls_session *item;
+
+	pthread_mutex_lock(&sessions_lock);
+	for (item = sessions; item != NULL; item = item->next) {
+		if ((strcmp(item->key, key) == 0) && (item->session != NULL)) {
+			SSL_set_session(tls, item->session);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&sessions_lock);
+}
+
+/**
+ * Called by OpenSSL whenever server issues a session (ticket).
+ * \return 1 (session reference is kept in cache).
+ */
+static int
+tls_new_session(SSL *tls, SSL_SESSION *session)
+{
+	const char *key = SSL_get_ex_data(tls, tls_keyidx);
+
+	if (key == NULL)
+		return (0);
+	tls_session_put(key, session);
+	return (1);
+}
+
+/**
+ * Takes the earliest OpenSSL error of calling thread into buf as
+ * "(reason)" (empty if there is none) and clears the rest.
+ * \return buf.
+ */
+static const char *
+tls_reason(char *buf, size_t len)
+{
+	unsigned long err = ERR_get_error();
+
+	buf[0] = '\0';
+	if (err != 0) {
+		buf[0] = '(';
+		ERR_error_string_n(err, buf + 1, len - 2);
+		strcat(buf, ")");
+	}
+	ERR_clear_error();
+	return (buf);
+}
+
+/**
+ * Initializes TLS client context (once, the first successful call wins, so
+ * that workers connecting before it don't race). If verify is nonzero,
+ * server certificates are verified against cafile (or against system CA
+ * store if cafile is NULL). Context isn't kept when initialization fails.
+ * \return 0 on success, -1 on fail.
+ */
+int
+tls_init(int verify, const char *cafile)
+{
+	char reason[TLS_REASON_MAX];
+	SSL_CTX *ctx;
+	int ret = -1;
+
+	pthread_mutex_lock(&tls_lock);
+	if (tls_ctx != NULL) {
+		ret = 0;
+		goto out;
+	}
+
+	if ((ctx = SSL_CTX_new(TLS_client_method())) == NULL) {
+		log_error(NULL, 0, "TLS context couldn't be created");
+		goto out;
+	}
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+#ifdef SSL_OP_ENABLE_KTLS
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
+	if (verify) {
+		SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+		if (((cafile == NULL) &&
+				(SSL_CTX_set_default_verify_paths(ctx) != 1))
+				|| ((cafile != NULL) &&
+				(SSL_CTX_load_verify_locations(ctx, cafile,
+				NULL) != 1))) {
+			log_error(NULL, 0, "CA certificates couldn't be "
+					"loaded %s", tls_reason(reason,
+					sizeof (reason)));
+			SSL_CTX_free(ctx);
+			goto out;
+		}
+	} else {
+		SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+	}
+
+	// sessions are cached by us (keyed by host), not by OpenSSL
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT |
+			SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ctx, tls_new_session);
+	tls_keyidx = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+
+	// context is published complete, tls_connect reads it without lock
+	__atomic_store_n(&tls_ctx, ctx, __ATOMIC_RELEASE);
+	ret = 0;
+out:
+	pthread_mutex_unlock(&tls_lock);
+	return (ret);
+}
+
+/**
+ * Performs TLS handshake on connected socket sockfd with server hostname
+ * (resumes cached session of hostname:port if there is one). alpn is
+ * protocol list in wire format offered to server, NULL for none.
+ * \return TLS connection, NULL on fail.
+ */
+SSL *
+tls_connect(http_sockfd sockfd, const char *hostname, int port,
+		const char *alpn)
+{
+	SSL *tls;
+	char *key;
+	char sport[8], reason[TLS_REASON_MAX];
+
+	if ((__atomic_load_n(&tls_ctx, __ATOMIC_ACQUIRE) == NULL) &&
+			(tls_init(1, NULL) == -1))
+		return (NULL);
+	if ((tls = SSL_new(tls_ctx)) == NULL)
+		return (NULL);
+
+	snprintf(sport, sizeof (sport), ":%d", port);
+	key = _strcat(hostname, sport);
+	SSL_set_ex_data(tls, tls_keyidx, key);
+
+	SSL_set_fd(tls, sockfd);
+	SSL_set_tlsext_host_name(tls, hostname);
+	SSL_set1_host(tls, hostname);
+	// cancelled connections are shut down, don't write close_notify
+	SSL_set_quiet_shutdown(tls, 1);
+	tls_session_resume(key, tls);
+	if (alpn != NULL)
+		SSL_set_alpn_protos(tls, (const unsigned char *) alpn,
+				strlen(alpn));
+
+	if (SSL_connect(tls) != 1) {
+		log_error(NULL, 0, "TLS handshake with %s failed %s",
+				hostname, tls_reason(reason, sizeof (reason)));
+		tls_close(tls);
+		return (NULL);
+	}
+
+	return (tls);
+}
+
+/**
+ * Checks if server selected h2 protocol by ALPN.
+ * \return nonzero if connection speaks http/2.
+ */
+int
+tls_alpn_h2(SSL *tls)
+{
+	const unsigned char *proto;
+	unsigned int len;
+
+	SSL_get0_alpn_selected(tls, &proto, &len);
+	return ((len == 2) && (memcmp(proto, "h2", 2) == 0));
+}
+
+/**
+ * \return number of decrypted bytes which can be read without waiting for
+ * socket.
+ */
+int
+tls_pending(SSL *tls)
+{
+	return (SSL_pending(tls));
+}
+
+/**
+ * Reads decrypted data from TLS connection.
+ * \return number of bytes read, 0 on end of connection, -1 on fail.
+ */
+ssize_t
+tls_read(SSL *tls, void *buf, size_t len)
+{
+	int ret = SSL_read(tls, buf, (len > 0x7FFFFFFF) ? 0x7FFFFFFF :
+			(int)len);
+
+	if (ret > 0)
+		return (ret);
+	return ((SSL_get_error(tls, ret) == SSL_ERROR_ZERO_RETURN) ? 0 : -1);
+}
+
+/**
+ * Writes data into TLS connection.
+ * \return number of bytes written, -1 on fail.
+ */
+ssize_t
+tls_write(SSL *tls, const void *buf, size_t len)
+{
+	int ret = SSL_write(tls, buf, (int)len);
+
+	return ((ret > 0) ? ret : -1);
+}
+
+/**
+ * Releases TLS connection (socket is closed by caller).
+ */
+void
+tls_close(SSL *tls)
+{
+	free(SSL_get_ex_data(tls, tls_keyidx));
+	SSL_shutdown(tls);
+	SSL_free(tls);
+}
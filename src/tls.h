@@ -0,0 +1,18 @@
+#ifndef TLS_H
+#define	TLS_H
+
+#include <sys/types.h>
+#include "defaults.h"
+
+#define	TLS_REASON_MAX 256	// OpenSSL error logged with failure
+
+int tls_init(int verify, const char *cafile);
+struct ssl_st *tls_connect(http_sockfd sockfd, const char *hostname, int port,
+		const char *alpn);
+int tls_alpn_h2(struct ssl_st *tls);
+int tls_pending(struct ssl_st *tls);
+ssize_t tls_read(struct ssl_st *tls, void *buf, size_t len);
+ssize_t tls_write(struct ssl_st *tls, const void *buf, size_t len);
+void tls_close(struct ssl_st *tls);
+
+#endif /* TLS_H */
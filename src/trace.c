@@ -0,0 +1,205 @@
+/*!
+ * \file
+ * \brief Timeline of connections and chunks in Chrome trace event format.
+ *
+ *  Spans (complete events) are recorded into buffer of recording thread and
+ *  written into trace file when the buffer fills or the thread exits, so
+ *  recording takes no lock. Trace file can be opened by Perfetto or
+ *  chrome://tracing.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+#include "log.h"
+
+typedef struct
+{
+	char *data;
+	size_t len;
+	long tid;
+} trace_buf;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t trace_key;
+static int trace_fd = -1;
+static int trace_enabled;
+static int trace_events;	// events written into file
+static double trace_start;
+
+static double
+trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/**
+ * Writes events of buffer into trace file and empties the buffer.
+ */
+static void
+trace_flush(trace_buf *buf)
+{
+	const char *data = buf->data;
+	size_t len = buf->len;
+
+	pthread_mutex_lock(&trace_lock);
+	if ((trace_fd != -1) && (len > 0)) {
+		// every event is preceded by separator, except the first one
+		if (trace_events++ == 0) {
+			data += 2;
+			len -= 2;
+		}
+		if (write(trace_fd, data, len) != (ssize_t) len)
+			log_error(NULL, errno, "trace");
+	}
+	pthread_mutex_unlock(&trace_lock);
+	buf->len = 0;
+}
+
+static void
+trace_buf_free(void *data)
+{
+	trace_buf *buf = data;
+
+	trace_flush(buf);
+	free(buf->data);
+	free(buf);
+}
+
+/**
+ * Starts recording of trace into file path.
+ * \return 0 on success, -1 on fail.
+ */
+int
+trace_open(const char *path)
+{
+	static const char head[] = "{\"traceEvents\":[\n";
+
+	if ((trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+			S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) == -1) {
+		log_error(NULL, errno, "Couldn't create trace %s", path);
+		return (-1);
+	}
+	if ((write(trace_fd, head, sizeof (head) - 1) == -1) ||
+			(pthread_key_create(&trace_key, trace_buf_free) != 0)) {
+		log_error(NULL, errno, "trace");
+		close(trace_fd);
+		trace_fd = -1;
+		return (-1);
+	}
+
+	trace_start = trace_now();
+	__atomic_store_n(&trace_enabled, 1, __ATOMIC_RELEASE);
+
+	return (0);
+}
+
+/**
+ * Writes events of calling thread (threads which exited were written
+ * already) and closes trace file.
+ */
+void
+trace_close(void)
+{
+	static const char tail[] = "\n]}\n";
+	trace_buf *buf;
+
+	if (!trace_enabled)
+		return;
+
+	if ((buf = pthread_getspecific(trace_key)) != NULL) {
+		pthread_setspecific(trace_key, NULL);
+		trace_buf_free(buf);
+	}
+
+	pthread_mutex_lock(&trace_lock);
+	__atomic_store_n(&trace_enabled, 0, __ATOMIC_RELAXED);
+	if (write(trace_fd, tail, sizeof (tail) - 1) == -1)
+		log_error(NULL, errno, "trace");
+	close(trace_fd);
+	trace_fd = -1;
+	pthread_mutex_unlock(&trace_lock);
+}
+
+/**
+ * \return start time of span, 0 if trace isn't recorded.
+ */
+double
+trace_begin(void)
+{
+	if (!__atomic_load_n(&trace_enabled, __ATOMIC_ACQUIRE))
+		return (0);
+	return (trace_now());
+}
+
+/**
+ * Records span name of calling thread which started at start (returned by
+ * trace_begin), annotated by link and byte range first-last of file (first
+ * -1 if span has no range).
+ */
+void
+trace_end(const char *name, double start, const lnk *link,
+		long long int first, long long int last)
+{
+	char args[TRACE_EVENT_MAX / 2], *out;
+	double end;
+	trace_buf *buf;
+	size_t len = 0;
+	const char *chr;
+
+	if ((start == 0) || !__atomic_load_n(&trace_enabled, __ATOMIC_ACQUIRE))
+		return;
+	end = trace_now();
+
+	if ((buf = pthread_getspecific(trace_key)) == NULL) {
+		buf = malloc(sizeof (trace_buf));
+		buf->data = malloc(TRACE_BUF_SIZE);
+		buf->len = 0;
+		buf->tid = syscall(SYS_gettid);
+		pthread_setspecific(trace_key, buf);
+	}
+	if (buf->len + TRACE_EVENT_MAX > TRACE_BUF_SIZE)
+		trace_flush(buf);
+
+	// link is escaped for json string
+	if (link != NULL) {
+		len = snprintf(args, sizeof (args), "\"link\":\"");
+		for (chr = link->hostname; (chr != NULL) && (*chr != '\0') &&
+				(len < sizeof (args) / 2); ++chr) {
+			if ((*chr == '"') || (*chr == '\\'))
+				args[len++] = '\\';
+			if ((unsigned char) *chr >= ' ')
+				args[len++] = *chr;
+		}
+		for (chr = link->rquri; (chr != NULL) && (*chr != '\0') &&
+				(len < sizeof (args) - 64); ++chr) {
+			if ((*chr == '"') || (*chr == '\\'))
+				args[len++] = '\\';
+			if ((unsigned char) *chr >= ' ')
+				args[len++] = *chr;
+		}
+		args[len++] = '"';
+	}
+	if (first >= 0)
+		len += snprintf(args + len, sizeof (args) - len,
+				"%s\"range\":\"%lld-%lld\"", (len > 0) ? "," : "",
+				first, last);
+	args[len] = '\0';
+
+	out = buf->data + buf->len;
+	buf->len += snprintf(out, TRACE_BUF_SIZE - buf->len,
+			",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,"
+			"\"dur\":%.3f,\"pid\":%d,\"tid\":%ld,\"args\":{%s}}",
+			name, (start - trace_start) * 1e6, (end - start) * 1e6,
+			(int) getpid(), buf->tid, args);
+}
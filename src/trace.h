@@ -0,0 +1,15 @@
+#ifndef TRACE_H
+#define	TRACE_H
+
+#include "defaults.h"
+
+#define	TRACE_BUF_SIZE (64 * 1024)	// events of thread buffered before write
+#define	TRACE_EVENT_MAX 1024		// longest event (link is shortened)
+
+int trace_open(const char *path);
+void trace_close(void);
+double trace_begin(void);
+void trace_end(const char *name, double start, const lnk *link,
+		long long int first, long long int last);
+
+#endif /* TRACE_H */
@@ -0,0 +1,390 @@
+/*!
+ * \file
+ * \brief Decompression of .gz and .xz links while they are downloaded.
+ *
+ *  Link is downloaded by chunks in order (as streamed link) into a pipe,
+ *  decoder thread reads the other end and writes unpacked data into the
+ *  destination (and compressed data into a copy of the link if asked to),
+ *  so unpacking overlaps the transfer and takes about as long as the slower
+ *  of the two. Multi-block xz files are decoded by several threads, gzip
+ *  has no independent blocks and is decoded by one.
+ */
+
+#define	_GNU_SOURCE	// F_SETPIPE_SZ
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <lzma.h>
+
+#include "unpack.h"
+#include "threadmanager.h"
+#include "linkparser.h"
+#include "membudget.h"
+#include "trace.h"
+#include "log.h"
+
+/**
+ * Suffixes of compressed links and suffixes of their unpacked names.
+ */
+static const struct
+{
+	const char *packed;
+	const char *unpacked;
+	unpack_format format;
+} unpack_suffixes[] = {
+	{ ".tgz", ".tar", UNPACK_GZIP },
+	{ ".gz", "", UNPACK_GZIP },
+	{ ".txz", ".tar", UNPACK_XZ },
+	{ ".xz", "", UNPACK_XZ }
+};
+
+/**
+ * Decoder thread of one link, it reads compressed data from infd.
+ */
+typedef struct
+{
+	int infd;		// read end of pipe
+	int outfd;		// unpacked data
+	int keepfd;		// copy of compressed data, -1 if not kept
+	unpack_format format;
+	int threads;		// decoder threads of xz
+	const char *name;	// unpacked file (for messages)
+	long long int unpacked;	// bytes written into outfd
+	int ret;		// 0 on success, -1 on fail
+	pthread_t thr;
+} unpack_stage;
+
+/**
+ * \return index of suffix of name (before query) in unpack_suffixes, -1 if
+ * name has none.
+ */
+static int
+unpack_suffix(const char *name)
+{
+	size_t len = strcspn(name, "?#"), sfxlen;
+	int idx;
+
+	for (idx = 0; idx != sizeof (unpack_suffixes) /
+			sizeof (*unpack_suffixes); ++idx) {
+		sfxlen = strlen(unpack_suffixes[idx].packed);
+		if ((len > sfxlen) && (strncasecmp(name + len - sfxlen,
+				unpack_suffixes[idx].packed, sfxlen) == 0))
+			return (idx);
+	}
+	return (-1);
+}
+
+/**
+ * \return compression of link named name (by its suffix), UNPACK_NONE if
+ * it isn't .gz, .tgz, .xz or .txz link.
+ */
+unpack_format
+unpack_format_of(const char *name)
+{
+	int idx = unpack_suffix(name);
+
+	return ((idx == -1) ? UNPACK_NONE : unpack_suffixes[idx].format);
+}
+
+/**
+ * Writes len bytes of buf into fd.
+ * \return 0 on success, -1 on fail.
+ */
+static int
+unpack_write(int fd, const unsigned char *buf, size_t len)
+{
+	if ((fd == -1) || (len == 0))
+		return (0);
+	return (stream_write(fd, (const char *) buf, len));
+}
+
+/**
+ * Reads the next compressed data from pipe into buf (and copies them into
+ * file of compressed link).
+ * \return bytes read, 0 at end of download, -1 on fail.
+ */
+static ssize_t
+unpack_read(unpack_stage *st, unsigned char *buf)
+{
+	ssize_t rd;
+
+	while (((rd = read(st->infd, buf, UNPACK_BUF_SIZE)) == -1) &&
+			(errno == EINTR))
+		;
+	if (rd == -1)
+		log_error(NULL, errno, "%s can't be read", st->name);
+	else if ((rd > 0) && (unpack_write(st->keepfd, buf, rd) == -1))
+		return (-1);
+	return (rd);
+}
+
+/**
+ * Decodes gzip (or zlib) stream, gzip members may follow each other.
+ * \return 0 on success, -1 on fail.
+ */
+static int
+unpack_gzip(unpack_stage *st, unsigned char *in, unsigned char *out)
+{
+	z_stream zs;
+	ssize_t rd;
+	int zret = Z_OK, ret = 0;
+
+	memset(&zs, 0, sizeof (zs));
+	// window bits + 32 detects gzip or zlib header
+	if (inflateInit2(&zs, 15 + 32) != Z_OK)
+		return (-1);
+
+	while ((ret == 0) && ((rd = unpack_read(st, in)) > 0)) {
+		zs.next_in = in;
+		zs.avail_in = (uInt) rd;
+		do {
+			if (zret == Z_STREAM_END)
+				inflateReset(&zs);
+			zs.next_out = out;
+			zs.avail_out = UNPACK_BUF_SIZE;
+			zret = inflate(&zs, Z_NO_FLUSH);
+			if ((zret != Z_OK) && (zret != Z_STREAM_END) &&
+					(zret != Z_BUF_ERROR)) {
+				log_error(NULL, 0, "%s can't be "
+						"unpacked (%s)", st->name,
+						(zs.msg != NULL) ? zs.msg :
+						"gzip error");
+				ret = -1;
+				break;
+			}
+			ret = unpack_write(st->outfd, out, UNPACK_BUF_SIZE -
+					zs.avail_out);
+			st->unpacked += UNPACK_BUF_SIZE - zs.avail_out;
+		} while ((ret == 0) && ((zs.avail_in > 0) ||
+				(zs.avail_out == 0)));
+	}
+	if ((ret == 0) && ((rd == -1) || (zret != Z_STREAM_END))) {
+		log_error(NULL, 0, "%s can't be unpacked (gzip stream "
+				"is truncated)", st->name);
+		ret = -1;
+	}
+	inflateEnd(&zs);
+
+	return (ret);
+}
+
+/**
+ * Decodes xz streams by st->threads threads (blocks of multi-threaded xz
+ * are independent, single block file is decoded by one thread).
+ * \return 0 on success, -1 on fail.
+ */
+static int
+unpack_xz(unpack_stage *st, unsigned char *in, unsigned char *out)
+{
+	lzma_stream xs = LZMA_STREAM_INIT;
+	lzma_action action = LZMA_RUN;
+	lzma_mt mt;
+	lzma_ret lret;
+	long long int limit = membudget_limit();
+	ssize_t rd;
+	int ret = 0;
+
+	memset(&mt, 0, sizeof (mt));
+	mt.flags = LZMA_CONCATENATED;
+	mt.threads = (st->threads > 0) ? st->threads : 1;
+	// more threads than memory budget allows decode in fewer threads
+	mt.memlimit_threading = (limit > 0) ? (uint64_t) limit :
+			lzma_physmem() / 4;
+	mt.memlimit_stop = UINT64_MAX;
+	if (((mt.threads > 1) ? lzma_stream_decoder_mt(&xs, &mt) :
+			lzma_stream_decoder(&xs, UINT64_MAX,
+			LZMA_CONCATENATED)) != LZMA_OK)
+		return (-1);
+
+	for (;;) {
+		if ((xs.avail_in == 0) && (action == LZMA_RUN)) {
+			if ((rd = unpack_read(st, in)) == -1) {
+				ret = -1;
+				break;
+			}
+			xs.next_in = in;
+			xs.avail_in = (size_t) rd;
+			if (rd == 0)
+				action = LZMA_FINISH;
+		}
+		xs.next_out = out;
+		xs.avail_out = UNPACK_BUF_SIZE;
+		lret = lzma_code(&xs, action);
+		if ((ret = unpack_write(st->outfd, out, UNPACK_BUF_SIZE -
+				xs.avail_out)) == -1)
+			break;
+		st->unpacked += UNPACK_BUF_SIZE - xs.avail_out;
+		if (lret == LZMA_STREAM_END)
+			break;
+		if (lret != LZMA_OK) {
+			log_error(NULL, 0, "%s can't be unpacked (xz "
+					"error %d)", st->name, (int) lret);
+			ret = -1;
+			break;
+		}
+	}
+	lzma_end(&xs);
+
+	return (ret);
+}
+
+/**
+ * Decodes compressed data of pipe until download ends (function for one
+ * thread). Pipe is closed when decoder fails, so that download stops.
+ * param data of type (unpack_stage *).
+ */
+static void *
+unpack_run(void *data)
+{
+	unpack_stage *st = (unpack_stage *) data;
+	unsigned char *in = malloc(UNPACK_BUF_SIZE);
+	unsigned char *out = malloc(UNPACK_BUF_SIZE);
+
+	membudget_charge(2 * UNPACK_BUF_SIZE);
+	if (st->format == UNPACK_GZIP)
+		st->ret = unpack_gzip(st, in, out);
+	else
+		st->ret = unpack_xz(st, in, out);
+	close(st->infd);
+	free(in);
+	free(out);
+	membudget_release(2 * UNPACK_BUF_SIZE);
+
+	return (NULL);
+}
+
+/**
+ * Creates file name for writing.
+ * \return file descriptor, -1 on fail.
+ */
+static int
+unpack_create(const char *name)
+{
+	int fd;
+
+	if ((fd = open(name, O_CREAT | O_EXCL | O_WRONLY,
+			S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) == -1)
+		log_error(NULL, errno, "Couldn't create file %s", name);
+	return (fd);
+}
+
+/**
+ * Downloads compressed link and unpacks it at the same time. Unpacked data
+ * go into link->destfd, or into link->path (resultdir/host_uri if it is
+ * NULL) without suffix of compression, compressed file is kept under the
+ * name with suffix if link->unpack is UNPACK_BOTH. link->filename is set to
+ * the unpacked file.
+ * \return 0 on success, -1 on fail.
+ */
+int
+unpack_download(const char *resultdir, lnk *link, lnk_http_header *linkh)
+{
+	int sfx = unpack_suffix(link->rquri), destfd = link->destfd;
+	int stream = link->stream, pipefd[2], ret;
+	char *packed = NULL, *name;
+	unpack_stage st;
+	size_t len, sfxlen;
+	double start;
+
+	memset(&st, 0, sizeof (st));
+	st.outfd = st.keepfd = -1;
+	st.format = unpack_suffixes[sfx].format;
+	st.threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (destfd != -1) {
+		// caller's descriptor gets unpacked data only
+		st.outfd = destfd;
+		st.name = link->rquri;
+	} else {
+		if (link->path != NULL) {
+			free(link->filename);
+			link->filename = strdup(link->path);
+		} else {
+			mk_filename(resultdir, link);
+		}
+		// destination named by caller is the unpacked file
+		name = link->filename;
+		len = strlen(name);
+		sfxlen = strlen(unpack_suffixes[sfx].packed);
+		if ((len > sfxlen) && (strcasecmp(name + len - sfxlen,
+				unpack_suffixes[sfx].packed) == 0)) {
+			packed = name;
+			len -= sfxlen;
+			name[len] = '\0';
+			link->filename = _strcat(name,
+					unpack_suffixes[sfx].unpacked);
+			name[len] = unpack_suffixes[sfx].packed[0];
+		} else {
+			packed = _strcat(name, unpack_suffixes[sfx].packed);
+		}
+		st.name = link->filename;
+		if ((st.outfd = unpack_create(link->filename)) == -1) {
+			free(packed);
+			return (-1);
+		}
+		if ((link->unpack == UNPACK_BOTH) &&
+				((st.keepfd = unpack_create(packed)) == -1)) {
+			thr_mgr_closefile(link, st.outfd, -1);
+			free(packed);
+			return (-1);
+		}
+	}
+
+	if (pipe(pipefd) == -1) {
+		log_error(link, errno, "pipe");
+		ret = -1;
+		goto out;
+	}
+	fcntl(pipefd[1], F_SETPIPE_SZ, UNPACK_PIPE_SIZE);
+	st.infd = pipefd[0];
+	if (pthread_create(&st.thr, NULL, unpack_run, &st) != 0) {
+		log_error(link, 0, "unpacking thread of %s couldn't be "
+				"created", link->rquri);
+		close(pipefd[0]);
+		close(pipefd[1]);
+		ret = -1;
+		goto out;
+	}
+
+	// chunks arrive in order into pipe
+	start = trace_begin();
+	link->destfd = pipefd[1];
+	link->stream = 1;
+	ret = thr_mgr_streamchunks(link, linkh);
+	link->destfd = destfd;
+	link->stream = stream;
+	close(pipefd[1]);
+	pthread_join(st.thr, NULL);
+	trace_end("unpack", start, link, 0, linkh->clen - 1);
+	if (st.ret == -1)
+		ret = -1;
+	if (ret == 0)
+		log_info(link, "%s: %lld bytes unpacked from %lld",
+				st.name, st.unpacked,
+				(long long int) linkh->clen);
+
+out:
+	if (st.keepfd != -1) {
+		if ((ret == 0) && (link->durability == DUR_END) &&
+				(fdatasync(st.keepfd) == -1)) {
+			log_error(link, errno, "%s couldn't be synced", packed);
+			ret = -1;
+		}
+		if (close(st.keepfd) == -1)
+			ret = -1;
+		if ((ret == -1) && (unlink(packed) == -1))
+			log_error(link, errno, "unlink %s", packed);
+	}
+	free(packed);
+	if (destfd == -1)
+		ret = thr_mgr_closefile(link, st.outfd, ret);
+
+	return (ret);
+}
@@ -0,0 +1,21 @@
+#ifndef UNPACK_H
+#define	UNPACK_H
+
+#include "defaults.h"
+
+#define	UNPACK_BUF_SIZE (1024 * 1024)	// compressed and unpacked buffers
+#define	UNPACK_PIPE_SIZE (1024 * 1024)	// download runs ahead of decoder
+
+/**
+ * Compression of link recognized by suffix of its name.
+ */
+typedef enum
+{
+	UNPACK_NONE, UNPACK_GZIP, UNPACK_XZ
+} unpack_format;
+
+unpack_format unpack_format_of(const char *name);
+int unpack_download(const char *resultdir, lnk *link,
+		lnk_http_header *linkh);
+
+#endif /* UNPACK_H */